@@ -213,4 +213,10 @@ local function run_tests(paths)
    root_suite:run_tests()
 end
 
+-- worker threads (see thread.lua) load this chunk to get the same
+-- require() setup, then run their module instead of the bootstrap
+if ZZ_THREAD_ARG then
+   return require(ZZ_CORE_PACKAGE..'/thread').run_child(ZZ_THREAD_ARG)
+end
+
 -- build system will inject bootstrap code after this line
@@ -4,9 +4,12 @@
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
-#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
 
-#include "trigger.h"
+#include "msgqueue.h"
 
 typedef void (*zz_async_handler)(void *request_data);
 
@@ -19,88 +22,317 @@ struct zz_async_worker {
 
 static struct zz_async_worker registered_workers[MAX_REGISTERED_WORKERS];
 static int registered_worker_count = 0;
+static pthread_mutex_t registered_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* every Lua state (the main one and each worker thread) registers
+   the workers of the modules it loads: a handler table which has
+   been registered already gets its existing id */
 int zz_async_register_worker(void *handlers[]) {
-  if (registered_worker_count == MAX_REGISTERED_WORKERS) {
-    fprintf(stderr, "async: cannot register more workers, %d limit exceeded\n",
-            MAX_REGISTERED_WORKERS);
-    exit(1);
+  int worker_id = 0;
+  pthread_mutex_lock(&registered_workers_mutex);
+  for (int i = 0; i < registered_worker_count; i++) {
+    if (registered_workers[i].handlers == (zz_async_handler *) handlers) {
+      // worker id is 1-based
+      worker_id = i + 1;
+      break;
+    }
   }
-  struct zz_async_worker *z = &registered_workers[registered_worker_count++];
-  z->handlers = (zz_async_handler *) handlers;
-  z->handler_count = 0;
-  // list of handlers must be NULL-terminated
-  while (*handlers != NULL) {
-    z->handler_count++;
-    handlers++;
+  if (worker_id == 0) {
+    if (registered_worker_count == MAX_REGISTERED_WORKERS) {
+      fprintf(stderr, "async: cannot register more workers, %d limit exceeded\n",
+              MAX_REGISTERED_WORKERS);
+      exit(1);
+    }
+    struct zz_async_worker *z = &registered_workers[registered_worker_count];
+    z->handlers = (zz_async_handler *) handlers;
+    z->handler_count = 0;
+    // list of handlers must be NULL-terminated
+    while (*handlers != NULL) {
+      z->handler_count++;
+      handlers++;
+    }
+    worker_id = ++registered_worker_count;
   }
-  // worker id is 1-based
-  return registered_worker_count;
+  pthread_mutex_unlock(&registered_workers_mutex);
+  return worker_id;
 }
 
-struct zz_async_worker_info {
-  zz_trigger request_trigger;
+/* When the Lua side wants to execute something which would block
+ * the event loop, it submits it as a job to the async worker pool.
+ *
+ * Every module can define its request types in C code and register
+ * the corresponding handlers with the async module by calling
+ * zz_async_register_worker(). A worker is a group of handlers
+ * registered in this way. Pool threads can be asked to execute any
+ * handler provided by a registered worker.
+ *
+ * To make a request, the Lua side fills out a zz_async_job structure
+ * with the worker_id, handler_id and a pointer to a structure
+ * describing the request (the layout varies by request type), then
+ * pushes it to the submission queue of the pool. The first free pool
+ * thread picks it up, looks up the desired handler and passes
+ * request_data to it.
+ *
+ * Before the request handler completes, it should store any return
+ * values in the request_data structure. The pool thread then sets
+ * job->done and posts [event_id, 0] to the scheduler's message queue
+ * (the completion queue): this wakes up the coroutine which is
+ * waiting for the completion of the request.
+ *
+ * The submission queue is a bounded lock-free ring (a cell sequence
+ * number tells whether a cell is free or holds a job). Threads are
+ * started on demand (up to max_threads) and exit after idle_timeout
+ * seconds without work.
+ */
+
+struct zz_async_job {
   int worker_id;
   int handler_id;
   void *request_data;
-  zz_trigger response_trigger;
+  int event_id;
+  int done;
 };
 
-void *zz_async_worker_thread(void *arg) {
-  struct zz_async_worker_info *info = (struct zz_async_worker_info*) arg;
-
-  /* When the Lua side wants to execute something which would block
-   * the event loop, it posts it as a request to one of the async
-   * worker threads.
-   *
-   * Every module can define its request types in C code and register
-   * the corresponding handlers with the async module by calling
-   * zz_async_register_worker(). A worker is a group of handlers
-   * registered in this way. Worker threads can be asked to execute
-   * any handler provided by a registered worker.
-   *
-   * To make a request, the Lua side fills out the selected worker
-   * thread's zz_async_worker_info structure with the worker_id,
-   * handler_id and a pointer to a structure describing the request
-   * (the layout varies by request type). The Lua side then fires the
-   * worker thread's request_trigger - this wakes up the thread which
-   * then looks up the desired handler and passes request_data to it.
-   *
-   * Before the request handler completes, it should store any return
-   * values in the request_data structure. The worker thread then
-   * fires response_trigger which is being polled on the Lua side in
-   * the coroutine which is waiting for the completion of the async
-   * request.
-   */
-
-  while (1) {
-    zz_trigger_wait(&info->request_trigger);
-    /* worker_id is a 1-based index to the registered_workers array */
-    int worker_id = info->worker_id;
-    /* worker_id == -1 is the exit signal */
-    if (worker_id == -1) {
-      zz_trigger_fire(&info->response_trigger);
-      break;
+struct zz_async_cell {
+  uint64_t seq;
+  struct zz_async_job *job;
+};
+
+struct zz_async_pool {
+  struct zz_async_cell *cells;
+  uint64_t mask;
+  uint8_t pad0[48];
+  uint64_t enqueue_pos;
+  uint8_t pad1[56];
+  uint64_t dequeue_pos;
+  uint8_t pad2[56];
+  sem_t jobs;
+  int idle_threads;
+  int pending_jobs; /* submitted, not yet taken by a thread */
+  zz_msgqueue *completion_queue;
+  double idle_timeout;
+  int max_threads;
+  /* thread bookkeeping (slow path only) */
+  pthread_mutex_t lock;
+  pthread_cond_t exited;
+  int thread_count;
+  int stopping;
+};
+
+static bool enqueue_job(struct zz_async_pool *pool, struct zz_async_job *job) {
+  uint64_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct zz_async_cell *cell = &pool->cells[pos & pool->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) seq - (int64_t) pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->job = job;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
     }
-    if (worker_id < 1 || worker_id > registered_worker_count) {
-      fprintf(stderr, "invalid async request: worker_id is out of range (registered_worker_count=%d, worker_id=%d)\n", registered_worker_count, worker_id);
-      exit(1);
+    else if (diff < 0) {
+      return false; /* full */
+    }
+    else {
+      pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static struct zz_async_job *dequeue_job(struct zz_async_pool *pool) {
+  uint64_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct zz_async_cell *cell = &pool->cells[pos & pool->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) seq - (int64_t) (pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        struct zz_async_job *job = cell->job;
+        __atomic_store_n(&cell->seq, pos + pool->mask + 1, __ATOMIC_RELEASE);
+        return job;
+      }
+    }
+    else if (diff < 0) {
+      return NULL; /* empty */
     }
-    struct zz_async_worker *worker = &registered_workers[worker_id-1];
-    /* handler id identifies the handler within the selected worker */
-    int handler_id = info->handler_id;
-    /* handler_id is 0-based */
-    if (handler_id < 0 || handler_id >= worker->handler_count) {
-      fprintf(stderr, "invalid async request: handler_id is out of range (worker_id=%d, handler_id=%u, handler_count=%d)\n", worker_id, handler_id, worker->handler_count);
+    else {
+      pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void run_job(struct zz_async_pool *pool, struct zz_async_job *job) {
+  /* worker_id is a 1-based index to the registered_workers array */
+  int worker_id = job->worker_id;
+  if (worker_id < 1 || worker_id > registered_worker_count) {
+    fprintf(stderr, "invalid async request: worker_id is out of range (registered_worker_count=%d, worker_id=%d)\n", registered_worker_count, worker_id);
+    exit(1);
+  }
+  struct zz_async_worker *worker = &registered_workers[worker_id-1];
+  /* handler id identifies the handler within the selected worker */
+  int handler_id = job->handler_id;
+  /* handler_id is 0-based */
+  if (handler_id < 0 || handler_id >= worker->handler_count) {
+    fprintf(stderr, "invalid async request: handler_id is out of range (worker_id=%d, handler_id=%u, handler_count=%d)\n", worker_id, handler_id, worker->handler_count);
+    exit(1);
+  }
+  zz_async_handler handler = worker->handlers[handler_id];
+  handler(job->request_data); /* process request */
+  /* the job may be freed as soon as the Lua side sees done == 1 */
+  int event_id = job->event_id;
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  zz_msgqueue *q = pool->completion_queue;
+  zz_msgqueue_prepare_write(q, 16);
+  zz_msgqueue_pack_array(q, 2);
+  zz_msgqueue_pack_integer(q, event_id);
+  zz_msgqueue_pack_integer(q, 0);
+  zz_msgqueue_finish_write(q);
+}
+
+static bool wait_for_job(struct zz_async_pool *pool) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  double fractional_part, integer_part;
+  fractional_part = modf(pool->idle_timeout, &integer_part);
+  deadline.tv_sec += integer_part;
+  deadline.tv_nsec += fractional_part * 1e9;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (sem_timedwait(&pool->jobs, &deadline) != 0) {
+    if (errno == ETIMEDOUT) {
+      return false;
+    }
+    if (errno != EINTR) {
+      fprintf(stderr, "async: sem_timedwait() failed\n");
       exit(1);
     }
-    zz_async_handler handler = worker->handlers[handler_id];
-    handler(info->request_data); /* process request */
-    zz_trigger_fire(&info->response_trigger);
   }
+  return true;
+}
+
+static void *zz_async_pool_thread(void *arg) {
+  struct zz_async_pool *pool = (struct zz_async_pool*) arg;
+  for (;;) {
+    __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+    bool got_job = wait_for_job(pool);
+    __atomic_sub_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+    if (!got_job) {
+      /* idle timeout: exit unless a job arrived in the meantime
+         (the submitter did not start a new thread for it because it
+         saw us idle) */
+      if (sem_trywait(&pool->jobs) != 0) {
+        break;
+      }
+    }
+    struct zz_async_job *job = dequeue_job(pool);
+    if (job == NULL) {
+      /* each job comes with one post, so this is a stop request */
+      if (__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+        break;
+      }
+      continue;
+    }
+    __atomic_sub_fetch(&pool->pending_jobs, 1, __ATOMIC_SEQ_CST);
+    run_job(pool, job);
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->thread_count--;
+  pthread_cond_signal(&pool->exited);
+  pthread_mutex_unlock(&pool->lock);
   return NULL;
 }
 
+static void start_thread(struct zz_async_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->thread_count < pool->max_threads) {
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread_id, &attr, zz_async_pool_thread, pool) != 0) {
+      fprintf(stderr, "async: cannot create pool thread: pthread_create() failed\n");
+      exit(1);
+    }
+    pthread_attr_destroy(&attr);
+    pool->thread_count++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+struct zz_async_pool *zz_async_pool_create(uint32_t queue_size,
+                                           int max_threads,
+                                           double idle_timeout,
+                                           zz_msgqueue *completion_queue) {
+  /* queue_size must be a power of two */
+  struct zz_async_pool *pool = calloc(1, sizeof(struct zz_async_pool));
+  if (!pool) {
+    fprintf(stderr, "async: cannot allocate pool\n");
+    exit(1);
+  }
+  pool->cells = calloc(queue_size, sizeof(struct zz_async_cell));
+  if (!pool->cells) {
+    fprintf(stderr, "async: cannot allocate submission queue\n");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < queue_size; i++) {
+    pool->cells[i].seq = i;
+  }
+  pool->mask = queue_size - 1;
+  sem_init(&pool->jobs, 0, 0);
+  pool->completion_queue = completion_queue;
+  pool->idle_timeout = idle_timeout;
+  pool->max_threads = max_threads;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->exited, NULL);
+  return pool;
+}
+
+/* returns false if the submission queue is full */
+bool zz_async_pool_submit(struct zz_async_pool *pool, struct zz_async_job *job) {
+  if (!enqueue_job(pool, job)) {
+    return false;
+  }
+  int pending = __atomic_add_fetch(&pool->pending_jobs, 1, __ATOMIC_SEQ_CST);
+  sem_post(&pool->jobs);
+  /* each idle thread takes one job: if more jobs are waiting than
+     there are idle threads, the rest would queue behind (possibly
+     blocking) jobs while the pool could still grow */
+  if (pending > __atomic_load_n(&pool->idle_threads, __ATOMIC_SEQ_CST)) {
+    start_thread(pool);
+  }
+  return true;
+}
+
+int zz_async_pool_thread_count(struct zz_async_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  int thread_count = pool->thread_count;
+  pthread_mutex_unlock(&pool->lock);
+  return thread_count;
+}
+
+void zz_async_pool_destroy(struct zz_async_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  __atomic_store_n(&pool->stopping, 1, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < pool->thread_count; i++) {
+    sem_post(&pool->jobs);
+  }
+  while (pool->thread_count > 0) {
+    pthread_cond_wait(&pool->exited, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_cond_destroy(&pool->exited);
+  pthread_mutex_destroy(&pool->lock);
+  sem_destroy(&pool->jobs);
+  free(pool->cells);
+  free(pool);
+}
+
 /* a pre-defined handler for testing purposes */
 
 enum {
@@ -1,8 +1,7 @@
 local ffi = require('ffi')
 local util = require('util')
 local sched = require('sched')
-local pthread = require('pthread')
-local trigger = require('trigger')
+local msgqueue = require('msgqueue')
 local inspect = require('inspect')
 
 ffi.cdef [[
@@ -11,15 +10,23 @@ typedef void (*zz_async_handler)(void *request_data);
 
 int zz_async_register_worker(void *handlers[]);
 
-struct zz_async_worker_info {
-  zz_trigger request_trigger;
+struct zz_async_job {
   int worker_id;
   int handler_id;
   void *request_data;
-  zz_trigger response_trigger;
+  int event_id;
+  int done;
 };
 
-void *zz_async_worker_thread(void *arg);
+struct zz_async_pool;
+
+struct zz_async_pool *zz_async_pool_create(uint32_t queue_size,
+                                           int max_threads,
+                                           double idle_timeout,
+                                           zz_msgqueue *completion_queue);
+bool zz_async_pool_submit(struct zz_async_pool *pool, struct zz_async_job *job);
+int zz_async_pool_thread_count(struct zz_async_pool *pool);
+void zz_async_pool_destroy(struct zz_async_pool *pool);
 
 enum {
   ZZ_ASYNC_ECHO
@@ -37,122 +44,110 @@ void *zz_async_handlers[];
 
 local M = {}
 
-local MAX_ACTIVE_THREADS = 64
-
--- pool of free (reservable) worker threads
-local thread_pool = {}
-
--- reservation ids of coroutines waiting for a worker thread
-local reserve_queue = util.List()
-
--- number of worker threads (free + active)
-local n_worker_threads   = 0
-
--- number of worker threads currently servicing a request
-local n_active_threads   = 0
-
-local function create_worker_thread()
-   n_worker_threads = n_worker_threads + 1
-   local worker_info = ffi.new("struct zz_async_worker_info")
-   local request_trigger = trigger()
-   worker_info.request_trigger = request_trigger
-   local response_trigger = trigger()
-   worker_info.response_trigger = response_trigger
-   sched.poller_add(response_trigger.fd, "r")
-   local thread_id = ffi.new("pthread_t[1]")
-   local rv = ffi.C.pthread_create(thread_id,
-                                   nil,
-                                   ffi.C.zz_async_worker_thread,
-                                   ffi.cast("void*", worker_info))
-   if rv ~= 0 then
-      ef("cannot create async worker thread: pthread_create() failed")
-   end
-   local self = {}
-   function self:send_request(worker_id, handler_id, request_data)
-      worker_info.worker_id = worker_id
-      worker_info.handler_id = handler_id
-      worker_info.request_data = request_data
-      request_trigger:fire()
-      response_trigger:wait() -- wait = poll + read
-   end
-   function self:stop()
-      self:send_request(-1, 0, nil)
-      local retval = ffi.new("void*[1]")
-      local rv = ffi.C.pthread_join(thread_id[0], retval)
-      if rv ~=0 then
-         ef("cannot join async worker thread: pthread_join() failed")
-      end
-      sched.poller_del(response_trigger.fd)
-      response_trigger:delete()
-      request_trigger:delete()
-      n_worker_threads = n_worker_threads - 1
+-- max number of pool threads
+M.MAX_THREADS = 64
+
+-- pool threads exit after this many seconds without work
+M.IDLE_TIMEOUT = 10
+
+-- capacity of the submission queue (must be a power of 2)
+M.QUEUE_SIZE = 4096
+
+-- the pool is created on the first request
+local pool = nil
+
+-- jobs which have not completed yet (key: event_id, value: job)
+--
+-- this also keeps the job structs alive while a pool thread is
+-- working on them
+local pending_jobs = {}
+local n_pending_jobs = 0
+
+local function get_pool()
+   if not pool then
+      pool = ffi.C.zz_async_pool_create(M.QUEUE_SIZE,
+                                        M.MAX_THREADS,
+                                        M.IDLE_TIMEOUT,
+                                        sched.msgqueue)
    end
-   return self
+   return pool
 end
 
-local function reserve_thread()
-   local t
-   if #thread_pool == 0 then
-      if n_active_threads == MAX_ACTIVE_THREADS then
-         local reservation_id = sched.make_event_id()
-         reserve_queue:push(reservation_id)
-         -- block until we get a free thread
-         t = sched.wait(reservation_id)
-      else
-         t = create_worker_thread()
-      end
-   else
-      t = table.remove(thread_pool)
+local Job_mt = {}
+
+function Job_mt:wait()
+   -- blocks the current coroutine until the job completes
+   if self.done == 0 then
+      sched.wait(self.event_id)
+   end
+   local event_id = self.event_id
+   if pending_jobs[event_id] then
+      pending_jobs[event_id] = nil
+      n_pending_jobs = n_pending_jobs - 1
    end
-   n_active_threads = n_active_threads + 1
-   return t
 end
 
-local function release_thread(t)
-   n_active_threads = n_active_threads - 1
-   if reserve_queue:empty() then
-      -- nobody is waiting for a thread, put it back into the pool
-      table.insert(thread_pool, t)
-   else
-      local reservation_id = reserve_queue:shift()
-      sched.emit(reservation_id, t)
-   end
+function Job_mt:completed()
+   return self.done ~= 0
 end
 
+Job_mt.__index = Job_mt
+
+local Job = ffi.metatype("struct zz_async_job", Job_mt)
+
 function M.register_worker(handlers)
    return ffi.C.zz_async_register_worker(handlers)
 end
 
+-- submit a request to the pool, returns a job handle
+--
+-- the caller must keep request_data alive and call job:wait() before
+-- reading the response
+function M.submit(worker_id, handler_id, request_data)
+   local job = Job(worker_id, handler_id, request_data, sched.make_event_id(), 0)
+   local p = get_pool()
+   while not ffi.C.zz_async_pool_submit(p, job) do
+      -- submission queue is full
+      sched.yield()
+   end
+   pending_jobs[job.event_id] = job
+   n_pending_jobs = n_pending_jobs + 1
+   return job
+end
+
 function M.request(worker_id, handler_id, request_data)
-   -- reserve_thread() blocks if needed
-   -- until a thread becomes available
-   local t = reserve_thread()
-   t:send_request(worker_id, handler_id, request_data)
-   release_thread(t)
+   M.submit(worker_id, handler_id, request_data):wait()
+end
+
+function M.thread_count()
+   return pool and ffi.C.zz_async_pool_thread_count(pool) or 0
 end
 
 local function AsyncModule(sched)
    local self = {}
    function self.init()
-      thread_pool = {}
-      reserve_queue = util.List()
-      n_active_threads = 0
-      n_worker_threads = 0
+      pool = nil
+      pending_jobs = {}
+      n_pending_jobs = 0
    end
    function self.done()
-      if n_active_threads > 0 then
-         pf("WARNING: async.n_active_threads = %d at scheduler shutdown", n_active_threads)
-      end
-      if not reserve_queue:empty() then
-         pf("WARNING: async.reserve_queue is not empty at scheduler shutdown")
-      end
-      for _,t in ipairs(thread_pool) do
-         t:stop()
-      end
-      if n_worker_threads > 0 then
-         pf("WARNING: async.n_worker_threads = %d at scheduler shutdown", n_worker_threads)
+      if pool then
+         local n_running_jobs = 0
+         for _,job in pairs(pending_jobs) do
+            if not job:completed() then
+               n_running_jobs = n_running_jobs + 1
+            end
+         end
+         if n_running_jobs > 0 then
+            -- pool threads are still working on these jobs, so we
+            -- cannot free the pool
+            pf("WARNING: async.n_running_jobs = %d at scheduler shutdown", n_running_jobs)
+         else
+            ffi.C.zz_async_pool_destroy(pool)
+         end
+         pool = nil
       end
-      thread_pool = {}
+      pending_jobs = {}
    end
    return self
 end
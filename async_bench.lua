@@ -0,0 +1,45 @@
+-- async worker pool benchmark: ZZ_ASYNC_ECHO requests per second
+--
+-- usage: zz run async_bench.lua
+
+local ffi = require('ffi')
+local async = require('async')
+local sched = require('sched')
+local time = require('time')
+
+local M = {}
+
+local ASYNC = async.register_worker(ffi.C.zz_async_handlers)
+
+local N = 100000
+
+local function bench(concurrency)
+   local requests_per_thread = math.floor(N / concurrency)
+   local threads = {}
+   local t0 = time.time()
+   for i=1,concurrency do
+      threads[i] = sched(function()
+         local request = ffi.new("struct zz_async_echo")
+         request.delay = 0
+         for j=1,requests_per_thread do
+            request.payload = j
+            async.request(ASYNC, ffi.C.ZZ_ASYNC_ECHO, request)
+            assert(request.response == j)
+         end
+      end)
+   end
+   sched.join(threads)
+   local elapsed = time.time() - t0
+   local total = requests_per_thread * concurrency
+   pf("concurrency %4d: %8d reqs %10.3f ms %12.0f reqs/s (%d threads)",
+      concurrency, total, elapsed * 1000, total / elapsed,
+      async.thread_count())
+end
+
+function M.main()
+   for _,concurrency in ipairs { 1, 8, 64, 256 } do
+      bench(concurrency)
+   end
+end
+
+return M
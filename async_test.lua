@@ -5,6 +5,7 @@ local sched = require('sched')
 local mm = require('mm')
 local assert = require('assert')
 local inspect = require('inspect')
+local time = require('time')
 
 local ASYNC = async.register_worker(ffi.C.zz_async_handlers)
 
@@ -57,3 +58,50 @@ testing("async_queueing", function()
       assert.equals(actual_replies[i], i)
    end
 end)
+
+-- async.submit() returns a job handle: the request runs in the
+-- background until somebody waits for it
+
+testing("async.submit", function()
+   local requests = {}
+   local jobs = {}
+   for i=1,10 do
+      local request = ffi.new("struct zz_async_echo")
+      -- later jobs complete first
+      request.delay = 0.01 * (10-i)
+      request.payload = i
+      requests[i] = request
+      jobs[i] = async.submit(ASYNC, ffi.C.ZZ_ASYNC_ECHO, request)
+   end
+   -- jobs can be waited on in any order, even after they completed
+   for i=1,10 do
+      jobs[i]:wait()
+      assert(jobs[i]:completed())
+      assert.equals(requests[i].response, i)
+   end
+   assert(async.thread_count() <= async.MAX_THREADS)
+end)
+
+-- a burst of jobs does not queue behind a single idle thread: the
+-- pool grows while there are more pending jobs than idle threads
+
+testing("async pool growth", function()
+   -- leave an idle thread in the pool
+   local request = ffi.new("struct zz_async_echo")
+   async.submit(ASYNC, ffi.C.ZZ_ASYNC_ECHO, request):wait()
+   local requests = {}
+   local jobs = {}
+   local t0 = time.time()
+   for i=1,8 do
+      requests[i] = ffi.new("struct zz_async_echo")
+      requests[i].delay = 0.2
+      requests[i].payload = i
+      jobs[i] = async.submit(ASYNC, ffi.C.ZZ_ASYNC_ECHO, requests[i])
+   end
+   for i=1,8 do
+      jobs[i]:wait()
+      assert.equals(requests[i].response, i)
+   end
+   -- one thread would need 1.6 seconds
+   assert(time.time() - t0 < 1)
+end)
@@ -176,4 +176,22 @@ function M.wrap(data, size)
    return Buffer(ffi.cast("uint8_t*", data), 0, size)
 end
 
+-- parents of live views (key: view, value: the data it points into)
+local view_parents = setmetatable({}, { __mode = "k" })
+
+-- buffer.view(data, offset, size)
+--
+-- like buffer.slice() but without copying: returns a non-owning
+-- buffer which points into `data` (a buffer or a string) and keeps
+-- it alive. the view sees changes of the parent and becomes invalid
+-- if the parent is resized or freed
+function M.view(data, offset, size)
+   offset = offset or 0
+   size = size or (#data - offset)
+   local ptr = is_buffer(data) and data.ptr or data
+   local self = Buffer(ffi.cast("uint8_t*", ptr) + offset, 0, size)
+   view_parents[self] = data
+   return self
+end
+
 return M
@@ -135,6 +135,21 @@ testing("buffer", function()
    assert.equals(#buf4, 3)
    assert.equals(buf4.cap, 3)
    assert(buf4=='cde')
+
+   -- buffer.view(data, offset, size)
+   -- like slice, but points into `data` instead of copying it
+   local parent = buffer.copy('abcdef')
+   local buf4 = buffer.view(parent, 2, 3)
+   assert.equals(#buf4, 3)
+   assert.equals(buf4.cap, 0)
+   assert(buf4=='cde')
+   parent[2] = 0x43
+   assert(buf4=='Cde')
+   -- the view keeps its parent alive
+   parent = nil
+   collectgarbage()
+   assert(buf4=='Cde')
+   assert(buffer.view('abcdef', 3)=='def')
    
    -- change capacity
    local buf5 = buffer.new()
@@ -47,6 +47,10 @@ extern int epoll_wait (int epfd, struct epoll_event *events, int max_events, int
 
 ]]
 
+-- the event array of a poller grows up to this size when waits
+-- return full batches
+local MAX_EVENTS_LIMIT = 65536
+
 local Poller_mt = {}
 
 local event_markers = {
@@ -77,11 +81,26 @@ function Poller_mt:fd()
    return self.epfd
 end
 
+-- errors and hangups match any mask: the waiter shall find out
+-- about them from the next syscall
+local EPOLLERR_HUP = bit.bor(ffi.C.EPOLLERR, ffi.C.EPOLLHUP)
+
 function Poller_mt:match_events(mask, events)
-   mask = parse_events(mask)
+   mask = bit.bor(parse_events(mask), EPOLLERR_HUP)
    return bit.band(events, mask) ~= 0
 end
 
+function Poller_mt:event_mask(events)
+   return parse_events(events)
+end
+
+-- returns `events` with the bits in `mask` cleared
+--
+-- errors and hangups are sticky: no further edge would report them
+function Poller_mt:clear_events(events, mask)
+   return bit.band(events, bit.bnot(parse_events(mask)))
+end
+
 function Poller_mt:ctl(op, fd, events, userdata)
    return mm.with_block("struct epoll_event", nil, function(ev)
       ev.events = events and parse_events(events) or 0
@@ -121,13 +140,19 @@ function Poller_mt:wait(timeout, process)
       end
    end
    if rv > 0 then
-      for i = 1,rv do
-         local epoll_event = self.epoll_events[i-1]
-         local events = epoll_event.events
-         local userdata = epoll_event.data.fd
-         process(events, userdata)
+      local epoll_events = self.epoll_events
+      for i = 0,rv-1 do
+         local epoll_event = epoll_events[i]
+         process(epoll_event.events, epoll_event.data.fd)
+      end
+      if rv == self.max_events and self.max_events < MAX_EVENTS_LIMIT then
+         -- full batch: more events may be waiting, fetch them in
+         -- fewer waits next time
+         self.max_events = math.min(self.max_events * 2, MAX_EVENTS_LIMIT)
+         self.epoll_events = ffi.new("struct epoll_event[?]", self.max_events)
       end
    end
+   return rv
 end
 
 function Poller_mt:close()
@@ -1,7 +1,42 @@
 local testing = require('testing')
 local epoll = require('epoll')
+local net = require('net')
+local assert = require('assert')
 
 testing("epoll", function()
    local poller = epoll.Poller()
    poller:close()
 end)
+
+testing:nosched("event array grows after full batches", function()
+   local poller = epoll.Poller(2)
+   local sockets = {}
+   for i=1,3 do
+      -- both ends are writable
+      local s1, s2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+      poller:add(s1.fd, "w", s1.fd)
+      poller:add(s2.fd, "w", s2.fd)
+      table.insert(sockets, s1)
+      table.insert(sockets, s2)
+   end
+   local function wait()
+      local count = 0
+      local n = poller:wait(0, function(events, fd)
+         count = count + 1
+      end)
+      assert.equals(n, count)
+      return n
+   end
+   assert.equals(wait(), 2)
+   assert.equals(poller.max_events, 4)
+   assert.equals(wait(), 4)
+   assert.equals(poller.max_events, 8)
+   -- not a full batch: no growth
+   assert.equals(wait(), 6)
+   assert.equals(poller.max_events, 8)
+   for _,s in ipairs(sockets) do
+      poller:del(s.fd)
+      s:close()
+   end
+   poller:close()
+end)
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE /* struct statx */
+
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <assert.h>
@@ -29,7 +35,15 @@ enum {
   ZZ_ASYNC_FS_OPENDIR,
   ZZ_ASYNC_FS_READDIR,
   ZZ_ASYNC_FS_CLOSEDIR,
-  ZZ_ASYNC_FS_GLOB
+  ZZ_ASYNC_FS_GLOB,
+  ZZ_ASYNC_FS_PREAD,
+  ZZ_ASYNC_FS_PWRITE,
+  ZZ_ASYNC_FS_PREADV,
+  ZZ_ASYNC_FS_PWRITEV,
+  ZZ_ASYNC_FS_READV,
+  ZZ_ASYNC_FS_WRITEV,
+  ZZ_ASYNC_FS_SENDFILE,
+  ZZ_ASYNC_FS_COPY_FILE_RANGE
 };
 
 union zz_async_fs_req {
@@ -148,6 +162,40 @@ union zz_async_fs_req {
     glob_t *pglob;
     int rv;
   } glob;
+
+  struct {
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+    ssize_t nbytes;
+    int _errno;
+  } pread, pwrite;
+
+  struct {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    ssize_t nbytes;
+    int _errno;
+  } preadv, pwritev;
+
+  struct {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    ssize_t nbytes;
+    int _errno;
+  } readv, writev;
+
+  struct {
+    int in_fd;
+    int out_fd;
+    size_t count;
+    ssize_t nbytes;
+    int _errno;
+  } sendfile, copy_file_range;
 };
 
 void zz_async_fs_open(union zz_async_fs_req *req) {
@@ -165,6 +213,48 @@ void zz_async_fs_write(union zz_async_fs_req *req) {
   req->write._errno = errno;
 }
 
+void zz_async_fs_pread(union zz_async_fs_req *req) {
+  req->pread.nbytes = pread(req->pread.fd, req->pread.buf, req->pread.count, req->pread.offset);
+  req->pread._errno = errno;
+}
+
+void zz_async_fs_pwrite(union zz_async_fs_req *req) {
+  req->pwrite.nbytes = pwrite(req->pwrite.fd, req->pwrite.buf, req->pwrite.count, req->pwrite.offset);
+  req->pwrite._errno = errno;
+}
+
+void zz_async_fs_preadv(union zz_async_fs_req *req) {
+  req->preadv.nbytes = preadv(req->preadv.fd, req->preadv.iov, req->preadv.iovcnt, req->preadv.offset);
+  req->preadv._errno = errno;
+}
+
+void zz_async_fs_pwritev(union zz_async_fs_req *req) {
+  req->pwritev.nbytes = pwritev(req->pwritev.fd, req->pwritev.iov, req->pwritev.iovcnt, req->pwritev.offset);
+  req->pwritev._errno = errno;
+}
+
+void zz_async_fs_readv(union zz_async_fs_req *req) {
+  req->readv.nbytes = readv(req->readv.fd, req->readv.iov, req->readv.iovcnt);
+  req->readv._errno = errno;
+}
+
+void zz_async_fs_writev(union zz_async_fs_req *req) {
+  req->writev.nbytes = writev(req->writev.fd, req->writev.iov, req->writev.iovcnt);
+  req->writev._errno = errno;
+}
+
+void zz_async_fs_sendfile(union zz_async_fs_req *req) {
+  req->sendfile.nbytes = sendfile(req->sendfile.out_fd, req->sendfile.in_fd, NULL, req->sendfile.count);
+  req->sendfile._errno = errno;
+}
+
+void zz_async_fs_copy_file_range(union zz_async_fs_req *req) {
+  req->copy_file_range.nbytes = copy_file_range(req->copy_file_range.in_fd, NULL,
+                                                req->copy_file_range.out_fd, NULL,
+                                                req->copy_file_range.count, 0);
+  req->copy_file_range._errno = errno;
+}
+
 void zz_async_fs_lseek(union zz_async_fs_req *req) {
   req->lseek.rv = lseek(req->lseek.fd, req->lseek.offset, req->lseek.whence);
   req->lseek._errno = errno;
@@ -258,6 +348,27 @@ int zz_fs_lstat(const char *path, struct stat *buf) {
   return lstat(path, buf);
 }
 
+/* io_uring can only do statx() */
+void zz_fs_statx_to_stat(struct statx *stx, struct stat *buf) {
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  buf->st_ino = stx->stx_ino;
+  buf->st_mode = stx->stx_mode;
+  buf->st_nlink = stx->stx_nlink;
+  buf->st_uid = stx->stx_uid;
+  buf->st_gid = stx->stx_gid;
+  buf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  buf->st_size = stx->stx_size;
+  buf->st_blksize = stx->stx_blksize;
+  buf->st_blocks = stx->stx_blocks;
+  buf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  buf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  buf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  buf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
 char * zz_fs_dirent_name(struct dirent *entry) {
   return entry->d_name;
 }
@@ -333,5 +444,13 @@ void *zz_async_fs_handlers[] = {
   zz_async_fs_readdir,
   zz_async_fs_closedir,
   zz_async_fs_glob,
+  zz_async_fs_pread,
+  zz_async_fs_pwrite,
+  zz_async_fs_preadv,
+  zz_async_fs_pwritev,
+  zz_async_fs_readv,
+  zz_async_fs_writev,
+  zz_async_fs_sendfile,
+  zz_async_fs_copy_file_range,
   0
 };
@@ -1,6 +1,7 @@
 local ffi = require('ffi')
 local sched = require('sched')
 local async = require('async')
+local uring = require('uring')
 local process = require('process')
 local buffer = require('buffer')
 local mm = require('mm')
@@ -16,6 +17,12 @@ ffi.cdef [[
 int     open  (const char *file, int oflag, mode_t mode);
 ssize_t read  (int fd, void *buf, size_t nbytes);
 ssize_t write (int fd, const void *buf, size_t n);
+ssize_t pread  (int fd, void *buf, size_t nbytes, off_t offset);
+ssize_t pwrite (int fd, const void *buf, size_t n, off_t offset);
+ssize_t preadv  (int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev (int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t sendfile (int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t copy_file_range (int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
 off_t   lseek (int fd, off_t offset, int whence);
 int     ftruncate (int fd, off_t length);
 int     close (int fd);
@@ -24,6 +31,22 @@ struct zz_fs_File_ct {
   int fd;
 };
 
+/* memory mapped files */
+
+enum {
+  PROT_READ      = 0x1,
+  MAP_PRIVATE    = 0x02,
+  MADV_NORMAL    = 0,
+  MADV_RANDOM    = 1,
+  MADV_SEQUENTIAL = 2,
+  MADV_WILLNEED  = 3,
+  MADV_DONTNEED  = 4
+};
+
+void *mmap    (void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int   munmap  (void *addr, size_t len);
+int   madvise (void *addr, size_t len, int advice);
+
 /* change file timestamps with nanosecond precision */
 
 int futimens(int fd, const struct timespec times[2]);
@@ -78,6 +101,8 @@ void              zz_fs_Stat_free(struct stat *);
 int zz_fs_stat  (const char *path, struct stat *buf);
 int zz_fs_lstat (const char *path, struct stat *buf);
 
+void zz_fs_statx_to_stat(struct statx *stx, struct stat *buf);
+
 typedef struct __dirstream DIR;
 
 struct zz_fs_Dir_ct {
@@ -161,7 +186,15 @@ enum {
   ZZ_ASYNC_FS_OPENDIR,
   ZZ_ASYNC_FS_READDIR,
   ZZ_ASYNC_FS_CLOSEDIR,
-  ZZ_ASYNC_FS_GLOB
+  ZZ_ASYNC_FS_GLOB,
+  ZZ_ASYNC_FS_PREAD,
+  ZZ_ASYNC_FS_PWRITE,
+  ZZ_ASYNC_FS_PREADV,
+  ZZ_ASYNC_FS_PWRITEV,
+  ZZ_ASYNC_FS_READV,
+  ZZ_ASYNC_FS_WRITEV,
+  ZZ_ASYNC_FS_SENDFILE,
+  ZZ_ASYNC_FS_COPY_FILE_RANGE
 };
 
 void *zz_async_fs_handlers[];
@@ -282,6 +315,40 @@ union zz_async_fs_req {
     glob_t *pglob;
     int rv;
   } glob;
+
+  struct {
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+    ssize_t nbytes;
+    int _errno;
+  } pread, pwrite;
+
+  struct {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    ssize_t nbytes;
+    int _errno;
+  } preadv, pwritev;
+
+  struct {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    ssize_t nbytes;
+    int _errno;
+  } readv, writev;
+
+  struct {
+    int in_fd;
+    int out_fd;
+    size_t count;
+    ssize_t nbytes;
+    int _errno;
+  } sendfile, copy_file_range;
 };
 
 ]]
@@ -322,7 +389,9 @@ end
 
 function File_mt:read1(ptr, size)
    local nbytes, _errno
-   if sched.ticking() then
+   if uring.available() then
+      nbytes, _errno = uring.read(self.fd, ptr, size)
+   elseif sched.ticking() then
       mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
          req.read.fd = self.fd
          req.read.buf = ptr
@@ -339,7 +408,9 @@ end
 
 function File_mt:write1(ptr, size)
    local nbytes, _errno
-   if sched.ticking() then
+   if uring.available() then
+      nbytes, _errno = uring.write(self.fd, ptr, size)
+   elseif sched.ticking() then
       mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
          req.write.fd = self.fd
          req.write.buf = ptr
@@ -354,6 +425,200 @@ function File_mt:write1(ptr, size)
    return util.check_errno("write1", nbytes, _errno)
 end
 
+-- reads into the buffers described by iov[0..iovcnt-1] (filling
+-- them in order) at the current file position with a single request
+function File_mt:readv(iov, iovcnt)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.readv(self.fd, iov, iovcnt)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.readv.fd = self.fd
+         req.readv.iov = iov
+         req.readv.iovcnt = iovcnt
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_READV, req)
+         _errno = req.readv._errno
+         nbytes = req.readv.nbytes
+      end)
+   else
+      nbytes = ffi.C.readv(self.fd, iov, iovcnt)
+   end
+   return util.check_errno("readv", nbytes, _errno)
+end
+
+-- writes the buffers described by iov[0..iovcnt-1] at the current
+-- file position with a single request
+function File_mt:writev(iov, iovcnt)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.writev(self.fd, iov, iovcnt)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.writev.fd = self.fd
+         req.writev.iov = iov
+         req.writev.iovcnt = iovcnt
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_WRITEV, req)
+         _errno = req.writev._errno
+         nbytes = req.writev.nbytes
+      end)
+   else
+      nbytes = ffi.C.writev(self.fd, iov, iovcnt)
+   end
+   return util.check_errno("writev", nbytes, _errno)
+end
+
+-- kernel-side copies from this file (at the file position) to
+-- out_fd: no data passes through user space
+--
+-- unlike the other methods these do not raise: they return the
+-- number of bytes copied or -1 and the errno, so callers can fall
+-- back to a buffered copy when the fds do not support the operation
+
+function File_mt:sendfile(out_fd, count)
+   local nbytes, _errno
+   if sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.sendfile.in_fd = self.fd
+         req.sendfile.out_fd = out_fd
+         req.sendfile.count = count
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_SENDFILE, req)
+         _errno = req.sendfile._errno
+         nbytes = req.sendfile.nbytes
+      end)
+   else
+      nbytes = ffi.C.sendfile(out_fd, self.fd, nil, count)
+      _errno = errno.errno()
+   end
+   return tonumber(nbytes), _errno
+end
+
+function File_mt:copy_file_range(out_fd, count)
+   local nbytes, _errno
+   if sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.copy_file_range.in_fd = self.fd
+         req.copy_file_range.out_fd = out_fd
+         req.copy_file_range.count = count
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_COPY_FILE_RANGE, req)
+         _errno = req.copy_file_range._errno
+         nbytes = req.copy_file_range.nbytes
+      end)
+   else
+      nbytes = ffi.C.copy_file_range(self.fd, nil, out_fd, nil, count, 0)
+      _errno = errno.errno()
+   end
+   return tonumber(nbytes), _errno
+end
+
+-- positional I/O: reads/writes at `offset` without using (or
+-- changing) the file position, so several threads can access
+-- different parts of the same file at the same time
+
+function File_mt:pread(ptr, size, offset)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.read(self.fd, ptr, size, offset)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.pread.fd = self.fd
+         req.pread.buf = ptr
+         req.pread.count = size
+         req.pread.offset = offset
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_PREAD, req)
+         _errno = req.pread._errno
+         nbytes = req.pread.nbytes
+      end)
+   else
+      nbytes = ffi.C.pread(self.fd, ptr, size, offset)
+   end
+   return util.check_errno("pread", nbytes, _errno)
+end
+
+function File_mt:pwrite(ptr, size, offset)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.write(self.fd, ptr, size, offset)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.pwrite.fd = self.fd
+         req.pwrite.buf = ffi.cast("void*", ptr)
+         req.pwrite.count = size
+         req.pwrite.offset = offset
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_PWRITE, req)
+         _errno = req.pwrite._errno
+         nbytes = req.pwrite.nbytes
+      end)
+   else
+      nbytes = ffi.C.pwrite(self.fd, ptr, size, offset)
+   end
+   return util.check_errno("pwrite", nbytes, _errno)
+end
+
+-- bufs: a list of buffers (pwritev also accepts strings)
+--
+-- the returned iovec array references the data in bufs, so bufs must
+-- be kept alive while the iovec is in use
+local function make_iovec(bufs)
+   local iovcnt = #bufs
+   local iov = ffi.new("struct iovec[?]", iovcnt)
+   for i=1,iovcnt do
+      local buf = bufs[i]
+      if buffer.is_buffer(buf) then
+         iov[i-1].iov_base = buf.ptr
+      else
+         iov[i-1].iov_base = ffi.cast("void*", buf)
+      end
+      iov[i-1].iov_len = #buf
+   end
+   return iov, iovcnt
+end
+
+-- fills the buffers in bufs (up to their current length) with data
+-- starting at `offset`, returns the total number of bytes read
+function File_mt:preadv(bufs, offset)
+   local iov, iovcnt = make_iovec(bufs)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.readv(self.fd, iov, iovcnt, offset)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.preadv.fd = self.fd
+         req.preadv.iov = iov
+         req.preadv.iovcnt = iovcnt
+         req.preadv.offset = offset
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_PREADV, req)
+         _errno = req.preadv._errno
+         nbytes = req.preadv.nbytes
+      end)
+   else
+      nbytes = ffi.C.preadv(self.fd, iov, iovcnt, offset)
+   end
+   return util.check_errno("preadv", nbytes, _errno)
+end
+
+-- writes the contents of bufs starting at `offset` with a single
+-- request, returns the total number of bytes written
+function File_mt:pwritev(bufs, offset)
+   local iov, iovcnt = make_iovec(bufs)
+   local nbytes, _errno
+   if uring.available() then
+      nbytes, _errno = uring.writev(self.fd, iov, iovcnt, offset)
+   elseif sched.ticking() then
+      mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
+         req.pwritev.fd = self.fd
+         req.pwritev.iov = iov
+         req.pwritev.iovcnt = iovcnt
+         req.pwritev.offset = offset
+         async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_PWRITEV, req)
+         _errno = req.pwritev._errno
+         nbytes = req.pwritev.nbytes
+      end)
+   else
+      nbytes = ffi.C.pwritev(self.fd, iov, iovcnt, offset)
+   end
+   return util.check_errno("pwritev", nbytes, _errno)
+end
+
 function File_mt:seek(offset, relative)
    if relative then
       return lseek(self.fd, offset, ffi.C.SEEK_CUR)
@@ -388,7 +653,9 @@ end
 function File_mt:close()
    if self.fd >= 0 then
       local rv, _errno
-      if sched.ticking() then
+      if uring.available() then
+         rv, _errno = uring.close(self.fd)
+      elseif sched.ticking() then
          rv = mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
             req.close.fd = self.fd
             async.request(ASYNC_FS, ffi.C.ZZ_ASYNC_FS_CLOSE, req)
@@ -423,6 +690,57 @@ function File_mt:as_stream()
    function stream:write1(ptr, size)
       return f:write1(ptr, size)
    end
+   function stream:readv(iov, iovcnt)
+      local nbytes = f:readv(iov, iovcnt)
+      if nbytes == 0 then
+         eof = true
+      end
+      return nbytes
+   end
+   function stream:writev(iov, iovcnt)
+      return f:writev(iov, iovcnt)
+   end
+   -- used by stream.copy() for zero-copy transfers
+   function stream:fileno()
+      return f.fd, "file"
+   end
+   function stream:set_eof()
+      eof = true
+   end
+   function stream:sendfile(out_fd, count)
+      return f:sendfile(out_fd, count)
+   end
+   function stream:copy_file_range(out_fd, count)
+      return f:copy_file_range(out_fd, count)
+   end
+   return stream
+end
+
+-- like as_stream() but reads/writes via pread/pwrite starting at
+-- `offset`. the file position is left alone and closing the stream
+-- does not close the file
+function File_mt:as_stream_at(offset)
+   local stream = {}
+   local f = self
+   local eof = false
+   function stream:close()
+   end
+   function stream:eof()
+      return eof
+   end
+   function stream:read1(ptr, size)
+      local nbytes = f:pread(ptr, size, offset)
+      if nbytes == 0 then
+         eof = true
+      end
+      offset = offset + nbytes
+      return nbytes
+   end
+   function stream:write1(ptr, size)
+      local nbytes = f:pwrite(ptr, size, offset)
+      offset = offset + nbytes
+      return nbytes
+   end
    return stream
 end
 
@@ -459,7 +777,9 @@ function M.open(path, flags, mode)
    flags = parse_open_flags(flags or ffi.C.O_RDONLY)
    mode = mode or util.oct("666")
    local fd, _errno
-   if sched.ticking() then
+   if uring.available() then
+      fd, _errno = uring.open(path, flags, mode)
+   elseif sched.ticking() then
       fd = mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
          req.open.file = ffi.cast("char*", path)
          req.open.oflag = flags
@@ -485,6 +805,83 @@ function M.readfile(path, rsize)
    return contents
 end
 
+-- memory mapping
+
+local madvise_flags = {
+   normal = ffi.C.MADV_NORMAL,
+   random = ffi.C.MADV_RANDOM,
+   sequential = ffi.C.MADV_SEQUENTIAL,
+   willneed = ffi.C.MADV_WILLNEED,
+   dontneed = ffi.C.MADV_DONTNEED,
+}
+
+local MAP_FAILED = ffi.cast("void*", -1)
+
+-- sizes of live mappings (key: buffer, value: size of the mapping)
+local mappings = setmetatable({}, { __mode = "k" })
+
+-- maps the file at `path` into memory (read-only) and returns a
+-- buffer which refers to the mapped pages. the data is not copied:
+-- pages are loaded by the kernel when they are first accessed
+--
+-- the buffer does not own the memory (cap == 0), the mapping is
+-- removed when the buffer is garbage collected (or passed to
+-- fs.munmap). views of the buffer (e.g. buffer.wrap) must not
+-- outlive it
+--
+-- advice (optional): see fs.madvise()
+function M.mmap(path, advice)
+   local f = M.open(path)
+   local size = f:size()
+   if size == 0 then
+      -- empty files cannot be mapped
+      f:close()
+      return buffer.new(0)
+   end
+   local ptr = ffi.C.mmap(nil, size, ffi.C.PROT_READ, ffi.C.MAP_PRIVATE, f.fd, 0)
+   local _errno = errno.errno()
+   -- the mapping stays valid after the fd is closed
+   f:close()
+   if ptr == MAP_FAILED then
+      util.check_errno("mmap", -1, _errno)
+   end
+   local buf = ffi.gc(buffer.wrap(ptr, size), function(buf)
+      ffi.C.munmap(ptr, size)
+   end)
+   mappings[buf] = size
+   if advice then
+      M.madvise(buf, advice)
+   end
+   return buf
+end
+
+-- tells the kernel how the pages of a mapping will be accessed
+--
+-- advice: "normal", "random", "sequential", "willneed" or "dontneed"
+function M.madvise(buf, advice)
+   local size = mappings[buf]
+   if not size then
+      ef("madvise: buffer is not a mapping created by fs.mmap()")
+   end
+   local flag = madvise_flags[advice]
+   if not flag then
+      ef("madvise: invalid advice: %s", advice)
+   end
+   util.check_errno("madvise", ffi.C.madvise(buf.ptr, size, flag))
+end
+
+-- removes the mapping right away (instead of waiting for the GC)
+function M.munmap(buf)
+   local size = mappings[buf]
+   if size then
+      ffi.gc(buf, nil)
+      mappings[buf] = nil
+      util.check_errno("munmap", ffi.C.munmap(buf.ptr, size))
+      buf.ptr = nil
+      buf.len = 0
+   end
+end
+
 function M.writefile(path, contents)
    local flags = bit.bor(ffi.C.O_CREAT,
                          ffi.C.O_WRONLY,
@@ -560,9 +957,23 @@ end
 
 local Stat_mt = {}
 
+-- io_uring has no stat/lstat, only statx
+local function uring_stat(path, flags, buf)
+   local rv, _errno
+   mm.with_block("struct statx", nil, function(stx, block_size)
+      rv, _errno = uring.statx(path, flags, stx)
+      if rv == 0 then
+         ffi.C.zz_fs_statx_to_stat(stx, buf)
+      end
+   end)
+   return rv, _errno
+end
+
 function Stat_mt:stat(path)
    local rv, _errno
-   if sched.ticking() then
+   if uring.available() then
+      rv, _errno = uring_stat(path, 0, self.buf)
+   elseif sched.ticking() then
       rv = mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
          req.stat.path = ffi.cast("char*", path)
          req.stat.buf = self.buf
@@ -580,7 +991,9 @@ end
 
 function Stat_mt:lstat(path)
    local rv, _errno
-   if sched.ticking() then
+   if uring.available() then
+      rv, _errno = uring_stat(path, ffi.C.ZZ_URING_AT_SYMLINK_NOFOLLOW, self.buf)
+   elseif sched.ticking() then
       rv = mm.with_block("union zz_async_fs_req", nil, function(req, block_size)
          req.stat.path = ffi.cast("char*", path)
          req.stat.buf = self.buf
@@ -0,0 +1,110 @@
+-- fs read throughput: io_uring vs. the async thread pool
+--
+-- usage: zz run fs_bench.lua
+
+local ffi = require('ffi')
+local fs = require('fs')
+local uring = require('uring')
+local sched = require('sched')
+local stream = require('stream')
+local time = require('time')
+
+local M = {}
+
+local FILE_SIZE = 64 * 1024 * 1024
+local BLOCK_SIZE = 4096
+local CONCURRENCY = 16
+
+local function make_test_file(path)
+   local f = fs.open(path, "w")
+   local buf = ffi.new("uint8_t[?]", 1024 * 1024)
+   for i=1,FILE_SIZE / (1024 * 1024) do
+      f:write1(buf, 1024 * 1024)
+   end
+   f:close()
+end
+
+local function sequential_read(path)
+   local f = fs.open(path)
+   local buf = ffi.new("uint8_t[?]", BLOCK_SIZE)
+   local total = 0
+   while true do
+      local nbytes = f:read1(buf, BLOCK_SIZE)
+      if nbytes == 0 then
+         break
+      end
+      total = total + nbytes
+   end
+   f:close()
+   return total
+end
+
+local function random_read(path)
+   local blocks = FILE_SIZE / BLOCK_SIZE
+   local reads_per_thread = blocks / CONCURRENCY
+   local threads = {}
+   local total = 0
+   for i=1,CONCURRENCY do
+      threads[i] = sched(function()
+         local f = fs.open(path)
+         local buf = ffi.new("uint8_t[?]", BLOCK_SIZE)
+         for j=1,reads_per_thread do
+            local offset = math.random(0, blocks-1) * BLOCK_SIZE
+            if uring.available() then
+               total = total + uring.read(f.fd, buf, BLOCK_SIZE, offset)
+            else
+               -- the thread pool has no pread, emulate it
+               f:seek(offset)
+               total = total + f:read1(buf, BLOCK_SIZE)
+            end
+         end
+         f:close()
+      end)
+   end
+   sched.join(threads)
+   return total
+end
+
+-- through user space (the sink has no fd, so no zero-copy)
+local function stream_copy(path)
+   local f = fs.open(path)
+   local sink = { total = 0 }
+   function sink:write1(ptr, size)
+      self.total = self.total + size
+      return size
+   end
+   stream.copy(f, sink)
+   f:close()
+   return sink.total
+end
+
+local function bench(name, fn, path)
+   local t0 = time.time()
+   local total = fn(path)
+   local elapsed = time.time() - t0
+   pf("%-28s %8.1f MiB %10.3f ms %10.1f MiB/s",
+      name, total / 1048576, elapsed * 1000, total / 1048576 / elapsed)
+end
+
+function M.main()
+   math.randomseed(0)
+   fs.with_tmpdir(function(tmpdir)
+      local path = fs.join(tmpdir, "data")
+      make_test_file(path)
+      -- warm up the page cache
+      fs.readfile(path)
+      for _,engine in ipairs { "uring", "thread pool" } do
+         uring.enabled = (engine == "uring")
+         if engine == "uring" and not uring.available() then
+            pf("io_uring is not available, skipping")
+         else
+            bench(sf("%s: sequential read", engine), sequential_read, path)
+            bench(sf("%s: random read (x%d)", engine, CONCURRENCY), random_read, path)
+            bench(sf("%s: stream.copy", engine), stream_copy, path)
+         end
+      end
+      uring.enabled = true
+   end)
+end
+
+return M
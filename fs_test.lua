@@ -81,6 +81,40 @@ testing("read", function()
    f:close()
 end)
 
+testing:with_tmpdir("mmap", function(ctx)
+   local contents = fs.readfile('testdata/arborescence.jpg')
+   local m = fs.mmap('testdata/arborescence.jpg')
+   assert(buffer.is_buffer(m))
+   -- the buffer does not own the mapped memory
+   assert.equals(tonumber(m.cap), 0)
+   assert.equals(#m, #contents)
+   assert(m == contents)
+   fs.madvise(m, "sequential")
+   fs.madvise(m, "willneed")
+   assert.throws('invalid advice', function()
+      fs.madvise(m, "fast")
+   end)
+   -- only mappings can be advised
+   assert.throws('not a mapping', function()
+      fs.madvise(contents, "random")
+   end)
+   -- mappings can be used as stream sources
+   assert.equals(stream(m):read(0), contents)
+   fs.munmap(m)
+   assert(m.ptr == nil)
+   assert.equals(#m, 0)
+   -- advice can be given at mmap time
+   local m = fs.mmap('testdata/hello.txt', "random")
+   assert.equals(m, "hello, world!\n")
+   -- empty files give an empty buffer
+   local path = fs.join(ctx.tmpdir, "empty")
+   fs.writefile(path, "")
+   assert.equals(#fs.mmap(path), 0)
+   assert.throws('No such file or directory', function()
+      fs.mmap("nonexistentfile")
+   end)
+end)
+
 testing:with_tmpdir("writefile", function(ctx)
    local tmp = fs.join(ctx.tmpdir, 'arborescence.jpg')
    fs.writefile(tmp, fs.readfile('testdata/arborescence.jpg'))
@@ -111,6 +145,58 @@ testing("seek", function()
    f:close()
 end)
 
+testing:with_tmpdir("pread, pwrite", function(ctx)
+   local path = fs.join(ctx.tmpdir, "data.txt")
+   fs.writefile(path, "hello, world!\n")
+   local f = fs.open(path, ffi.C.O_RDWR)
+   local buf = buffer.new(64)
+   assert.equals(f:pread(buf.ptr, 5, 7), 5)
+   assert.equals(buffer.wrap(buf.ptr, 5), "world")
+   -- positional I/O does not move the file position
+   assert.equals(f:pos(), 0)
+   assert.equals(f:pwrite("WORLD", 5, 7), 5)
+   assert.equals(f:pos(), 0)
+   -- reading beyond the end returns 0
+   assert.equals(f:pread(buf.ptr, 64, 1000), 0)
+   f:close()
+   assert.equals(fs.readfile(path), "hello, WORLD!\n")
+end)
+
+testing:with_tmpdir("preadv, pwritev", function(ctx)
+   local path = fs.join(ctx.tmpdir, "data.txt")
+   local f = fs.open(path, "w+")
+   assert.equals(f:pwritev({ "hello", buffer.copy(", "), "world!" }, 0), 13)
+   assert.equals(f:pos(), 0)
+   local b1 = buffer.new(5, 5)
+   local b2 = buffer.new(2, 2)
+   local b3 = buffer.new(16, 16)
+   assert.equals(f:preadv({ b1, b2, b3 }, 0), 13)
+   assert.equals(b1, "hello")
+   assert.equals(b2, ", ")
+   assert.equals(buffer.wrap(b3.ptr, 6), "world!")
+   f:close()
+end)
+
+testing("as_stream_at", function()
+   local f = fs.open('testdata/arborescence.jpg')
+   local contents = fs.readfile('testdata/arborescence.jpg')
+   -- several readers of the same file do not disturb each other
+   local threads = {}
+   for i=1,8 do
+      threads[i] = sched(function()
+         local offset = (i-1) * 10000
+         local s = stream(f:as_stream_at(offset))
+         assert(s:read(10000) == buffer.slice(contents, offset, 10000))
+         s:close()
+      end)
+   end
+   sched.join(threads)
+   -- closing the streams did not close the file
+   assert(f.fd >= 0)
+   assert.equals(f:pos(), 0)
+   f:close()
+end)
+
 testing:with_tmpdir("truncate, seek_end", function(ctx)
    local path = fs.join(ctx.tmpdir, "temp")
    fs.writefile(path, fs.readfile("testdata/arborescence.jpg"))
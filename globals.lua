@@ -75,6 +75,16 @@ ssize_t read  (int fd, void *buf, size_t size);
 ssize_t write (int fd, const void *buf, size_t size);
 int     close (int fd);
 
+/* sys/uio.h */
+
+struct iovec {
+  void  *iov_base;
+  size_t iov_len;
+};
+
+ssize_t readv  (int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev (int fd, const struct iovec *iov, int iovcnt);
+
 /* sys/ioctl.h */
 
 int ioctl(int fd, int cmd, ...);
@@ -0,0 +1,281 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* incremental parser for the head (start line + header fields) of
+   HTTP/1.x messages
+
+   the parser works in place over a buffer which holds the beginning
+   of the message (typically the read buffer of a stream) and does
+   not allocate. if the head is incomplete, the parser can be called
+   again after more data has been appended: parsing resumes where it
+   stopped. positions are recorded as offsets relative to the start
+   of the buffer, so the data may be moved between calls */
+
+#define ZZ_HTTP_MAX_HEADERS 64
+
+enum {
+  ZZ_HTTP_REQUEST  = 0,
+  ZZ_HTTP_RESPONSE = 1
+};
+
+enum {
+  ZZ_HTTP_DONE     = 1,
+  ZZ_HTTP_MORE     = 0,  /* head is incomplete */
+  ZZ_HTTP_EINVAL   = -1, /* malformed head */
+  ZZ_HTTP_ETOOBIG  = -2, /* head is longer than max_head_size */
+  ZZ_HTTP_ETOOMANY = -3  /* more than ZZ_HTTP_MAX_HEADERS header fields */
+};
+
+struct zz_http_span {
+  uint32_t off;
+  uint32_t len;
+};
+
+struct zz_http_header {
+  struct zz_http_span name;
+  struct zz_http_span value;
+};
+
+struct zz_http_parser {
+  int type;
+  int state;
+  uint32_t pos; /* number of bytes parsed so far */
+  uint32_t max_head_size;
+  /* requests: method, uri, version
+     responses: version, status, reason */
+  struct zz_http_span start[3];
+  int nheaders;
+  struct zz_http_header headers[ZZ_HTTP_MAX_HEADERS];
+};
+
+enum {
+  S_START,
+  S_TOKEN0,
+  S_TOKEN1,
+  S_TOKEN2,
+  S_LINE_LF,
+  S_HEADER_START,
+  S_NAME,
+  S_VALUE_START,
+  S_VALUE,
+  S_HEADER_LF,
+  S_END_LF,
+  S_DONE
+};
+
+/* token characters (RFC 7230, 3.2.6) */
+static int is_tchar(uint8_t c) {
+  if ((c >= 'a' && c <= 'z') ||
+      (c >= 'A' && c <= 'Z') ||
+      (c >= '0' && c <= '9')) {
+    return 1;
+  }
+  return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/* visible characters (incl. obs-text) */
+static int is_vchar(uint8_t c) {
+  return c > 0x20 && c != 0x7f;
+}
+
+/* characters allowed in field values and reason phrases */
+static int is_text(uint8_t c) {
+  return (c >= 0x20 && c != 0x7f) || c == '\t';
+}
+
+static int is_digit(uint8_t c) {
+  return c >= '0' && c <= '9';
+}
+
+void zz_http_parser_init(struct zz_http_parser *p, int type, uint32_t max_head_size) {
+  p->type = type;
+  p->state = S_START;
+  p->pos = 0;
+  p->max_head_size = max_head_size;
+  memset(p->start, 0, sizeof(p->start));
+  p->nheaders = 0;
+}
+
+static int validate_start_line(struct zz_http_parser *p, const uint8_t *data) {
+  struct zz_http_span *version;
+  if (p->type == ZZ_HTTP_REQUEST) {
+    if (p->start[2].len == 0) {
+      return 0;
+    }
+    version = &p->start[2];
+  }
+  else {
+    struct zz_http_span *status = &p->start[1];
+    if (status->len != 3 ||
+        !is_digit(data[status->off]) ||
+        !is_digit(data[status->off+1]) ||
+        !is_digit(data[status->off+2])) {
+      return 0;
+    }
+    version = &p->start[0];
+  }
+  return version->len > 5 && memcmp(data + version->off, "HTTP/", 5) == 0;
+}
+
+int zz_http_parse(struct zz_http_parser *p, const uint8_t *data, size_t len) {
+  size_t end = len;
+  if (end > p->max_head_size) {
+    end = p->max_head_size;
+  }
+  uint32_t i = p->pos;
+  int state = p->state;
+  struct zz_http_header *h = &p->headers[p->nheaders];
+  while (i < end) {
+    uint8_t c = data[i];
+    switch (state) {
+    case S_START:
+      /* ignore empty lines before the start line (RFC 7230, 3.5) */
+      if (c == '\r' || c == '\n') {
+        i++;
+      }
+      else {
+        p->start[0].off = i;
+        state = S_TOKEN0;
+      }
+      break;
+    case S_TOKEN0:
+      if (c == ' ') {
+        p->start[0].len = i - p->start[0].off;
+        if (p->start[0].len == 0) {
+          return ZZ_HTTP_EINVAL;
+        }
+        p->start[1].off = i + 1;
+        state = S_TOKEN1;
+      }
+      else if (p->type == ZZ_HTTP_REQUEST ? !is_tchar(c) : !is_vchar(c)) {
+        return ZZ_HTTP_EINVAL;
+      }
+      i++;
+      break;
+    case S_TOKEN1:
+      if (c == ' ') {
+        p->start[1].len = i - p->start[1].off;
+        if (p->start[1].len == 0) {
+          return ZZ_HTTP_EINVAL;
+        }
+        p->start[2].off = i + 1;
+        state = S_TOKEN2;
+      }
+      else if ((c == '\r' || c == '\n') && p->type == ZZ_HTTP_RESPONSE) {
+        /* status line without reason phrase */
+        p->start[1].len = i - p->start[1].off;
+        p->start[2].off = i;
+        p->start[2].len = 0;
+        if (!validate_start_line(p, data)) {
+          return ZZ_HTTP_EINVAL;
+        }
+        state = (c == '\r') ? S_LINE_LF : S_HEADER_START;
+      }
+      else if (!is_vchar(c)) {
+        return ZZ_HTTP_EINVAL;
+      }
+      i++;
+      break;
+    case S_TOKEN2:
+      if (c == '\r' || c == '\n') {
+        p->start[2].len = i - p->start[2].off;
+        if (!validate_start_line(p, data)) {
+          return ZZ_HTTP_EINVAL;
+        }
+        state = (c == '\r') ? S_LINE_LF : S_HEADER_START;
+      }
+      else if (p->type == ZZ_HTTP_REQUEST ? !is_vchar(c) : !is_text(c)) {
+        return ZZ_HTTP_EINVAL;
+      }
+      i++;
+      break;
+    case S_LINE_LF:
+    case S_HEADER_LF:
+      if (c != '\n') {
+        return ZZ_HTTP_EINVAL;
+      }
+      state = S_HEADER_START;
+      i++;
+      break;
+    case S_HEADER_START:
+      if (c == '\r') {
+        state = S_END_LF;
+        i++;
+      }
+      else if (c == '\n') {
+        i++;
+        goto done;
+      }
+      else if (c == ' ' || c == '\t') {
+        /* obsolete line folding is not supported (RFC 7230, 3.2.4) */
+        return ZZ_HTTP_EINVAL;
+      }
+      else {
+        if (p->nheaders == ZZ_HTTP_MAX_HEADERS) {
+          return ZZ_HTTP_ETOOMANY;
+        }
+        h = &p->headers[p->nheaders];
+        h->name.off = i;
+        state = S_NAME;
+      }
+      break;
+    case S_NAME:
+      if (c == ':') {
+        h->name.len = i - h->name.off;
+        if (h->name.len == 0) {
+          return ZZ_HTTP_EINVAL;
+        }
+        state = S_VALUE_START;
+      }
+      else if (!is_tchar(c)) {
+        return ZZ_HTTP_EINVAL;
+      }
+      i++;
+      break;
+    case S_VALUE_START:
+      /* skip leading whitespace */
+      if (c == ' ' || c == '\t') {
+        i++;
+      }
+      else {
+        h->value.off = i;
+        h->value.len = 0;
+        state = S_VALUE;
+      }
+      break;
+    case S_VALUE:
+      if (c == '\r' || c == '\n') {
+        p->nheaders++;
+        state = (c == '\r') ? S_HEADER_LF : S_HEADER_START;
+      }
+      else if (!is_text(c)) {
+        return ZZ_HTTP_EINVAL;
+      }
+      else if (c != ' ' && c != '\t') {
+        /* trailing whitespace is not part of the value */
+        h->value.len = i + 1 - h->value.off;
+      }
+      i++;
+      break;
+    case S_END_LF:
+      if (c != '\n') {
+        return ZZ_HTTP_EINVAL;
+      }
+      i++;
+      goto done;
+    default:
+      return ZZ_HTTP_EINVAL;
+    }
+  }
+  p->pos = i;
+  p->state = state;
+  if (i == p->max_head_size) {
+    return ZZ_HTTP_ETOOBIG;
+  }
+  return ZZ_HTTP_MORE;
+done:
+  p->pos = i;
+  p->state = S_DONE;
+  return ZZ_HTTP_DONE;
+}
@@ -1,16 +1,13 @@
+local ffi = require('ffi')
 local buffer = require('buffer')
 local stream = require('stream')
 local net = require('net')
 local util = require('util')
 local sched = require('sched')
-local re = require('re')
+local uri = require('uri')
 
 local M = {}
 
-local function readln(stream)
-   return stream:readln("\x0d\x0a")
-end
-
 local function writeln(stream, line)
    return stream:writeln(line, "\x0d\x0a")
 end
@@ -19,49 +16,404 @@ local make_stream = stream -- via __call
 
 --[[ headers ]]--
 
+-- header tables map header names (as they were set) to values
+--
+-- lookups are case-insensitive: each header table has an index which
+-- maps lowercased names to the names used in the table
+--
+-- values are strings, except lists of strings for fields which may
+-- appear more than once but cannot be combined (Set-Cookie)
+local header_index = setmetatable({}, { __mode = "k" })
+
 local Headers_mt = {
-   -- case-insensitive lookup by header name
    __index = function(self, key)
-      key = string.lower(key)
-      for k,v in pairs(self) do
-         if string.lower(k) == key then
-            return v
-         end
-      end
+      local name = header_index[self][string.lower(key)]
+      return name and rawget(self, name)
    end,
    __newindex = function(self, key, value)
-      rawset(self, key, tostring(value))
+      local index = header_index[self]
+      local lkey = string.lower(key)
+      local name = index[lkey]
+      if name then
+         -- same header with different capitalization
+         rawset(self, name, nil)
+      end
+      index[lkey] = key
+      if type(value) ~= "table" then
+         value = tostring(value)
+      end
+      rawset(self, key, value)
    end
 }
 
-local header_line_regex = re.compile([[^(\S+):\s*(.+)\s*$]])
+local function Headers(headers)
+   headers = headers or {}
+   local index = {}
+   for k,_ in pairs(headers) do
+      index[string.lower(k)] = k
+   end
+   header_index[headers] = index
+   return setmetatable(headers, Headers_mt)
+end
+
+local function write_headers(stream, headers)
+   for k,v in pairs(headers) do
+      if type(v) == "table" then
+         for i=1,#v do
+            writeln(stream, sf("%s: %s", k, v[i]))
+         end
+      else
+         writeln(stream, sf("%s: %s", k, v))
+      end
+   end
+   writeln(stream, "")
+end
+
+--[[ errors ]]--
+
+-- raises an error caused by a malformed incoming message
+--
+-- the error carries the status code (http_status) with which a
+-- server answers the message before it closes the connection
+local function protocol_error(status, fmt, ...)
+   util.throwat(2, sf(fmt, ...), { http_status = status })
+end
+
+-- adds a field of an incoming message to `headers`
+--
+-- repeated fields are combined into a comma-separated list (RFC 7230,
+-- 3.2.2), except Set-Cookie whose values are kept in a list
+local function add_header(headers, name, value)
+   local prev = headers[name]
+   if prev == nil then
+      headers[name] = value
+      return
+   end
+   local lname = string.lower(name)
+   if lname == "set-cookie" then
+      if type(prev) == "string" then
+         prev = { prev }
+         headers[name] = prev
+      end
+      table.insert(prev, value)
+   elseif lname == "content-length" then
+      -- a list would be ambiguous: which one frames the body?
+      if value ~= prev then
+         protocol_error(400, "conflicting Content-Length values: %s, %s", prev, value)
+      end
+   else
+      headers[name] = prev..", "..value
+   end
+end
+
+--[[ message head parser ]]--
+
+ffi.cdef [[
+
+enum {
+  ZZ_HTTP_MAX_HEADERS = 64
+};
+
+enum {
+  ZZ_HTTP_REQUEST  = 0,
+  ZZ_HTTP_RESPONSE = 1
+};
+
+enum {
+  ZZ_HTTP_DONE     = 1,
+  ZZ_HTTP_MORE     = 0,
+  ZZ_HTTP_EINVAL   = -1,
+  ZZ_HTTP_ETOOBIG  = -2,
+  ZZ_HTTP_ETOOMANY = -3
+};
+
+struct zz_http_span {
+  uint32_t off;
+  uint32_t len;
+};
 
-local function read_headers(stream)
-   local headers = {}
+struct zz_http_header {
+  struct zz_http_span name;
+  struct zz_http_span value;
+};
+
+struct zz_http_parser {
+  int type;
+  int state;
+  uint32_t pos;
+  uint32_t max_head_size;
+  struct zz_http_span start[3];
+  int nheaders;
+  struct zz_http_header headers[ZZ_HTTP_MAX_HEADERS];
+};
+
+void zz_http_parser_init(struct zz_http_parser *p, int type, uint32_t max_head_size);
+int zz_http_parse(struct zz_http_parser *p, const uint8_t *data, size_t len);
+
+]]
+
+-- max size of the start line + headers of a message
+M.MAX_HEAD_SIZE = 8192
+
+-- formatted with the max head size the parser was initialized with
+local parse_errors = {
+   [ffi.C.ZZ_HTTP_EINVAL] = "malformed",
+   [ffi.C.ZZ_HTTP_ETOOBIG] = "larger than %d bytes",
+   [ffi.C.ZZ_HTTP_ETOOMANY] = sf("has more than %d header fields", ffi.C.ZZ_HTTP_MAX_HEADERS),
+}
+
+local parse_error_statuses = {
+   [ffi.C.ZZ_HTTP_EINVAL] = 400,
+   [ffi.C.ZZ_HTTP_ETOOBIG] = 431,
+   [ffi.C.ZZ_HTTP_ETOOMANY] = 431,
+}
+
+-- parsers are reused: reading a message head does not allocate
+-- anything but the Lua strings of the result
+local parser_pool = {}
+
+-- parses the head of the next message in place (in the read buffer
+-- of the stream) and consumes it
+--
+-- returns the three parts of the start line and the headers or nil
+-- if the stream reached EOF before the head was complete
+local function read_head(stream, type)
+   local p = table.remove(parser_pool) or ffi.new("struct zz_http_parser")
+   local max_head_size = M.MAX_HEAD_SIZE
+   ffi.C.zz_http_parser_init(p, type, max_head_size)
+   local ptr, len
    while true do
-      line = readln(stream)
-      if stream:eof() then
+      ptr, len = stream:buffered()
+      local rv = ffi.C.zz_http_parse(p, ptr, len)
+      if rv == ffi.C.ZZ_HTTP_DONE then
+         break
+      elseif rv ~= ffi.C.ZZ_HTTP_MORE then
+         table.insert(parser_pool, p)
+         protocol_error(parse_error_statuses[rv],
+                        "message head is "..parse_errors[rv], max_head_size)
+      elseif stream:fill() == 0 then
+         table.insert(parser_pool, p)
          return nil
       end
-      if line == "" then
-         break
+   end
+   local function span(s)
+      return ffi.string(ptr + s.off, s.len)
+   end
+   local headers = Headers()
+   for i=0,p.nheaders-1 do
+      local h = p.headers[i]
+      add_header(headers, span(h.name), span(h.value))
+   end
+   local a, b, c = span(p.start[0]), span(p.start[1]), span(p.start[2])
+   stream:consume(p.pos)
+   table.insert(parser_pool, p)
+   return a, b, c, headers
+end
+
+--[[ chunked transfer coding ]]--
+
+-- returns a stream which decodes a chunked body read from `s`
+--
+-- the stream reaches EOF after the last chunk (and the trailer
+-- section). closing it does not close `s`
+function M.chunked_reader(s)
+   local remaining = 0 -- bytes left in the current chunk
+   local done = false
+   local function read_chunk_size()
+      local line = s:readln("\x0d\x0a")
+      -- chunk extensions (after the size) are ignored
+      local hex = line:match("^%x+")
+      if not hex then
+         protocol_error(400, "invalid chunk size line: %s", line)
       end
-      local m = header_line_regex:match(line)
-      if not m then
-         ef("Invalid header line: %s", line)
+      return tonumber(hex, 16)
+   end
+   local self = {}
+   function self:eof()
+      return done
+   end
+   function self:read1(ptr, size)
+      if done then
+         return 0
+      end
+      if remaining == 0 then
+         remaining = read_chunk_size()
+         if remaining == 0 then
+            -- skip the trailer section
+            repeat
+               local line = s:readln("\x0d\x0a")
+            until line == ""
+            done = true
+            return 0
+         end
       end
-      local key = m[1]
-      local value = m[2]
-      headers[key] = value
+      local nbytes = s:read1(ptr, util.min(size, remaining))
+      if nbytes == 0 then
+         protocol_error(400, "unexpected EOF in chunked body")
+      end
+      remaining = remaining - nbytes
+      if remaining == 0 and s:readln("\x0d\x0a") ~= "" then
+         protocol_error(400, "missing CRLF after chunk data")
+      end
+      return nbytes
    end
-   return setmetatable(headers, Headers_mt)
+   function self:close()
+   end
+   return make_stream(self)
 end
 
-local function write_headers(stream, headers)
-   for k,v in pairs(headers) do
-      writeln(stream, sf("%s: %s", k, v))
+-- returns a stream which writes data to `s` in chunks
+--
+-- small writes are collected into larger chunks. close() writes the
+-- last chunk but does not close `s`
+function M.chunked_writer(s)
+   local closed = false
+   local self = {}
+   function self:write1(ptr, size)
+      if size > 0 then
+         s:write(sf("%x\x0d\x0a", size))
+         s:write(buffer.wrap(ptr, size))
+         s:write("\x0d\x0a")
+      end
+      return size
+   end
+   function self:close()
+      if not closed then
+         s:write("0\x0d\x0a\x0d\x0a")
+         closed = true
+      end
+   end
+   return make_stream(self):buffer_writes()
+end
+
+--[[ messages ]]--
+
+local function is_bytes(x)
+   return type(x) == "string" or buffer.is_buffer(x)
+end
+
+-- the last transfer coding listed in a Transfer-Encoding value
+local function last_coding(te)
+   return string.lower(te):match("([^,%s]+)%s*$")
+end
+
+local function has_chunked_body(msg)
+   local te = msg._headers["Transfer-Encoding"]
+   return te ~= nil and last_coding(te) == "chunked"
+end
+
+-- checks the headers which frame the body of an incoming message
+--
+-- on a persistent connection, a body whose length the two ends see
+-- differently turns into the start of the next message (request
+-- smuggling): anything ambiguous is rejected
+local function check_framing(headers)
+   local te = headers["Transfer-Encoding"]
+   local cl = headers["Content-Length"]
+   if te then
+      if cl then
+         protocol_error(400, "message has both Transfer-Encoding and Content-Length")
+      end
+      if last_coding(te) ~= "chunked" then
+         protocol_error(400, "unsupported Transfer-Encoding: %s", te)
+      end
+   elseif cl and not cl:match("^%d+$") then
+      protocol_error(400, "invalid Content-Length: %s", cl)
+   end
+end
+
+-- true if the sender of `msg` wants to keep the connection open
+local function keep_alive(msg)
+   local connection = string.lower(msg._headers["Connection"] or "")
+   if msg.http_version == "HTTP/1.0" then
+      return connection:match("keep%-alive") ~= nil
+   else
+      return connection:match("close") == nil
+   end
+end
+
+-- returns a stream for reading the body of an incoming message
+local function body_stream(msg)
+   if not msg._body_stream then
+      local s = msg.stream
+      if msg._no_body then
+         s = make_stream("")
+      elseif has_chunked_body(msg) then
+         s = M.chunked_reader(s)
+      elseif msg.content_length then
+         s = stream.with_size(msg.content_length, stream.no_close(s))
+      elseif msg._read_to_eof then
+         -- the end of the body is marked by closing the connection
+         s = stream.no_close(s)
+      else
+         s = make_stream("")
+      end
+      msg._body_stream = s
+   end
+   return msg._body_stream
+end
+
+local function read_body(msg)
+   if not msg._body_data then
+      msg._body_data = body_stream(msg):read(0)
+   end
+   return msg._body_data
+end
+
+-- reads and drops what is left from the body of an incoming message,
+-- so that the next message can be read from the same stream
+local function discard_body(msg)
+   local body = body_stream(msg)
+   while not body:eof() do
+      body:read()
+   end
+end
+
+-- writes the head and the body of an outgoing message
+--
+-- bodies of unknown length (functions without content_length) are
+-- sent with chunked transfer coding, unless the message is marked as
+-- close-delimited (_close_delimited): then the end of the body is
+-- signalled by closing the connection. with flush = false the
+-- message may remain in the write buffer of the stream
+local function write_message(stream, msg, start_line, flush)
+   writeln(stream, start_line)
+   local body_writer
+   local chunked = false
+   local b = msg._body
+   if b then
+      if type(b) == "function" then
+         body_writer = b
+         if not msg.content_length
+            and msg.http_version == "HTTP/1.1"
+            and not msg._close_delimited then
+            msg:header("Transfer-Encoding", "chunked")
+            chunked = true
+         end
+      elseif is_bytes(b) then
+         body_writer = function(stream) stream:write(b) end
+         msg:header("Content-Length", #b)
+         msg.content_length = #b
+      else
+         ef("invalid body: %s", b)
+      end
+   else
+      msg:header("Content-Length", 0)
+      msg.content_length = 0
+   end
+   write_headers(stream, msg._headers)
+   if body_writer then
+      if chunked then
+         local w = M.chunked_writer(stream)
+         body_writer(w)
+         w:close()
+      else
+         body_writer(stream)
+      end
+   end
+   if flush ~= false then
+      stream:flush()
    end
-   writeln(stream, "")
 end
 
 --[[ request ]]--
@@ -77,7 +429,7 @@ function Request:new(opts)
       _headers = opts.headers or {},
       _body = opts.body,
    }
-   setmetatable(self._headers, Headers_mt)
+   Headers(self._headers)
    local host = opts.host or self._headers['Host']
    if host then
       self._headers['Host'] = host
@@ -98,29 +450,24 @@ function Request:header(key, value)
    return self._headers[key]
 end
 
-function Request:read_body()
-   if not self.content_length then
-      ef("cannot read request body without Content-Length")
-   end
-   return self.stream:read(self.content_length)
+-- returns a stream for reading the request body
+--
+-- requests without Content-Length and chunked transfer coding have
+-- no body
+function Request:body()
+   return body_stream(self)
 end
 
-local request_line_regex = re.compile([[^(\S+)\s+(\S+)\s+(HTTP/[0-9.]+)$]])
+function Request:read_body()
+   return read_body(self)
+end
 
 local function read_request(stream)
-   local request_line = readln(stream)
-   if stream:eof() then
-      return nil
-   end
-   local m = request_line_regex:match(request_line)
-   if not m then
-      ef("invalid request line: %s", request_line)
-   end
-   local method, uri, http_version = m[1], m[2], m[3]
-   local headers = read_headers(stream)
-   if stream:eof() then
+   local method, uri, http_version, headers = read_head(stream, ffi.C.ZZ_HTTP_REQUEST)
+   if not method then
       return nil
    end
+   check_framing(headers)
    return Request {
       stream = stream,
       method = method,
@@ -130,32 +477,9 @@ local function read_request(stream)
    }
 end
 
-local function is_bytes(x)
-   return type(x) == "string" or buffer.is_buffer(x)
-end
-
-local function write_request(stream, request)
-   writeln(stream, sf("%s %s %s", request.method, request.uri, request.http_version))
-   local body_writer
-   local b = request._body
-   if b then
-      if type(b) == "function" then
-         body_writer = b
-      elseif is_bytes(b) then
-         body_writer = function(stream) stream:write(b) end
-         request:header("Content-Length", #b)
-         request.content_length = #b
-      else
-         ef("invalid body: %s", b)
-      end
-   else
-      request:header("Content-Length", 0)
-      request.content_length = 0
-   end
-   write_headers(stream, request._headers)
-   if body_writer then
-      body_writer(stream)
-   end
+local function write_request(stream, request, flush)
+   local request_line = sf("%s %s %s", request.method, request.uri, request.http_version)
+   write_message(stream, request, request_line, flush)
 end
 
 M.Request = Request
@@ -247,7 +571,7 @@ function Response:new(opts)
       _headers = opts.headers or {},
       _body = opts.body,
    }
-   setmetatable(self._headers, Headers_mt)
+   Headers(self._headers)
    local content_type = opts.content_type or self._headers['Content-Type'] or "application/octet-stream"
    if content_type then
       self._headers['Content-Type'] = content_type
@@ -268,60 +592,44 @@ function Response:header(key, value)
    return self._headers[key]
 end
 
-function Response:read_body()
-   if not self.content_length then
-      ef("cannot read response body without Content-Length")
-   end
-   return self.stream:read(self.content_length)
+-- returns a stream for reading the response body
+--
+-- without Content-Length and chunked transfer coding the body
+-- extends until the server closes the connection
+function Response:body()
+   return body_stream(self)
 end
 
-local status_line_regex = re.compile([[^(HTTP/[0-9.]+)\s+([0-9]+)\s+(.+)$]])
+function Response:read_body()
+   return read_body(self)
+end
 
-local function read_response(stream)
-   local status_line = readln(stream)
-   if stream:eof() then
-      return nil
-   end
-   local m = status_line_regex:match(status_line)
-   if not m then
-      ef("invalid status line: %s", status_line)
-   end
-   local http_version, status, status_reason = m[1], tonumber(m[2]), m[3]
-   local headers = read_headers(stream)
-   if stream:eof() then
+-- request_method: the method of the request this is a response to
+local function read_response(stream, request_method)
+   local http_version, status, status_reason, headers = read_head(stream, ffi.C.ZZ_HTTP_RESPONSE)
+   if not http_version then
       return nil
    end
-   return Response {
+   check_framing(headers)
+   status = tonumber(status)
+   local res = Response {
       stream = stream,
       http_version = http_version,
       status = status,
       status_reason = status_reason,
       headers = headers,
    }
+   res._no_body = request_method == "HEAD"
+      or (status >= 100 and status < 200)
+      or status == 204
+      or status == 304
+   res._read_to_eof = true
+   return res
 end
 
-local function write_response(stream, response)
-   writeln(stream, sf("%s %d %s", response.http_version, response.status, response.status_reason))
-   local body_writer
-   local b = response._body
-   if b then
-      if type(b) == "function" then
-         body_writer = b
-      elseif is_bytes(b) then
-         body_writer = function(stream) stream:write(b) end
-         response:header("Content-Length", #b)
-         response.content_length = #b
-      else
-         ef("invalid body: %s", b)
-      end
-   else
-      response:header("Content-Length", 0)
-      response.content_length = 0
-   end
-   write_headers(stream, response._headers)
-   if body_writer then
-      body_writer(stream)
-   end
+local function write_response(stream, response, flush)
+   local status_line = sf("%s %d %s", response.http_version, response.status, response.status_reason)
+   write_message(stream, response, status_line, flush)
 end
 
 M.Response = Response
@@ -330,12 +638,22 @@ M.write_response = write_response
 
 --[[ StreamServer ]]--
 
+-- max number of seconds a connection may stay idle while the server
+-- waits for the next request (nil: no limit)
+M.IDLE_TIMEOUT = 60
+
 local StreamServer = util.Class()
 
-function StreamServer:new(stream, request_handler)
+function StreamServer:new(stream, request_handler, options)
+   options = options or {}
+   local idle_timeout = options.idle_timeout
+   if idle_timeout == nil then
+      idle_timeout = M.IDLE_TIMEOUT
+   end
    return {
-      stream = make_stream(stream),
+      stream = make_stream(stream):buffer_writes(),
       request_handler = request_handler,
+      idle_timeout = idle_timeout,
       _running = false,
    }
 end
@@ -344,18 +662,108 @@ function StreamServer:running()
    return self._running
 end
 
+function StreamServer:read_request()
+   local s = self.stream
+   local timer
+   if self.idle_timeout then
+      timer = sched.timer(self.idle_timeout, function()
+         -- the pending read returns EOF
+         s:shutdown()
+      end)
+   end
+   local ok, req = util.pcall(read_request, s)
+   if timer then
+      sched.cancel(timer)
+   end
+   if not ok then
+      util.throw(req)
+   end
+   return req
+end
+
+-- runs fn(...) and returns its result
+--
+-- protocol errors (malformed input from the client) are caught:
+-- then it returns nil and the http_status of the error
+local function catch_protocol_error(fn, ...)
+   local ok, rv = util.pcall(fn, ...)
+   if ok then
+      return rv
+   end
+   if type(rv) == "table" and rv.http_status then
+      return nil, rv.http_status
+   end
+   util.throw(rv)
+end
+
+-- answers a malformed request (the connection is closed afterwards)
+local function reject(s, status)
+   write_response(s, Response {
+      status = status,
+      headers = { Connection = "close" },
+      body = "",
+   })
+end
+
+-- serves requests until the client closes the connection (or asks
+-- us to close it)
+--
+-- pipelined requests are handled one after the other, their
+-- responses are collected in the write buffer and sent together when
+-- there are no more requests waiting
+--
+-- malformed requests are answered with 400 or 431, then the
+-- connection is closed: what follows them cannot be trusted
+--
+-- returns the thread which serves the connection
 function StreamServer:start()
-   sched(function()
+   return sched(function()
       self._running = true
-      while not self.stream:eof() do
-         local req = read_request(self.stream)
+      local s = self.stream
+      while true do
+         local req, status = catch_protocol_error(self.read_request, self)
+         if status then
+            reject(s, status)
+            break
+         end
          if req == nil then break end
-         local res = self.request_handler(req)
+         -- the handler may fail while it reads a malformed body
+         local res, status = catch_protocol_error(self.request_handler, req)
+         if status then
+            reject(s, status)
+            break
+         end
          if is_bytes(res) then
             res = Response { body = res }
          end
-         write_response(self.stream, res)
+         local persistent = keep_alive(req) and keep_alive(res)
+         if type(res._body) == "function"
+            and not res.content_length
+            and (res.http_version ~= "HTTP/1.1"
+                 or req.http_version ~= "HTTP/1.1") then
+            -- body of unknown length without chunked transfer coding
+            -- (HTTP/1.0 clients cannot decode it)
+            res._close_delimited = true
+            persistent = false
+         end
+         if not persistent then
+            res:header("Connection", "close")
+         elseif req.http_version == "HTTP/1.0" then
+            res:header("Connection", "keep-alive")
+         end
+         write_response(s, res, false)
+         -- the next request starts after the body of this one
+         local _, status = catch_protocol_error(discard_body, req)
+         if status or not persistent then
+            -- the response has been sent already
+            break
+         end
+         local _, nbytes = s:buffered()
+         if nbytes == 0 then
+            s:flush()
+         end
       end
+      s:close()
       self._running = false
    end)
 end
@@ -364,26 +772,100 @@ M.StreamServer = StreamServer
 
 --[[ StreamClient ]]--
 
+-- a persistent connection to an HTTP server
 local StreamClient = util.Class()
 
 function StreamClient:new(stream)
    return {
-      stream = make_stream(stream),
+      stream = make_stream(stream):buffer_writes(),
       http_version = "HTTP/1.1",
+      _last_response = nil,
    }
 end
 
+-- skips the rest of the last response, closes the connection if the
+-- server won't take more requests on it
+local function finish_response(client)
+   local res = client._last_response
+   if res then
+      client._last_response = nil
+      discard_body(res)
+      local delimited = res._no_body
+         or res.content_length ~= nil
+         or has_chunked_body(res)
+      if not (delimited and keep_alive(res)) then
+         client:close()
+      end
+   end
+end
+
+local function receive(client, req)
+   local s = client.stream
+   local ok, res = util.pcall(read_response, s, req.method)
+   if ok and res then
+      client.nothing_received = false
+      client._last_response = res
+      return res
+   end
+   -- a malformed response has been received, even if its bytes
+   -- have been consumed already
+   local _, nbytes = s:buffered()
+   client.nothing_received = nbytes == 0
+      and not (type(res) == "table" and res.http_status)
+   client:close()
+   if not ok then
+      util.throw(res)
+   end
+   return nil
+end
+
+-- returns false if the connection has been closed
+function StreamClient:usable()
+   finish_response(self)
+   return self.stream ~= nil
+end
+
 function StreamClient:send(req)
-   local s = self.stream
-   write_request(s, req)
-   local res = read_response(s)
-   if res == nil then
-      self:close()
+   if not self:usable() then
+      ef("connection closed")
    end
-   return res
+   -- stays true if the exchange fails before the first byte of the
+   -- response arrives
+   self.nothing_received = true
+   write_request(self.stream, req)
+   return receive(self, req)
+end
+
+-- sends all requests with a single flush, then reads the responses
+--
+-- returns the responses (with their bodies read). the list is shorter
+-- than `reqs` if the server closed the connection early
+function StreamClient:pipeline(reqs)
+   if not self:usable() then
+      ef("connection closed")
+   end
+   for i=1,#reqs do
+      write_request(self.stream, reqs[i], false)
+   end
+   self.stream:flush()
+   local responses = {}
+   for i=1,#reqs do
+      if not self.stream then
+         break
+      end
+      local res = receive(self, reqs[i])
+      if res == nil then
+         break
+      end
+      res:read_body()
+      finish_response(self)
+      table.insert(responses, res)
+   end
+   return responses
 end
 
 function StreamClient:close()
+   self._last_response = nil
    if self.stream then
       self.stream:close()
       self.stream = nil
@@ -392,4 +874,263 @@ end
 
 M.StreamClient = StreamClient
 
+--[[ Client ]]--
+
+-- max number of connections the client opens to a single host
+M.MAX_CONNECTIONS_PER_HOST = 8
+
+-- idle pooled connections are closed after this many seconds
+M.POOL_IDLE_TIMEOUT = 30
+
+-- HTTP client which keeps pools of persistent connections per host
+--
+-- when all connections to a host are busy and the per-host limit has
+-- been reached, requests wait (in FIFO order) for a connection to
+-- become available
+local Client = util.Class()
+
+local function tcp_connect(host, port)
+   if host == "localhost" then
+      host = "127.0.0.1"
+   end
+   local socket = net.socket(ffi.C.PF_INET, ffi.C.SOCK_STREAM)
+   local ok, err = util.pcall(function()
+      socket:connect(net.sockaddr(ffi.C.AF_INET, host, port))
+   end)
+   if not ok then
+      socket:close()
+      util.throw(err)
+   end
+   return socket
+end
+
+function Client:new(opts)
+   opts = opts or {}
+   return {
+      max_per_host = opts.max_per_host or M.MAX_CONNECTIONS_PER_HOST,
+      idle_timeout = opts.idle_timeout or M.POOL_IDLE_TIMEOUT,
+      -- connect(host, port) returns a socket (or stream) connected to
+      -- host:port (host: IPv4 address or localhost by default)
+      connect = opts.connect or tcp_connect,
+      pools = {},
+      stats = {
+         hits = 0,       -- requests served by a pooled connection
+         misses = 0,     -- requests which opened a new connection
+         waits = 0,      -- requests which waited for a free connection
+         wait_time = 0,  -- total time spent waiting (seconds)
+         evictions = 0,  -- idle connections closed by the timer
+      },
+   }
+end
+
+local function Pool(host, port)
+   return {
+      host = host,
+      port = port,
+      idle = {}, -- most recently used at the end
+      open = 0, -- number of open connections (idle + busy)
+      waiters = util.List(), -- event ids of waiting threads
+   }
+end
+
+-- gives up a connection slot of the pool (after its connection has
+-- been closed)
+--
+-- if a thread is waiting, the slot passes to it directly: otherwise
+-- another thread could take it first, and the waiter could starve
+local function release_slot(pool)
+   if pool.waiters:empty() then
+      pool.open = pool.open - 1
+   else
+      sched.emit(pool.waiters:shift(), true)
+   end
+end
+
+-- opens a new connection in a slot the caller holds
+local function connect(self, pool)
+   self.stats.misses = self.stats.misses + 1
+   local ok, sock = util.pcall(self.connect, pool.host, pool.port)
+   if not ok then
+      release_slot(pool)
+      util.throw(sock)
+   end
+   return StreamClient(sock), false
+end
+
+-- returns a connection to the pool's host and true if it has been
+-- used before
+local function acquire(self, pool)
+   local stats = self.stats
+   while true do
+      local entry = table.remove(pool.idle)
+      if entry then
+         sched.cancel(entry.timer)
+         if entry.conn:usable() then
+            stats.hits = stats.hits + 1
+            return entry.conn, true
+         end
+         pool.open = pool.open - 1
+      elseif pool.open < self.max_per_host then
+         pool.open = pool.open + 1
+         return connect(self, pool)
+      else
+         local event_id = sched.make_event_id()
+         pool.waiters:push(event_id)
+         local t0 = sched.now
+         -- a released connection or (true) a free slot
+         local handed = sched.wait(event_id)
+         stats.waits = stats.waits + 1
+         stats.wait_time = stats.wait_time + (sched.now - t0)
+         if handed ~= true and handed:usable() then
+            stats.hits = stats.hits + 1
+            return handed, true
+         end
+         -- the slot is ours
+         return connect(self, pool)
+      end
+   end
+end
+
+local function release(self, pool, conn)
+   if not conn:usable() then
+      release_slot(pool)
+   elseif not pool.waiters:empty() then
+      -- straight to the first waiter
+      sched.emit(pool.waiters:shift(), conn)
+   else
+      local entry = { conn = conn }
+      entry.timer = sched.timer(self.idle_timeout, function()
+         for i=1,#pool.idle do
+            if pool.idle[i] == entry then
+               table.remove(pool.idle, i)
+               break
+            end
+         end
+         conn:close()
+         self.stats.evictions = self.stats.evictions + 1
+         release_slot(pool)
+      end)
+      table.insert(pool.idle, entry)
+   end
+end
+
+local function split_host(host)
+   if not host then
+      ef("request without host")
+   end
+   local name, port = host:match("^(.-):(%d+)$")
+   if name then
+      return name, tonumber(port)
+   else
+      return host, 80
+   end
+end
+
+-- idempotent methods (RFC 7231, 4.2.2)
+local idempotent_methods = {
+   GET = true,
+   HEAD = true,
+   PUT = true,
+   DELETE = true,
+   OPTIONS = true,
+   TRACE = true,
+}
+
+-- true if `req` may be sent again after a failed attempt
+local function retryable(req)
+   local b = req._body
+   return idempotent_methods[req.method] and (b == nil or is_bytes(b))
+end
+
+-- sends `req` (which must have a host) over a pooled connection and
+-- calls fn(res) with the response. the connection returns to the
+-- pool when fn returns (the unread part of the body is skipped)
+function Client:with_response(req, fn)
+   local host, port = split_host(req.host)
+   local key = sf("%s:%d", host, port)
+   local pool = self.pools[key]
+   if not pool then
+      pool = Pool(host, port)
+      self.pools[key] = pool
+   end
+   local attempts = 0
+   while true do
+      attempts = attempts + 1
+      local conn, reused = acquire(self, pool)
+      local ok, res = util.pcall(conn.send, conn, req)
+      if ok and res then
+         local ok, rv = util.pcall(fn, res)
+         if not ok then
+            conn:close()
+         end
+         release(self, pool, conn)
+         if not ok then
+            util.throw(rv)
+         end
+         return rv
+      end
+      conn:close()
+      release(self, pool, conn)
+      -- the server may have closed a pooled connection while it was
+      -- idle: retry once on a new one. only if the server cannot have
+      -- processed the request (it sent nothing) or processing it
+      -- twice does no harm, and the body can be sent again
+      if not (reused and attempts == 1
+              and conn.nothing_received
+              and retryable(req)) then
+         if ok then
+            ef("connection closed before response")
+         else
+            util.throw(res)
+         end
+      end
+   end
+end
+
+-- sends `req` and returns the response with its body read
+function Client:send(req)
+   return self:with_response(req, function(res)
+      res:read_body()
+      return res
+   end)
+end
+
+function Client:get(url, headers)
+   local u = uri(url)
+   if not u or u.scheme ~= "http" or not u.host then
+      ef("invalid URL: %s", url)
+   end
+   local path = u.path ~= "" and u.path or "/"
+   if u.query then
+      path = sf("%s?%s", path, u.query)
+   end
+   return self:send(Request {
+      uri = path,
+      host = u.port and sf("%s:%s", u.host, u.port) or u.host,
+      headers = headers,
+   })
+end
+
+-- number of open connections (idle and busy) to all hosts
+function Client:connections()
+   local count = 0
+   for _,pool in pairs(self.pools) do
+      count = count + pool.open
+   end
+   return count
+end
+
+function Client:close()
+   for _,pool in pairs(self.pools) do
+      for _,entry in ipairs(pool.idle) do
+         sched.cancel(entry.timer)
+         entry.conn:close()
+      end
+      pool.open = pool.open - #pool.idle
+      pool.idle = {}
+   end
+end
+
+M.Client = Client
+
 return M
@@ -0,0 +1,238 @@
+-- http micro-benchmarks
+--
+-- usage: zz run http_bench.lua
+
+local ffi = require('ffi')
+local http = require('http')
+local net = require('net')
+local stream = require('stream')
+local buffer = require('buffer')
+local re = require('re')
+local sched = require('sched')
+local time = require('time')
+
+local M = {}
+
+local N = 20000
+
+-- wraps the stream implementation of a socket, counting the write
+-- syscalls which go through it
+local function counting_stream(sock, counts)
+   local impl = sock:as_stream()
+   local counting = {}
+   function counting:close()
+      return impl:close()
+   end
+   function counting:eof()
+      return impl:eof()
+   end
+   function counting:read1(ptr, size)
+      return impl:read1(ptr, size)
+   end
+   function counting:write1(ptr, size)
+      counts.syscalls = counts.syscalls + 1
+      return impl:write1(ptr, size)
+   end
+   function counting:writev(iov, iovcnt)
+      counts.syscalls = counts.syscalls + 1
+      return impl:writev(iov, iovcnt)
+   end
+   return counting
+end
+
+local function make_response(body)
+   local res = http.Response { body = body }
+   res:header("Content-Type", "text/html; charset=utf-8")
+   res:header("Server", "zz")
+   res:header("Date", "Thu, 01 Jan 1970 00:00:00 GMT")
+   res:header("Cache-Control", "no-cache")
+   return res
+end
+
+local function bench_write_response(name, write_buffer_size, body)
+   local s1,s2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local counts = { syscalls = 0 }
+   local s = stream(counting_stream(s1, counts))
+   s:buffer_writes(write_buffer_size)
+   local total = 0
+   local reader = sched(function()
+      local buf = ffi.new("uint8_t[?]", 65536)
+      while true do
+         local nbytes = s2:read1(buf, 65536)
+         if nbytes == 0 then
+            break
+         end
+         total = total + nbytes
+      end
+   end)
+   local t0 = time.time()
+   for i=1,N do
+      http.write_response(s, make_response(body))
+   end
+   s:close()
+   sched.join(reader)
+   local elapsed = time.time() - t0
+   s2:close()
+   pf("%-36s %6.2f syscalls/resp %10.3f ms %10.0f resp/s %8.1f MiB",
+      name, counts.syscalls / N, elapsed * 1000, N / elapsed,
+      total / 1048576)
+end
+
+-- the line-by-line regex parser which preceded the state machine
+-- in http.lua (kept here as a reference)
+
+local request_line_regex = re.compile([[^(\S+)\s+(\S+)\s+(HTTP/[0-9.]+)$]])
+local header_line_regex = re.compile([[^(\S+):\s*(.+)\s*$]])
+
+local RegexHeaders_mt = {
+   __index = function(self, key)
+      key = string.lower(key)
+      for k,v in pairs(self) do
+         if string.lower(k) == key then
+            return v
+         end
+      end
+   end,
+}
+
+local function regex_read_request(s)
+   local request_line = s:readln("\x0d\x0a")
+   if s:eof() then
+      return nil
+   end
+   local m = request_line_regex:match(request_line)
+   if not m then
+      ef("invalid request line: %s", request_line)
+   end
+   local headers = {}
+   while true do
+      local line = s:readln("\x0d\x0a")
+      if line == "" then
+         break
+      end
+      local m = header_line_regex:match(line)
+      if not m then
+         ef("Invalid header line: %s", line)
+      end
+      headers[m[1]] = m[2]
+   end
+   return { method = m[1], uri = m[2], http_version = m[3],
+            headers = setmetatable(headers, RegexHeaders_mt) }
+end
+
+local function http_read_request(s)
+   local req = http.read_request(s)
+   return req and { method = req.method, headers = req._headers }
+end
+
+local REQUEST_HEAD = table.concat({
+   "GET /api/v1/items?page=2&sort=name HTTP/1.1",
+   "Host: api.example.com",
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0",
+   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+   "Accept-Language: en-US,en;q=0.5",
+   "Accept-Encoding: gzip, deflate",
+   "Cookie: session=0123456789abcdef; theme=dark",
+   "Connection: keep-alive",
+   "Cache-Control: max-age=0",
+   "", ""}, "\r\n")
+
+local function bench_parse(name, read_request)
+   local input = buffer.new()
+   for i=1,N do
+      input:append(REQUEST_HEAD)
+   end
+   local s = stream(input)
+   local count = 0
+   local t0 = time.time()
+   while true do
+      local req = read_request(s)
+      if not req then
+         break
+      end
+      -- a typical handler looks up a few headers
+      assert(req.headers["host"])
+      assert(req.headers["Connection"])
+      count = count + 1
+   end
+   local elapsed = time.time() - t0
+   assert(count == N)
+   pf("%-36s %10.3f ms %10.0f req/s %8.1f MiB/s",
+      name, elapsed * 1000, N / elapsed,
+      #input / 1048576 / elapsed)
+end
+
+-- client: pooled connections vs. one connection per request
+
+local CLIENT_REQUESTS = 5000
+local CLIENT_CONCURRENCY = 8
+local PORT = 54380
+
+local function start_server()
+   local socket = net.socket(net.PF_INET, net.SOCK_STREAM)
+   socket.SO_REUSEADDR = true
+   socket:bind(net.sockaddr(net.AF_INET, "127.0.0.1", PORT))
+   socket:listen(1024)
+   sched.background(function()
+      while true do
+         local client = socket:accept()
+         http.StreamServer(client, function(req)
+            return "hello"
+         end):start()
+      end
+   end)
+   return socket
+end
+
+local function bench_client(name, send)
+   local threads = {}
+   local t0 = time.time()
+   for i=1,CLIENT_CONCURRENCY do
+      threads[i] = sched(function()
+         for j=1,CLIENT_REQUESTS / CLIENT_CONCURRENCY do
+            local res = send(http.Request { host = sf("127.0.0.1:%d", PORT) })
+            assert(res:read_body() == "hello")
+         end
+      end)
+   end
+   sched.join(threads)
+   local elapsed = time.time() - t0
+   pf("%-36s %10.3f ms %10.0f req/s",
+      name, elapsed * 1000, CLIENT_REQUESTS / elapsed)
+end
+
+local function bench_clients()
+   local server = start_server()
+   bench_client("client: connection per request", function(req)
+      local socket = net.socket(net.PF_INET, net.SOCK_STREAM)
+      socket:connect(net.sockaddr(net.AF_INET, "127.0.0.1", PORT))
+      local client = http.StreamClient(socket)
+      local res = client:send(req)
+      res:read_body()
+      client:close()
+      return res
+   end)
+   local client = http.Client { max_per_host = CLIENT_CONCURRENCY }
+   bench_client("client: pooled (http.Client)", function(req)
+      return client:send(req)
+   end)
+   local stats = client.stats
+   pf("  pool hits=%d misses=%d waits=%d wait_time=%.3f ms",
+      stats.hits, stats.misses, stats.waits, stats.wait_time * 1000)
+   client:close()
+   server:close()
+end
+
+function M.main()
+   bench_parse("parse request heads (regex)", regex_read_request)
+   bench_parse("parse request heads (state machine)", http_read_request)
+   local small_body = string.rep("x", 256)
+   local large_body = string.rep("x", 8192)
+   bench_write_response("write_response (unbuffered, 256 B)", 0, small_body)
+   bench_write_response("write_response (buffered, 256 B)", nil, small_body)
+   bench_write_response("write_response (unbuffered, 8 KiB)", 0, large_body)
+   bench_write_response("write_response (buffered, 8 KiB)", nil, large_body)
+   bench_clients()
+end
+
+return M
@@ -3,6 +3,9 @@ local assert = require('assert')
 local http = require('http')
 local net = require('net')
 local sched = require('sched')
+local stream = require('stream')
+local ffi = require('ffi')
+local buffer = require('buffer')
 
 -- Hypertext Transfer Protocol (HTTP/1.1): Message Syntax and Routing
 --
@@ -126,3 +129,447 @@ testing("404", function()
       assert.equals(res.content_length, 0)
    end)
 end)
+
+testing("parsing message heads", function()
+   local s = stream("\r\nGET /index.html?q=1 HTTP/1.1\r\n"..
+                    "Host: www.example.com\r\n"..
+                    "X-Padded: \t value with spaces \t\r\n"..
+                    "X-Empty:\r\n"..
+                    "\r\n"..
+                    "POST /upload HTTP/1.0\n"..
+                    "content-length: 5\n"..
+                    "\n"..
+                    "hello")
+   local req = http.read_request(s)
+   assert.equals(req.method, "GET")
+   assert.equals(req.uri, "/index.html?q=1")
+   assert.equals(req.http_version, "HTTP/1.1")
+   assert.equals(req.host, "www.example.com")
+   assert.equals(req:header("x-padded"), "value with spaces")
+   assert.equals(req:header("X-EMPTY"), "")
+   -- bare LF line endings are accepted
+   local req = http.read_request(s)
+   assert.equals(req.method, "POST")
+   assert.equals(req.http_version, "HTTP/1.0")
+   assert.equals(req.content_length, 5)
+   assert.equals(req:read_body(), "hello")
+   assert.is_nil(http.read_request(s))
+   local res = http.read_response(stream("HTTP/1.1 204\r\n\r\n"))
+   assert.equals(res.status, 204)
+end)
+
+testing("heads arriving in pieces", function()
+   local ss,sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local head = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nServer: zz\r\n\r\nabc"
+   sched(function()
+      for i=1,#head do
+         sc:write1(ffi.cast("void*", head:sub(i,i)), 1)
+         sched.yield()
+      end
+      sc:close()
+   end)
+   local s = stream(ss)
+   local res = http.read_response(s)
+   assert.equals(res.status_reason, "OK")
+   assert.equals(res:header("server"), "zz")
+   assert.equals(res:read_body(), "abc")
+   s:close()
+end)
+
+testing("malformed heads", function()
+   local function parse(head)
+      return pcall(http.read_request, stream(head))
+   end
+   assert(parse("GET / HTTP/1.1\r\n\r\n"))
+   assert(not parse("GET  / HTTP/1.1\r\n\r\n"))
+   assert(not parse("GET / HTTP/1.1\r\nHost : x\r\n\r\n"))
+   assert(not parse("GET / HTTP/1.1\r\nX-A: 1\r\n folded\r\n\r\n"))
+   assert(not parse("GET / FTP/1.1\r\n\r\n"))
+   assert(not parse("GET / HTTP/1.1\rX\n\r\n"))
+   -- truncated heads are treated like EOF
+   local ok, req = parse("GET / HTTP/1.1\r\nHost: x\r\n")
+   assert(ok)
+   assert.is_nil(req)
+end)
+
+testing("header limits", function()
+   local long_header = "X-Long: "..string.rep("x", http.MAX_HEAD_SIZE).."\r\n"
+   local ok, err = pcall(http.read_request, stream("GET / HTTP/1.1\r\n"..long_header.."\r\n"))
+   assert(not ok)
+   assert(tostring(err):match("larger than"))
+   -- the message reports the limit in effect
+   local max_head_size = http.MAX_HEAD_SIZE
+   http.MAX_HEAD_SIZE = 1024
+   local long_header = "X-Long: "..string.rep("x", 1024).."\r\n"
+   local ok, err = pcall(http.read_request, stream("GET / HTTP/1.1\r\n"..long_header.."\r\n"))
+   http.MAX_HEAD_SIZE = max_head_size
+   assert(not ok)
+   assert(tostring(err):match("larger than 1024 bytes"))
+   local headers = {}
+   for i=1,100 do
+      table.insert(headers, sf("X-%d: %d\r\n", i, i))
+   end
+   local ok, err = pcall(http.read_request, stream("GET / HTTP/1.1\r\n"..table.concat(headers).."\r\n"))
+   assert(not ok)
+   assert(tostring(err):match("header fields"))
+end)
+
+testing("header lookup", function()
+   local req = http.Request {
+      headers = { ["Content-Type"] = "text/plain" }
+   }
+   assert.equals(req:header("content-type"), "text/plain")
+   -- setting a header with different capitalization replaces it
+   req:header("CONTENT-TYPE", "text/html")
+   assert.equals(req:header("Content-Type"), "text/html")
+   local count = 0
+   for k,v in pairs(req._headers) do
+      if string.lower(k) == "content-type" then
+         count = count + 1
+      end
+   end
+   assert.equals(count, 1)
+end)
+
+testing("repeated header fields", function()
+   local res = http.read_response(stream(table.concat {
+      "HTTP/1.1 200 OK\r\n",
+      "Set-Cookie: a=1\r\n",
+      "Set-Cookie: b=2; Expires=Wed, 21 Oct 2015 07:28:00 GMT\r\n",
+      "Cache-Control: no-cache\r\n",
+      "cache-control: no-store\r\n",
+      "Content-Length: 0\r\n",
+      "Content-Length: 0\r\n",
+      "\r\n",
+   }))
+   -- combined into a list
+   assert.equals(res:header("Cache-Control"), "no-cache, no-store")
+   -- except Set-Cookie (its values may contain commas)
+   assert.equals(res:header("Set-Cookie"), {
+      "a=1",
+      "b=2; Expires=Wed, 21 Oct 2015 07:28:00 GMT",
+   })
+   assert.equals(res.content_length, 0)
+   -- lists are written as repeated fields
+   local out = buffer.new()
+   http.write_response(stream(out), http.Response {
+      headers = { ["Set-Cookie"] = { "a=1", "b=2" } },
+      body = "",
+   })
+   local res = http.read_response(stream(out:str()))
+   assert.equals(res:header("Set-Cookie"), { "a=1", "b=2" })
+   -- conflicting Content-Length values
+   local ok, err = pcall(http.read_request, stream("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab"))
+   assert(not ok)
+   assert.equals(err.http_status, 400)
+end)
+
+testing("chunked transfer coding", function()
+   local out = buffer.new()
+   local w = http.chunked_writer(stream(out))
+   w:write("hello, ")
+   w:flush()
+   w:write("world!")
+   w:close()
+   assert.equals(out, "7\r\nhello, \r\n6\r\nworld!\r\n0\r\n\r\n")
+   local input = stream(tostring(out).."next")
+   local r = http.chunked_reader(input)
+   assert.equals(r:read(0), "hello, world!")
+   assert(r:eof())
+   -- the underlying stream is positioned after the body
+   assert.equals(input:read(), "next")
+   -- chunk extensions and trailers are skipped
+   local r = http.chunked_reader(stream("3;ext=1\r\nabc\r\n0\r\nX-Trailer: 1\r\n\r\n"))
+   assert.equals(r:read(0), "abc")
+end)
+
+testing("keep-alive and streamed bodies", function()
+   local function handler(req)
+      if req.uri == "/stream" then
+         return http.Response {
+            body = function(stream)
+               for i=1,100 do
+                  stream:write(sf("line %d\n", i))
+               end
+            end
+         }
+      elseif req.uri == "/echo" then
+         return http.Response { body = req:read_body() }
+      else
+         -- the server skips the unread request body
+         return "ignored"
+      end
+   end
+   with_request_handler(handler, function(client)
+      local res = client:send(http.Request { uri = "/stream" })
+      assert.equals(res:header("Transfer-Encoding"), "chunked")
+      assert.is_nil(res.content_length)
+      local lines = {}
+      for i=1,100 do
+         table.insert(lines, sf("line %d\n", i))
+      end
+      assert.equals(res:read_body(), table.concat(lines))
+      -- chunked request body
+      local res = client:send(http.Request {
+         method = "POST",
+         uri = "/echo",
+         body = function(stream)
+            stream:write("abc")
+            stream:write("def")
+         end
+      })
+      assert.equals(res:read_body(), "abcdef")
+      -- the body of the response is skipped if we don't read it
+      client:send(http.Request { uri = "/stream" })
+      local res = client:send(http.Request { method = "POST", uri = "/x", body = "unread" })
+      assert.equals(res:read_body(), "ignored")
+      assert(client:usable())
+   end)
+end)
+
+testing("Connection: close", function()
+   local function handler(req)
+      return "bye"
+   end
+   with_request_handler(handler, function(client, server)
+      local req = http.Request { headers = { Connection = "close" } }
+      local res = client:send(req)
+      assert.equals(res:header("connection"), "close")
+      assert.equals(res:read_body(), "bye")
+      assert(not client:usable())
+   end)
+   -- HTTP/1.0 closes by default
+   with_request_handler(handler, function(client, server)
+      local res = client:send(http.Request { http_version = "HTTP/1.0" })
+      assert.equals(res:read_body(), "bye")
+      assert(not client:usable())
+   end)
+end)
+
+testing("streamed body to an HTTP/1.0 client", function()
+   local function handler(req)
+      return http.Response {
+         body = function(stream)
+            stream:write("streamed ")
+            stream:write("body")
+         end
+      }
+   end
+   with_request_handler(handler, function(client, server)
+      -- even if the client asks for a persistent connection
+      local res = client:send(http.Request {
+         http_version = "HTTP/1.0",
+         headers = { Connection = "keep-alive" },
+      })
+      -- HTTP/1.0 clients cannot decode chunked bodies
+      assert.is_nil(res:header("Transfer-Encoding"))
+      assert.equals(res:header("Connection"), "close")
+      assert.equals(res:read_body(), "streamed body")
+      assert(not client:usable())
+   end)
+end)
+
+testing("response body until EOF", function()
+   local res = http.read_response(stream("HTTP/1.0 200 OK\r\n\r\nuntil the end"))
+   assert.is_nil(res.content_length)
+   assert.equals(res:read_body(), "until the end")
+   -- requests without length have no body
+   local req = http.read_request(stream("GET / HTTP/1.1\r\n\r\nGET"))
+   assert.equals(req:read_body(), "")
+end)
+
+testing("pipelining", function()
+   local count = 0
+   local function handler(req)
+      count = count + 1
+      return req.uri
+   end
+   with_request_handler(handler, function(client)
+      local reqs = {}
+      for i=1,10 do
+         reqs[i] = http.Request { uri = sf("/%d", i) }
+      end
+      local responses = client:pipeline(reqs)
+      assert.equals(#responses, 10)
+      for i=1,10 do
+         assert.equals(responses[i]:read_body(), sf("/%d", i))
+      end
+      assert.equals(count, 10)
+   end)
+end)
+
+testing("malformed requests", function()
+   local function handler(req)
+      return req:read_body()
+   end
+   -- sends raw request bytes to a new server, returns the response
+   local function exchange(request)
+      local ss,sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+      http.StreamServer(ss, handler):start()
+      local c = stream(sc)
+      c:write(request)
+      local res = http.read_response(c)
+      local body = res:read_body()
+      c:close()
+      return res, body
+   end
+   local function assert_rejected(request, status)
+      local res, body = exchange(request)
+      assert.equals(res.status, status)
+      assert.equals(res:header("Connection"), "close")
+      -- the body is empty: the server closed the connection
+      assert.equals(#body, 0)
+   end
+   -- obs-fold
+   assert_rejected("GET / HTTP/1.1\r\nX-A: a\r\n b\r\n\r\n", 400)
+   local headers = {}
+   for i=1,100 do
+      table.insert(headers, sf("X-%d: %d\r\n", i, i))
+   end
+   assert_rejected("GET / HTTP/1.1\r\n"..table.concat(headers).."\r\n", 431)
+   local long_header = "X-Long: "..string.rep("x", http.MAX_HEAD_SIZE).."\r\n"
+   assert_rejected("GET / HTTP/1.1\r\n"..long_header.."\r\n", 431)
+   assert_rejected("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 400)
+   -- ambiguous framing
+   for _,cl in ipairs { "0x10", "1e3", "-5", "+5", "1, 1" } do
+      assert_rejected(sf("POST / HTTP/1.1\r\nContent-Length: %s\r\n\r\n", cl), 400)
+   end
+   assert_rejected("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab", 400)
+   assert_rejected("POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", 400)
+   assert_rejected("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", 400)
+   assert_rejected("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n", 400)
+   -- the next client is still served
+   local res, body = exchange("POST / HTTP/1.1\r\nContent-Length: 2\r\n\r\nok")
+   assert.equals(res.status, 200)
+   assert.equals(body, "ok")
+end)
+
+testing("idle timeout", function()
+   local ss,sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local server = http.StreamServer(ss, function(req) return "ok" end,
+                                    { idle_timeout = 0.1 })
+   server:start()
+   local client = http.StreamClient(sc)
+   assert.equals(client:send(http.Request {}):read_body(), "ok")
+   sched.sleep(0.3)
+   assert(not server:running())
+   -- the server closed the connection
+   assert(client:usable())
+   assert.equals(#client.stream:read(0), 0)
+   client:close()
+end)
+
+-- a Client which connects to StreamServers over socketpairs
+local function make_client(handler, opts)
+   opts = opts or {}
+   opts.connect = function(host, port)
+      assert.equals(host, "example.com")
+      assert.equals(port, 8080)
+      local ss,sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+      http.StreamServer(ss, handler):start()
+      return sc
+   end
+   return http.Client(opts)
+end
+
+testing("client connection reuse", function()
+   local client = make_client(function(req) return req.uri end)
+   for i=1,5 do
+      local res = client:get(sf("http://example.com:8080/%d?x=y", i))
+      assert.equals(res:read_body(), sf("/%d?x=y", i))
+   end
+   assert.equals(client.stats.misses, 1)
+   assert.equals(client.stats.hits, 4)
+   assert.equals(client:connections(), 1)
+   client:close()
+   assert.equals(client:connections(), 0)
+end)
+
+testing("client concurrency limit", function()
+   local busy, max_busy = 0, 0
+   local client = make_client(function(req)
+      busy = busy + 1
+      max_busy = math.max(busy, max_busy)
+      sched.sleep(0.05)
+      busy = busy - 1
+      return "done"
+   end, { max_per_host = 2 })
+   local threads = {}
+   for i=1,6 do
+      threads[i] = sched(function()
+         local req = http.Request { host = "example.com:8080" }
+         assert.equals(client:send(req):read_body(), "done")
+      end)
+   end
+   sched.join(threads)
+   assert.equals(max_busy, 2)
+   assert.equals(client.stats.misses, 2)
+   assert.equals(client.stats.hits, 4)
+   assert.equals(client.stats.waits, 4)
+   assert(client.stats.wait_time > 0)
+   client:close()
+end)
+
+testing("client waiters are served in FIFO order", function()
+   local served = {}
+   local client = make_client(function(req)
+      table.insert(served, req.uri)
+      sched.sleep(0.01)
+      return "done"
+   end, { max_per_host = 1 })
+   local function get(path)
+      return client:get("http://example.com:8080"..path)
+   end
+   local threads = {}
+   threads[1] = sched(function()
+      get("/1a")
+      -- the connection goes to the threads which have been waiting
+      -- for it, even though this one asks again right away
+      get("/1b")
+   end)
+   sched.yield()
+   for i=2,3 do
+      threads[i] = sched(function()
+         get(sf("/%d", i))
+      end)
+   end
+   sched.join(threads)
+   assert.equals(served, { "/1a", "/2", "/3", "/1b" })
+   assert.equals(client.stats.misses, 1)
+   client:close()
+end)
+
+testing("client retries", function()
+   local client = http.Client {
+      connect = function(host, port)
+         local ss,sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+         -- the server closes idle connections quickly
+         http.StreamServer(ss, function(req) return req.method end,
+                           { idle_timeout = 0.05 }):start()
+         return sc
+      end,
+   }
+   local url = "http://example.com:8080/"
+   assert.equals(client:get(url):read_body(), "GET")
+   sched.sleep(0.1)
+   -- GET is retried on a new connection
+   assert.equals(client:get(url):read_body(), "GET")
+   assert.equals(client.stats.misses, 2)
+   sched.sleep(0.1)
+   -- POST is not: the server may have processed it
+   local req = http.Request { method = "POST", host = "example.com:8080", body = "x" }
+   assert(not pcall(client.send, client, req))
+   assert.equals(client.stats.misses, 2)
+   client:close()
+end)
+
+testing("client idle eviction", function()
+   local client = make_client(function(req) return "ok" end,
+                              { idle_timeout = 0.1 })
+   client:get("http://example.com:8080/")
+   assert.equals(client:connections(), 1)
+   sched.sleep(0.2)
+   assert.equals(client.stats.evictions, 1)
+   assert.equals(client:connections(), 0)
+   client:close()
+end)
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "msgpack.h"
@@ -33,3 +34,312 @@ size_t zz_cmp_buffer_writer(struct cmp_ctx_s *ctx, const void *data, size_t coun
      non-zero if all bytes could be written and 0 otherwise */
   return bytes_appended == count ? bytes_appended : 0;
 }
+
+/* bulk decoding/encoding via tapes
+
+   the decoder walks one complete value of a buffer and describes it
+   as a flat array of tape entries in pre-order: containers are
+   followed by their elements (maps by alternating keys and values).
+   strings and bins are recorded as offsets into the source, so their
+   data can be picked up from there without intermediate copies
+
+   the encoder does the reverse: it serializes a tape (built by Lua)
+   into a buffer with a single call */
+
+static inline uint16_t load_be16(const uint8_t *p) {
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t load_be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t load_be64(const uint8_t *p) {
+  return ((uint64_t) load_be32(p) << 32) | load_be32(p + 4);
+}
+
+int zz_msgpack_decode(const uint8_t *data, size_t len, size_t *pos,
+                      struct zz_msgpack_tape_entry *tape, uint32_t tape_size) {
+  size_t i = *pos;
+  uint32_t n = 0;
+  /* number of values still expected: decoding stops after the first
+     complete value */
+  uint64_t pending = 1;
+  while (pending > 0) {
+    if (i >= len) {
+      return ZZ_MSGPACK_EMORE;
+    }
+    if (n == tape_size) {
+      return ZZ_MSGPACK_ETAPE;
+    }
+    struct zz_msgpack_tape_entry *e = &tape[n++];
+    uint8_t c = data[i++];
+    size_t need = 0; /* bytes of the argument */
+    e->size = 0;
+    pending--;
+    if (c <= 0x7f) {
+      e->type = ZZ_MSGPACK_INT;
+      e->as.i = c;
+      continue;
+    }
+    else if (c >= 0xe0) {
+      e->type = ZZ_MSGPACK_INT;
+      e->as.i = (int8_t) c;
+      continue;
+    }
+    else if (c >= 0x80 && c <= 0x8f) {
+      e->type = ZZ_MSGPACK_MAP;
+      e->size = c & 0x0f;
+      pending += 2 * (uint64_t) e->size;
+      continue;
+    }
+    else if (c >= 0x90 && c <= 0x9f) {
+      e->type = ZZ_MSGPACK_ARRAY;
+      e->size = c & 0x0f;
+      pending += e->size;
+      continue;
+    }
+    else if (c >= 0xa0 && c <= 0xbf) {
+      e->type = ZZ_MSGPACK_STR;
+      e->size = c & 0x1f;
+    }
+    else {
+      switch (c) {
+      case 0xc0: e->type = ZZ_MSGPACK_NIL; continue;
+      case 0xc2: e->type = ZZ_MSGPACK_FALSE; continue;
+      case 0xc3: e->type = ZZ_MSGPACK_TRUE; continue;
+      case 0xc4: case 0xd9: need = 1; break;
+      case 0xc5: case 0xda: case 0xdc: case 0xde: need = 2; break;
+      case 0xc6: case 0xdb: case 0xdd: case 0xdf: need = 4; break;
+      case 0xca: case 0xce: case 0xd2: need = 4; break;
+      case 0xcb: case 0xcf: case 0xd3: need = 8; break;
+      case 0xcc: case 0xd0: need = 1; break;
+      case 0xcd: case 0xd1: need = 2; break;
+      default:
+        /* 0xc1 (never used) and extension types */
+        return ZZ_MSGPACK_EINVAL;
+      }
+      if (len - i < need) {
+        return ZZ_MSGPACK_EMORE;
+      }
+      const uint8_t *p = data + i;
+      i += need;
+      switch (c) {
+      case 0xc4: e->type = ZZ_MSGPACK_BIN; e->size = p[0]; break;
+      case 0xc5: e->type = ZZ_MSGPACK_BIN; e->size = load_be16(p); break;
+      case 0xc6: e->type = ZZ_MSGPACK_BIN; e->size = load_be32(p); break;
+      case 0xd9: e->type = ZZ_MSGPACK_STR; e->size = p[0]; break;
+      case 0xda: e->type = ZZ_MSGPACK_STR; e->size = load_be16(p); break;
+      case 0xdb: e->type = ZZ_MSGPACK_STR; e->size = load_be32(p); break;
+      case 0xdc: case 0xdd:
+        e->type = ZZ_MSGPACK_ARRAY;
+        e->size = (c == 0xdc) ? load_be16(p) : load_be32(p);
+        pending += e->size;
+        continue;
+      case 0xde: case 0xdf:
+        e->type = ZZ_MSGPACK_MAP;
+        e->size = (c == 0xde) ? load_be16(p) : load_be32(p);
+        pending += 2 * (uint64_t) e->size;
+        continue;
+      case 0xca: {
+        uint32_t u = load_be32(p);
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        e->type = ZZ_MSGPACK_DOUBLE;
+        e->as.d = f;
+        continue;
+      }
+      case 0xcb: {
+        uint64_t u = load_be64(p);
+        e->type = ZZ_MSGPACK_DOUBLE;
+        memcpy(&e->as.d, &u, sizeof(e->as.d));
+        continue;
+      }
+      case 0xcc: e->type = ZZ_MSGPACK_INT; e->as.i = p[0]; continue;
+      case 0xcd: e->type = ZZ_MSGPACK_INT; e->as.i = load_be16(p); continue;
+      case 0xce: e->type = ZZ_MSGPACK_INT; e->as.i = load_be32(p); continue;
+      case 0xcf: e->type = ZZ_MSGPACK_UINT64; e->as.u = load_be64(p); continue;
+      case 0xd0: e->type = ZZ_MSGPACK_INT; e->as.i = (int8_t) p[0]; continue;
+      case 0xd1: e->type = ZZ_MSGPACK_INT; e->as.i = (int16_t) load_be16(p); continue;
+      case 0xd2: e->type = ZZ_MSGPACK_INT; e->as.i = (int32_t) load_be32(p); continue;
+      case 0xd3: e->type = ZZ_MSGPACK_INT64; e->as.i = (int64_t) load_be64(p); continue;
+      }
+    }
+    /* strings and bins */
+    if (len - i < e->size) {
+      return ZZ_MSGPACK_EMORE;
+    }
+    e->as.off = i;
+    i += e->size;
+  }
+  *pos = i;
+  return (int) n;
+}
+
+static inline uint8_t *store_be16(uint8_t *p, uint16_t x) {
+  p[0] = x >> 8;
+  p[1] = x;
+  return p + 2;
+}
+
+static inline uint8_t *store_be32(uint8_t *p, uint32_t x) {
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+  return p + 4;
+}
+
+static inline uint8_t *store_be64(uint8_t *p, uint64_t x) {
+  store_be32(p, x >> 32);
+  return store_be32(p + 4, x);
+}
+
+/* writes a header byte followed by a 1/2/4 byte length or count */
+static uint8_t *store_size(uint8_t *p, uint32_t size,
+                           int fix_bits, uint8_t fix_tag,
+                           uint8_t tag8, uint8_t tag16, uint8_t tag32) {
+  if (fix_bits && size < (1U << fix_bits)) {
+    *p++ = fix_tag | size;
+  }
+  else if (tag8 && size <= 0xff) {
+    *p++ = tag8;
+    *p++ = size;
+  }
+  else if (size <= 0xffff) {
+    *p++ = tag16;
+    p = store_be16(p, size);
+  }
+  else {
+    *p++ = tag32;
+    p = store_be32(p, size);
+  }
+  return p;
+}
+
+/* the encodings of integers and decimals are the same as those of
+   cmp_write_uinteger(), cmp_write_integer() and cmp_write_decimal() */
+
+static uint8_t *store_uint(uint8_t *p, uint64_t u) {
+  if (u <= 0x7f) {
+    *p++ = u;
+  }
+  else if (u <= 0xff) {
+    *p++ = 0xcc;
+    *p++ = u;
+  }
+  else if (u <= 0xffff) {
+    *p++ = 0xcd;
+    p = store_be16(p, u);
+  }
+  else if (u <= 0xffffffff) {
+    *p++ = 0xce;
+    p = store_be32(p, u);
+  }
+  else {
+    *p++ = 0xcf;
+    p = store_be64(p, u);
+  }
+  return p;
+}
+
+static uint8_t *store_int(uint8_t *p, int64_t i) {
+  if (i >= 0) {
+    return store_uint(p, i);
+  }
+  else if (i >= -32) {
+    *p++ = (uint8_t) i;
+  }
+  else if (i >= INT8_MIN) {
+    *p++ = 0xd0;
+    *p++ = (uint8_t) i;
+  }
+  else if (i >= INT16_MIN) {
+    *p++ = 0xd1;
+    p = store_be16(p, (uint16_t) i);
+  }
+  else if (i >= INT32_MIN) {
+    *p++ = 0xd2;
+    p = store_be32(p, (uint32_t) i);
+  }
+  else {
+    *p++ = 0xd3;
+    p = store_be64(p, (uint64_t) i);
+  }
+  return p;
+}
+
+static uint8_t *store_double(uint8_t *p, double d) {
+  float f = (float) d;
+  if ((double) f == d) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    *p++ = 0xca;
+    p = store_be32(p, u);
+  }
+  else {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    *p++ = 0xcb;
+    p = store_be64(p, u);
+  }
+  return p;
+}
+
+/* max size of an encoded entry without its string/bin data */
+#define MAX_HEAD_SIZE 9
+
+int zz_msgpack_encode(const struct zz_msgpack_tape_entry *tape, uint32_t n,
+                      zz_buffer_t *buf) {
+  /* size the buffer once for the worst case */
+  size_t max_size = buf->len;
+  for (uint32_t k = 0; k < n; k++) {
+    max_size += MAX_HEAD_SIZE;
+    if (tape[k].type == ZZ_MSGPACK_STR || tape[k].type == ZZ_MSGPACK_BIN) {
+      max_size += tape[k].size;
+    }
+  }
+  if (max_size > buf->cap && !zz_buffer_resize(buf, max_size)) {
+    return ZZ_MSGPACK_ENOMEM;
+  }
+  uint8_t *p = buf->ptr + buf->len;
+  for (uint32_t k = 0; k < n; k++) {
+    const struct zz_msgpack_tape_entry *e = &tape[k];
+    switch (e->type) {
+    case ZZ_MSGPACK_NIL: *p++ = 0xc0; break;
+    case ZZ_MSGPACK_FALSE: *p++ = 0xc2; break;
+    case ZZ_MSGPACK_TRUE: *p++ = 0xc3; break;
+    case ZZ_MSGPACK_INT:
+    case ZZ_MSGPACK_INT64:
+      p = store_int(p, e->as.i);
+      break;
+    case ZZ_MSGPACK_UINT64:
+      p = store_uint(p, e->as.u);
+      break;
+    case ZZ_MSGPACK_DOUBLE:
+      p = store_double(p, e->as.d);
+      break;
+    case ZZ_MSGPACK_STR:
+      p = store_size(p, e->size, 5, 0xa0, 0xd9, 0xda, 0xdb);
+      memcpy(p, e->as.ptr, e->size);
+      p += e->size;
+      break;
+    case ZZ_MSGPACK_BIN:
+      p = store_size(p, e->size, 0, 0, 0xc4, 0xc5, 0xc6);
+      memcpy(p, e->as.ptr, e->size);
+      p += e->size;
+      break;
+    case ZZ_MSGPACK_ARRAY:
+      p = store_size(p, e->size, 4, 0x90, 0, 0xdc, 0xdd);
+      break;
+    case ZZ_MSGPACK_MAP:
+      p = store_size(p, e->size, 4, 0x80, 0, 0xde, 0xdf);
+      break;
+    default:
+      return ZZ_MSGPACK_EINVAL;
+    }
+  }
+  buf->len = p - buf->ptr;
+  return 0;
+}
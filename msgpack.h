@@ -15,4 +15,44 @@ bool zz_cmp_buffer_reader(struct cmp_ctx_s *ctx, void *data, size_t limit);
 bool zz_cmp_buffer_skipper(struct cmp_ctx_s *ctx, size_t count);
 size_t zz_cmp_buffer_writer(struct cmp_ctx_s *ctx, const void *data, size_t count);
 
+/* bulk decoding/encoding via tapes */
+
+enum {
+  ZZ_MSGPACK_NIL,
+  ZZ_MSGPACK_FALSE,
+  ZZ_MSGPACK_TRUE,
+  ZZ_MSGPACK_INT,    /* encoded with at most 32 bits */
+  ZZ_MSGPACK_INT64,  /* encoded as int 64 */
+  ZZ_MSGPACK_UINT64, /* encoded as uint 64 */
+  ZZ_MSGPACK_DOUBLE, /* float 32 or float 64 */
+  ZZ_MSGPACK_STR,
+  ZZ_MSGPACK_BIN,
+  ZZ_MSGPACK_ARRAY,
+  ZZ_MSGPACK_MAP
+};
+
+enum {
+  ZZ_MSGPACK_EMORE   = -1, /* the value is incomplete */
+  ZZ_MSGPACK_EINVAL  = -2, /* malformed or unsupported (ext) data */
+  ZZ_MSGPACK_ETAPE   = -3, /* the tape is too small */
+  ZZ_MSGPACK_ENOMEM  = -4
+};
+
+struct zz_msgpack_tape_entry {
+  uint8_t type;
+  uint32_t size; /* str/bin: length, array/map: number of elements */
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    uint64_t off;       /* str/bin when decoding: offset in the source */
+    const uint8_t *ptr; /* str/bin when encoding: the data */
+  } as;
+};
+
+int zz_msgpack_decode(const uint8_t *data, size_t len, size_t *pos,
+                      struct zz_msgpack_tape_entry *tape, uint32_t tape_size);
+int zz_msgpack_encode(const struct zz_msgpack_tape_entry *tape, uint32_t n,
+                      zz_buffer_t *buf);
+
 #endif
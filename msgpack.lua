@@ -158,6 +158,46 @@ bool zz_cmp_buffer_reader(struct cmp_ctx_s *ctx, void *data, size_t limit);
 bool zz_cmp_buffer_skipper(struct cmp_ctx_s *ctx, size_t count);
 size_t zz_cmp_buffer_writer(struct cmp_ctx_s *ctx, const void *data, size_t count);
 
+/* bulk decoding/encoding via tapes */
+
+enum {
+  ZZ_MSGPACK_NIL,
+  ZZ_MSGPACK_FALSE,
+  ZZ_MSGPACK_TRUE,
+  ZZ_MSGPACK_INT,
+  ZZ_MSGPACK_INT64,
+  ZZ_MSGPACK_UINT64,
+  ZZ_MSGPACK_DOUBLE,
+  ZZ_MSGPACK_STR,
+  ZZ_MSGPACK_BIN,
+  ZZ_MSGPACK_ARRAY,
+  ZZ_MSGPACK_MAP
+};
+
+enum {
+  ZZ_MSGPACK_EMORE   = -1,
+  ZZ_MSGPACK_EINVAL  = -2,
+  ZZ_MSGPACK_ETAPE   = -3,
+  ZZ_MSGPACK_ENOMEM  = -4
+};
+
+struct zz_msgpack_tape_entry {
+  uint8_t type;
+  uint32_t size;
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    uint64_t off;
+    const uint8_t *ptr;
+  } as;
+};
+
+int zz_msgpack_decode(const uint8_t *data, size_t len, size_t *pos,
+                      struct zz_msgpack_tape_entry *tape, uint32_t tape_size);
+int zz_msgpack_encode(const struct zz_msgpack_tape_entry *tape, uint32_t n,
+                      zz_buffer_t *buf);
+
 ]]
 
 local Context_mt = {}
@@ -275,8 +315,7 @@ readers[ffi.C.CMP_TYPE_FIXARRAY] = function(ctx, obj)
    local size = obj.as.array_size
    local array = {}
    for i=1,size do
-      local v = ctx:read()
-      table.insert(array, v)
+      array[i] = ctx:read()
    end
    return array
 end
@@ -307,8 +346,8 @@ readers[ffi.C.CMP_TYPE_BIN8] = function(ctx, obj)
    end
    return buf
 end
-readers[ffi.C.CMP_TYPE_BIN16] = readers[CMP_TYPE_BIN8]
-readers[ffi.C.CMP_TYPE_BIN32] = readers[CMP_TYPE_BIN8]
+readers[ffi.C.CMP_TYPE_BIN16] = readers[ffi.C.CMP_TYPE_BIN8]
+readers[ffi.C.CMP_TYPE_BIN32] = readers[ffi.C.CMP_TYPE_BIN8]
 
 readers[ffi.C.CMP_TYPE_FLOAT] = function(ctx, obj)
    return obj.as.flt
@@ -350,15 +389,15 @@ readers[ffi.C.CMP_TYPE_SINT64] = function(ctx, obj)
    return obj.as.s64
 end
 
-readers[ffi.C.CMP_TYPE_STR8] = readers[CMP_TYPE_FIXSTR]
-readers[ffi.C.CMP_TYPE_STR16] = readers[CMP_TYPE_FIXSTR]
-readers[ffi.C.CMP_TYPE_STR32] = readers[CMP_TYPE_FIXSTR]
+readers[ffi.C.CMP_TYPE_STR8] = readers[ffi.C.CMP_TYPE_FIXSTR]
+readers[ffi.C.CMP_TYPE_STR16] = readers[ffi.C.CMP_TYPE_FIXSTR]
+readers[ffi.C.CMP_TYPE_STR32] = readers[ffi.C.CMP_TYPE_FIXSTR]
 
-readers[ffi.C.CMP_TYPE_ARRAY16] = readers[CMP_TYPE_FIXARRAY]
-readers[ffi.C.CMP_TYPE_ARRAY32] = readers[CMP_TYPE_FIXARRAY]
+readers[ffi.C.CMP_TYPE_ARRAY16] = readers[ffi.C.CMP_TYPE_FIXARRAY]
+readers[ffi.C.CMP_TYPE_ARRAY32] = readers[ffi.C.CMP_TYPE_FIXARRAY]
 
-readers[ffi.C.CMP_TYPE_MAP16] = readers[CMP_TYPE_FIXMAP]
-readers[ffi.C.CMP_TYPE_MAP32] = readers[CMP_TYPE_FIXMAP]
+readers[ffi.C.CMP_TYPE_MAP16] = readers[ffi.C.CMP_TYPE_FIXMAP]
+readers[ffi.C.CMP_TYPE_MAP32] = readers[ffi.C.CMP_TYPE_FIXMAP]
 
 readers[ffi.C.CMP_TYPE_NEGATIVE_FIXNUM] = function(ctx, obj)
    return obj.as.s8
@@ -405,28 +444,216 @@ local function BufferContext(buf)
    }
 end
 
+-- bulk decoding/encoding
+--
+-- pack() and unpack() do not go through cmp one value at a time:
+-- the C side walks the whole message in one call and exchanges a
+-- tape (a flat array of typed entries, see msgpack.c) with Lua
+--
+-- the encoding is the same as that of Context:write()
+
+local NIL = ffi.C.ZZ_MSGPACK_NIL
+local FALSE = ffi.C.ZZ_MSGPACK_FALSE
+local TRUE = ffi.C.ZZ_MSGPACK_TRUE
+local INT = ffi.C.ZZ_MSGPACK_INT
+local INT64 = ffi.C.ZZ_MSGPACK_INT64
+local UINT64 = ffi.C.ZZ_MSGPACK_UINT64
+local DOUBLE = ffi.C.ZZ_MSGPACK_DOUBLE
+local STR = ffi.C.ZZ_MSGPACK_STR
+local BIN = ffi.C.ZZ_MSGPACK_BIN
+local ARRAY = ffi.C.ZZ_MSGPACK_ARRAY
+local MAP = ffi.C.ZZ_MSGPACK_MAP
+
+local TAPE_INITIAL_SIZE = 256
+
+-- tapes are reused between calls and grow on demand
+local Tape = ffi.typeof("struct zz_msgpack_tape_entry[?]")
+
+local dtape_size = TAPE_INITIAL_SIZE
+local dtape = Tape(dtape_size)
+local dpos = ffi.new("size_t[1]")
+
+local etape_size = TAPE_INITIAL_SIZE
+local etape = Tape(etape_size)
+local etape_used = 0
+
+-- builds the value which starts at dtape[i]
+--
+-- returns the value and the index of the next entry
+local function build(ptr, i)
+   local e = dtape[i]
+   local t = e.type
+   if t == INT then
+      return tonumber(e.as.i), i+1
+   elseif t == STR then
+      return ffi.string(ptr + e.as.off, e.size), i+1
+   elseif t == MAP then
+      local size = e.size
+      local map = {}
+      i = i+1
+      for j=1,size do
+         local k, v
+         k, i = build(ptr, i)
+         v, i = build(ptr, i)
+         map[k] = v
+      end
+      return map, i
+   elseif t == ARRAY then
+      local size = e.size
+      local array = {}
+      i = i+1
+      for j=1,size do
+         array[j], i = build(ptr, i)
+      end
+      return array, i
+   elseif t == DOUBLE then
+      return e.as.d, i+1
+   elseif t == NIL then
+      return nil, i+1
+   elseif t == TRUE then
+      return true, i+1
+   elseif t == FALSE then
+      return false, i+1
+   elseif t == BIN then
+      return buffer.copy(ptr + e.as.off, e.size), i+1
+   elseif t == INT64 then
+      return e.as.i, i+1
+   elseif t == UINT64 then
+      return e.as.u, i+1
+   else
+      ef("invalid tape entry type: %d", t)
+   end
+end
+
+local function decode(ptr, len)
+   while true do
+      dpos[0] = 0
+      local n = ffi.C.zz_msgpack_decode(ptr, len, dpos, dtape, dtape_size)
+      if n >= 0 then
+         return n
+      elseif n == ffi.C.ZZ_MSGPACK_ETAPE then
+         dtape_size = dtape_size * 2
+         dtape = Tape(dtape_size)
+      elseif n == ffi.C.ZZ_MSGPACK_EMORE then
+         ef("msgpack data is incomplete")
+      else
+         ef("invalid or unsupported msgpack data")
+      end
+   end
+end
+
+-- appends an entry to the encoder tape and returns its index
+local function put_entry(t)
+   if etape_used == etape_size then
+      local new_size = etape_size * 2
+      local new_tape = Tape(new_size)
+      ffi.copy(new_tape, etape, ffi.sizeof("struct zz_msgpack_tape_entry") * etape_size)
+      etape = new_tape
+      etape_size = new_size
+   end
+   local i = etape_used
+   etape[i].type = t
+   etape_used = i + 1
+   return i
+end
+
+local put
+
+local function put_map(t)
+   local i = put_entry(MAP)
+   local size = 0
+   for k,v in pairs(t) do
+      put(k)
+      put(v)
+      size = size + 1
+   end
+   -- the tape may have been reallocated: index it again
+   etape[i].size = size
+end
+
+local function put_array(t)
+   local i = put_entry(ARRAY)
+   local size = #t
+   etape[i].size = size
+   for j=1,size do
+      put(t[j])
+   end
+end
+
+function put(o)
+   local t = type(o)
+   if t == "number" then
+      if math.floor(o) == o and o >= -2^63 and o < 2^64 then
+         if o < 0 then
+            etape[put_entry(INT)].as.i = o
+         else
+            etape[put_entry(UINT64)].as.u = o
+         end
+      else
+         etape[put_entry(DOUBLE)].as.d = o
+      end
+   elseif t == "string" then
+      local e = etape[put_entry(STR)]
+      e.size = #o
+      e.as.ptr = ffi.cast("const uint8_t*", o)
+   elseif t == "table" then
+      put_map(o)
+   elseif o == nil then
+      put_entry(NIL)
+   elseif t == "boolean" then
+      put_entry(o and TRUE or FALSE)
+   elseif ffi.istype("size_t", o) then
+      -- pack pointers by casting them to size_t
+      etape[put_entry(UINT64)].as.u = o
+   elseif buffer.is_buffer(o) then
+      local e = etape[put_entry(BIN)]
+      e.size = o.len
+      e.as.ptr = o.ptr
+   else
+      ef("cannot serialize object %s", o)
+   end
+end
+
+-- serializes the tape built by put_fn(obj) into buf
+--
+-- the tape points into the strings/buffers of obj, so it must be
+-- encoded before obj can be collected
+local function encode(put_fn, obj, buf)
+   buf = buf or buffer.new()
+   etape_used = 0
+   put_fn(obj)
+   local rv = ffi.C.zz_msgpack_encode(etape, etape_used, buf)
+   if rv ~= 0 then
+      ef("zz_msgpack_encode() failed: %d", rv)
+   end
+   return buf
+end
+
 --
 
 local M = {}
 
-function M.pack(obj)
-   local ctx = BufferContext()
-   ctx:write(obj)
-   return ctx.buf
+-- serializes obj (tables become maps)
+--
+-- the result is appended to `buf` if given (it must own its data),
+-- otherwise to a new buffer
+function M.pack(obj, buf)
+   return encode(put, obj, buf)
 end
 
-function M.pack_array(obj)
-   local ctx = BufferContext()
-   ctx:write_array(obj)
-   return ctx.buf
+-- like pack() but the (top-level) table obj is packed as an array
+function M.pack_array(obj, buf)
+   return encode(put_array, obj, buf)
 end
 
+-- deserializes the first value in data (a string or a buffer)
 function M.unpack(data)
    local buf = buffer.wrap(data)
-   local ctx = BufferContext(buf)
-   return ctx:read()
+   decode(buf.ptr, buf.len)
+   return (build(buf.ptr, 0))
 end
 
 M.Context = Context
+M.BufferContext = BufferContext
 
 return M
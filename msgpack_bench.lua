@@ -0,0 +1,58 @@
+-- msgpack: bulk (tape) encoder/decoder vs. the cmp Context
+--
+-- usage: zz run msgpack_bench.lua
+
+local msgpack = require('msgpack')
+local buffer = require('buffer')
+local time = require('time')
+
+local M = {}
+
+local N = 100000
+
+-- a typical RPC message: a small map with a few strings and numbers
+local function make_message(i)
+   return {
+      id = i,
+      method = "object.update",
+      params = {
+         name = "item-"..i,
+         description = string.rep("d", 200),
+         price = i * 0.25,
+         tags = { "red", "green", "blue" },
+         payload = buffer.copy(string.rep("p", 64)),
+      },
+   }
+end
+
+local function context_pack(obj)
+   local ctx = msgpack.BufferContext()
+   ctx:write(obj)
+   return ctx.buf
+end
+
+local function context_unpack(buf)
+   return msgpack.BufferContext(buffer.wrap(buf)):read()
+end
+
+local function bench(name, fn, arg, bytes)
+   local t0 = time.time()
+   for i=1,N do
+      fn(arg)
+   end
+   local elapsed = time.time() - t0
+   pf("%-28s %10.3f ms %10.0f msg/s %8.1f MiB/s",
+      name, elapsed * 1000, N / elapsed, bytes * N / 1048576 / elapsed)
+end
+
+function M.main()
+   local msg = make_message(42)
+   local packed = msgpack.pack(msg)
+   assert(packed == context_pack(msg))
+   bench("pack (cmp Context)", context_pack, msg, #packed)
+   bench("pack (bulk)", msgpack.pack, msg, #packed)
+   bench("unpack (cmp Context)", context_unpack, packed, #packed)
+   bench("unpack (bulk)", msgpack.unpack, packed, #packed)
+end
+
+return M
@@ -119,3 +119,94 @@ testing("pointers", function()
    local unpacked_test_struct = ffi.cast("struct zz_test_msgpack_t*", unpacked[2])
    assert.equals(unpacked_test_struct.x, 42)
 end)
+
+local function context_pack(obj)
+   local ctx = msgpack.BufferContext()
+   ctx:write(obj)
+   return ctx.buf
+end
+
+local function context_unpack(buf)
+   return msgpack.BufferContext(buffer.wrap(buf)):read()
+end
+
+testing("bulk encoder and cmp produce the same bytes", function()
+   local long_array = {}
+   for i=1,100 do
+      long_array[i] = i * 1000.5
+   end
+   local objects = {
+      nil, true, false, 0, -1, 127, 128, -32, -33, 2^16, -2^31-1, 2^40,
+      1.5, 123412341234.25, 0/0,
+      "", "x", string.rep("s", 31), string.rep("s", 32),
+      string.rep("m", 255), string.rep("m", 256), string.rep("l", 65536),
+      buffer.copy("bin"), buffer.copy(string.rep("b", 70000)),
+      { a = 1, b = { c = { "deep" } } },
+      long_array,
+   }
+   for i=1,26 do
+      local x = objects[i]
+      local packed = msgpack.pack(x)
+      assert.equals(packed, context_pack(x))
+      -- and both decoders agree
+      local a = msgpack.unpack(packed)
+      local b = context_unpack(packed)
+      if x == x then
+         assert.equals(a, x)
+         assert.equals(b, x)
+      else
+         -- NaN
+         assert(a ~= a and b ~= b)
+      end
+   end
+end)
+
+testing("pack into an existing buffer", function()
+   local buf = buffer.new(64)
+   buf:append("prefix")
+   local rv = msgpack.pack({1,2,3}, buf)
+   assert(rv == buf)
+   assert.equals(buffer.copy(buf.ptr, 6), "prefix")
+   assert.equals(msgpack.unpack(buffer.wrap(buf.ptr + 6, buf.len - 6)), {1,2,3})
+end)
+
+testing("unpack of large arrays and maps", function()
+   local array = {}
+   local map = {}
+   for i=1,70000 do
+      array[i] = tostring(i)
+      map["k"..i] = i
+   end
+   assert.equals(msgpack.unpack(msgpack.pack_array(array)), array)
+   assert.equals(msgpack.unpack(msgpack.pack(map)), map)
+end)
+
+testing("unpack keeps nils in arrays", function()
+   local unpacked = msgpack.unpack("\x93\x01\xc0\x03")
+   assert.equals(unpacked[1], 1)
+   assert.equals(unpacked[2], nil)
+   assert.equals(unpacked[3], 3)
+end)
+
+testing("64-bit integers", function()
+   local u = ffi.cast("uint64_t", 2^53) + 1
+   local unpacked = msgpack.unpack(msgpack.pack(u))
+   assert(ffi.istype("uint64_t", unpacked))
+   assert(unpacked == u)
+   -- int 64 is decoded as int64_t
+   local i = msgpack.unpack("\xd3\xff\xff\xff\xff\x7f\xff\xff\xff")
+   assert(ffi.istype("int64_t", i))
+   assert(i == -2^31-1)
+end)
+
+testing("invalid data", function()
+   -- truncated
+   local packed = msgpack.pack({ x = "hello" })
+   assert.throws("incomplete", function()
+      msgpack.unpack(buffer.wrap(packed.ptr, packed.len - 1))
+   end)
+   -- ext types are not supported
+   assert.throws("invalid", function()
+      msgpack.unpack("\xd4\x01\x00")
+   end)
+end)
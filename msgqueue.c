@@ -2,189 +2,246 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 
 #include "msgqueue.h"
 
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define ALIGN8(n) (((n) + 7) & ~((size_t) 7))
 
-void zz_msgqueue_lock(zz_msgqueue *q) {
-  int rv = pthread_mutex_lock(q->mutex);
-  if (rv != 0) {
-    fprintf(stderr, "msgqueue: cannot lock mutex for read\n");
-    exit(1);
-  }
-}
+/* each writer thread builds at most one message at a time */
 
-void zz_msgqueue_prepare_write(zz_msgqueue *q, size_t length) {
-  if (length > q->size) {
-    fprintf(stderr, "msgqueue: length (%zd) exceeds queue size (%zd)\n", length, q->size);
-    exit(1);
-  }
-  while (q->free_space < length) {
-    int rv = pthread_cond_wait(q->cond_w, q->mutex);
-    if (rv != 0) {
-      fprintf(stderr, "msgqueue: pthread_cond_wait(cond_w) failed\n");
-      exit(1);
-    }
-  }
-  q->bytes_transferred = 0;
-}
+typedef struct {
+  zz_msgqueue *q;
+  zz_msgqueue_slot *slot;
+  size_t slot_size;
+  size_t capacity; /* max length of the message */
+  size_t length;   /* bytes written so far */
+  cmp_ctx_t cmp_ctx;
+} zz_msgqueue_writer;
 
-void zz_msgqueue_finish_write(zz_msgqueue *q) {
-  q->free_space -= q->bytes_transferred;
-  // notify reader
-  zz_trigger_fire(q->trig_r);
-  pthread_cond_signal(q->cond_r); // for extra safety
-}
-
-void zz_msgqueue_prepare_read(zz_msgqueue *q) {
-  while (q->free_space == q->size) {
-    // the Lua side should call zz_msgqueue_prepare_read() only after
-    // q->trig_r fired
-    //
-    // when this assumption holds, we should not get here
-    int rv = pthread_cond_wait(q->cond_r, q->mutex);
-    if (rv != 0) {
-      fprintf(stderr, "msgqueue: pthread_cond_wait(cond_r) failed\n");
-      exit(1);
-    }
+static __thread zz_msgqueue_writer writer;
+
+static size_t writer_write(struct cmp_ctx_s *ctx, const void *data, size_t count) {
+  zz_msgqueue_writer *w = (zz_msgqueue_writer*) ctx->buf;
+  if (w->length + count > w->capacity) {
+    return 0;
   }
-  q->bytes_transferred = 0;
+  memcpy((uint8_t*) (w->slot + 1) + w->length, data, count);
+  w->length += count;
+  return count;
 }
 
-void zz_msgqueue_finish_read(zz_msgqueue *q) {
-  q->free_space += q->bytes_transferred;
-  pthread_cond_broadcast(q->cond_w); // notify writers
+static void commit_slot(zz_msgqueue_slot *slot, size_t size) {
+  __atomic_store_n(&slot->size, (uint32_t) size, __ATOMIC_SEQ_CST);
 }
 
-void zz_msgqueue_unlock(zz_msgqueue *q) {
-  int rv = pthread_mutex_unlock(q->mutex);
-  if (rv != 0) {
-    fprintf(stderr, "msgqueue: cannot unlock mutex\n");
-    exit(1);
+static zz_msgqueue_slot *reserve_slot(zz_msgqueue *q, size_t slot_size) {
+  size_t mask = q->size - 1;
+  uint64_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  for (;;) {
+    size_t offset = head & mask;
+    size_t room = q->size - offset;
+    /* if the slot does not fit before the end of the ring, we
+       reserve the rest of the ring as padding */
+    size_t need = slot_size <= room ? slot_size : room;
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head + need - tail > q->size) {
+      /* queue is full: let the reader catch up */
+      sched_yield();
+      head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!__atomic_compare_exchange_n(&q->head, &head, head + need, true,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      /* another writer was faster, head has been reloaded */
+      continue;
+    }
+    zz_msgqueue_slot *slot = (zz_msgqueue_slot*) (q->ptr + offset);
+    if (need == slot_size) {
+      return slot;
+    }
+    slot->length = ZZ_MSGQUEUE_PADDING;
+    commit_slot(slot, need);
+    head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
   }
 }
 
-static size_t read_bytes(zz_msgqueue *q, void *ptr, size_t size) {
-  size_t bytes_read = 0;
-  size_t chunk_size = MIN(size, q->size - q->rpos);
-  if (chunk_size > 0) {
-    memcpy(ptr, q->ptr + q->rpos, chunk_size);
-    q->rpos = (q->rpos + chunk_size) % q->size;
-    bytes_read += chunk_size;
+void zz_msgqueue_prepare_write(zz_msgqueue *q, size_t length) {
+  size_t slot_size = ALIGN8(sizeof(zz_msgqueue_slot) + length);
+  if (slot_size > q->size) {
+    fprintf(stderr, "msgqueue: length (%zd) exceeds queue size (%zd)\n", length, q->size);
+    exit(1);
   }
-  if (bytes_read < size) {
-    chunk_size = size - bytes_read;
-    memcpy(ptr + bytes_read, q->ptr, chunk_size);
-    q->rpos += chunk_size;
-    bytes_read += chunk_size;
+  if (writer.q) {
+    fprintf(stderr, "msgqueue: prepare_write() called twice without finish_write()\n");
+    exit(1);
   }
-  q->bytes_transferred += bytes_read;
-  return bytes_read;
+  writer.slot = reserve_slot(q, slot_size);
+  writer.q = q;
+  writer.slot_size = slot_size;
+  writer.capacity = slot_size - sizeof(zz_msgqueue_slot);
+  writer.length = 0;
+  cmp_init(&writer.cmp_ctx, &writer, NULL, NULL, writer_write);
 }
 
-static size_t write_bytes(zz_msgqueue *q, const void *ptr, size_t size) {
-  size_t bytes_written = 0;
-  size_t chunk_size = MIN(size, q->size - q->wpos);
-  if (chunk_size > 0) {
-    memcpy(q->ptr + q->wpos, ptr, chunk_size);
-    q->wpos = (q->wpos + chunk_size) % q->size;
-    bytes_written += chunk_size;
+void zz_msgqueue_finish_write(zz_msgqueue *q) {
+  if (writer.q != q) {
+    fprintf(stderr, "msgqueue: finish_write() called without prepare_write()\n");
+    exit(1);
   }
-  if (bytes_written < size) {
-    chunk_size = size - bytes_written;
-    memcpy(q->ptr, ptr + bytes_written, chunk_size);
-    q->wpos += chunk_size;
-    bytes_written += chunk_size;
+  writer.slot->length = (uint32_t) writer.length;
+  commit_slot(writer.slot, writer.slot_size);
+  writer.q = NULL;
+  writer.slot = NULL;
+  /* notify reader (only if it sleeps) */
+  if (__atomic_load_n(&q->reader_asleep, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&q->reader_asleep, 0, __ATOMIC_SEQ_CST)) {
+    zz_trigger_fire(q->trig_r);
   }
-  q->bytes_transferred += bytes_written;
-  return bytes_written;
 }
 
-void zz_msgqueue_write(zz_msgqueue *q, void* ptr, size_t size) {
-  zz_msgqueue_lock(q);
+void zz_msgqueue_write(zz_msgqueue *q, const void *ptr, size_t size) {
   zz_msgqueue_prepare_write(q, size);
-  write_bytes(q, ptr, size);
+  memcpy(writer.slot + 1, ptr, size);
+  writer.length = size;
   zz_msgqueue_finish_write(q);
-  zz_msgqueue_unlock(q);
 }
 
 #define CHECK(op) \
+  if (writer.q != q) { \
+    fprintf(stderr, #op " called without prepare_write()\n"); \
+    exit(1); \
+  } \
   if (!op) { \
     fprintf(stderr, #op " failed\n"); \
     exit(1); \
   }
 
 void zz_msgqueue_pack_integer(zz_msgqueue *q, int64_t d) {
-  CHECK(cmp_write_integer(q->cmp_ctx, d));
+  CHECK(cmp_write_integer(&writer.cmp_ctx, d));
 }
 
 void zz_msgqueue_pack_uinteger(zz_msgqueue *q, uint64_t u) {
-  CHECK(cmp_write_uinteger(q->cmp_ctx, u));
+  CHECK(cmp_write_uinteger(&writer.cmp_ctx, u));
 }
 
 void zz_msgqueue_pack_decimal(zz_msgqueue *q, double d) {
-  CHECK(cmp_write_decimal(q->cmp_ctx, d));
+  CHECK(cmp_write_decimal(&writer.cmp_ctx, d));
 }
 
 void zz_msgqueue_pack_nil(zz_msgqueue *q) {
-  CHECK(cmp_write_nil(q->cmp_ctx));
+  CHECK(cmp_write_nil(&writer.cmp_ctx));
 }
 
 void zz_msgqueue_pack_true(zz_msgqueue *q) {
-  CHECK(cmp_write_true(q->cmp_ctx));
+  CHECK(cmp_write_true(&writer.cmp_ctx));
 }
 
 void zz_msgqueue_pack_false(zz_msgqueue *q) {
-  CHECK(cmp_write_false(q->cmp_ctx));
+  CHECK(cmp_write_false(&writer.cmp_ctx));
 }
 
 void zz_msgqueue_pack_bool(zz_msgqueue *q, bool b) {
-  CHECK(cmp_write_bool(q->cmp_ctx, b));
+  CHECK(cmp_write_bool(&writer.cmp_ctx, b));
 }
 
 void zz_msgqueue_pack_str(zz_msgqueue *q, const char *data, uint32_t size) {
-  CHECK(cmp_write_str(q->cmp_ctx, data, size));
+  CHECK(cmp_write_str(&writer.cmp_ctx, data, size));
 }
 
 void zz_msgqueue_pack_bin(zz_msgqueue *q, const char *data, uint32_t size) {
-  CHECK(cmp_write_bin(q->cmp_ctx, data, size));
+  CHECK(cmp_write_bin(&writer.cmp_ctx, data, size));
 }
 
 void zz_msgqueue_pack_array(zz_msgqueue *q, uint32_t size) {
-  CHECK(cmp_write_array(q->cmp_ctx, size));
+  CHECK(cmp_write_array(&writer.cmp_ctx, size));
 }
 
 void zz_msgqueue_pack_map(zz_msgqueue *q, uint32_t size) {
-  CHECK(cmp_write_map(q->cmp_ctx, size));
+  CHECK(cmp_write_map(&writer.cmp_ctx, size));
 }
 
-bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, uint8_t *data, size_t limit) {
-  zz_msgqueue *q = (zz_msgqueue*) ctx->buf;
-  if (limit > q->size) {
+/* reader */
+
+static void consume_slot(zz_msgqueue *q, zz_msgqueue_slot *slot, uint32_t size) {
+  /* writers expect zeroed memory: a slot is committed when its
+     size becomes non-zero */
+  memset(slot, 0, size);
+  q->rtail += size;
+}
+
+void zz_msgqueue_release(zz_msgqueue *q) {
+  if (q->rtail != q->tail) {
+    __atomic_store_n(&q->tail, q->rtail, __ATOMIC_RELEASE);
+  }
+}
+
+/* returns the first committed message slot or NULL */
+static zz_msgqueue_slot *first_slot(zz_msgqueue *q) {
+  for (;;) {
+    zz_msgqueue_slot *slot = (zz_msgqueue_slot*) (q->ptr + (q->rtail & (q->size - 1)));
+    uint32_t size = __atomic_load_n(&slot->size, __ATOMIC_SEQ_CST);
+    if (size == 0) {
+      return NULL;
+    }
+    if (slot->length != ZZ_MSGQUEUE_PADDING) {
+      return slot;
+    }
+    consume_slot(q, slot, size);
+  }
+}
+
+bool zz_msgqueue_readable(zz_msgqueue *q) {
+  return first_slot(q) != NULL;
+}
+
+bool zz_msgqueue_prepare_read(zz_msgqueue *q) {
+  q->rslot = first_slot(q);
+  q->rpos = 0;
+  return q->rslot != NULL;
+}
+
+void zz_msgqueue_finish_read(zz_msgqueue *q) {
+  if (q->rslot) {
+    consume_slot(q, q->rslot, q->rslot->size);
+    q->rslot = NULL;
+  }
+}
+
+bool zz_msgqueue_prepare_sleep(zz_msgqueue *q) {
+  /* writers waiting for free space must not wait for us */
+  zz_msgqueue_release(q);
+  __atomic_store_n(&q->reader_asleep, 1, __ATOMIC_SEQ_CST);
+  if (first_slot(q)) {
+    /* a message arrived in the meantime */
+    __atomic_store_n(&q->reader_asleep, 0, __ATOMIC_SEQ_CST);
     return false;
   }
-  size_t bytes_read = read_bytes(q, data, limit);
-  return bytes_read == limit;
+  return true;
 }
 
-bool zz_msgqueue_cmp_skipper(struct cmp_ctx_s *ctx, size_t count) {
+void zz_msgqueue_finish_sleep(zz_msgqueue *q) {
+  /* writers do not have to fire the trigger while we are awake */
+  __atomic_store_n(&q->reader_asleep, 0, __ATOMIC_SEQ_CST);
+}
+
+bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, void *data, size_t limit) {
   zz_msgqueue *q = (zz_msgqueue*) ctx->buf;
-  if (count > q->size) {
+  if (!q->rslot || q->rpos + limit > q->rslot->length) {
     return false;
   }
-  q->rpos = (q->rpos + count) % q->size;
-  q->bytes_transferred += count;
+  memcpy(data, (uint8_t*) (q->rslot + 1) + q->rpos, limit);
+  q->rpos += limit;
   return true;
 }
 
-size_t zz_msgqueue_cmp_writer(struct cmp_ctx_s *ctx, const uint8_t *data, size_t count) {
+bool zz_msgqueue_cmp_skipper(struct cmp_ctx_s *ctx, size_t count) {
   zz_msgqueue *q = (zz_msgqueue*) ctx->buf;
-  if (count > q->size) {
-    return 0;
+  if (!q->rslot || q->rpos + count > q->rslot->length) {
+    return false;
   }
-  size_t bytes_written = write_bytes(q, data, count);
-  return bytes_written == count ? bytes_written : 0;
+  q->rpos += count;
+  return true;
 }
 
 /* test support */
@@ -199,3 +256,23 @@ void zz_msgqueue_test_writer(void *arg) {
   struct zz_msgqueue_test_writer_info *info = (struct zz_msgqueue_test_writer_info*) arg;
   zz_msgqueue_write(info->queue, info->msg_data, info->msg_len);
 }
+
+/* benchmark support */
+
+struct zz_msgqueue_bench_writer_info {
+  zz_msgqueue *queue;
+  int count;
+};
+
+void *zz_msgqueue_bench_writer(void *arg) {
+  struct zz_msgqueue_bench_writer_info *info = (struct zz_msgqueue_bench_writer_info*) arg;
+  zz_msgqueue *q = info->queue;
+  for (int i = 0; i < info->count; i++) {
+    zz_msgqueue_prepare_write(q, 16);
+    zz_msgqueue_pack_array(q, 2);
+    zz_msgqueue_pack_str(q, "bench", 5);
+    zz_msgqueue_pack_integer(q, i);
+    zz_msgqueue_finish_write(q);
+  }
+  return NULL;
+}
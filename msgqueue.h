@@ -1,31 +1,56 @@
 #ifndef ZZ_MSGQUEUE_H
 #define ZZ_MSGQUEUE_H
 
-#include <pthread.h>
+#include <stdint.h>
 
 #include "msgpack.h"
 #include "trigger.h"
 
+/* lock-free multi-producer/single-consumer queue of MessagePack
+   messages
+
+   the queue is a ring buffer of slots. writers reserve a slot by
+   atomically advancing `head`, fill it, then commit it by setting
+   its size. a message never wraps around the end of the ring: when
+   there is not enough room before the end, the writer reserves the
+   remaining bytes as a padding slot and retries at the beginning.
+
+   the reader consumes committed slots in order, zeroes them and
+   advances `tail`. writers fire the trigger only when the reader
+   announced that it is going to sleep (zz_msgqueue_prepare_sleep) */
+
+#define ZZ_MSGQUEUE_PADDING 0xffffffff
+
+typedef struct {
+  uint32_t size;   /* size of the slot including this header, 0 until committed */
+  uint32_t length; /* length of the message, ZZ_MSGQUEUE_PADDING for padding */
+} zz_msgqueue_slot;
+
 typedef struct {
   uint8_t *ptr;
-  size_t size;
-  size_t rpos;
-  size_t wpos;
-  size_t free_space;
-  size_t bytes_transferred;
+  size_t size; /* must be a power of two */
   cmp_ctx_t *cmp_ctx;
-  pthread_mutex_t *mutex;
-  pthread_cond_t *cond_r;
-  pthread_cond_t *cond_w;
   zz_trigger *trig_r;
+  /* reader state: rtail runs ahead of tail until release */
+  zz_msgqueue_slot *rslot;
+  size_t rpos;
+  uint64_t rtail;
+  /* head and tail live on separate cache lines */
+  uint8_t pad0[64];
+  uint64_t head;
+  uint8_t pad1[56];
+  uint64_t tail;
+  uint32_t reader_asleep;
+  uint8_t pad2[52];
 } zz_msgqueue;
 
-void zz_msgqueue_lock(zz_msgqueue *q);
+/* reserves a slot which can hold a message of `length` bytes
 
+   blocks (yields the CPU) until there is enough free space */
 void zz_msgqueue_prepare_write(zz_msgqueue *q, size_t length);
 
 /* for writing a single blob of data */
-void zz_msgqueue_write(zz_msgqueue *q, void* ptr, size_t size);
+void zz_msgqueue_write(zz_msgqueue *q, const void *ptr, size_t size);
 
 /* for building a message piece by piece in MessagePack format */
 void zz_msgqueue_pack_integer(zz_msgqueue *q, int64_t d);
@@ -40,17 +65,29 @@ void zz_msgqueue_pack_bin(zz_msgqueue *q, const char *data, uint32_t size);
 void zz_msgqueue_pack_array(zz_msgqueue *q, uint32_t size);
 void zz_msgqueue_pack_map(zz_msgqueue *q, uint32_t size);
 
+/* commits the slot and wakes up the reader if it sleeps */
 void zz_msgqueue_finish_write(zz_msgqueue *q);
 
-void zz_msgqueue_prepare_read(zz_msgqueue *q);
+/* reader side (single thread only) */
+
+bool zz_msgqueue_readable(zz_msgqueue *q);
+bool zz_msgqueue_prepare_read(zz_msgqueue *q);
 void zz_msgqueue_finish_read(zz_msgqueue *q);
 
-void zz_msgqueue_unlock(zz_msgqueue *q);
+/* makes the space of consumed messages available to writers
+
+   reading several messages and releasing them at once saves the
+   writers from fighting over the cache line of `tail` */
+void zz_msgqueue_release(zz_msgqueue *q);
+
+/* returns false if the queue is not empty (the reader shall not
+   sleep), otherwise the next write will fire the trigger */
+bool zz_msgqueue_prepare_sleep(zz_msgqueue *q);
+void zz_msgqueue_finish_sleep(zz_msgqueue *q);
 
 /* msgqueue - cmp interop */
 
-bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, uint8_t *data, size_t limit);
+bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, void *data, size_t limit);
 bool zz_msgqueue_cmp_skipper(struct cmp_ctx_s *ctx, size_t count);
-size_t zz_msgqueue_cmp_writer(struct cmp_ctx_s *ctx, const uint8_t *data, size_t count);
 
 #endif
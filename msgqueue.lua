@@ -1,31 +1,35 @@
 local ffi = require('ffi')
 local msgpack = require('msgpack')
 local trigger = require('trigger')
-local pthread = require('pthread')
 local util = require('util')
 
 ffi.cdef [[
 
+typedef struct {
+  uint32_t size;
+  uint32_t length;
+} zz_msgqueue_slot;
+
 typedef struct {
   uint8_t *ptr;
   size_t size;
-  size_t rpos;
-  size_t wpos;
-  size_t free_space;
-  size_t bytes_transferred;
   cmp_ctx_t *cmp_ctx;
-  pthread_mutex_t *mutex;
-  pthread_cond_t *cond_r;
-  pthread_cond_t *cond_w;
   zz_trigger *trig_r;
+  zz_msgqueue_slot *rslot;
+  size_t rpos;
+  uint64_t rtail;
+  uint8_t pad0[64];
+  uint64_t head;
+  uint8_t pad1[56];
+  uint64_t tail;
+  uint32_t reader_asleep;
+  uint8_t pad2[52];
 } zz_msgqueue;
 
-void zz_msgqueue_lock(zz_msgqueue *q);
-
 void zz_msgqueue_prepare_write(zz_msgqueue *q, size_t length);
 
 /* for writing a single blob of data */
-void zz_msgqueue_write(zz_msgqueue *q, void* ptr, size_t size);
+void zz_msgqueue_write(zz_msgqueue *q, const void *ptr, size_t size);
 
 /* for building a message piece by piece in MessagePack format */
 void zz_msgqueue_pack_integer(zz_msgqueue *q, int64_t d);
@@ -42,16 +46,18 @@ void zz_msgqueue_pack_map(zz_msgqueue *q, uint32_t size);
 
 void zz_msgqueue_finish_write(zz_msgqueue *q);
 
-void zz_msgqueue_prepare_read(zz_msgqueue *q);
+bool zz_msgqueue_readable(zz_msgqueue *q);
+bool zz_msgqueue_prepare_read(zz_msgqueue *q);
 void zz_msgqueue_finish_read(zz_msgqueue *q);
+void zz_msgqueue_release(zz_msgqueue *q);
 
-void zz_msgqueue_unlock(zz_msgqueue *q);
+bool zz_msgqueue_prepare_sleep(zz_msgqueue *q);
+void zz_msgqueue_finish_sleep(zz_msgqueue *q);
 
 /* msgqueue - cmp interop */
 
-bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, uint8_t *data, size_t limit);
+bool zz_msgqueue_cmp_reader(struct cmp_ctx_s *ctx, void *data, size_t limit);
 bool zz_msgqueue_cmp_skipper(struct cmp_ctx_s *ctx, size_t count);
-size_t zz_msgqueue_cmp_writer(struct cmp_ctx_s *ctx, const uint8_t *data, size_t count);
 
 ]]
 
@@ -60,38 +66,29 @@ local M = {}
 local Queue = util.Class()
 
 function Queue:new(size)
+   -- slots are addressed by masking, so the size must be a power of 2
+   size = util.next_power_of_2(size)
    local ptr = ffi.new("uint8_t[?]", size)
-   local mutex = ffi.C.zz_pthread_mutex_alloc()
-   local cond_r = ffi.C.zz_pthread_cond_alloc()
-   local cond_w = ffi.C.zz_pthread_cond_alloc()
    local trig_r = trigger.Semaphore()
    local q = ffi.new("zz_msgqueue", {
       ptr = ptr,
       size = size,
-      rpos = 0,
-      wpos = 0,
-      free_space = size,
-      bytes_transferred = 0,
-      mutex = mutex,
-      cond_r = cond_r,
-      cond_w = cond_w,
       trig_r = trig_r,
+      rslot = nil,
+      rpos = 0,
+      rtail = 0,
+      head = 0,
+      tail = 0,
+      reader_asleep = 0,
    })
    local msgpack_context = msgpack.Context {
       state = q,
       reader = ffi.C.zz_msgqueue_cmp_reader,
       skipper = ffi.C.zz_msgqueue_cmp_skipper,
-      writer = ffi.C.zz_msgqueue_cmp_writer,
    }
    q.cmp_ctx = msgpack_context.ctx
-   util.check_ok("pthread_mutex_init", 0, ffi.C.pthread_mutex_init(q.mutex, nil))
-   util.check_ok("pthread_cond_init", 0, ffi.C.pthread_cond_init(q.cond_r, nil))
-   util.check_ok("pthread_cond_init", 0, ffi.C.pthread_cond_init(q.cond_w, nil))
    local self = {
       ptr = ptr,
-      mutex = mutex,
-      cond_r = cond_r,
-      cond_w = cond_w,
       trig_r = trig_r,
       fd = trig_r.fd, -- for easier access
       q = q,
@@ -102,10 +99,6 @@ end
 
 -- low-level API
 
-function Queue:lock()
-   ffi.C.zz_msgqueue_lock(self.q)
-end
-
 function Queue:prepare_write(length)
    ffi.C.zz_msgqueue_prepare_write(self.q, length)
 end
@@ -162,16 +155,21 @@ function Queue:finish_write()
    ffi.C.zz_msgqueue_finish_write(self.q)
 end
 
-function Queue:prepare_read()
-   ffi.C.zz_msgqueue_prepare_read(self.q)
+function Queue:readable()
+   -- true if there is at least one complete message in the queue
+   return ffi.C.zz_msgqueue_readable(self.q)
 end
 
-function Queue:finish_read()
-   ffi.C.zz_msgqueue_finish_read(self.q)
+function Queue:prepare_sleep()
+   -- returns false if the queue is not empty
+   --
+   -- otherwise the reader is marked as sleeping and the next
+   -- finish_write() fires the trigger
+   return ffi.C.zz_msgqueue_prepare_sleep(self.q)
 end
 
-function Queue:unlock()
-   ffi.C.zz_msgqueue_unlock(self.q)
+function Queue:finish_sleep()
+   ffi.C.zz_msgqueue_finish_sleep(self.q)
 end
 
 -- high-level API
@@ -183,8 +181,14 @@ function Queue:pack(x, serialize)
 end
 
 function Queue:wait()
-   -- wait is a poll followed by a read on the trigger's event fd
-   return self.trig_r:wait()
+   -- wait until there is at least one message in the queue
+   while not self:readable() do
+      if self:prepare_sleep() then
+         -- wait is a poll followed by a read on the trigger's event fd
+         self.trig_r:wait()
+         self:finish_sleep()
+      end
+   end
 end
 
 function Queue:reset_trigger()
@@ -198,32 +202,37 @@ function Queue:reset_trigger()
 end
 
 function Queue:unpack()
-   ffi.C.zz_msgqueue_lock(self.q)
-   ffi.C.zz_msgqueue_prepare_read(self.q)
+   if not ffi.C.zz_msgqueue_prepare_read(self.q) then
+      ef("msgqueue is empty")
+   end
    local rv = self.msgpack_context:read()
    ffi.C.zz_msgqueue_finish_read(self.q)
-   ffi.C.zz_msgqueue_unlock(self.q)
+   ffi.C.zz_msgqueue_release(self.q)
    return rv
 end
 
+function Queue:drain(max, fn)
+   -- unpacks at most `max` messages and calls fn(msg) for each
+   --
+   -- the space of the messages is given back to the writers at the
+   -- end, in one step
+   --
+   -- returns the number of messages processed
+   local q = self.q
+   local count = 0
+   while count < max and ffi.C.zz_msgqueue_prepare_read(q) do
+      local msg = self.msgpack_context:read()
+      ffi.C.zz_msgqueue_finish_read(q)
+      count = count + 1
+      fn(msg)
+   end
+   ffi.C.zz_msgqueue_release(q)
+   return count
+end
+
 function Queue:delete()
    self.ptr = nil
-   if self.mutex then
-      ffi.C.pthread_mutex_destroy(self.mutex)
-      ffi.C.zz_pthread_mutex_free(self.mutex)
-      self.mutex = nil
-   end
-   if self.cond_r then
-      ffi.C.pthread_cond_destroy(self.cond_r)
-      ffi.C.zz_pthread_cond_free(self.cond_r)
-      self.cond_r = nil
-   end
-   if self.cond_w then
-      ffi.C.pthread_cond_destroy(self.cond_w)
-      ffi.C.zz_pthread_cond_free(self.cond_w)
-      self.cond_w = nil
-   end
-   if self.trig_r then
+   if self.trig_r and not self.attached then
       self.trig_r:delete()
       self.trig_r = nil
    end
@@ -231,6 +240,28 @@ function Queue:delete()
    self.msgpack_context = nil
 end
 
+-- wraps a zz_msgqueue created by another Lua state (e.g. the parent
+-- of a thread), the caller becomes its reader
+--
+-- the queue and its trigger remain owned by their creator
+function M.attach(q)
+   q = ffi.cast("zz_msgqueue*", q)
+   local msgpack_context = msgpack.Context {
+      state = q,
+      reader = ffi.C.zz_msgqueue_cmp_reader,
+      skipper = ffi.C.zz_msgqueue_cmp_skipper,
+   }
+   q.cmp_ctx = msgpack_context.ctx
+   local self = {
+      trig_r = q.trig_r,
+      fd = q.trig_r.fd,
+      q = q,
+      msgpack_context = msgpack_context,
+      attached = true,
+   }
+   return setmetatable(self, { __index = Queue })
+end
+
 local M_mt = {}
 
 function M_mt:__call(...)
@@ -0,0 +1,66 @@
+-- msgqueue producer scaling benchmark
+--
+-- usage: zz run msgqueue_bench.lua
+
+local ffi = require('ffi')
+local msgqueue = require('msgqueue')
+local pthread = require('pthread')
+local time = require('time')
+
+ffi.cdef [[
+struct zz_msgqueue_bench_writer_info {
+  zz_msgqueue *queue;
+  int count;
+};
+
+void *zz_msgqueue_bench_writer(void *arg);
+]]
+
+local M = {}
+
+local MESSAGES_PER_WRITER = 250000
+
+local function bench(writer_count)
+   local q = msgqueue(16384)
+   local infos = {}
+   local threads = ffi.new("pthread_t[?]", writer_count)
+   local t0 = time.time()
+   for i=0,writer_count-1 do
+      local info = ffi.new("struct zz_msgqueue_bench_writer_info")
+      info.queue = q.q
+      info.count = MESSAGES_PER_WRITER
+      infos[i] = info -- prevent GC
+      local rv = ffi.C.pthread_create(threads+i,
+                                      nil,
+                                      ffi.C.zz_msgqueue_bench_writer,
+                                      ffi.cast("void*", info))
+      if rv ~= 0 then
+         ef("cannot create writer thread: pthread_create() failed")
+      end
+   end
+   local total = writer_count * MESSAGES_PER_WRITER
+   local received = 0
+   local wakeups = 0
+   local function receive(msg) end
+   while received < total do
+      q:wait()
+      wakeups = wakeups + 1
+      received = received + q:drain(total, receive)
+   end
+   local elapsed = time.time() - t0
+   for i=0,writer_count-1 do
+      ffi.C.pthread_join(threads[i], nil)
+   end
+   q:delete()
+   pf("%d writer(s): %8d msgs %10.3f ms %12.0f msgs/s %8.1f msgs/wakeup",
+      writer_count, total, elapsed * 1000, total / elapsed,
+      total / wakeups)
+end
+
+function M.main()
+   for _,writer_count in ipairs { 1, 2, 4, 8 } do
+      bench(writer_count)
+   end
+end
+
+return M
@@ -13,16 +13,20 @@ local pthread = require('pthread')
 -- queue of MessagePack-serialized messages supporting multiple
 -- writers and a single reader.
 --
--- Writers lock the queue (`lock`), prepare for the write
--- (`prepare_write`), write a single message (`write` or `pack_X`),
--- then unlock the queue (`unlock`). Writers can use a series of API
--- calls (`pack_integer`, `pack_decimal`, `pack_str`, `pack_bin`,
--- `pack_bool`, `pack_array`, `pack_map`, etc.) to construct the
--- message piece by piece or write the entire message at once
--- (`write`). When the write is complete (`finish_write`), the queue's
--- trigger is fired. The reader can poll the associated eventfd for
--- incoming message notifications and then use `unpack` to read and
--- deserialize the next available message.
+-- The queue is lock-free: writers reserve a slot in the queue
+-- (`prepare_write`) and write a single message into it (`write` or
+-- `pack_X`). Writers can use a series of API calls (`pack_integer`,
+-- `pack_decimal`, `pack_str`, `pack_bin`, `pack_bool`, `pack_array`,
+-- `pack_map`, etc.) to construct the message piece by piece or write
+-- the entire message at once (`write`). When the write is complete
+-- (`finish_write`), the message becomes visible to the reader.
+--
+-- The reader checks for messages with `readable` and uses `unpack`
+-- to read and deserialize the next available message. Before going
+-- to sleep, the reader calls `prepare_sleep`: the first write after
+-- this call fires the queue's trigger, so the reader can poll the
+-- associated eventfd for incoming message notifications. (`wait`
+-- does all of this.)
 --
 -- The primary (only?) purpose of `msgqueue` is to let C threads
 -- safely inject structured events into the scheduler event queue.
@@ -68,11 +72,8 @@ testing('msgqueue/c', function()
       received_message = q:unpack()
    end)
 
-   -- before a read/write, always lock the queue first
-   q:lock()
-
-   -- block until the queue has 128 bytes of free space
-   q:prepare_write(128)
+   -- block until the queue has room for a 64-byte message
+   q:prepare_write(64)
 
    -- write an array of 7 elements
    q:pack_array(7)
@@ -103,12 +104,9 @@ testing('msgqueue/c', function()
    -- [7]: "binary data" (11 bytes)
    q:pack_bin("binary data", 11)
 
-   -- notify the reader by firing the queue trigger
+   -- commit the message (and notify the reader if it sleeps)
    q:finish_write()
 
-   -- unlock the queue
-   q:unlock()
-
    sched.join(receiver)
    assert.equals(received_message, test_message)
    q:delete()
@@ -191,16 +189,33 @@ testing('trigger fd', function()
    q:delete()
 end)
 
-testing('reset_trigger', function()
+testing('trigger fires only when the reader sleeps', function()
    local q = msgqueue(128)
+   assert(not q:readable())
+   -- the reader is awake: writes do not fire the trigger
    q:pack("hello")
-   sched.poll(q.fd, "r")
+   assert(q:readable())
+   assert.equals(q.trig_r:read(), nil)
    assert.equals(q:unpack(), "hello")
+   -- prepare_sleep() returns false if the queue is not empty
+   q:pack("world")
+   assert(not q:prepare_sleep())
+   assert.equals(q:unpack(), "world")
+   -- otherwise it marks the reader as sleeping
+   assert(q:prepare_sleep())
+   q:pack("wakeup")
+   sched.poll(q.fd, "r")
+   q:finish_sleep()
+   assert.equals(q:unpack(), "wakeup")
    -- at this point, q.fd is still readable because the trigger has
    -- not been read
    sched.poll(q.fd, "r")
    -- reset_trigger() resets the trigger by reading it
    q:reset_trigger()
+   -- only the first write after prepare_sleep() fires the trigger
+   q:pack("no trigger")
+   assert.equals(q.trig_r:read(), nil)
+   assert.equals(q:unpack(), "no trigger")
    sched.background(function()
          -- this thread should never return
          --
@@ -211,3 +226,40 @@ testing('reset_trigger', function()
    end)
    sched.on('quit', function() q:delete() end)
 end)
+
+testing('messages do not wrap around', function()
+   -- messages of various sizes force the writer to insert padding
+   -- at the end of the ring
+   local q = msgqueue(128)
+   for i=1,100 do
+      local msg = string.rep("x", i % 50)
+      q:pack(msg)
+      assert.equals(q:unpack(), msg)
+   end
+   assert(not q:readable())
+   q:delete()
+end)
+
+testing('drain', function()
+   local q = msgqueue(4096)
+   for i=1,10 do
+      q:pack(i)
+   end
+   local received = {}
+   local function receive(msg)
+      table.insert(received, msg)
+   end
+   -- drain() unpacks at most `max` messages
+   assert.equals(q:drain(4, receive), 4)
+   assert.equals(received, {1,2,3,4})
+   assert.equals(q:drain(100, receive), 6)
+   assert.equals(received, {1,2,3,4,5,6,7,8,9,10})
+   assert.equals(q:drain(100, receive), 0)
+   q:delete()
+end)
+
+testing('unpack() on an empty queue', function()
+   local q = msgqueue(128)
+   assert.throws("msgqueue is empty", function() q:unpack() end)
+   q:delete()
+end)
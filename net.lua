@@ -160,6 +160,7 @@ int getsockopt (int fd, int level, int optname, void * optval, socklen_t * optle
 int setsockopt (int fd, int level, int optname, const void *optval, socklen_t optlen);
 int listen (int fd, int n);
 int accept (int fd, struct sockaddr * addr, socklen_t * len);
+int accept4 (int fd, struct sockaddr * addr, socklen_t * len, int flags);
 int close (int fd);
 int shutdown (int fd, int how);
 
@@ -286,14 +287,29 @@ end
 
 local Socket_mt = {}
 
-local function Socket(fd, domain)
+local function Socket(fd, domain, socktype)
    local self = {
       fd = fd,
-      domain = domain
+      domain = domain,
+      -- SOCK_STREAM, SOCK_DGRAM, ... (without flags)
+      socktype = socktype and bit.band(socktype, 0xff),
+      -- true if the fd has been registered with the scheduler
+      registered = false,
    }
    return setmetatable(self, Socket_mt)
 end
 
+-- sockets created while the scheduler is running are non-blocking
+-- and get registered with the scheduler for their whole lifetime
+-- (except in forked children which share the parent's poll set)
+local function NonBlockingSocket(fd, domain, socktype)
+   local self = Socket(fd, domain, socktype)
+   if sched.ticking() and sched.owns_poll_set() then
+      self:register()
+   end
+   return self
+end
+
 function Socket_mt:bind(sockaddr)
    return util.check_errno("bind", ffi.C.bind(self.fd, ffi.cast("struct sockaddr *", sockaddr.addr), sockaddr.addr_size))
 end
@@ -329,11 +345,66 @@ function Socket_mt:getpeername()
 end
 
 function Socket_mt:accept()
+   if self.registered then
+      while true do
+         local client = self:try_accept()
+         if client then
+            return client
+         end
+         sched.not_ready(self.fd, "r")
+         sched.wait_ready(self.fd, "r")
+      end
+   end
    if sched.ticking() then
       sched.poll(self.fd, "r")
    end
    local client_fd = util.check_errno("accept", ffi.C.accept(self.fd, nil, nil))
-   return Socket(client_fd, self.domain)
+   return Socket(client_fd, self.domain, self.socktype)
+end
+
+-- accept a pending connection without blocking
+--
+-- returns nil if there are no pending connections. the accepted
+-- socket is non-blocking and close-on-exec.
+function Socket_mt:try_accept()
+   local flags = bit.bor(ffi.C.SOCK_NONBLOCK, ffi.C.SOCK_CLOEXEC)
+   while true do
+      local client_fd = ffi.C.accept4(self.fd, nil, nil, flags)
+      if client_fd ~= -1 then
+         return NonBlockingSocket(client_fd, self.domain, self.socktype)
+      end
+      local e = errno.errno()
+      if e == ffi.C.EAGAIN then
+         return nil
+      elseif e ~= ffi.C.EINTR and e ~= ffi.C.ECONNABORTED then
+         util.check_errno("accept4", client_fd, e)
+      end
+   end
+end
+
+-- register the socket with the scheduler (see sched.register_fd)
+--
+-- I/O on registered sockets tries the syscall first and waits for
+-- readiness only if the socket is known to be not ready, so there
+-- are no epoll_ctl() calls per operation
+--
+-- sockets created while the scheduler is running are registered
+-- automatically, close() unregisters them
+function Socket_mt:register()
+   assert(sched.ticking())
+   if not self.registered then
+      sched.register_fd(self.fd)
+      self.registered = true
+   end
+end
+
+function Socket_mt:unregister()
+   if self.registered then
+      if sched.ticking() then
+         sched.unregister_fd(self.fd)
+      end
+      self.registered = false
+   end
 end
 
 function Socket_mt:connect(sockaddr)
@@ -362,7 +433,31 @@ function Socket_mt:connect(sockaddr)
    end
 end
 
+-- performs an operation on a registered socket
+local function registered_io(self, events, funcname, f, ...)
+   local fd = self.fd
+   while true do
+      sched.wait_ready(fd, events)
+      local rv = f(fd, ...)
+      if rv ~= -1 then
+         return rv
+      end
+      local e = errno.errno()
+      if e == ffi.C.EAGAIN then
+         sched.not_ready(fd, events)
+      elseif e ~= ffi.C.EINTR then
+         util.check_errno(funcname, rv, e)
+      end
+   end
+end
+
 function Socket_mt:read1(ptr, size)
+   if self.registered then
+      -- a short read does not mean that the fd is not ready: the
+      -- edge which brought the data may have brought the EOF too,
+      -- so only EAGAIN clears the readiness flag
+      return registered_io(self, "r", "read", ffi.C.read, ptr, size)
+   end
    if sched.ticking() then
       sched.poll(self.fd, "r")
    end
@@ -370,14 +465,45 @@ function Socket_mt:read1(ptr, size)
 end
 
 function Socket_mt:write1(ptr, size)
+   if self.registered then
+      local nbytes = registered_io(self, "w", "write", ffi.C.write, ptr, size)
+      if nbytes < size and self.socktype == ffi.C.SOCK_STREAM then
+         -- short write: the send buffer is full
+         sched.not_ready(self.fd, "w")
+      end
+      return nbytes
+   end
    if sched.ticking() then
       sched.poll(self.fd, "w")
    end
    return util.check_errno("write", ffi.C.write(self.fd, ptr, size))
 end
 
+function Socket_mt:readv(iov, iovcnt)
+   if self.registered then
+      return registered_io(self, "r", "readv", ffi.C.readv, iov, iovcnt)
+   end
+   if sched.ticking() then
+      sched.poll(self.fd, "r")
+   end
+   return util.check_errno("readv", ffi.C.readv(self.fd, iov, iovcnt))
+end
+
+function Socket_mt:writev(iov, iovcnt)
+   if self.registered then
+      return registered_io(self, "w", "writev", ffi.C.writev, iov, iovcnt)
+   end
+   if sched.ticking() then
+      sched.poll(self.fd, "w")
+   end
+   return util.check_errno("writev", ffi.C.writev(self.fd, iov, iovcnt))
+end
+
 function Socket_mt:sendto(data, addr)
    local buf = buffer.wrap(data)
+   if self.registered then
+      return registered_io(self, "w", "sendto", ffi.C.sendto, buf.ptr, #buf, 0, ffi.cast("const struct sockaddr *", addr.addr), addr.addr_size)
+   end
    if sched.ticking() then
       sched.poll(self.fd, "w")
    end
@@ -387,10 +513,15 @@ end
 function Socket_mt:recvfrom(ptr, size)
    local peer_addr = sockaddr(self.domain)
    local address_len = ffi.new("socklen_t[1]", ffi.sizeof(peer_addr.addr))
-   if sched.ticking() then
-      sched.poll(self.fd, "r")
+   local nbytes
+   if self.registered then
+      nbytes = registered_io(self, "r", "recvfrom", ffi.C.recvfrom, ptr, size, 0, ffi.cast("struct sockaddr *", peer_addr.addr), address_len)
+   else
+      if sched.ticking() then
+         sched.poll(self.fd, "r")
+      end
+      nbytes = util.check_errno("recvfrom", ffi.C.recvfrom(self.fd, ptr, size, 0, ffi.cast("struct sockaddr *", peer_addr.addr), address_len))
    end
-   local nbytes = util.check_errno("recvfrom", ffi.C.recvfrom(self.fd, ptr, size, 0, ffi.cast("struct sockaddr *", peer_addr.addr), address_len))
    peer_addr.addr_size = address_len[0]
    return nbytes, peer_addr
 end
@@ -414,6 +545,7 @@ function Socket_mt:close()
    local rv = 0
    -- double close is a noop
    if self.fd ~= -1 then
+      self:unregister()
       rv = util.check_errno("close", ffi.C.close(self.fd))
       self.fd = -1
    end
@@ -440,11 +572,39 @@ function Socket_mt:as_stream()
    function stream:write1(ptr, size)
       return sock:write1(ptr, size)
    end
+   function stream:readv(iov, iovcnt)
+      local nbytes = sock:readv(iov, iovcnt)
+      if nbytes == 0 then
+         eof = true
+      end
+      return nbytes
+   end
+   function stream:writev(iov, iovcnt)
+      return sock:writev(iov, iovcnt)
+   end
+   function stream:shutdown(how)
+      return sock:shutdown(how)
+   end
+   -- used by stream.copy() for zero-copy transfers: only registered
+   -- sockets qualify as they are guaranteed to be non-blocking
+   function stream:fileno()
+      if sock.registered then
+         return sock.fd, "socket"
+      end
+   end
+   function stream:set_eof()
+      eof = true
+   end
+   -- waits until the socket becomes ready after an EAGAIN
+   function stream:wait_io(events)
+      sched.not_ready(sock.fd, events)
+      sched.wait_ready(sock.fd, events)
+   end
    return stream
 end
 
 Socket_mt.__newindex = function(self, k, v)
-   if k == "SO_REUSEADDR" or k == "SO_BROADCAST" then
+   if k == "SO_REUSEADDR" or k == "SO_REUSEPORT" or k == "SO_BROADCAST" then
       local optval = ffi.new("int[1]", v and 1 or 0)
       util.check_errno("setsockopt",
                        ffi.C.setsockopt(self.fd,
@@ -476,7 +636,7 @@ function M.socket(domain, type, protocol)
       type = bit.bor(type, ffi.C.SOCK_NONBLOCK)
    end
    local fd = util.check_errno("socket", ffi.C.socket(domain, type, protocol or 0))
-   return Socket(fd, domain)
+   return NonBlockingSocket(fd, domain, type)
 end
 
 function M.socketpair(domain, type, protocol)
@@ -485,22 +645,33 @@ function M.socketpair(domain, type, protocol)
    end
    local fds = ffi.new("int[2]")
    local rv = util.check_errno("socketpair", ffi.C.socketpair(domain, type, protocol or 0, fds))
-   return Socket(fds[0], domain), Socket(fds[1], domain)
+   return NonBlockingSocket(fds[0], domain, type), NonBlockingSocket(fds[1], domain, type)
 end
 
-local function qpoll(fd, cb, quit_event) -- "quittable" poll
+-- qpoll(fd, cb, quit_events): call cb() whenever fd becomes readable
+-- until the 'quit' event (or one of the events listed in quit_events)
+-- arrives
+local function qpoll(fd, cb, quit_events) -- "quittable" poll
    local exit_trigger = trigger()
    local poller = epoll.Poller(1)
    poller:add(exit_trigger.fd, "r", exit_trigger.fd)
    poller:add(fd, "r", fd)
-   quit_event = quit_event or 'quit'
-   sched.on(quit_event, function()
-      exit_trigger:fire()
-      -- exit_trigger will be polled in the next cycle of the event loop
-      -- without this sched.yield() here, the qpoll loop wouldn't exit
-      sched.yield()
-   end)
+   if type(quit_events) ~= "table" then
+      quit_events = { quit_events or 'quit' }
+   end
    local running = true
+   local function quit()
+      if running then
+         exit_trigger:fire()
+         -- exit_trigger will be polled in the next cycle of the event loop
+         -- without this sched.yield() here, the qpoll loop wouldn't exit
+         sched.yield()
+      end
+      return sched.OFF
+   end
+   for _,evtype in ipairs(quit_events) do
+      sched.on(evtype, quit)
+   end
    while running do
       sched.poll(poller:fd(), "r")
       poller:wait(0, function(events, data)
@@ -521,6 +692,13 @@ local function qpoll(fd, cb, quit_event) -- "quittable" poll
 end
 M.qpoll = qpoll
 
+-- max number of connections accepted per wakeup of a TCPListener
+M.ACCEPT_BATCH = 64
+
+-- defaults for TCPListener:run()
+M.WORKER_DRAIN_TIMEOUT = 30
+M.WORKER_RESTART_DELAY = 1
+
 local TCPListener = util.Class()
 
 function TCPListener:start()
@@ -536,20 +714,223 @@ function TCPListener:start()
    end
    local socket = M.socket(ffi.C.PF_INET, ffi.C.SOCK_STREAM)
    socket.SO_REUSEADDR = true
+   if self.reuseport then
+      -- each worker process binds its own socket to the same
+      -- address, the kernel distributes connections among them
+      socket.SO_REUSEPORT = true
+   end
    socket:bind(self.sockaddr)
    socket:listen()
+   -- qpoll() polls the socket through its own epoll instance and
+   -- try_accept() does not wait: no need to keep it in the poll set
+   socket:unregister()
+   self.stop_event = sched.make_event_id(true)
    sched(function()
       qpoll(socket.fd, function()
-         local client = socket:accept()
-         sched(function()
-            self.server(stream(client))
-            client:close()
-         end)
-      end)
+         -- accept all pending connections (but leave some time to
+         -- the others when there is a flood of them)
+         for i=1,M.ACCEPT_BATCH do
+            local client = socket:try_accept()
+            if not client then
+               break
+            end
+            sched(function()
+               self.server(stream(client))
+               client:close()
+            end)
+         end
+      end, { 'quit', self.stop_event })
       socket:close()
    end)
 end
 
+-- stop accepting connections
+--
+-- connections which have been accepted already are not affected
+function TCPListener:stop()
+   if self.stop_event then
+      sched.emit(self.stop_event, 0)
+   end
+end
+
+local function run_worker(listener)
+   local process = require('process')
+   local signal = require('signal')
+   -- do not outlive the master
+   process.set_parent_death_signal(signal.SIGTERM)
+   sched(function()
+      listener:start()
+      -- SIGQUIT: drain (the scheduler exits when the last
+      -- connection has been closed)
+      sched.on('signal', function(data)
+         if data[1] == signal.SIGQUIT then
+            listener:stop()
+            return sched.OFF
+         end
+      end)
+   end)
+   sched()
+end
+
+-- serve connections with multiple worker processes
+--
+-- forks self.workers (default: number of online CPUs) workers, each
+-- of them running its own scheduler and listening on its own socket
+-- bound to the same address with SO_REUSEPORT
+--
+-- the calling process becomes the master which supervises the
+-- workers until all of them exited:
+--
+-- * workers which exit are restarted (a worker which failed is
+--   restarted no sooner than self.restart_delay seconds after its
+--   previous start)
+--
+-- * SIGTERM, SIGINT: workers get SIGQUIT which makes them stop
+--   accepting and exit after their last connection has been closed.
+--   workers still running after self.drain_timeout seconds are
+--   killed. a second SIGTERM or SIGINT is forwarded to the workers
+--   (which makes them quit immediately)
+--
+-- * SIGHUP: workers are replaced by new ones, the old workers are
+--   drained as above
+--
+-- * SIGUSR1, SIGUSR2: forwarded to the workers
+--
+-- forking a running scheduler is not supported, so this must be
+-- called while the scheduler is not running
+function TCPListener:run()
+   assert(sched.state() == "off", "TCPListener:run() called while the scheduler is running")
+   local process = require('process')
+   local signal = require('signal')
+   local time = require('time')
+   local nworkers = self.workers or process.nprocs()
+   local drain_timeout = self.drain_timeout or M.WORKER_DRAIN_TIMEOUT
+   local restart_delay = self.restart_delay or M.WORKER_RESTART_DELAY
+   self.reuseport = true
+
+   local signals = {
+      signal.SIGCHLD,
+      signal.SIGTERM,
+      signal.SIGINT,
+      signal.SIGHUP,
+      signal.SIGUSR1,
+      signal.SIGUSR2,
+   }
+   for _,signum in ipairs(signals) do
+      signal.block(signum)
+   end
+
+   -- pid -> { slot, started, deadline, killed }
+   -- deadline is set when the worker has been asked to drain
+   local workers = {}
+   -- slot -> time when the worker in that slot shall be restarted
+   local restarts = {}
+   local shutting_down = false
+
+   local function spawn(slot)
+      local pid = process.fork()
+      if pid == 0 then
+         local ok, err = util.pcall(run_worker, self)
+         if not ok then
+            io.stderr:write(sf("TCPListener worker %d: %s\n", process.getpid(), err))
+         end
+         process.exit(ok and 0 or 1)
+      end
+      workers[pid] = { slot = slot, started = time.time() }
+   end
+
+   local function send_all(signum)
+      for pid in pairs(workers) do
+         process.kill(pid, signum)
+      end
+   end
+
+   local function drain_all()
+      local deadline = time.time() + drain_timeout
+      for pid,w in pairs(workers) do
+         if not w.deadline then
+            w.deadline = deadline
+            process.kill(pid, signal.SIGQUIT)
+         end
+      end
+   end
+
+   local function reap()
+      while next(workers) do
+         local pid = ffi.C.waitpid(-1, nil, process.WNOHANG)
+         if pid <= 0 then
+            break
+         end
+         local w = workers[pid]
+         if w then
+            workers[pid] = nil
+            if not w.deadline and not shutting_down then
+               restarts[w.slot] = math.max(time.time(), w.started + restart_delay)
+            end
+         end
+      end
+   end
+
+   local function next_timeout()
+      local t = nil
+      for _,at in pairs(restarts) do
+         t = t and math.min(t, at) or at
+      end
+      for _,w in pairs(workers) do
+         if w.deadline and not w.killed then
+            t = t and math.min(t, w.deadline) or w.deadline
+         end
+      end
+      return t and math.max(t - time.time(), 0)
+   end
+
+   for slot=1,nworkers do
+      spawn(slot)
+   end
+   while next(workers) or next(restarts) do
+      local signum = signal.wait(signals, next_timeout())
+      if signum == signal.SIGCHLD then
+         reap()
+      elseif signum == signal.SIGTERM or signum == signal.SIGINT then
+         if shutting_down then
+            send_all(signal.SIGTERM)
+         else
+            shutting_down = true
+            restarts = {}
+            drain_all()
+         end
+      elseif signum == signal.SIGHUP then
+         if not shutting_down then
+            drain_all()
+            restarts = {}
+            for slot=1,nworkers do
+               spawn(slot)
+            end
+         end
+      elseif signum then
+         send_all(signum)
+      end
+      local now = time.time()
+      for slot,at in pairs(restarts) do
+         if at <= now then
+            restarts[slot] = nil
+            spawn(slot)
+         end
+      end
+      for pid,w in pairs(workers) do
+         if w.deadline and not w.killed and w.deadline <= now then
+            -- drain timeout
+            w.killed = true
+            process.kill(pid, signal.SIGKILL)
+         end
+      end
+   end
+
+   for _,signum in ipairs(signals) do
+      signal.unblock(signum)
+   end
+end
+
 M.TCPListener = TCPListener
 
 local UDPListener = util.Class()
@@ -568,7 +949,6 @@ function UDPListener:start()
    local socket = M.socket(ffi.C.PF_INET, ffi.C.SOCK_DGRAM)
    socket.SO_REUSEADDR = true
    socket:bind(self.sockaddr)
-   sched.poller_add(socket.fd, "rw")
    local clients = {}
    sched(function()
       qpoll(socket.fd, function()
@@ -583,7 +963,6 @@ function UDPListener:start()
                   mtime = sched.now,
                   active = true,
                }
-               sched.poller_add(ss.fd, "rw")
                sched(function()
                   self.server(client.sc)
                   client.active = false
@@ -594,7 +973,6 @@ function UDPListener:start()
                      local data = client.ss:read()
                      socket:sendto(data, peer_addr)
                   end
-                  sched.poller_del(ss.fd)
                   ss:close()
                end)
                clients[client_id] = client
@@ -606,7 +984,6 @@ function UDPListener:start()
          until clients[client_id] and clients[client_id].active
          clients[client_id].ss:write(data)
       end)
-      sched.poller_del(socket.fd)
       socket:close()
    end)
 end
@@ -0,0 +1,111 @@
+-- TCPListener:run(): requests/sec served by 1..N worker processes
+--
+-- usage: zz run net_bench.lua
+--
+-- load is generated by separate client processes (each of them
+-- running its own scheduler) over persistent HTTP connections on
+-- the loopback interface
+--
+-- this script has no main function: forking is done before the
+-- scheduler gets started
+
+local http = require('http')
+local net = require('net')
+local process = require('process')
+local signal = require('signal')
+local sched = require('sched')
+local time = require('time')
+
+local HOST = "127.0.0.1"
+local PORT = 54390
+local DURATION = 3 -- seconds
+local CONNECTIONS = 32 -- per client process
+
+local nprocs = process.nprocs()
+-- half of the CPUs generate load, the other half serves it
+local NCLIENTS = math.max(1, math.floor(nprocs / 2))
+local MAX_WORKERS = math.max(1, nprocs - NCLIENTS)
+
+local addr = net.sockaddr(net.AF_INET, HOST, PORT)
+
+local function start_server(nworkers)
+   local pid = process.fork()
+   if pid == 0 then
+      net.TCPListener {
+         address = HOST,
+         port = PORT,
+         workers = nworkers,
+         server = function(stream)
+            sched.join(http.StreamServer(stream, function(req)
+               return "hello"
+            end):start())
+         end,
+      }:run()
+      process.exit(0)
+   end
+   -- wait until the workers are listening
+   while true do
+      local client = net.socket(net.PF_INET, net.SOCK_STREAM)
+      local ok = pcall(client.connect, client, addr)
+      client:close()
+      if ok then
+         break
+      end
+      time.sleep(0.01)
+   end
+   time.sleep(0.2)
+   return pid
+end
+
+local function generate_load(sc)
+   local count = 0
+   sched(function()
+      local deadline = sched.now + DURATION
+      local threads = {}
+      for i=1,CONNECTIONS do
+         threads[i] = sched(function()
+            local socket = net.socket(net.PF_INET, net.SOCK_STREAM)
+            socket:connect(addr)
+            local client = http.StreamClient(socket)
+            while sched.now < deadline do
+               local res = client:send(http.Request { host = sf("%s:%d", HOST, PORT) })
+               assert(res:read_body() == "hello")
+               count = count + 1
+            end
+            client:close()
+         end)
+      end
+      sched.join(threads)
+   end)
+   sched()
+   sc:write(tostring(count))
+end
+
+local function bench(nworkers)
+   local server = start_server(nworkers)
+   local t0 = time.time()
+   local clients = {}
+   for i=1,NCLIENTS do
+      local pid, sp = process.fork(generate_load)
+      clients[i] = { pid = pid, sp = sp }
+   end
+   local total = 0
+   for _,c in ipairs(clients) do
+      total = total + tonumber(c.sp:read(0))
+      c.sp:close()
+      process.waitpid(c.pid)
+   end
+   local elapsed = time.time() - t0
+   process.kill(server, signal.SIGTERM)
+   process.waitpid(server)
+   pf("%2d worker(s) %10.0f req/s", nworkers, total / elapsed)
+end
+
+pf("%d CPUs, %d client processes x %d connections",
+   nprocs, NCLIENTS, CONNECTIONS)
+local nworkers = 1
+while nworkers < MAX_WORKERS do
+   bench(nworkers)
+   nworkers = nworkers * 2
+end
+bench(MAX_WORKERS)
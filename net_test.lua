@@ -407,3 +407,192 @@ testing:nosched("TCPListener, UDPListener", function(t)
    test_listener(net.TCPListener, net.SOCK_STREAM)
    test_listener(net.UDPListener, net.SOCK_DGRAM)
 end)
+
+testing("try_accept, registered sockets", function(t)
+   local server_addr = net.sockaddr(net.AF_INET, "127.0.0.1", 54321 + t:nextid())
+   local server = net.socket(net.PF_INET, net.SOCK_STREAM)
+   server.SO_REUSEADDR = true
+   server:bind(server_addr)
+   server:listen()
+   -- no pending connections
+   assert.equals(server:try_accept(), nil)
+   local client = net.socket(net.PF_INET, net.SOCK_STREAM)
+   client:connect(server_addr)
+   local peer = server:accept()
+   -- sockets created while the scheduler is running are registered
+   assert.equals(server.registered, true)
+   assert.equals(client.registered, true)
+   assert.equals(peer.registered, true)
+   local server_thread = sched(function()
+      local s = stream(peer)
+      assert.equals(s:read(5), "hello")
+      s:write("world")
+      assert.equals(#s:read(0), 0)
+      s:close()
+   end)
+   local cs = stream(client)
+   cs:write("hello")
+   assert.equals(cs:read(5), "world")
+   cs:close()
+   sched.join(server_thread)
+   -- closing a socket removes it from the poll set
+   assert.equals(peer.registered, false)
+   assert.equals(client.registered, false)
+   server:close()
+end)
+
+testing("readiness cache of registered sockets", function()
+   local s1, s2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   -- a freshly registered fd is assumed to be ready
+   sched.wait_ready(s1.fd, "r")
+   sched.wait_ready(s1.fd, "w")
+   -- after EAGAIN, readers wait for the next edge
+   sched.not_ready(s1.fd, "r")
+   local woke_up = false
+   local reader = sched(function()
+      sched.wait_ready(s1.fd, "r")
+      woke_up = true
+   end)
+   sched.yield()
+   assert.equals(woke_up, false)
+   local ss2 = stream(s2)
+   ss2:write("x")
+   sched.join(reader)
+   assert.equals(woke_up, true)
+   local ss1 = stream(s1)
+   assert.equals(ss1:read(1), "x")
+   ss1:close()
+   ss2:close()
+end)
+
+testing("EOF after a short read of a registered socket", function()
+   local s1, s2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   -- the data and the EOF arrive before the first read
+   local ss2 = stream(s2)
+   ss2:write("x")
+   ss2:close()
+   local ss1 = stream(s1)
+   assert.equals(ss1:read(0), "x")
+   ss1:close()
+end)
+
+testing:nosched("permanent event ids of closed sockets are reused", function()
+   local pool_size = sched.permanent_event_id_pool_size
+   sched.permanent_event_id_pool_size = 64
+   sched(function()
+      for i=1,1000 do
+         local s1, s2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+         assert(s1.registered)
+         s1:close()
+         s2:close()
+      end
+   end)
+   local ok, err = pcall(sched)
+   sched.permanent_event_id_pool_size = pool_size
+   assert(ok, err)
+end)
+
+testing("TCPListener accepts bursts of connections", function(t)
+   local server_host, server_port = "127.0.0.1", 54321 + t:nextid()
+   local server_addr = net.sockaddr(net.AF_INET, server_host, server_port)
+   local listener = net.TCPListener {
+      address = server_host,
+      port = server_port,
+      server = function(stream)
+         stream:write(stream:read(4))
+      end,
+   }
+   listener:start()
+   local clients = {}
+   for i=1,100 do
+      clients[i] = sched(function()
+         local client = net.socket(net.PF_INET, net.SOCK_STREAM)
+         client:connect(server_addr)
+         local cs = stream(client)
+         cs:write("ping")
+         assert.equals(cs:read(4), "ping")
+         cs:close()
+      end)
+   end
+   sched.join(clients)
+   listener:stop()
+end)
+
+testing:nosched("TCPListener:run() with worker processes", function(t)
+   local signal = require('signal')
+   local time = require('time')
+   local server_host, server_port = "127.0.0.1", 54321 + t:nextid()
+   local server_addr = net.sockaddr(net.AF_INET, server_host, server_port)
+
+   local master = process.fork()
+   if master == 0 then
+      net.TCPListener {
+         address = server_host,
+         port = server_port,
+         workers = 2,
+         restart_delay = 0,
+         server = function(stream)
+            stream:write(tostring(process.getpid()))
+         end,
+      }:run()
+      process.exit(0)
+   end
+
+   -- returns the pid of the worker which served the connection
+   local function ask()
+      for i=1,1000 do
+         local ok, pid = pcall(function()
+            local client = net.socket(net.PF_INET, net.SOCK_STREAM)
+            client:connect(server_addr)
+            local cs = stream(client)
+            local pid = tonumber(cs:read(0))
+            cs:close()
+            return pid
+         end)
+         if ok and pid then
+            return pid
+         end
+         -- workers are (re)starting
+         time.sleep(0.01)
+      end
+      ef("no worker answered")
+   end
+
+   local function collect_pids(count, pids)
+      pids = pids or {}
+      for i=1,1000 do
+         local pid = ask()
+         if pids[pid] then
+            -- give the other workers a chance to come up
+            time.sleep(0.01)
+         end
+         pids[pid] = true
+         local n = 0
+         for _ in pairs(pids) do
+            n = n + 1
+         end
+         if n == count then
+            return pids
+         end
+      end
+      ef("connections were not served by %d workers", count)
+   end
+
+   -- connections are distributed among the workers
+   local pids = collect_pids(2)
+
+   -- a worker which dies gets restarted
+   local victim = next(pids)
+   process.kill(victim, signal.SIGKILL)
+   pids[victim] = nil
+   collect_pids(2, pids)
+
+   -- graceful shutdown
+   process.kill(master, signal.SIGTERM)
+   local pid, status = process.waitpid(master)
+   assert.equals(pid, master)
+   assert.equals(status, 0)
+   local client = net.socket(net.PF_INET, net.SOCK_STREAM)
+   assert(not pcall(client.connect, client, server_addr))
+   client:close()
+end)
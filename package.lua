@@ -178,9 +178,11 @@ P.exports = {
    "signal",
    "stream",
    "testing",
+   "thread",
    "time",
    "trigger",
    "uri",
+   "uring",
    "util",
    "vfs",
    "zip",
@@ -188,10 +190,11 @@ P.exports = {
 }
 
 P.depends = {
-   async = { "trigger" },
+   async = { "msgqueue" },
    msgpack = { "buffer", "libcmp.a" },
    msgqueue = { "msgpack", "trigger" },
    signal = { "msgqueue" },
+   thread = { "libluajit.a", "msgqueue", "trigger" },
 }
 
 P.ldflags = {
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE /* POSIX_SPAWN_USEVFORK, posix_spawn_file_actions_addchdir_np */
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
 
 enum {
   ZZ_ASYNC_PROCESS_WAITPID
@@ -24,3 +29,81 @@ void *zz_async_process_handlers[] = {
   zz_async_process_waitpid,
   0
 };
+
+/* process creation without fork()
+
+   fork() copies the page tables of the (possibly huge) parent, then
+   the child throws them away at execvp(). posix_spawn() creates the
+   child via vfork()/clone(CLONE_VM|CLONE_VFORK): it shares the memory
+   of the parent until exec, the redirections are done by file
+   actions */
+
+struct zz_process_spawn_opts {
+  const char *file;
+  char *const *argv;
+  const char *cwd;   /* NULL: inherit */
+  int dup_fds[3];    /* dup2(dup_fds[i], i) in the child if >= 0 */
+  int close_fds[3];  /* close(close_fds[i]) in the child if >= 0 */
+};
+
+extern char **environ;
+
+/* returns 0 on success or an errno value */
+int zz_process_spawn(struct zz_process_spawn_opts *opts, pid_t *pid) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  int rv, i;
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  if (opts->cwd) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    /* handled by a file action below */
+#else
+    return ENOSYS;
+#endif
+  }
+  rv = posix_spawn_file_actions_init(&fa);
+  if (rv) return rv;
+  rv = posix_spawnattr_init(&attr);
+  if (rv) {
+    posix_spawn_file_actions_destroy(&fa);
+    return rv;
+  }
+  /* the same order as the fork() path: close, then redirect */
+  for (i = 0; i < 3 && rv == 0; i++) {
+    if (opts->close_fds[i] >= 0) {
+      rv = posix_spawn_file_actions_addclose(&fa, opts->close_fds[i]);
+    }
+    if (rv == 0 && opts->dup_fds[i] >= 0) {
+      rv = posix_spawn_file_actions_adddup2(&fa, opts->dup_fds[i], i);
+    }
+  }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+  if (rv == 0 && opts->cwd) {
+    rv = posix_spawn_file_actions_addchdir_np(&fa, opts->cwd);
+  }
+#endif
+  /* the Lua thread runs with all signals blocked (a dedicated thread
+     waits for them), the child starts with an empty mask */
+  sigemptyset(&mask);
+  if (rv == 0) rv = posix_spawnattr_setsigmask(&attr, &mask);
+  if (rv == 0) rv = posix_spawnattr_setflags(&attr, flags);
+  if (rv == 0) rv = posix_spawnp(pid, opts->file, &fa, &attr, opts->argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  return rv;
+}
+
+/* returns a file descriptor which becomes readable when the process
+   exits (Linux 5.3+) or -1 (errno: ENOSYS on older kernels) */
+int zz_process_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
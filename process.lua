@@ -5,6 +5,7 @@ local stream = require('stream')
 local sched = require('sched')
 local async = require('async')
 local mm = require('mm')
+local errno = require('errno')
 
 ffi.cdef [[
 
@@ -56,6 +57,23 @@ int dup2 (int old, int new);
 
 mode_t umask (mode_t mask);
 
+/* system configuration */
+
+long sysconf (int name);
+
+enum {
+  _SC_NPROCESSORS_ONLN = 84
+};
+
+/* process attributes */
+
+int prctl (int option, unsigned long arg2, unsigned long arg3,
+           unsigned long arg4, unsigned long arg5);
+
+enum {
+  PR_SET_PDEATHSIG = 1
+};
+
 /* async worker */
 
 enum {
@@ -74,16 +92,46 @@ union zz_async_process_req {
 
 void *zz_async_process_handlers[];
 
+/* spawning and reaping */
+
+struct zz_process_spawn_opts {
+  const char *file;
+  char *const *argv;
+  const char *cwd;
+  int dup_fds[3];
+  int close_fds[3];
+};
+
+int zz_process_spawn(struct zz_process_spawn_opts *opts, pid_t *pid);
+int zz_process_pidfd_open(pid_t pid);
+
 ]]
 
 local M = {}
 
+-- set to false to create child processes with fork() + execvp()
+-- (processes with a pre_exec hook are always created that way)
+M.use_spawn = true
+
+-- set to false to wait for child processes in the async thread pool
+M.use_pidfd = true
+
 local ASYNC_PROCESS = async.register_worker(ffi.C.zz_async_process_handlers)
 
 function M.getpid()
    return ffi.C.getpid()
 end
 
+-- fork() which tells the scheduler in the child that the poll set
+-- belongs to the parent
+local function fork()
+   local pid = util.check_errno("fork", ffi.C.fork())
+   if pid == 0 then
+      sched.forked()
+   end
+   return pid
+end
+
 function M.fork(child_fn)
    if child_fn then
       -- sp: parent side
@@ -91,7 +139,7 @@ function M.fork(child_fn)
       local sp, sc = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM, 0)
       sp = stream(sp)
       sc = stream(sc)
-      local pid = util.check_errno("fork", ffi.C.fork())
+      local pid = fork()
       if pid == 0 then
          -- child
          sp:close()
@@ -104,21 +152,28 @@ function M.fork(child_fn)
          return pid, sp
       end
    else
-      return util.check_errno("fork", ffi.C.fork())
+      return fork()
    end
 end
 
-function M.execvp(path, argv)
-   -- stringify args
+-- build a NULL-terminated char*[] from a list of args
+--
+-- argv is modified in place (args are stringified): the strings
+-- must stay alive while the array is in use
+local function make_argv(argv)
    for i=1,#argv do
       argv[i] = tostring(argv[i])
    end
-   -- build const char* argv[] for execvp()
-   local execvp_argv = ffi.new("char*[?]", #argv+1)
+   local c_argv = ffi.new("char*[?]", #argv+1)
    for i=1,#argv do
-      execvp_argv[i-1] = ffi.cast("char*", argv[i])
+      c_argv[i-1] = ffi.cast("char*", argv[i])
    end
-   execvp_argv[#argv] = nil
+   c_argv[#argv] = nil
+   return c_argv
+end
+
+function M.execvp(path, argv)
+   local execvp_argv = make_argv(argv)
    -- unblock all signals (signal mask is preserved through execvp)
    require('signal').unblock()
    -- if execvp() is successful, the following call shall not return
@@ -130,6 +185,9 @@ function M.kill(pid, signum)
    return ffi.C.kill(pid, signum)
 end
 
+-- waitpid() options
+M.WNOHANG = 1
+
 local function extract_status(status)
    -- see /usr/include/bits/waitstatus.h
    local ret = bit.rshift(status, 8)
@@ -137,22 +195,47 @@ local function extract_status(status)
    return ret, sig
 end
 
+-- a pidfd becomes readable when the process exits: the scheduler
+-- polls it like any other fd, so no thread blocks in waitpid()
+--
+-- returns nil if pidfds are not supported (Linux < 5.3)
+local function wait_pidfd(pid)
+   local pidfd = ffi.C.zz_process_pidfd_open(pid)
+   if pidfd == -1 then
+      return nil
+   end
+   local _status = ffi.new("int[1]")
+   local rv, _errno
+   repeat
+      sched.poll(pidfd, "r")
+      rv = ffi.C.waitpid(pid, _status, M.WNOHANG)
+      _errno = errno.errno()
+   until rv ~= 0
+   ffi.C.close(pidfd)
+   return rv, _status[0], _errno
+end
+
 function M.waitpid(pid, options)
    options = options or 0
-   local rv, status, errno
-   if sched.ticking() then
+   local rv, status, _errno
+   if sched.ticking() and M.use_pidfd and pid > 0 and options == 0 then
+      rv, status, _errno = wait_pidfd(pid)
+   end
+   if rv then
+      -- reaped via pidfd
+   elseif sched.ticking() then
       mm.with_block("union zz_async_process_req", nil, function(req, block_size)
          req.waitpid.pid = pid
          req.waitpid.options = options
          async.request(ASYNC_PROCESS, ffi.C.ZZ_ASYNC_PROCESS_WAITPID, req)
-         rv, status, errno = req.waitpid.rv, req.waitpid.status, req.waitpid._errno
+         rv, status, _errno = req.waitpid.rv, req.waitpid.status, req.waitpid._errno
       end)
    else
       local _status = ffi.new("int[1]")
       rv = ffi.C.waitpid(pid, _status, options)
       status = _status[0]
    end
-   return util.check_errno("waitpid", rv, errno), extract_status(status)
+   return util.check_errno("waitpid", rv, _errno), extract_status(status)
 end
 
 function M.create(opts)
@@ -171,6 +254,7 @@ function M.create(opts)
 
    -- opts.command[1] is the command
    -- opts.command[2..n] are the arguments
+   -- opts.cwd (optional) is the working directory of the child
    assert(opts.command and type(opts.command) == "table")
 
    local function is_channel(x)
@@ -273,6 +357,21 @@ function M.create(opts)
          end
       end
 
+      -- the same as setup_in_child(), expressed as file actions of
+      -- posix_spawn() (O_NONBLOCK is shared with the child anyway)
+      function self:setup_for_spawn(spawn_opts)
+         if is_channel(peer) then
+            peer.sp.O_NONBLOCK = false
+            spawn_opts.dup_fds[fd] = peer.sp.fd
+         elseif self.sp then
+            if not self.redirect_target then
+               spawn_opts.close_fds[fd] = self.sp.fd
+            end
+            self.sc.O_NONBLOCK = false
+            spawn_opts.dup_fds[fd] = self.sc.fd
+         end
+      end
+
       function self:setup_in_parent()
          if self.sc then
             self.sc:close()
@@ -319,18 +418,56 @@ function M.create(opts)
       end
    end
 
-   function self:start()
-      self.pid = util.check_errno("fork", ffi.C.fork())
-      if self.pid == 0 then
+   -- returns the pid of the child or nil if posix_spawn() cannot
+   -- do what we need
+   local function spawn()
+      local spawn_opts = ffi.new("struct zz_process_spawn_opts", {
+         dup_fds = { -1, -1, -1 },
+         close_fds = { -1, -1, -1 },
+      })
+      invoke_on_all_channels(function(channel)
+         channel:setup_for_spawn(spawn_opts)
+      end)
+      -- the strings are kept alive by opts
+      local argv = make_argv(opts.command)
+      spawn_opts.file = opts.command[1]
+      spawn_opts.argv = argv
+      spawn_opts.cwd = opts.cwd
+      local pid = ffi.new("pid_t[1]")
+      local rv = ffi.C.zz_process_spawn(spawn_opts, pid)
+      if rv == ffi.C.ENOSYS then
+         -- no posix_spawn_file_actions_addchdir_np()
+         return nil
+      end
+      -- unlike the fork() path, a missing executable is reported here
+      util.check_errno("posix_spawn", rv == 0 and 0 or -1, rv)
+      return pid[0]
+   end
+
+   local function fork_exec()
+      local pid = fork()
+      if pid == 0 then
+         if opts.cwd then
+            M.chdir(opts.cwd)
+         end
          if type(opts.pre_exec) == "function" then
             opts.pre_exec()
          end
          invoke_on_all_channels("setup_in_child")
          M.execvp(opts.command[1], opts.command)
          ef("execvp failed")
-      else
-         invoke_on_all_channels("setup_in_parent")
       end
+      return pid
+   end
+
+   function self:start()
+      if M.use_spawn and not opts.pre_exec then
+         self.pid = spawn()
+      end
+      if not self.pid then
+         self.pid = fork_exec()
+      end
+      invoke_on_all_channels("setup_in_parent")
       return self
    end
 
@@ -404,6 +541,16 @@ function M.Group()
    return self
 end
 
+-- number of online CPUs
+function M.nprocs()
+   return tonumber(util.check_errno("sysconf", ffi.C.sysconf(ffi.C._SC_NPROCESSORS_ONLN)))
+end
+
+-- the calling process gets signal `signum` when its parent exits
+function M.set_parent_death_signal(signum)
+   return util.check_errno("prctl", ffi.C.prctl(ffi.C.PR_SET_PDEATHSIG, signum, 0, 0, 0))
+end
+
 function M.getcwd()
    local buf = ffi.C.getcwd(nil, 0)
    local cwd = ffi.string(buf)
@@ -0,0 +1,48 @@
+-- process: posix_spawn vs. fork, pidfd vs. async waitpid
+--
+-- usage: zz run process_bench.lua
+
+local process = require('process')
+local sched = require('sched')
+local time = require('time')
+
+local M = {}
+
+local N = 1000
+local CONCURRENCY = 16
+
+-- runs N short-lived children, CONCURRENCY of them at a time
+local function bench(name, use_spawn, use_pidfd)
+   process.use_spawn = use_spawn
+   process.use_pidfd = use_pidfd
+   local next_child = 1
+   local threads = {}
+   local t0 = time.time()
+   for i=1,CONCURRENCY do
+      threads[i] = sched(function()
+         while next_child <= N do
+            next_child = next_child + 1
+            assert(process.system { "true" } == 0)
+         end
+      end)
+   end
+   sched.join(threads)
+   local elapsed = time.time() - t0
+   pf("%-28s %10.3f ms %10.0f procs/s", name, elapsed * 1000, N / elapsed)
+end
+
+function M.main()
+   -- a bigger heap makes fork() more expensive
+   local ballast = {}
+   for i=1,1000000 do
+      ballast[i] = { i }
+   end
+   bench("fork + async waitpid", false, false)
+   bench("fork + pidfd", false, true)
+   bench("posix_spawn + async waitpid", true, false)
+   bench("posix_spawn + pidfd", true, true)
+   process.use_spawn = true
+   process.use_pidfd = true
+end
+
+return M
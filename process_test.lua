@@ -189,6 +189,36 @@ testing("start with a string on stdin", function()
    assert.equals(p.stdout, "Hello, Mike\n")
 end)
 
+testing("start with cwd", function()
+   local p = process.start {
+      command = { "pwd" },
+      cwd = "/tmp",
+      stdout = "capture",
+   }
+   p:wait()
+   assert.equals(p.stdout, "/tmp\n")
+end)
+
+testing:exclusive("start via fork", function()
+   process.use_spawn = false
+   local p = process.start {
+      command = { "sed", "-e", "s/Joe/Mike/" },
+      cwd = "/tmp",
+      stdin = "Hello, Joe\n",
+      stdout = "capture",
+   }
+   p:wait()
+   process.use_spawn = true
+   assert.equals(p.stdout, "Hello, Mike\n")
+end)
+
+testing:exclusive("waitpid in the async pool", function()
+   process.use_pidfd = false
+   local status = process.system("exit 42")
+   process.use_pidfd = true
+   assert.equals(status, 42)
+end)
+
 testing("system", function()
    local status = process.system("exit 123")
    assert.equals(status, 123)
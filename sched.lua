@@ -4,11 +4,16 @@ local msgpack = require('msgpack')
 local msgqueue = require('msgqueue')
 local inspect = require('inspect')
 local util = require('util')
+local bit = require('bit')
 
 local M = {}
 
 M.MSGQUEUE_SIZE = 16384
 
+-- max number of messages moved from the message queue to the event
+-- queue in one tick (the rest waits for the next tick)
+M.MSGQUEUE_BATCH_SIZE = 1024
+
 local scheduler_state = "off"
 
 -- off -> init -> running -> shutdown -> done -> off
@@ -99,6 +104,8 @@ M.permanent_event_id_pool_size = 1048576
 local function EventIdGenerator()
    -- permanent event ids are allocated from the beginning of the range
    local next_permanent_event_id = 1
+   -- permanent event ids given back via release_event_id()
+   local free_permanent_event_ids = {}
 
    local first_event_id = M.permanent_event_id_pool_size + 1
    local next_event_id = first_event_id
@@ -106,7 +113,9 @@ local function EventIdGenerator()
 
    local function make_event_id(permanent)
       local event_id
-      if permanent then
+      if permanent and #free_permanent_event_ids > 0 then
+         event_id = table.remove(free_permanent_event_ids)
+      elseif permanent then
          event_id = next_permanent_event_id
          if next_permanent_event_id == first_event_id then
             -- if this happens, we are doomed
@@ -137,7 +146,12 @@ local function EventIdGenerator()
       return -event_id
    end
 
-   return make_event_id
+   -- gives back a permanent event id which is no longer used
+   local function release_event_id(event_id)
+      table.insert(free_permanent_event_ids, -event_id)
+   end
+
+   return make_event_id, release_event_id
 end
 
 local function Scheduler()
@@ -152,8 +166,8 @@ local function Scheduler()
    -- again (thus they can be recycled)
    --
    -- make_event_id(true) generates a permanent event id: these are
-   -- guaranteed to be unique (they will never be reused)
-   self.make_event_id = EventIdGenerator()
+   -- unique until given back via release_event_id()
+   self.make_event_id, self.release_event_id = EventIdGenerator()
 
    local poller = M.poller_factory()
 
@@ -168,11 +182,67 @@ local function Scheduler()
       registered_fds[fd] = event_id
    end
 
+   -- a child forked while the scheduler is running shares the epoll
+   -- instance with its parent: it must not add or remove fds there
+   --
+   -- fork paths call sched.forked() in the child
+   local owns_poll_set = true
+
+   function self.forked()
+      owns_poll_set = false
+   end
+
+   function self.owns_poll_set()
+      return owns_poll_set
+   end
+
    function self.poller_del(fd)
       local event_id = registered_fds[fd]
       assert(event_id)
-      poller:del(fd)
+      if owns_poll_set then
+         poller:del(fd)
+      end
       registered_fds[fd] = nil
+      self.release_event_id(event_id)
+   end
+
+   -- fds registered with register_fd() are polled in edge-triggered
+   -- mode and have a readiness cache
+   --
+   -- the cache remembers whether the fd is ready for reading ("r")
+   -- and writing ("w"). edges reported by the poller set these flags,
+   -- the owner of the fd clears them via not_ready() when a syscall
+   -- returns EAGAIN (or a short write shows that the kernel buffer
+   -- got filled). I/O on such fds needs no epoll_ctl()
+   -- calls and waits only when the fd is known to be not ready.
+   local readiness = {} -- fd -> events
+   local edge_fds = {} -- event_id -> fd
+
+   function self.register_fd(fd)
+      self.poller_add(fd, "rwe")
+      edge_fds[registered_fds[fd]] = fd
+      -- we do not know yet: the first syscall will tell
+      readiness[fd] = poller:event_mask("rw")
+   end
+
+   function self.unregister_fd(fd)
+      edge_fds[registered_fds[fd]] = nil
+      readiness[fd] = nil
+      self.poller_del(fd)
+   end
+
+   function self.not_ready(fd, events)
+      readiness[fd] = poller:clear_events(readiness[fd], events)
+   end
+
+   -- suspend the calling thread until the readiness cache of `fd`
+   -- says that it is ready for `events` (returns immediately if it
+   -- is ready already)
+   function self.wait_ready(fd, events)
+      local event_id = registered_fds[fd]
+      while not poller:match_events(events, readiness[fd]) do
+         self.wait(event_id)
+      end
    end
 
    -- the poller's own fd - we poll this when we want notifications
@@ -211,9 +281,34 @@ local function Scheduler()
    -- runnable threads are those which can be resumed in the current tick
    local runnables = util.List()
 
+   -- threads which yielded in the current tick are collected here,
+   -- at the end of the tick the two lists swap roles
+   local runnables_next = util.List()
+
    -- each runnable consists of a callable (of some sort) and one piece of data
+   --
+   -- runnable records are recycled via a free list to avoid creating
+   -- garbage on every resume
+   local free_runnables = {}
+   local n_free_runnables = 0
+
    local function Runnable(r, data)
-      return { r = r, data = data }
+      if n_free_runnables == 0 then
+         return { r = r, data = data }
+      end
+      local runnable = free_runnables[n_free_runnables]
+      free_runnables[n_free_runnables] = nil
+      n_free_runnables = n_free_runnables - 1
+      runnable.r = r
+      runnable.data = data
+      return runnable
+   end
+
+   local function release_runnable(runnable)
+      runnable.r = nil
+      runnable.data = nil
+      n_free_runnables = n_free_runnables + 1
+      free_runnables[n_free_runnables] = runnable
    end
 
    -- if a thread is scheduled as exclusive, no other runnables will
@@ -222,12 +317,12 @@ local function Scheduler()
 
    -- sleeping threads are waiting for their time to come
    --
-   -- they are kept in a priority list ordered by wake-up time
-   local sleeping = util.OrderedList(function(st) return st.time end)
-
-   local function SleepingRunnable(r, time)
-      return { r = r, time = time }
-   end
+   -- they are kept in a binary heap keyed by wake-up time: both
+   -- putting a thread to sleep and waking it up are O(log n)
+   --
+   -- timers created with sched.timer() live in the same heap (as
+   -- functions instead of threads)
+   local sleeping = util.Heap()
 
    -- `waiting` is a registry of runnables which are currently waiting
    -- for various events
@@ -241,9 +336,23 @@ local function Scheduler()
    local waiting = {}
    local n_waiting_threads = 0
 
+   -- emptied lists of `waiting`, reused for the next evtype: most
+   -- event ids are waited for once, a new list for each would be
+   -- garbage
+   local spare_lists = {}
+   local MAX_SPARE_LISTS = 256
+
+   local function drop_waiting(evtype)
+      local rs = waiting[evtype]
+      waiting[evtype] = nil
+      if #spare_lists < MAX_SPARE_LISTS then
+         table.insert(spare_lists, rs)
+      end
+   end
+
    local function add_waiting(evtype, r) -- r = runnable
       if not waiting[evtype] then
-         waiting[evtype] = util.List()
+         waiting[evtype] = table.remove(spare_lists) or util.List()
       end
       waiting[evtype]:push(r)
       if type(r)=="thread" then
@@ -261,8 +370,8 @@ local function Scheduler()
                n_waiting_threads = n_waiting_threads - 1
             end
          end
-         if waiting[evtype]:empty() then
-            waiting[evtype] = nil
+         if rs:empty() then
+            drop_waiting(evtype)
          end
       end
    end
@@ -287,6 +396,121 @@ local function Scheduler()
    -- C threads need access to the internal zz_msgqueue struct
    self.msgqueue = message_queue.q
 
+   local function push_message(event)
+      assert(type(event) == "table")
+      assert(#event == 2, "event shall be a table of two elements, but it is "..inspect(event))
+      event_queue:push(event)
+   end
+
+   -- scheduler statistics (counters only grow)
+   --
+   -- msgqueue_batches: number of ticks which received messages
+   -- msgqueue_messages: number of messages received
+   -- msgqueue_max_batch: max number of messages received in a tick
+   -- msgqueue_capped: number of ticks which hit MSGQUEUE_BATCH_SIZE
+   -- ticks: number of iterations of the event loop
+   -- poll_waits: number of poller waits
+   -- poll_events: number of events returned by the poller
+   -- poll_max_batch: max number of events returned by one wait
+   -- poll_time: seconds spent in poller waits (incl. idle time)
+   -- run_time: seconds spent running threads
+   -- max_runnables: max number of threads resumed in a tick
+   -- max_event_queue: max length of the event queue
+   local stats = {
+      msgqueue_batches = 0,
+      msgqueue_messages = 0,
+      msgqueue_max_batch = 0,
+      msgqueue_capped = 0,
+      ticks = 0,
+      poll_waits = 0,
+      poll_events = 0,
+      poll_max_batch = 0,
+      poll_time = 0,
+      run_time = 0,
+      max_runnables = 0,
+      max_event_queue = 0,
+   }
+   self.stats = stats
+
+   -- current queue depths
+   function self.depths()
+      return {
+         runnables = runnables:size(),
+         event_queue = event_queue:size(),
+         sleeping = sleeping:size(),
+         waiting_threads = n_waiting_threads,
+      }
+   end
+
+   -- wake up the runnables waiting for `evtype`
+   --
+   -- the list is filtered in place (each runnable is shifted off and
+   -- callbacks which keep waiting are pushed back), so delivering an
+   -- event allocates nothing
+   local function deliver(evtype, evdata)
+      local rs = waiting[evtype]
+      if rs then
+         for _=1,rs:size() do
+            local r = rs:shift()
+            if type(r)=="thread" then
+               -- plain thread
+               runnables:push(Runnable(r, evdata))
+               n_waiting_threads = n_waiting_threads - 1
+            elseif type(r)=="table" then
+               -- background thread in r[1]
+               runnables:push(Runnable(r, evdata))
+            elseif type(r)=="function" then
+               -- callback: create a new thread which executes the
+               -- callback function
+               local function wrapper(evdata)
+                  -- remove the callback if it returns sched.OFF
+                  -- quit handlers are also automatically removed
+                  if r(evdata) == OFF or evtype == 'quit' then
+                     del_waiting(evtype, r)
+                  end
+               end
+               self.sched(wrapper, evdata)
+               -- callbacks keep waiting
+               -- (unless they are quit callbacks)
+               if evtype ~= 'quit' then
+                  rs:push(r)
+               end
+            else
+               ef("invalid object in waiting[%s]: %s", evtype, r)
+            end
+         end
+         if rs:empty() then
+            drop_waiting(evtype)
+         end
+      end
+   end
+
+   local function handle_poll_event(received_events, userdata)
+      if userdata == message_queue_event_id then
+         -- messages are collected by receive_messages()
+         message_queue:reset_trigger()
+      else
+         local fd = edge_fds[userdata]
+         if fd then
+            readiness[fd] = bit.bor(readiness[fd], received_events)
+         end
+         -- poll events go to their waiters directly (without a
+         -- round trip through the event queue)
+         deliver(userdata, received_events)
+      end
+   end
+
+   local function poll_wait(timeout_ms)
+      local t0 = get_current_time()
+      local n = poller:wait(timeout_ms, handle_poll_event)
+      stats.poll_time = stats.poll_time + (get_current_time() - t0)
+      stats.poll_waits = stats.poll_waits + 1
+      stats.poll_events = stats.poll_events + n
+      if n > stats.poll_max_batch then
+         stats.poll_max_batch = n
+      end
+   end
+
    -- tick: one iteration of the event loop
    local function tick() 
       local now = get_current_time()
@@ -295,9 +519,18 @@ local function Scheduler()
       self.now = now
 
       local function wakeup_sleepers(now)
-         while not sleeping:empty() and sleeping[0].time <= now do
-            local sr = sleeping:shift()
-            runnables:push(Runnable(sr.r, nil))
+         while not sleeping:empty() do
+            local r, time = sleeping:peek()
+            if time > now then
+               break
+            end
+            sleeping:pop()
+            if type(r)=="function" then
+               -- expired timer: run its callback in a new thread
+               self.sched(r)
+            else
+               runnables:push(Runnable(r, nil))
+            end
          end
       end
 
@@ -307,18 +540,6 @@ local function Scheduler()
       -- let all registered scheduler modules do their `tick`
       module_registry:invoke('tick')
 
-      local function handle_poll_event(received_events, userdata)
-         if userdata == message_queue_event_id then
-            message_queue:reset_trigger()
-            local event = message_queue:unpack()
-            assert(type(event) == "table")
-            assert(#event == 2, "event shall be a table of two elements, but it is "..inspect(event))
-            event_queue:push(event)
-         else
-            -- evtype: userdata, evdata: received_events
-            event_queue:push({userdata, received_events})
-         end
-      end
 
       local function poll_events()
          if runnables:empty() and event_queue:empty() then
@@ -328,7 +549,8 @@ local function Scheduler()
             if not sleeping:empty() then
                -- but may be shorter (or longer)
                -- if there are sleeping threads
-               wait_until = sleeping[0].time
+               local _, time = sleeping:peek()
+               wait_until = time
             end
             local timeout_ms = (wait_until - now) * 1000 -- sec -> ms
             -- if the thread's time comes sooner than 1 ms,
@@ -338,72 +560,59 @@ local function Scheduler()
             end
             -- round to a whole number
             timeout_ms = math.floor(timeout_ms+0.5)
-            -- poller invokes handle_poll_event() for each event
-            poller:wait(timeout_ms, handle_poll_event)
+            -- C threads fire the message queue trigger only if we
+            -- announced that we are going to sleep
+            if message_queue:prepare_sleep() then
+               -- poller invokes handle_poll_event() for each event
+               poll_wait(timeout_ms)
+               message_queue:finish_sleep()
+            else
+               poll_wait(0)
+            end
          else
             -- there are runnable threads waiting for execution
             -- or the event queue is not empty
             --
             -- let's poll in a non-blocking way
-            poller:wait(0, handle_poll_event)
+            poll_wait(0)
          end
       end
 
-      -- poll for events, transfer them to the event queue
+      -- poll for events, wake up the threads waiting for them
       poll_events()
 
-      local function process_event(event)
-         local evtype, evdata = unpack(event)
-         --pf("got event: evtype=%s, evdata=%s", evtype, inspect(evdata))
-         -- wake up runnables waiting for this evtype
-         local rs = waiting[evtype]
-         if rs then
-            local rs_next = util.List()
-            for r in rs:itervalues() do
-               if type(r)=="thread" then
-                  -- plain thread
-                  runnables:push(Runnable(r, evdata))
-                  n_waiting_threads = n_waiting_threads - 1
-               elseif type(r)=="table" then
-                  -- background thread in r[1]
-                  runnables:push(Runnable(r, evdata))
-               elseif type(r)=="function" then
-                  -- callback: create a new thread which executes the
-                  -- callback function
-                  local function wrapper(evdata)
-                     -- remove the callback if it returns sched.OFF
-                     -- quit handlers are also automatically removed
-                     if r(evdata) == OFF or evtype == 'quit' then
-                        del_waiting(evtype, r)
-                     end
-                  end
-                  self.sched(wrapper, evdata)
-                  -- callbacks keep waiting
-                  -- (unless they are quit callbacks)
-                  if evtype ~= 'quit' then
-                     rs_next:push(r)
-                  end
-               else
-                  ef("invalid object in waiting[%s]: %s", evtype, r)
-               end
+      local function receive_messages()
+         local batch_size = M.MSGQUEUE_BATCH_SIZE
+         local count = message_queue:drain(batch_size, push_message)
+         if count > 0 then
+            stats.msgqueue_batches = stats.msgqueue_batches + 1
+            stats.msgqueue_messages = stats.msgqueue_messages + count
+            if count > stats.msgqueue_max_batch then
+               stats.msgqueue_max_batch = count
             end
-            if rs_next:empty() then
-               waiting[evtype] = nil
-            else
-               waiting[evtype] = rs_next
+            if count == batch_size then
+               stats.msgqueue_capped = stats.msgqueue_capped + 1
             end
          end
       end
 
+      -- transfer messages sent by C threads to the event queue
+      receive_messages()
+
       -- process the event queue
+      if event_queue:size() > stats.max_event_queue then
+         stats.max_event_queue = event_queue:size()
+      end
       while not event_queue:empty() do
          local event = event_queue:shift()
-         process_event(event)
+         deliver(event[1], event[2])
       end
 
       local function resume_runnables()
-         local runnables_next = util.List()
-         for runnable in runnables:itervalues() do
+         -- threads scheduled while we are resuming are pushed to
+         -- `runnables` and get a chance to run in this tick as well
+         while not runnables:empty() do
+            local runnable = runnables:shift()
             local r, data = runnable.r, runnable.data
             local is_background = (type(r)=="table")
             local t = is_background and r[1] or r
@@ -415,16 +624,20 @@ local function Scheduler()
                if status == "suspended" then
                   if type(rv) == "number" and rv > 0 then
                      -- the coroutine shall be resumed at the given time
-                     sleeping:push(SleepingRunnable(r, rv))
+                     sleeping:push(r, rv)
+                     release_runnable(runnable)
                   elseif rv then
                      -- rv is the evtype which shall wake up this thread
                      add_waiting(rv, r)
+                     release_runnable(runnable)
                   else
                      -- the coroutine shall be resumed in the next tick
                      -- it already consumed data, so no need to pass again
-                     runnables_next:push(Runnable(r, nil))
+                     runnable.data = nil
+                     runnables_next:push(runnable)
                   end
                elseif status == "dead" then
+                  release_runnable(runnable)
                   if not ok then
                      local e = rv
                      if not util.is_error(e) then
@@ -449,11 +662,17 @@ local function Scheduler()
                end
             end
          end
-         runnables = runnables_next
+         runnables, runnables_next = runnables_next, runnables
       end
 
       -- give each active thread a chance to run
+      if runnables:size() > stats.max_runnables then
+         stats.max_runnables = runnables:size()
+      end
+      local t0 = get_current_time()
       resume_runnables()
+      stats.run_time = stats.run_time + (get_current_time() - t0)
+      stats.ticks = stats.ticks + 1
    end
 
    function self.loop()
@@ -565,6 +784,20 @@ local function Scheduler()
       return self.wait(get_current_time() + seconds)
    end
 
+   -- sched.timer(seconds, fn): call fn in a new thread after
+   -- `seconds` elapsed
+   --
+   -- returns a handle which can be passed to sched.cancel() to
+   -- remove the timer before it fires
+   function self.timer(seconds, fn)
+      return sleeping:push(to_function(fn), get_current_time() + seconds)
+   end
+
+   -- returns true if the timer was pending (and got cancelled)
+   function self.cancel(handle)
+      return sleeping:remove(handle)
+   end
+
    function self.emit(evtype, evdata)
       assert(evdata ~= nil, "evdata must be non-nil")
       event_queue:push({ evtype, evdata })
@@ -619,6 +852,14 @@ local function get_scheduler()
    return scheduler_singleton
 end
 
+-- to be called in the child after fork(): the child must leave the
+-- poll set of the parent's scheduler (if there is one) alone
+function M.forked()
+   if scheduler_singleton then
+      scheduler_singleton.forked()
+   end
+end
+
 local M_mt = {}
 
 -- all lookups are proxied to the singleton Scheduler instance
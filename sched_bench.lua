@@ -0,0 +1,94 @@
+-- scheduler micro-benchmarks
+--
+-- usage: zz run sched_bench.lua
+
+local sched = require('sched')
+local time = require('time')
+local util = require('util')
+
+local M = {}
+
+local function bench(name, n, fn)
+   local t0 = time.time()
+   fn(n)
+   local elapsed = time.time() - t0
+   pf("%-32s %8d ops %10.3f ms %12.0f ops/s",
+      name, n, elapsed * 1000, n / elapsed)
+end
+
+local N = 100000
+
+function M.main()
+   math.randomseed(0)
+
+   bench("heap push+pop (random keys)", N, function(n)
+      local h = util.Heap()
+      for i=1,n do
+         h:push(i, math.random())
+      end
+      while not h:empty() do
+         h:pop()
+      end
+   end)
+
+   bench("heap push+remove", N, function(n)
+      local h = util.Heap()
+      local handles = {}
+      for i=1,n do
+         handles[i] = h:push(i, math.random())
+      end
+      for i=1,n do
+         h:remove(handles[i])
+      end
+   end)
+
+   bench("list push+shift (queue of 1k)", N, function(n)
+      local l = util.List()
+      for i=1,1000 do
+         l:push(i)
+      end
+      for i=1,n do
+         l:push(l:shift())
+      end
+   end)
+
+   bench("ticks with 10k runnable threads", 100, function(n)
+      local threads = {}
+      for i=1,10000 do
+         threads[i] = sched(function()
+            for j=1,n do
+               sched.yield()
+            end
+         end)
+      end
+      sched.join(threads)
+   end)
+
+   bench("sleeping threads", N, function(n)
+      local now = sched.time()
+      local threads = {}
+      for i=1,n do
+         local wake_at = now + math.random() * 0.1
+         threads[i] = sched(function() sched.wait(wake_at) end)
+      end
+      sched.join(threads)
+   end)
+
+   bench("timers (half cancelled)", N, function(n)
+      local fired = 0
+      local handles = {}
+      for i=1,n do
+         handles[i] = sched.timer(math.random() * 0.1, function()
+            fired = fired + 1
+         end)
+      end
+      for i=1,n,2 do
+         sched.cancel(handles[i])
+      end
+      while fired < n / 2 do
+         sched.sleep(0.01)
+      end
+   end)
+end
+
+return M
@@ -6,6 +6,8 @@ local signal = require('signal')
 local assert = require('assert')
 local inspect = require('inspect')
 local util = require('util')
+local ffi = require('ffi')
+local msgpack = require('msgpack')
 
 testing:nosched("scheduler creation and release", function()
    for i=1,10 do
@@ -98,6 +100,98 @@ testing:nosched("sched.OFF", function()
    assert.equals(counter, 5)
 end)
 
+-- threads stop waiting when the event arrives, callbacks keep on
+-- waiting (in the order they were registered)
+
+testing:nosched("threads and callbacks waiting for the same event", function()
+   local log = {}
+   sched.on('my-mixed-signal', function(n)
+      table.insert(log, sf("cb1:%d", n))
+   end)
+   sched(function()
+      local n = sched.wait('my-mixed-signal')
+      table.insert(log, sf("thread:%d", n))
+   end)
+   sched.on('my-mixed-signal', function(n)
+      table.insert(log, sf("cb2:%d", n))
+      if n == 2 then
+         return sched.OFF
+      end
+   end)
+   sched(function()
+      sched.emit('my-mixed-signal', 1)
+      sched.yield()
+      sched.yield()
+      sched.emit('my-mixed-signal', 2)
+      sched.yield()
+      sched.yield()
+      sched.emit('my-mixed-signal', 3)
+      sched.yield()
+      sched.yield()
+   end)
+   sched()
+   assert.equals(log, {
+      "cb1:1", "cb2:1", "thread:1",
+      "cb1:2", "cb2:2",
+      "cb1:3",
+   })
+end)
+
+-- C threads inject events through sched.msgqueue
+--
+-- in each tick, the scheduler moves at most sched.MSGQUEUE_BATCH_SIZE
+-- messages to the event queue. sched.stats shows how it went.
+
+testing:nosched("message queue batches", function()
+   local batch_size = sched.MSGQUEUE_BATCH_SIZE
+   sched.MSGQUEUE_BATCH_SIZE = 100
+   local count = 0
+   sched.on('msgqueue-batch', function(i)
+      count = count + 1
+   end)
+   local n = 450
+   for i=1,n do
+      local buf = msgpack.pack({'msgqueue-batch', i})
+      ffi.C.zz_msgqueue_write(sched.msgqueue, buf.ptr, #buf)
+   end
+   local stats = sched.stats
+   sched(function()
+      while count < n do
+         sched.yield()
+      end
+   end)
+   sched()
+   sched.MSGQUEUE_BATCH_SIZE = batch_size
+   assert.equals(count, n)
+   assert.equals(stats.msgqueue_messages, n)
+   assert.equals(stats.msgqueue_batches, 5)
+   assert.equals(stats.msgqueue_max_batch, 100)
+   assert.equals(stats.msgqueue_capped, 4)
+end)
+
+testing:nosched("poll and run statistics", function()
+   local stats = sched.stats
+   local n = 10
+   local threads = {}
+   for i=1,n do
+      threads[i] = sched(function()
+         sched.sleep(0.01)
+      end)
+   end
+   sched(function()
+      sched.join(threads)
+      local depths = sched.depths()
+      assert.equals(depths.runnables, 0)
+      assert.equals(depths.sleeping, 0)
+   end)
+   sched()
+   assert(stats.ticks > 1)
+   assert(stats.poll_waits > 0)
+   assert(stats.poll_time > 0)
+   assert(stats.run_time > 0)
+   assert(stats.max_runnables >= n)
+end)
+
 -- a 'quit' event terminates the event loop
 -- after a quit event has been posted, sched.running() returns false
 -- this can be used to check whether it's time to exit
@@ -184,6 +278,24 @@ testing:nosched("sched.wait(timestamp)", function()
    assert.equals(sched.state(), "off")
 end)
 
+-- sched.timer(seconds, fn) runs fn in a new thread after the given
+-- amount of time. the returned handle can be passed to sched.cancel()
+
+testing:nosched("sched.timer() and sched.cancel()", function()
+   local fired = {}
+   sched.timer(0.2, function() table.insert(fired, 2) end)
+   sched.timer(0.1, function() table.insert(fired, 1) end)
+   local h = sched.timer(0.15, function() table.insert(fired, "cancelled") end)
+   sched(function()
+      assert(sched.cancel(h))
+      -- cancelling again is a no-op
+      assert(not sched.cancel(h))
+   end)
+   sched()
+   assert.equals(fired, {1, 2})
+   assert.equals(sched.state(), "off")
+end)
+
 testing:nosched("a thread sleeping in sched.wait() keeps the event loop alive", function()
    local pid = process.fork()
    if pid == 0 then
@@ -23,7 +23,6 @@ void *zz_signal_handler_thread(void *arg) {
       /* SIGALRM is our exit signal */
       break;
     }
-    zz_msgqueue_lock(q);
     zz_msgqueue_prepare_write(q, 32);
     zz_msgqueue_pack_array(q, 2);
     zz_msgqueue_pack_str(q, "signal", 6);
@@ -31,7 +30,6 @@ void *zz_signal_handler_thread(void *arg) {
     zz_msgqueue_pack_integer(q, signum);
     zz_msgqueue_pack_integer(q, siginfo.si_pid);
     zz_msgqueue_finish_write(q);
-    zz_msgqueue_unlock(q);
   }
 
   return NULL;
@@ -3,6 +3,8 @@ local process = require('process')
 local util = require('util')
 local sched = require('sched')
 local pthread = require('pthread')
+local errno = require('errno')
+local time = require('time') -- for struct timespec
 
 ffi.cdef [[
 
@@ -19,6 +21,18 @@ int sigismember (const sigset_t *__set, int __signo);
 
 int pthread_sigmask(int how, const sigset_t *set, sigset_t *oldset);
 
+typedef struct {
+  int si_signo;
+  int si_errno;
+  int si_code;
+  int __pad0;
+  int si_pid; /* sender pid (kill, sigqueue, SIGCHLD) */
+  int __pad[27];
+} siginfo_t;
+
+int sigtimedwait (const sigset_t *set, siginfo_t *info,
+                  const struct timespec *timeout);
+
 void *zz_signal_handler_thread(void *arg);
 
 ]]
@@ -81,6 +95,41 @@ function M.unblock(signum)
    return sigmask(SIG_UNBLOCK, signum)
 end
 
+-- wait for one of the signals listed in `signums`
+--
+-- this is for processes which do not run the scheduler (within the
+-- event loop, signals arrive as 'signal' events). the signals should
+-- be blocked, otherwise they may get delivered before the call.
+--
+-- returns the signal number and the pid of the sender, or nil if
+-- `timeout` seconds elapsed without any of the signals arriving
+function M.wait(signums, timeout)
+   local ss = ffi.new("sigset_t")
+   ffi.C.sigemptyset(ss)
+   for _,signum in ipairs(signums) do
+      ffi.C.sigaddset(ss, signum)
+   end
+   local ts = nil
+   if timeout then
+      ts = ffi.new("struct timespec")
+      ts.tv_sec = math.floor(timeout)
+      ts.tv_nsec = (timeout - math.floor(timeout)) * 1e9
+   end
+   local info = ffi.new("siginfo_t")
+   while true do
+      local rv = ffi.C.sigtimedwait(ss, info, ts)
+      if rv >= 0 then
+         return rv, info.si_pid
+      end
+      local errnum = errno.errno()
+      if errnum == ffi.C.EAGAIN then
+         return nil
+      elseif errnum ~= ffi.C.EINTR then
+         util.check_errno("sigtimedwait", rv, errnum)
+      end
+   end
+end
+
 local function SignalModule(sched)
    local self = {}
 
@@ -141,6 +190,10 @@ local function SignalModule(sched)
    return self
 end
 
-sched.register_module(SignalModule)
+-- signals are handled by the main Lua state: the signal handler
+-- thread of a worker thread's scheduler would compete for them
+if not ZZ_THREAD_ARG then
+   sched.register_module(SignalModule)
+end
 
 return M
@@ -5,12 +5,44 @@ local util = require('util')
 local buffer = require('buffer')
 local mm = require('mm')
 local re = require('re')
+local errno = require('errno')
 
 local M = {}
 
+ffi.cdef [[
+
+void * memmove (void *dest, const void *src, size_t n);
+
+ssize_t read  (int fd, void *buf, size_t nbytes);
+int     close (int fd);
+int     pipe2 (int pipefd[2], int flags);
+ssize_t splice (int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                size_t len, unsigned int flags);
+
+enum {
+  SPLICE_F_MOVE     = 1,
+  SPLICE_F_NONBLOCK = 2,
+  F_SETPIPE_SZ      = 1031
+};
+
+]]
+
+-- unread data of a stream
+--
+-- a single buffer is reused for the lifetime of the stream: unread
+-- data lives in buf[offset..buf.len). when we need room after the
+-- data, the data is moved to the front of the buffer (compaction)
+-- and the buffer grows only if the data itself does not fit
+--
+-- the size of reads starts at READ_BLOCK_SIZE and doubles (up to
+-- MAX_READ_BLOCK_SIZE) whenever a read fills all available room:
+-- streams with lots of data behind them need fewer syscalls, while
+-- the many small streams (e.g. sockets with short requests) keep
+-- small buffers
 local function ReadBuffer()
    local buf = buffer.new()
    local offset = 0
+   local block_size = M.READ_BLOCK_SIZE
    return {
       length = function(self)
          return tonumber(buf.len - offset)
@@ -21,45 +53,162 @@ local function ReadBuffer()
       consume = function(self, nbytes)
          offset = offset + nbytes
          assert(offset <= buf.len)
+         if offset == buf.len then
+            -- empty: start again at the front, no compaction needed
+            self:clear()
+         end
       end,
       clear = function(self)
          buf.len = 0
          offset = 0
       end,
+      -- returns all unread data in a buffer owned by the caller
       get = function(self)
          local rv
-         if offset == 0 then
+         if offset == 0 and buf.cap > 0 then
             rv = buf
-            buf = buffer.new()
+            buf = buffer.new(block_size)
          else
-            rv = buffer.slice(buf, offset)
+            rv = buffer.copy(buf.ptr + offset, self:length())
             self:clear()
          end
          return rv
       end,
+      -- returns a view of the next `size` bytes and consumes them
+      --
+      -- the view points into the read buffer: it remains valid until
+      -- the next read from the stream
+      view = function(self, size)
+         local rv = buffer.view(buf, offset, size)
+         self:consume(size)
+         return rv
+      end,
       set = function(self, newbuf)
          buf = newbuf
          offset = 0
       end,
+      -- makes room for `size` more bytes after the unread data
+      reserve = function(self, size)
+         local length = self:length()
+         if buf.cap == 0 then
+            -- externally owned data (see set), copy it to our own buffer
+            local owned = buffer.new(util.max(length + size, M.READ_BLOCK_SIZE))
+            owned:append(buf.ptr + offset, length)
+            buf = owned
+            offset = 0
+         elseif buf.cap - buf.len < size then
+            if offset > 0 then
+               ffi.C.memmove(buf.ptr, buf.ptr + offset, length)
+               buf.len = length
+               offset = 0
+            end
+            if buf.cap - buf.len < size then
+               buf:resize(buf.len + size)
+            end
+         end
+      end,
+      -- reads more data from the stream with a single read1_raw()
+      --
+      -- with `size`: until there are `size` bytes of unread data
+      -- without `size`: as much as fits (at least READ_BLOCK_SIZE)
       fill = function(self, stream, size)
          if stream:eof() then return end
-         size = size or (buf.cap - offset)
-         if self:length() < size then
-            local desired_cap = offset + size
-            if buf.cap < desired_cap then
-               buf:resize(desired_cap)
-            end
-            local dst = buf.ptr + buf.len
-            local bytes_to_read = size - self:length()
-            local nbytes = stream:read1_raw(dst, bytes_to_read)
-            buf.len = buf.len + nbytes
+         local bytes_to_read
+         if size then
+            bytes_to_read = size - self:length()
+            if bytes_to_read <= 0 then return end
+            self:reserve(bytes_to_read)
+         else
+            self:reserve(block_size)
+            bytes_to_read = tonumber(buf.cap - buf.len)
          end
-      end
+         local nbytes = stream:read1_raw(buf.ptr + buf.len, bytes_to_read)
+         buf.len = buf.len + nbytes
+         if not size and nbytes == bytes_to_read then
+            block_size = util.min(block_size * 2, M.MAX_READ_BLOCK_SIZE)
+         end
+         return nbytes
+      end,
+      block_size = function(self)
+         return block_size
+      end,
    }
 end
 
+-- initial size of reads into the read buffer
 M.READ_BLOCK_SIZE = 4096
 
+-- limit of the adaptive read size (see ReadBuffer)
+M.MAX_READ_BLOCK_SIZE = 262144
+
+-- copy() reads via readv() into a chain of up to READV_BLOCKS
+-- blocks from the mm block pool. the chain starts with one block
+-- and doubles while reads keep filling all of them
+M.READV_BLOCK_SIZE = 65536
+M.READV_BLOCKS = 16
+
+-- default size of the write buffer (see Stream:buffer_writes)
+M.WRITE_BUFFER_SIZE = 16384
+
+-- strings at least this long are queued by reference instead of
+-- being copied into the write buffer
+M.WRITE_COPY_THRESHOLD = 1024
+
+-- max number of buffers passed to a single writev() call
+local IOV_MAX = 1024
+
+-- queue of data waiting to be written
+--
+-- small writes are copied into buffers, long strings are queued by
+-- reference (they are immutable). flushing sends the whole queue
+-- with a single writev() when the stream supports it
+local function WriteBuffer()
+   local size = 0 -- 0: writes are not buffered
+   local queue = {}
+   local queued = 0
+   local spare = nil -- buffer kept for the next round
+   return {
+      size = function(self)
+         return size
+      end,
+      set_size = function(self, new_size)
+         size = new_size
+      end,
+      length = function(self)
+         return queued
+      end,
+      full = function(self)
+         return queued >= size
+      end,
+      copy = function(self, ptr, nbytes)
+         local last = queue[#queue]
+         if not buffer.is_buffer(last) then
+            last = spare or buffer.new(size)
+            spare = nil
+            table.insert(queue, last)
+         end
+         last:append(ptr, nbytes)
+         queued = queued + nbytes
+      end,
+      ref = function(self, str)
+         table.insert(queue, str)
+         queued = queued + #str
+      end,
+      -- removes and returns all queued items
+      take = function(self)
+         local items = queue
+         queue = {}
+         queued = 0
+         return items
+      end,
+      -- gives back a buffer returned by take() for reuse
+      recycle = function(self, buf)
+         buf.len = 0
+         spare = buf
+      end,
+   }
+end
+
 local Stream = util.Class()
 
 function Stream:new(obj)
@@ -75,19 +224,29 @@ function Stream:new(obj)
       self.impl = obj
    end
    self.read_buffer = ReadBuffer()
+   self.write_buffer = WriteBuffer()
    self.is_stream = true
    return self
 end
 
 function Stream:close()
+   self:flush()
    return self.impl.close and self.impl:close()
 end
 
+function Stream:shutdown(how)
+   return self.impl.shutdown and self.impl:shutdown(how)
+end
+
 function Stream:eof()
    return self.read_buffer:length() == 0 and self.impl:eof()
 end
 
 function Stream:read1_raw(ptr, size)
+   -- the peer may be waiting for our data before it sends anything
+   if self.write_buffer:length() > 0 then
+      self:flush()
+   end
    return self.impl:read1(ptr, size)
 end
 
@@ -115,8 +274,120 @@ function Stream:read1(ptr, size)
    return bytes_read
 end
 
+-- reads into the buffers described by iov[0..iovcnt-1], filling
+-- them in order
+--
+-- uses a single impl:readv() if the stream supports it. buffered
+-- data is returned first (from a single read1() into the first
+-- buffer), as are reads of streams which override read1_raw()
+function Stream:readv(iov, iovcnt)
+   local impl = self.impl
+   if self.read_buffer:length() > 0
+      or not impl.readv
+      or self.read1_raw ~= Stream.read1_raw then
+      return self:read1(iov[0].iov_base, tonumber(iov[0].iov_len))
+   end
+   if self.write_buffer:length() > 0 then
+      self:flush()
+   end
+   return impl:readv(iov, iovcnt)
+end
+
+-- turns on write buffering: written data is queued until the queue
+-- reaches `size` bytes, flush() is called or the stream is closed (or
+-- read from). size = 0 turns buffering off
+function Stream:buffer_writes(size)
+   self:flush()
+   self.write_buffer:set_size(size or M.WRITE_BUFFER_SIZE)
+   return self
+end
+
+-- writes all `size` bytes at `ptr` via impl:write1()
+local function write_fully(impl, ptr, size)
+   ptr = ffi.cast("uint8_t*", ptr)
+   while size > 0 do
+      local nbytes = impl:write1(ptr, size)
+      if nbytes == 0 then
+         ef("write1() wrote nothing")
+      end
+      ptr = ptr + nbytes
+      size = size - nbytes
+   end
+end
+
+-- writes all data referenced by iov[0..iovcnt-1] via impl:writev()
+local function writev_fully(impl, iov, iovcnt)
+   local i = 0
+   while i < iovcnt do
+      local nbytes = impl:writev(iov + i, util.min(iovcnt - i, IOV_MAX))
+      if nbytes == 0 then
+         ef("writev() wrote nothing")
+      end
+      -- skip fully written buffers, adjust the partially written one
+      while i < iovcnt and nbytes >= tonumber(iov[i].iov_len) do
+         nbytes = nbytes - tonumber(iov[i].iov_len)
+         i = i + 1
+      end
+      if nbytes > 0 then
+         iov[i].iov_base = ffi.cast("uint8_t*", iov[i].iov_base) + nbytes
+         iov[i].iov_len = iov[i].iov_len - nbytes
+      end
+   end
+end
+
+local function data_ptr(data)
+   if buffer.is_buffer(data) then
+      return data.ptr
+   else
+      return ffi.cast("void*", data)
+   end
+end
+
+-- sends all queued data, using a single writev() if there is more
+-- than one item in the queue and the stream supports it
+function Stream:flush()
+   local wb = self.write_buffer
+   if wb:length() == 0 then
+      return
+   end
+   local items = wb:take()
+   local impl = self.impl
+   if #items == 1 or not impl.writev then
+      for i=1,#items do
+         write_fully(impl, data_ptr(items[i]), #items[i])
+      end
+   else
+      local iov = ffi.new("struct iovec[?]", #items)
+      for i=1,#items do
+         iov[i-1].iov_base = data_ptr(items[i])
+         iov[i-1].iov_len = #items[i]
+      end
+      writev_fully(impl, iov, #items)
+   end
+   for i=1,#items do
+      if buffer.is_buffer(items[i]) then
+         wb:recycle(items[i])
+         break
+      end
+   end
+end
+
 function Stream:write1(ptr, size)
-   return self.impl:write1(ptr, size)
+   local wb = self.write_buffer
+   local write_buffer_size = wb:size()
+   if write_buffer_size == 0 then
+      return self.impl:write1(ptr, size)
+   elseif size >= write_buffer_size then
+      -- large writes bypass the buffer (after what is already queued)
+      self:flush()
+      return self.impl:write1(ptr, size)
+   else
+      wb:copy(ptr, size)
+      if wb:full() then
+         self:flush()
+      end
+      return size
+   end
 end
 
 function Stream:read(n)
@@ -124,14 +395,13 @@ function Stream:read(n)
    local buf
    if not n then
       -- read an arbitrary amount of bytes
-      if self.read_buffer:length() > 0 then
-         buf = self.read_buffer:get()
-      else
-         mm.with_block(READ_BLOCK_SIZE, nil, function(ptr, block_size)
-            local nbytes = self:read1(ptr, block_size)
-            buf = buffer.copy(ptr, nbytes)
-         end)
+      --
+      -- data is read directly into the read buffer which is then
+      -- handed over to the caller
+      if self.read_buffer:length() == 0 then
+         self.read_buffer:fill(self)
       end
+      buf = self.read_buffer:get()
    elseif n > 0 then
       -- read exactly N bytes or until EOF
       buf = buffer.new(n)
@@ -156,26 +426,19 @@ function Stream:read(n)
          end
       end
    elseif n == 0 then
-      -- read until EOF
-      local buffers = {}
-      local nbytes_total = 0
-      local rbl = self.read_buffer:length()
-      if rbl > 0 then
-         table.insert(buffers, self.read_buffer:get())
-         nbytes_total = nbytes_total + rbl
+      -- read until EOF (directly into the result buffer)
+      if self.read_buffer:length() > 0 then
+         buf = self.read_buffer:get()
+      else
+         buf = buffer.new(READ_BLOCK_SIZE)
       end
-      mm.with_block(READ_BLOCK_SIZE, nil, function(ptr, block_size)
-         while not self:eof() do
-            local nbytes = self:read1(ptr, block_size)
-            if nbytes > 0 then
-               table.insert(buffers, buffer.copy(ptr, nbytes))
-               nbytes_total = nbytes_total + nbytes
-            end
+      while not self:eof() do
+         if buf.cap - buf.len < READ_BLOCK_SIZE then
+            -- grow geometrically to keep the number of reallocs low
+            buf:resize(util.max(tonumber(buf.cap) * 2, tonumber(buf.len) + READ_BLOCK_SIZE))
          end
-      end)
-      buf = buffer.new(nbytes_total)
-      for i=1,#buffers do
-         buf:append(buffers[i])
+         local nbytes = self:read1(buf.ptr + buf.len, tonumber(buf.cap - buf.len))
+         buf.len = buf.len + nbytes
       end
    end
    return buf
@@ -193,7 +456,9 @@ function Stream:unread(data)
       if buffer.is_buffer(data) then
          self.read_buffer:set(data)
       else
-         self.read_buffer:set(buffer.copy(data))
+         -- strings are immutable: the read buffer can point into them
+         -- until it needs to be refilled
+         self.read_buffer:set(buffer.view(data))
       end
    else
       local read_buffer = buffer.new(#data + rbl)
@@ -206,35 +471,41 @@ end
 ffi.cdef [[ void * memmem (const void *haystack, size_t haystack_len,
                            const void *needle, size_t needle_len); ]]
 
+-- reads until `marker` (or EOF)
+--
+-- returns a view into the read buffer which remains valid until the
+-- next read from the stream, plus a flag which tells if the marker
+-- was found
 function Stream:read_until(marker, keep_marker)
-   local buf = buffer.new()
+   local rb = self.read_buffer
+   local marker_len = #marker
+   -- where to continue searching (relative to the unread data)
    local start_search_at = 0
-   while not self:eof() do
-      local chunk = self:read()
-      if #chunk == 0 then
-         break
-      end
-      buf:append(chunk) -- buffer automatically grows as needed
-      local search_ptr = buf.ptr + start_search_at
-      local search_len = buf.len - start_search_at
-      local p = ffi.cast("uint8_t*", ffi.C.memmem(search_ptr, search_len, marker, #marker))
-      if p ~= nil then
-         local marker_offset = p - buf.ptr
-         local next_offset = marker_offset + #marker
-         if next_offset < #buf then
-            assert(self.read_buffer:length() == 0)
-            self.read_buffer:set(buffer.slice(buf, next_offset))
-         end
-         if keep_marker then
-            return buffer.copy(buf, next_offset), true
-         else
-            return buffer.copy(buf, marker_offset), true
+   while true do
+      local length = rb:length()
+      if length - start_search_at >= marker_len then
+         local search_ptr = rb:ptr() + start_search_at
+         local search_len = length - start_search_at
+         local p = ffi.cast("uint8_t*", ffi.C.memmem(search_ptr, search_len, marker, marker_len))
+         if p ~= nil then
+            local marker_offset = p - rb:ptr()
+            if keep_marker then
+               return rb:view(marker_offset + marker_len), true
+            else
+               local rv = rb:view(marker_offset)
+               rb:consume(marker_len)
+               return rv, true
+            end
          end
-      else
-         start_search_at = buf.len - #marker + 1
+         start_search_at = length - marker_len + 1
+      end
+      -- the read buffer may be compacted but the offsets we keep are
+      -- relative to the unread data, so they remain valid
+      if self:eof() or (rb:fill(self) or 0) == 0 then
+         break
       end
    end
-   return buf, false
+   return rb:view(rb:length()), false
 end
 
 function Stream:match(pattern)
@@ -256,7 +527,7 @@ function Stream:match(pattern)
          else
             if hi < #buf then
                assert(self.read_buffer:length() == 0)
-               self.read_buffer:set(buffer.slice(buf, hi))
+               self.read_buffer:set(buffer.view(buf, hi))
             end
             return m
          end
@@ -274,6 +545,26 @@ function Stream:match(pattern)
    return nil
 end
 
+-- in-place parsing: parsers can inspect the unread data without
+-- copying it, read more if needed and then consume what they parsed
+
+-- returns a pointer to the unread data and its length
+function Stream:buffered()
+   return self.read_buffer:ptr(), self.read_buffer:length()
+end
+
+-- reads more data into the read buffer
+--
+-- returns the number of bytes read (0 at EOF). the read buffer may
+-- be moved: pointers returned by buffered() become invalid
+function Stream:fill()
+   return self.read_buffer:fill(self) or 0
+end
+
+function Stream:consume(nbytes)
+   self.read_buffer:consume(nbytes)
+end
+
 function Stream:read_byte()
    local byte
    if self.read_buffer:length() == 0 then
@@ -302,6 +593,17 @@ function Stream:peek(size)
 end
 
 function Stream:write(data)
+   local wb = self.write_buffer
+   if wb:size() > 0
+      and type(data) == "string"
+      and #data >= M.WRITE_COPY_THRESHOLD then
+      -- strings are immutable, so we can queue them without copying
+      wb:ref(data)
+      if wb:full() then
+         self:flush()
+      end
+      return
+   end
    local size
    if buffer.is_buffer(data) then
       size = #data
@@ -356,6 +658,8 @@ end
 local function MemoryStream()
    local self = {}
    local buffers = {}
+   -- number of bytes already read from buffers[1]
+   local head_offset = 0
    function self:eof()
       return #buffers == 0
    end
@@ -368,16 +672,17 @@ local function MemoryStream()
       local bytes_left = size
       while #buffers > 0 and bytes_left > 0 do
          local buf = buffers[1]
-         local bufsize = #buf
+         local bufsize = #buf - head_offset
          if bufsize > bytes_left then
-            ffi.copy(dst, buf.ptr, bytes_left)
-            buffers[1] = buffer.slice(buf, bytes_left)
+            ffi.copy(dst, buf.ptr + head_offset, bytes_left)
+            head_offset = head_offset + bytes_left
             bytes_left = 0
          else
-            ffi.copy(dst, buf.ptr, bufsize)
+            ffi.copy(dst, buf.ptr + head_offset, bufsize)
             dst = dst + bufsize
             bytes_left = bytes_left - bufsize
             table.remove(buffers, 1)
+            head_offset = 0
          end
       end
       return size - bytes_left
@@ -403,15 +708,207 @@ local function make_stream(x)
    end
 end
 
-function M.copy(s1, s2)
-   s1 = make_stream(s1)
-   s2 = make_stream(s2)
+-- zero-copy transfers
+--
+-- when both streams are backed by a file descriptor, copy() lets the
+-- kernel move the data:
+--
+--   file -> file    copy_file_range() (or sendfile) in the async pool
+--   file -> socket  sendfile() in the async pool
+--   socket -> any   splice() through a pipe, non-blocking
+--
+-- stream impls opt in by providing fileno(). streams which override
+-- read1_raw() or write1() (like taps) see the data, so they are
+-- always copied through user space
+
+-- max number of bytes moved by a single syscall
+M.ZERO_COPY_CHUNK = 1048576
+
+-- errors which mean that the fds do not support the operation
+local function unsupported(e)
+   return e == ffi.C.EINVAL or e == ffi.C.ENOSYS or e == ffi.C.EXDEV
+      or e == ffi.C.EOPNOTSUPP or e == ffi.C.EBADF
+end
+
+-- copies via impl:sendfile() or impl:copy_file_range()
+--
+-- returns false if the first call was refused, the caller shall
+-- fall back to another method then
+local function file_copy(s1, s2, method)
+   local impl = s1.impl
+   local out_fd = s2.impl:fileno()
+   local first = true
+   while true do
+      local nbytes, e = impl[method](impl, out_fd, M.ZERO_COPY_CHUNK)
+      if nbytes > 0 then
+         first = false
+      elseif nbytes == 0 then
+         impl:set_eof()
+         return true
+      elseif e == ffi.C.EAGAIN then
+         s2.impl:wait_io("w")
+      elseif first and unsupported(e) then
+         return false
+      elseif e ~= ffi.C.EINTR then
+         util.check_errno(method, nbytes, e)
+      end
+   end
+end
+
+-- writes the data left in the pipe via the buffered path
+local function drain_pipe(rfd, s2, nbytes)
    mm.with_block(M.READ_BLOCK_SIZE, nil, function(ptr, block_size)
+      while nbytes > 0 do
+         local n = util.check_errno("read", ffi.C.read(rfd, ptr, util.min(nbytes, block_size)))
+         s2:write1(ptr, n)
+         nbytes = nbytes - n
+      end
+   end)
+end
+
+local function splice_loop(s1, s2, rfd, wfd)
+   local in_fd = s1.impl:fileno()
+   local out_fd = s2.impl:fileno()
+   local flags = bit.bor(ffi.C.SPLICE_F_MOVE, ffi.C.SPLICE_F_NONBLOCK)
+   local first = true
+   while true do
+      local nbytes = tonumber(ffi.C.splice(in_fd, nil, wfd, nil, M.ZERO_COPY_CHUNK, flags))
+      if nbytes == 0 then
+         s1.impl:set_eof()
+         return true
+      elseif nbytes == -1 then
+         local e = errno.errno()
+         if e == ffi.C.EAGAIN then
+            -- the pipe is always empty here, so it's the socket
+            s1.impl:wait_io("r")
+         elseif first and unsupported(e) then
+            return false
+         elseif e ~= ffi.C.EINTR then
+            util.check_errno("splice", nbytes, e)
+         end
+      end
+      while nbytes > 0 do
+         local n = tonumber(ffi.C.splice(rfd, nil, out_fd, nil, nbytes, flags))
+         if n > 0 then
+            nbytes = nbytes - n
+            first = false
+         elseif n == 0 then
+            ef("splice() wrote nothing")
+         else
+            local e = errno.errno()
+            if e == ffi.C.EAGAIN then
+               s2.impl:wait_io("w")
+            elseif first and unsupported(e) then
+               -- e.g. an O_APPEND file: the data is already in the pipe
+               drain_pipe(rfd, s2, nbytes)
+               return false
+            elseif e ~= ffi.C.EINTR then
+               util.check_errno("splice", n, e)
+            end
+         end
+      end
+   end
+end
+
+local function splice_copy(s1, s2)
+   local fds = ffi.new("int[2]")
+   if ffi.C.pipe2(fds, bit.bor(ffi.C.O_NONBLOCK, ffi.C.O_CLOEXEC)) == -1 then
+      return false
+   end
+   -- best effort: a bigger pipe means fewer splice() calls
+   ffi.C.fcntl(fds[1], ffi.C.F_SETPIPE_SZ, ffi.cast("int", M.ZERO_COPY_CHUNK))
+   local ok, rv = util.pcall(splice_loop, s1, s2, fds[0], fds[1])
+   ffi.C.close(fds[0])
+   ffi.C.close(fds[1])
+   if not ok then
+      util.throw(rv)
+   end
+   return rv
+end
+
+-- returns true if all data has been copied from s1 to s2
+local function zero_copy(s1, s2)
+   if s1.read1_raw ~= Stream.read1_raw or s2.write1 ~= Stream.write1 then
+      return false
+   end
+   local impl1, impl2 = s1.impl, s2.impl
+   if not impl1.fileno or not impl2.fileno then
+      return false
+   end
+   local in_fd, in_kind = impl1:fileno()
+   local out_fd, out_kind = impl2:fileno()
+   if not in_fd or not out_fd then
+      return false
+   end
+   -- the peer may be waiting for our data before it sends anything
+   s1:flush()
+   -- data which has been read into the buffer goes first
+   local rb = s1.read_buffer
+   if rb:length() > 0 then
+      write_fully(s2, rb:ptr(), rb:length())
+      rb:clear()
+   end
+   s2:flush()
+   if impl1:eof() then
+      return true
+   end
+   if in_kind == "file" then
+      if out_kind == "file" and file_copy(s1, s2, "copy_file_range") then
+         return true
+      end
+      return file_copy(s1, s2, "sendfile")
+   else
+      return splice_copy(s1, s2)
+   end
+end
+
+-- copies through user space, reading with readv() into a chain of
+-- pooled blocks (see READV_BLOCKS)
+local function buffered_copy(s1, s2)
+   local iov = ffi.new("struct iovec[?]", M.READV_BLOCKS)
+   local blocks = {}
+   local block_size
+   local function add_block()
+      local ptr
+      ptr, block_size = mm.get_block(M.READV_BLOCK_SIZE)
+      iov[#blocks].iov_base = ptr
+      iov[#blocks].iov_len = block_size
+      table.insert(blocks, ptr)
+   end
+   add_block()
+   local ok, err = util.pcall(function()
       while not s1:eof() do
-         local nbytes = s1:read1(ptr, block_size)
-         s2:write1(ptr, nbytes)
+         local nblocks = #blocks
+         local nbytes = tonumber(s1:readv(iov, nblocks))
+         if nbytes == nblocks * block_size then
+            -- the chain was filled: next time read more at once
+            for i=nblocks+1,util.min(nblocks * 2, M.READV_BLOCKS) do
+               add_block()
+            end
+         end
+         local i = 1
+         while nbytes > 0 do
+            local n = util.min(nbytes, block_size)
+            write_fully(s2, blocks[i], n)
+            nbytes = nbytes - n
+            i = i + 1
+         end
       end
    end)
+   for i=1,#blocks do
+      mm.ret_block(blocks[i], block_size)
+   end
+   if not ok then
+      util.throw(err)
+   end
+end
+
+function M.copy(s1, s2)
+   s1 = make_stream(s1)
+   s2 = make_stream(s2)
+   if not zero_copy(s1, s2) then
+      buffered_copy(s1, s2)
+   end
 end
 
 function M.pipe(s1, s2)
@@ -464,8 +961,17 @@ end
 function M.tap(s, callback)
    s = make_stream(s)
    local self = {}
-   function self:read1(ptr, size)
-      local bytes_read = s:read1(ptr, size)
+   -- data enters the (shared) read buffer via read1_raw(), so
+   -- tapping it there sees every byte exactly once
+   --
+   -- bytes already buffered by s (e.g. after a peek()) came in
+   -- before the tap: they are passed to the callback right away
+   local rb = s.read_buffer
+   if rb:length() > 0 then
+      callback(rb:ptr(), rb:length())
+   end
+   function self:read1_raw(ptr, size)
+      local bytes_read = s:read1_raw(ptr, size)
       callback(ptr, bytes_read)
       return bytes_read
    end
@@ -69,6 +69,39 @@ testing("read_until keeping marker", function()
    assert.equals(s:read_until(',', true), ' he said.')
 end)
 
+testing("read_until returns views into the read buffer", function()
+   local s = stream("first,second,third")
+   local part = s:read_until(',')
+   assert.equals(part, "first")
+   -- no copy: the view is only valid until the next read
+   assert.equals(part.cap, 0)
+   assert.equals(buffer.copy(s:read_until(',')), "second")
+   assert.equals(s:read(), "third")
+end)
+
+testing("readln across many reads", function()
+   -- lines of varying length, some longer than the read block size
+   local lines = {}
+   for i=1,200 do
+      lines[i] = string.rep(string.char(65+i%26), (i*97) % (stream.READ_BLOCK_SIZE*2))
+   end
+   local sock1,sock2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   sched(function()
+      local s1 = stream(sock1)
+      for i=1,#lines do
+         s1:writeln(lines[i])
+      end
+      s1:close()
+   end)
+   local s2 = stream(sock2)
+   for i=1,#lines do
+      assert.equals(s2:readln(), lines[i])
+   end
+   assert.equals(s2:readln(), "")
+   assert(s2:eof())
+   s2:close()
+end)
+
 testing("match", function()
    local s = stream("The realization that this universe is the body of God.")
    local m = s:match("real.*\\b(u.+?)\\b.*th")
@@ -307,6 +340,130 @@ testing:with_tmpdir("stream.pipe", function(ctx)
                  fs.readfile(fs.join(ctx.tmpdir, "out.jpg")))
 end)
 
+testing("stream.copy from a partially read file to a socket", function()
+   local data = fs.readfile("testdata/arborescence.jpg"):str()
+   local s1 = stream(fs.open("testdata/arborescence.jpg"))
+   local a,b = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local s2 = stream(a)
+   -- the rest of the read buffer must be sent before the file data
+   s1:peek(1)
+   assert.equals(s1:read(100), data:sub(1,100))
+   sched(function()
+      stream.copy(s1, s2)
+      assert(s1:eof())
+      s2:close()
+   end)
+   local output = stream(b):read(0)
+   s1:close()
+   b:close()
+   assert.equals(output, data:sub(101))
+end)
+
+testing:with_tmpdir("stream.copy from a socket to a file", function(ctx)
+   local data = fs.readfile("testdata/arborescence.jpg"):str()
+   local path = fs.join(ctx.tmpdir, "out.jpg")
+   local a,b = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   sched(function()
+      local s = stream(a)
+      s:write(data)
+      s:close()
+   end)
+   local f = fs.open(path, "w")
+   stream.copy(b, f)
+   f:close()
+   b:close()
+   assert.equals(fs.readfile(path), data)
+end)
+
+testing:with_tmpdir("stream.copy to a file opened for appending", function(ctx)
+   local path = fs.join(ctx.tmpdir, "out")
+   fs.writefile(path, "head:")
+   local a,b = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   sched(function()
+      local s = stream(a)
+      s:write("tail")
+      s:close()
+   end)
+   local f = fs.open(path, "a")
+   stream.copy(b, f)
+   f:close()
+   b:close()
+   assert.equals(fs.readfile(path), "head:tail")
+end)
+
+testing("stream.copy through a tap", function()
+   local data = fs.readfile("testdata/arborescence.jpg"):str()
+   local a,b = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local seen = 0
+   local s1 = stream.tap(fs.open("testdata/arborescence.jpg"), function(ptr, size)
+      seen = seen + size
+   end)
+   sched(function()
+      stream.copy(s1, a)
+      a:close()
+   end)
+   local output = stream(b):read(0)
+   s1:close()
+   b:close()
+   -- taps see the data, so the copy goes through user space
+   assert.equals(seen, #data)
+   assert.equals(output, data)
+end)
+
+testing("read size adapts to the stream", function()
+   local data = fs.readfile("testdata/arborescence.jpg")
+   local s = stream(fs.open("testdata/arborescence.jpg"))
+   assert.equals(s.read_buffer:block_size(), stream.READ_BLOCK_SIZE)
+   -- each read() which fills the buffer doubles the next read
+   assert.equals(#s:read(), stream.READ_BLOCK_SIZE)
+   assert.equals(#s:read(), stream.READ_BLOCK_SIZE * 2)
+   assert.equals(s.read_buffer:block_size(), stream.READ_BLOCK_SIZE * 4)
+   local rest = s:read(0)
+   assert.equals(stream.READ_BLOCK_SIZE * 3 + #rest, #data)
+   s:close()
+   -- short reads do not grow the buffer
+   local a,b = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local s1, s2 = stream(a), stream(b)
+   s1:write("hello")
+   assert.equals(s2:read(), "hello")
+   assert.equals(s2.read_buffer:block_size(), stream.READ_BLOCK_SIZE)
+   s1:close()
+   s2:close()
+end)
+
+testing("readv", function()
+   local data = fs.readfile("testdata/arborescence.jpg"):str()
+   local s = stream(fs.open("testdata/arborescence.jpg"))
+   local b1 = buffer.new(100)
+   local b2 = buffer.new(200)
+   local iov = ffi.new("struct iovec[2]")
+   iov[0].iov_base = b1.ptr
+   iov[0].iov_len = 100
+   iov[1].iov_base = b2.ptr
+   iov[1].iov_len = 200
+   -- a single read fills both buffers
+   assert.equals(s:readv(iov, 2), 300)
+   b1.len = 100
+   b2.len = 200
+   assert.equals(b1, data:sub(1,100))
+   assert.equals(b2, data:sub(101,300))
+   -- buffered data comes first
+   assert.equals(s:peek(5), data:sub(301,305))
+   assert.equals(s:readv(iov, 2), 100)
+   b1.len = 100
+   assert.equals(b1, data:sub(301,400))
+   s:close()
+end)
+
+testing("stream.copy to a memory stream", function()
+   local data = fs.readfile("testdata/arborescence.jpg")
+   local s1 = stream(fs.open("testdata/arborescence.jpg"))
+   local s2 = stream()
+   stream.copy(s1, s2)
+   s1:close()
+   assert.equals(s2:read(0), data)
+end)
+
 testing("stream.with_size", function()
    local f = fs.open("testdata/arborescence.jpg")
    s = stream.with_size(20, f)
@@ -351,6 +508,17 @@ testing("stream.tap", function()
    assert.equals(#output_buf, compressed_size)
 end)
 
+testing("stream.tap of a stream with buffered data", function()
+   local s = stream("hello, world")
+   assert.equals(s:peek(5), "hello")
+   local seen = buffer.new()
+   s = stream.tap(s, function(ptr, len)
+      seen:append(ptr, len)
+   end)
+   assert.equals(s:read(), "hello, world")
+   assert.equals(seen:str(), "hello, world")
+end)
+
 testing("stream.no_close", function()
    local f = fs.open("testdata/arborescence.jpg")
    local s = stream(f)
@@ -382,3 +550,113 @@ testing("reading characters from pipe wrapped via fs.fd()", function()
    s1:close()
    s2:close()
 end)
+
+-- stream implementation which records the syscalls it would make
+local function CountingSink(with_writev)
+   local sink = {
+      output = buffer.new(),
+      write1_calls = 0,
+      writev_calls = 0,
+   }
+   function sink:write1(ptr, size)
+      self.write1_calls = self.write1_calls + 1
+      self.output:append(ptr, size)
+      return size
+   end
+   if with_writev then
+      function sink:writev(iov, iovcnt)
+         self.writev_calls = self.writev_calls + 1
+         local nbytes = 0
+         for i=0,iovcnt-1 do
+            local len = tonumber(iov[i].iov_len)
+            self.output:append(iov[i].iov_base, len)
+            nbytes = nbytes + len
+         end
+         return nbytes
+      end
+   end
+   function sink:close()
+   end
+   return sink
+end
+
+testing("write buffering", function()
+   local sink = CountingSink(true)
+   local s = stream(sink):buffer_writes(64)
+   s:write("hello")
+   s:writeln(", world!")
+   assert.equals(sink.write1_calls, 0)
+   s:flush()
+   -- a single queued buffer is written via write1()
+   assert.equals(sink.write1_calls, 1)
+   assert.equals(sink.output, "hello, world!\n")
+   -- flushing an empty queue is a noop
+   s:flush()
+   assert.equals(sink.write1_calls, 1)
+   -- writes are flushed when the queue is full
+   for i=1,10 do
+      s:write("0123456789")
+   end
+   assert.equals(sink.write1_calls, 2)
+   assert.equals(#sink.output, 14+70)
+   -- close() flushes
+   s:close()
+   assert.equals(sink.write1_calls, 3)
+   assert.equals(#sink.output, 14+100)
+end)
+
+testing("write buffering with writev", function()
+   local sink = CountingSink(true)
+   local s = stream(sink):buffer_writes()
+   local body = string.rep("x", stream.WRITE_COPY_THRESHOLD)
+   s:writeln("HTTP/1.1 200 OK")
+   s:writeln("")
+   -- long strings are queued by reference
+   s:write(body)
+   s:write("trailer")
+   s:flush()
+   assert.equals(sink.write1_calls, 0)
+   assert.equals(sink.writev_calls, 1)
+   assert.equals(sink.output, "HTTP/1.1 200 OK\n\n"..body.."trailer")
+   -- writes at least as large as the buffer bypass the queue
+   sink.output.len = 0
+   local big = string.rep("y", stream.WRITE_BUFFER_SIZE)
+   s:write(buffer.copy("z"))
+   s:write(buffer.copy(big))
+   assert.equals(sink.output, "z"..big)
+   assert.equals(sink.writev_calls, 1)
+   assert.equals(sink.write1_calls, 2)
+   -- buffer_writes(0) flushes and turns buffering off
+   s:write("a")
+   s:buffer_writes(0)
+   s:write("b")
+   assert.equals(sink.output, "z"..big.."ab")
+end)
+
+testing("reading flushes pending writes", function()
+   local sock1,sock2 = net.socketpair(net.PF_LOCAL, net.SOCK_STREAM)
+   local s1 = stream(sock1):buffer_writes()
+   local s2 = stream(sock2):buffer_writes()
+   sched(function()
+      -- the ping stays in the queue until s2 starts reading
+      assert.equals(s2:readln(), "ping")
+      s2:writeln("pong")
+      s2:close()
+   end)
+   s1:writeln("ping")
+   assert.equals(s1:readln(), "pong")
+   s1:close()
+end)
+
+testing:with_tmpdir("writev to files", function(ctx)
+   local path = fs.join(ctx.tmpdir, "data")
+   local s = stream(fs.open(path, "w")):buffer_writes()
+   local parts = {}
+   for i=1,100 do
+      local part = string.rep(string.char(64+i%26), 100+i)
+      table.insert(parts, part)
+      s:write(part)
+   end
+   s:close()
+   assert.equals(fs.readfile(path), table.concat(parts))
+end)
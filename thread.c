@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "thread.h"
+
+static int traceback(lua_State *L) {
+  if (!lua_isstring(L, 1)) {
+    if (lua_isnoneornil(L, 1) ||
+        !luaL_callmeta(L, 1, "__tostring") ||
+        !lua_isstring(L, -1))
+      return 1;
+    lua_remove(L, 1);
+  }
+  luaL_traceback(L, L, lua_tostring(L, 1), 1);
+  return 1;
+}
+
+static int thread_pmain(lua_State *L) {
+  zz_thread *t = (zz_thread*) lua_touserdata(L, 1);
+  /* the same libraries as in the main state (see _main.tpl.c) */
+  lua_gc(L, LUA_GCSTOP, 0);
+  luaopen_base(L);
+  luaopen_math(L);
+  luaopen_string(L);
+  luaopen_table(L);
+  luaopen_io(L);
+  luaopen_os(L);
+  luaopen_package(L);
+  luaopen_debug(L);
+  luaopen_bit(L);
+  luaopen_jit(L);
+  luaopen_ffi(L);
+  lua_gc(L, LUA_GCRESTART, -1);
+  lua_newtable(L);
+  lua_setglobal(L, "arg");
+  lua_pushlightuserdata(L, t->arg);
+  lua_setglobal(L, "ZZ_THREAD_ARG");
+  lua_pushcfunction(L, traceback);
+  lua_getglobal(L, "require");
+  lua_pushstring(L, "_main");
+  if (lua_pcall(L, 1, 0, -3) != 0) {
+    const char *msg = lua_tostring(L, -1);
+    fprintf(stderr, "thread: %s\n", msg ? msg : "(error object is not a string)");
+    fflush(stderr);
+    t->status = 1;
+  }
+  return 0;
+}
+
+static void *thread_main(void *arg) {
+  zz_thread *t = (zz_thread*) arg;
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    fprintf(stderr, "thread: cannot create Lua state: not enough memory\n");
+    t->status = 1;
+  }
+  else {
+    if (lua_cpcall(L, thread_pmain, t) != 0) {
+      fprintf(stderr, "thread: %s\n", lua_tostring(L, -1));
+      t->status = 1;
+    }
+    lua_close(L);
+  }
+  __atomic_store_n(&t->exited, 1, __ATOMIC_RELEASE);
+  zz_trigger_fire(t->exit_trigger);
+  return NULL;
+}
+
+int zz_thread_create(zz_thread *t) {
+  t->status = 0;
+  t->exited = 0;
+  return pthread_create(&t->thread_id, NULL, thread_main, t);
+}
+
+int zz_thread_exited(zz_thread *t) {
+  return __atomic_load_n(&t->exited, __ATOMIC_ACQUIRE);
+}
+
+int zz_thread_join(zz_thread *t) {
+  return pthread_join(t->thread_id, NULL);
+}
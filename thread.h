@@ -0,0 +1,28 @@
+#ifndef ZZ_THREAD_H
+#define ZZ_THREAD_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "trigger.h"
+
+/* a Lua state running on its own pthread
+
+   the new state opens the standard libraries, stores `arg` in the
+   global ZZ_THREAD_ARG and loads the linked `_main` chunk, which
+   sets up require() and hands over to thread.lua */
+
+typedef struct {
+  pthread_t thread_id;
+  void *arg;
+  /* fired after the thread's Lua state has been closed */
+  zz_trigger *exit_trigger;
+  int status; /* 0: success, 1: the Lua code raised an error */
+  int exited;
+} zz_thread;
+
+int zz_thread_create(zz_thread *t);
+int zz_thread_exited(zz_thread *t);
+int zz_thread_join(zz_thread *t);
+
+#endif
@@ -0,0 +1,273 @@
+local ffi = require('ffi')
+local sched = require('sched')
+local msgqueue = require('msgqueue')
+local msgpack = require('msgpack')
+local process = require('process')
+local pthread = require('pthread') -- pthread_t
+local util = require('util')
+
+ffi.cdef [[
+
+typedef struct {
+  pthread_t thread_id;
+  void *arg;
+  zz_trigger *exit_trigger;
+  int status;
+  int exited;
+} zz_thread;
+
+int zz_thread_create(zz_thread *t);
+int zz_thread_exited(zz_thread *t);
+int zz_thread_join(zz_thread *t);
+
+/* passed to the thread in ZZ_THREAD_ARG */
+struct zz_thread_arg {
+  zz_msgqueue *down; /* parent -> thread */
+  zz_msgqueue *up;   /* thread -> parent */
+};
+
+uint64_t zz_trigger_wait(zz_trigger *t);
+
+]]
+
+-- worker threads
+--
+-- a thread is an independent Lua state running on its own pthread
+-- with its own scheduler. it loads a module (linked into the
+-- executable as bytecode) and calls one of its functions: by default
+-- `main(channel, ...)`
+--
+-- the parent and the thread talk via a pair of message queues:
+-- channel:send(msg) packs msg into the outgoing queue, channel:recv()
+-- unpacks the next message from the incoming one. messages are
+-- MessagePack-serialized, so they cannot carry functions, userdata
+-- or cdata (except buffers)
+--
+-- a full queue blocks the sending OS thread (and with it, the
+-- sender's scheduler) until the other side catches up
+
+local M = {}
+
+-- size of each message queue in bytes (also the max message size)
+M.QUEUE_SIZE = 1048576
+
+local Channel = util.Class()
+
+-- rq: the msgqueue we read from
+-- wq: the zz_msgqueue* we write to
+-- peer_exited: returns true if the other side is gone
+function Channel:new(rq, wq, peer_exited)
+   return {
+      rq = rq,
+      wq = wq,
+      peer_exited = peer_exited,
+   }
+end
+
+function Channel:send(msg)
+   local buf = msgpack.pack(msg)
+   -- a message must fit into the queue together with its slot header
+   local max_size = tonumber(self.wq.size) - ffi.sizeof("zz_msgqueue_slot")
+   if #buf > max_size then
+      ef("message too big: %d bytes (max: %d, see thread.QUEUE_SIZE)",
+         #buf, max_size)
+   end
+   ffi.C.zz_msgqueue_write(self.wq, buf.ptr, #buf)
+end
+
+function Channel:recv()
+   local rq = self.rq
+   while not rq:readable() do
+      if self.peer_exited() then
+         -- the peer may have written a message just before exiting
+         if not rq:readable() then
+            ef("thread exited")
+         end
+      elseif rq:prepare_sleep() then
+         if sched.ticking() then
+            rq.trig_r:wait()
+         else
+            ffi.C.zz_trigger_wait(rq.trig_r)
+         end
+         rq:finish_sleep()
+      end
+   end
+   return rq:unpack()
+end
+
+local Thread = util.Class()
+
+-- threads which have been started but not joined yet
+--
+-- keeps their queues alive while the thread may access them
+local live_threads = {}
+
+local function start_thread(modname, entry, ...)
+   local down = msgqueue(M.QUEUE_SIZE)
+   local up = msgqueue(M.QUEUE_SIZE)
+   local arg = ffi.new("struct zz_thread_arg", down.q, up.q)
+   local t = ffi.new("zz_thread")
+   t.arg = arg
+   -- the thread wakes up the parent when it exits
+   t.exit_trigger = up.trig_r
+   local function exited()
+      return ffi.C.zz_thread_exited(t) ~= 0
+   end
+   local self = Thread {
+      modname = modname,
+      t = t,
+      arg = arg,
+      down = down,
+      up = up,
+      channel = Channel(up, down.q, exited),
+      exited = exited,
+   }
+   -- the start message is the first one the thread receives
+   self.channel:send {
+      modname = modname,
+      entry = entry,
+      args = {...},
+      n = select('#', ...),
+   }
+   local rv = ffi.C.zz_thread_create(t)
+   if rv ~= 0 then
+      ef("cannot create thread: pthread_create() failed")
+   end
+   live_threads[self] = true
+   return self
+end
+
+-- starts a thread which runs `require(modname).main(channel, ...)`
+function M.start(modname, ...)
+   return start_thread(modname, "main", ...)
+end
+
+function Thread:send(msg)
+   self.channel:send(msg)
+end
+
+function Thread:recv()
+   return self.channel:recv()
+end
+
+-- waits until the thread exits and releases its resources
+--
+-- raises an error if the thread died because of an error
+function Thread:join()
+   if not live_threads[self] then
+      return
+   end
+   local t = self.t
+   if sched.ticking() then
+      -- do not block the scheduler in pthread_join()
+      local trig_r = self.up.trig_r
+      while not self.exited() do
+         trig_r:wait()
+      end
+   end
+   local rv = ffi.C.zz_thread_join(t)
+   if rv ~= 0 then
+      ef("cannot join thread: pthread_join() failed")
+   end
+   live_threads[self] = nil
+   self.down:delete()
+   self.up:delete()
+   if t.status ~= 0 then
+      ef("thread %s failed", self.modname)
+   end
+end
+
+-- runs in the new Lua state (see _main.tpl.lua)
+function M.run_child(arg)
+   arg = ffi.cast("struct zz_thread_arg*", arg)
+   -- the parent outlives us: it joins the thread before it releases
+   -- the queues
+   local channel = Channel(msgqueue.attach(arg.down), arg.up,
+                           function() return false end)
+   local start = channel:recv()
+   -- resolve the module the same way as the main module
+   local m = _G.require(start.modname)
+   local fn = type(m) == "table" and m[start.entry]
+   if type(fn) ~= "function" then
+      ef("module %s has no function %s", start.modname, start.entry)
+   end
+   local args = start.args
+   sched(function()
+      fn(channel, unpack(args, 1, start.n))
+   end)
+   sched()
+end
+
+-- parallel map
+--
+-- each worker receives {i, item} messages and replies with
+-- {i, true, result} or {i, false, err}. false means: no more items
+
+function M.map_worker(channel, modname, fname)
+   local m = _G.require(modname)
+   local fn = m
+   if fname then
+      fn = m[fname]
+   end
+   while true do
+      local msg = channel:recv()
+      if not msg then
+         break
+      end
+      local i, item = msg[1], msg[2]
+      local ok, result = pcall(fn, item)
+      if ok then
+         channel:send { i, true, result }
+      else
+         channel:send { i, false, tostring(result) }
+      end
+   end
+end
+
+-- returns { require(modname)[fname](item) for each item in items }
+--
+-- the calls are distributed over `nthreads` threads (default: number
+-- of online CPUs). if fname is nil, the module itself is called.
+-- items and results travel via message queues, so they must be
+-- serializable
+function M.map(modname, fname, items, nthreads)
+   local results = {}
+   if #items == 0 then
+      return results
+   end
+   nthreads = math.min(nthreads or process.nprocs(), #items)
+   local next_item = 1
+   local failure = nil
+   local threads = {}
+   local workers = {}
+   for w=1,nthreads do
+      -- thread.lua resolves to the core module in the thread too
+      local worker = start_thread(ZZ_PACKAGE.."/thread", "map_worker",
+                                  modname, fname)
+      workers[w] = worker
+      threads[w] = sched(function()
+         while not failure and next_item <= #items do
+            local i = next_item
+            next_item = next_item + 1
+            worker:send { i, items[i] }
+            local reply = worker:recv()
+            if reply[2] then
+               results[reply[1]] = reply[3]
+            else
+               failure = reply[3]
+            end
+         end
+         worker:send(false)
+      end)
+   end
+   sched.join(threads)
+   for _,worker in ipairs(workers) do
+      worker:join()
+   end
+   if failure then
+      ef("thread.map(%s, %s) failed: %s", modname, tostring(fname), failure)
+   end
+   return results
+end
+
+return M
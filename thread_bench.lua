@@ -0,0 +1,50 @@
+-- thread: parallel map over a growing number of threads
+--
+-- usage: zz run thread_bench.lua
+
+local thread = require('thread')
+local process = require('process')
+local sha1 = require('sha1')
+local time = require('time')
+
+local M = {}
+
+local N = 64
+local ITEM_SIZE = 65536
+
+local function bench(items, nthreads)
+   local t0 = time.time()
+   local results = thread.map("sha1", "sha1", items, nthreads)
+   local elapsed = time.time() - t0
+   assert(#results == #items)
+   pf("sha1 x %d (%d KiB), %2d threads %10.3f ms %8.1f MiB/s",
+      #items, ITEM_SIZE / 1024, nthreads, elapsed * 1000,
+      #items * ITEM_SIZE / 1048576 / elapsed)
+   return results
+end
+
+function M.main()
+   local items = {}
+   for i=1,N do
+      items[i] = string.rep(string.char(i), ITEM_SIZE)
+   end
+   local t0 = time.time()
+   for i=1,N do
+      sha1.sha1(items[i])
+   end
+   local elapsed = time.time() - t0
+   pf("sha1 x %d (%d KiB), main state %10.3f ms %8.1f MiB/s",
+      N, ITEM_SIZE / 1024, elapsed * 1000,
+      N * ITEM_SIZE / 1048576 / elapsed)
+   local nprocs = process.nprocs()
+   local nthreads = 1
+   while true do
+      bench(items, nthreads)
+      if nthreads == nprocs then
+         break
+      end
+      nthreads = math.min(nthreads * 2, nprocs)
+   end
+end
+
+return M
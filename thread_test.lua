@@ -0,0 +1,59 @@
+local testing = require('testing')('thread')
+local thread = require('thread')
+local assert = require('assert')
+
+-- The `thread` module runs Lua code on other CPU cores: each thread
+-- is an independent Lua state (with its own scheduler) running on a
+-- separate pthread. Threads load a module linked into the
+-- executable and talk to their parent via message queues.
+--
+-- `thread.start(modname, ...)` calls `require(modname).main(channel,
+-- ...)` in a new thread. The parent uses `t:send(msg)` and
+-- `t:recv()`, the thread uses the same methods of `channel`.
+-- `t:join()` waits for the thread to exit.
+--
+-- `thread.map(modname, fname, items, nthreads)` applies
+-- `require(modname)[fname]` to each item using a pool of threads.
+
+testing("map", function()
+   local items = { "ab", "cd", "ef", "\x00\xff" }
+   assert.equals(thread.map("util", "hexstr", items, 2),
+                 { "6162", "6364", "6566", "00ff" })
+   -- at most one thread per item
+   assert.equals(thread.map("util", "hexstr", { "zz" }, 8), { "7a7a" })
+   assert.equals(thread.map("util", "hexstr", {}), {})
+end)
+
+testing("map error", function()
+   assert.throws("thread.map%(util, no_such_function%) failed", function()
+      thread.map("util", "no_such_function", { "x" })
+   end)
+end)
+
+testing("module without main", function()
+   local t = thread.start("util")
+   assert.throws("thread exited", function()
+      t:recv()
+   end)
+   assert.throws("thread util failed", function()
+      t:join()
+   end)
+end)
+
+testing("message too big", function()
+   local t = thread.start("util")
+   assert.throws("message too big", function()
+      t:send(string.rep("x", thread.QUEUE_SIZE))
+   end)
+   assert.throws("thread util failed", function()
+      t:join()
+   end)
+end)
+
+testing("many threads", function()
+   -- each thread registers its async workers again
+   for i=1,200 do
+      assert.equals(thread.map("util", "hexstr", { "a", "b" }, 2),
+                    { "61", "62" })
+   end
+end)
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* minimal io_uring driver: we talk to the kernel via raw syscalls
+   to avoid a dependency on liburing
+
+   the submission queue is filled by the scheduler thread only, so
+   the local tail needs no synchronization. SQEs are published to
+   the kernel in batches by zz_uring_submit() */
+
+typedef struct zz_uring {
+  int fd;
+  int event_fd;
+  /* submission queue */
+  void *sq_ptr;
+  size_t sq_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sqe_tail; /* local tail, published at submit */
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  /* completion queue */
+  void *cq_ptr;
+  size_t cq_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  unsigned cq_entries;
+  struct io_uring_cqe *cqes;
+} zz_uring;
+
+struct zz_uring_completion {
+  uint64_t user_data;
+  int32_t res;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* the opcodes used by the fs module */
+static const int required_ops[] = {
+  IORING_OP_READ,
+  IORING_OP_WRITE,
+  IORING_OP_READV,
+  IORING_OP_WRITEV,
+  IORING_OP_OPENAT,
+  IORING_OP_STATX,
+  IORING_OP_CLOSE,
+  -1
+};
+
+static bool probe_ops(int fd) {
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  if (!probe) {
+    return false;
+  }
+  bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (int i = 0; ok && required_ops[i] >= 0; i++) {
+    int op = required_ops[i];
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      ok = false;
+    }
+  }
+  free(probe);
+  return ok;
+}
+
+void zz_uring_destroy(zz_uring *r) {
+  if (r->sqes && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqes_size);
+  }
+  if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_size);
+  }
+  if (r->sq_ptr && r->sq_ptr != MAP_FAILED) {
+    munmap(r->sq_ptr, r->sq_size);
+  }
+  if (r->event_fd >= 0) {
+    close(r->event_fd);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  free(r);
+}
+
+/* returns NULL (with errno set) if io_uring is not usable */
+zz_uring *zz_uring_create(unsigned entries) {
+  zz_uring *r = calloc(1, sizeof(zz_uring));
+  if (!r) {
+    return NULL;
+  }
+  r->fd = -1;
+  r->event_fd = -1;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = io_uring_setup(entries, &p);
+  if (r->fd < 0) {
+    goto fail;
+  }
+  /* reads/writes at offset -1 must use (and update) the file position */
+  if (!(p.features & IORING_FEAT_RW_CUR_POS) || !probe_ops(r->fd)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size) {
+      r->sq_size = r->cq_size;
+    }
+    r->cq_size = r->sq_size;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ptr = r->sq_ptr;
+  }
+  else {
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      goto fail;
+    }
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    goto fail;
+  }
+  uint8_t *sq = r->sq_ptr;
+  r->sq_head = (unsigned*) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*) (sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->sqe_tail = *r->sq_tail;
+  uint8_t *cq = r->cq_ptr;
+  r->cq_head = (unsigned*) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  r->cq_entries = p.cq_entries;
+  r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  /* the scheduler polls this fd. we reap right after submitting, so
+     it is enough to be notified about asynchronous completions */
+  r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->event_fd < 0) {
+    goto fail;
+  }
+  if (io_uring_register(r->fd, IORING_REGISTER_EVENTFD_ASYNC, &r->event_fd, 1) != 0 &&
+      io_uring_register(r->fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) != 0) {
+    goto fail;
+  }
+  return r;
+fail:
+  {
+    int saved_errno = errno;
+    zz_uring_destroy(r);
+    errno = saved_errno;
+  }
+  return NULL;
+}
+
+int zz_uring_event_fd(zz_uring *r) {
+  return r->event_fd;
+}
+
+unsigned zz_uring_cq_entries(zz_uring *r) {
+  return r->cq_entries;
+}
+
+/* resets the eventfd after a notification */
+void zz_uring_drain_event_fd(zz_uring *r) {
+  uint64_t count;
+  while (read(r->event_fd, &count, sizeof(count)) == sizeof(count));
+}
+
+/* returns NULL if the submission queue is full */
+static struct io_uring_sqe *get_sqe(zz_uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (r->sqe_tail - head >= r->sq_entries) {
+    return NULL;
+  }
+  unsigned index = r->sqe_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  r->sqe_tail++;
+  return sqe;
+}
+
+static bool prep_rw(zz_uring *r, uint64_t user_data, int op, int fd,
+                    const void *addr, unsigned len, uint64_t offset,
+                    struct io_uring_sqe **psqe) {
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = (uint8_t) op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  if (psqe) {
+    *psqe = sqe;
+  }
+  return true;
+}
+
+/* offset -1 means: use the current file position */
+bool zz_uring_prep_read(zz_uring *r, uint64_t user_data, int fd, void *buf,
+                        unsigned nbytes, int64_t offset) {
+  return prep_rw(r, user_data, IORING_OP_READ, fd, buf, nbytes, (uint64_t) offset, NULL);
+}
+
+bool zz_uring_prep_write(zz_uring *r, uint64_t user_data, int fd, const void *buf,
+                         unsigned nbytes, int64_t offset) {
+  return prep_rw(r, user_data, IORING_OP_WRITE, fd, buf, nbytes, (uint64_t) offset, NULL);
+}
+
+bool zz_uring_prep_readv(zz_uring *r, uint64_t user_data, int fd,
+                         const struct iovec *iov, int iovcnt, int64_t offset) {
+  return prep_rw(r, user_data, IORING_OP_READV, fd, iov, (unsigned) iovcnt, (uint64_t) offset, NULL);
+}
+
+bool zz_uring_prep_writev(zz_uring *r, uint64_t user_data, int fd,
+                          const struct iovec *iov, int iovcnt, int64_t offset) {
+  return prep_rw(r, user_data, IORING_OP_WRITEV, fd, iov, (unsigned) iovcnt, (uint64_t) offset, NULL);
+}
+
+bool zz_uring_prep_openat(zz_uring *r, uint64_t user_data, int dfd,
+                          const char *path, int flags, mode_t mode) {
+  struct io_uring_sqe *sqe;
+  if (!prep_rw(r, user_data, IORING_OP_OPENAT, dfd, path, mode, 0, &sqe)) {
+    return false;
+  }
+  sqe->open_flags = (uint32_t) flags;
+  return true;
+}
+
+bool zz_uring_prep_statx(zz_uring *r, uint64_t user_data, int dfd,
+                         const char *path, int flags, unsigned mask, void *statxbuf) {
+  struct io_uring_sqe *sqe;
+  if (!prep_rw(r, user_data, IORING_OP_STATX, dfd, path, mask,
+               (uint64_t) (uintptr_t) statxbuf, &sqe)) {
+    return false;
+  }
+  sqe->statx_flags = (uint32_t) flags;
+  return true;
+}
+
+bool zz_uring_prep_close(zz_uring *r, uint64_t user_data, int fd) {
+  return prep_rw(r, user_data, IORING_OP_CLOSE, fd, NULL, 0, 0, NULL);
+}
+
+/* number of prepared SQEs which have not been consumed by the kernel */
+unsigned zz_uring_pending(zz_uring *r) {
+  return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* hands over all prepared SQEs to the kernel in a single syscall
+
+   returns the number of submitted SQEs or -1 (errno is set) */
+int zz_uring_submit(zz_uring *r) {
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  unsigned to_submit = zz_uring_pending(r);
+  if (to_submit == 0) {
+    return 0;
+  }
+  int rv;
+  do {
+    rv = io_uring_enter(r->fd, to_submit, 0, 0);
+  } while (rv < 0 && errno == EINTR);
+  return rv;
+}
+
+/* copies at most `max` completions into `out`, returns their number */
+int zz_uring_reap(zz_uring *r, struct zz_uring_completion *out, int max) {
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned mask = *r->cq_mask;
+  int n = 0;
+  while (head != tail && n < max) {
+    struct io_uring_cqe *cqe = &r->cqes[head & mask];
+    out[n].user_data = cqe->user_data;
+    out[n].res = cqe->res;
+    n++;
+    head++;
+  }
+  if (n > 0) {
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return n;
+}
@@ -0,0 +1,248 @@
+local ffi = require('ffi')
+local sched = require('sched')
+local util = require('util')
+local errno = require('errno')
+
+ffi.cdef [[
+
+struct statx_timestamp {
+  int64_t  tv_sec;
+  uint32_t tv_nsec;
+  int32_t  __reserved;
+};
+
+struct statx {
+  uint32_t stx_mask;
+  uint32_t stx_blksize;
+  uint64_t stx_attributes;
+  uint32_t stx_nlink;
+  uint32_t stx_uid;
+  uint32_t stx_gid;
+  uint16_t stx_mode;
+  uint16_t __spare0[1];
+  uint64_t stx_ino;
+  uint64_t stx_size;
+  uint64_t stx_blocks;
+  uint64_t stx_attributes_mask;
+  struct statx_timestamp stx_atime;
+  struct statx_timestamp stx_btime;
+  struct statx_timestamp stx_ctime;
+  struct statx_timestamp stx_mtime;
+  uint32_t stx_rdev_major;
+  uint32_t stx_rdev_minor;
+  uint32_t stx_dev_major;
+  uint32_t stx_dev_minor;
+  uint64_t __spare2[14];
+};
+
+enum {
+  ZZ_URING_AT_FDCWD            = -100,
+  ZZ_URING_AT_SYMLINK_NOFOLLOW = 0x100,
+  ZZ_URING_STATX_BASIC_STATS   = 0x7ff
+};
+
+typedef struct zz_uring zz_uring;
+
+struct zz_uring_completion {
+  uint64_t user_data;
+  int32_t res;
+};
+
+zz_uring *zz_uring_create(unsigned entries);
+int zz_uring_event_fd(zz_uring *r);
+unsigned zz_uring_cq_entries(zz_uring *r);
+void zz_uring_drain_event_fd(zz_uring *r);
+
+bool zz_uring_prep_read(zz_uring *r, uint64_t user_data, int fd, void *buf,
+                        unsigned nbytes, int64_t offset);
+bool zz_uring_prep_write(zz_uring *r, uint64_t user_data, int fd, const void *buf,
+                         unsigned nbytes, int64_t offset);
+bool zz_uring_prep_readv(zz_uring *r, uint64_t user_data, int fd,
+                         const struct iovec *iov, int iovcnt, int64_t offset);
+bool zz_uring_prep_writev(zz_uring *r, uint64_t user_data, int fd,
+                          const struct iovec *iov, int iovcnt, int64_t offset);
+bool zz_uring_prep_openat(zz_uring *r, uint64_t user_data, int dfd,
+                          const char *path, int flags, mode_t mode);
+bool zz_uring_prep_statx(zz_uring *r, uint64_t user_data, int dfd,
+                         const char *path, int flags, unsigned mask, struct statx *statxbuf);
+bool zz_uring_prep_close(zz_uring *r, uint64_t user_data, int fd);
+
+unsigned zz_uring_pending(zz_uring *r);
+int zz_uring_submit(zz_uring *r);
+int zz_uring_reap(zz_uring *r, struct zz_uring_completion *out, int max);
+void zz_uring_destroy(zz_uring *r);
+
+]]
+
+-- io_uring based fs engine
+--
+-- operations are prepared in the submission queue by the calling
+-- thread which then waits for the completion event. the scheduler
+-- tick submits all prepared operations with a single syscall and
+-- turns completions into events
+--
+-- the return values follow the conventions of util.check_errno():
+-- rv is -1 on failure and the second return value is the errno
+
+local M = {}
+
+-- set to false to force the async thread pool
+M.enabled = true
+
+-- number of submission queue entries
+M.ENTRIES = 256
+
+-- max number of completions reaped in one go
+local REAP_BATCH = 256
+
+-- nil: not created yet, false: io_uring is not available
+local ring = nil
+
+-- number of operations submitted but not yet completed
+local inflight = 0
+
+local completions = ffi.new("struct zz_uring_completion[?]", REAP_BATCH)
+
+local function create_ring()
+   local r = ffi.C.zz_uring_create(M.ENTRIES)
+   if r == nil then
+      return false
+   end
+   local efd = ffi.C.zz_uring_event_fd(r)
+   sched.poller_add(efd, "r")
+   sched.background(function()
+      while true do
+         sched.poll(efd, "r")
+         ffi.C.zz_uring_drain_event_fd(r)
+      end
+   end)
+   return r
+end
+
+-- returns true if fs operations shall be submitted to io_uring
+function M.available()
+   if not M.enabled or not sched.ticking() then
+      return false
+   end
+   if ring == nil then
+      ring = create_ring()
+   end
+   return ring ~= false
+end
+
+local function submit()
+   local rv = ffi.C.zz_uring_submit(ring)
+   if rv < 0 then
+      local errnum = errno.errno()
+      -- EAGAIN/EBUSY: the kernel is out of resources or the
+      -- completion queue overflowed, we retry in the next tick
+      if errnum ~= ffi.C.EAGAIN and errnum ~= ffi.C.EBUSY then
+         util.check_errno("io_uring_enter", rv, errnum)
+      end
+   end
+end
+
+local function reap()
+   local n
+   repeat
+      n = ffi.C.zz_uring_reap(ring, completions, REAP_BATCH)
+      for i=0,n-1 do
+         local c = completions[i]
+         sched.emit(-tonumber(c.user_data), c.res)
+      end
+      inflight = inflight - n
+   until n < REAP_BATCH
+end
+
+-- runs `prep(ring, user_data, ...)` and waits for the completion
+local function request(prep, ...)
+   local event_id = sched.make_event_id()
+   while true do
+      -- do not submit more operations than the completion queue can hold
+      while inflight >= ffi.C.zz_uring_cq_entries(ring) do
+         sched.yield()
+      end
+      if prep(ring, -event_id, ...) then
+         break
+      end
+      -- submission queue is full: submit it and let the scheduler
+      -- reap completions (submit may fail with EAGAIN/EBUSY until
+      -- then, retrying without yielding would spin)
+      submit()
+      sched.yield()
+   end
+   inflight = inflight + 1
+   local res = sched.wait(event_id)
+   if res < 0 then
+      return -1, -res
+   else
+      return res
+   end
+end
+
+-- offset -1 means: read at (and advance) the current file position
+function M.read(fd, buf, nbytes, offset)
+   return request(ffi.C.zz_uring_prep_read, fd, buf, nbytes, offset or -1)
+end
+
+function M.write(fd, buf, nbytes, offset)
+   return request(ffi.C.zz_uring_prep_write, fd, buf, nbytes, offset or -1)
+end
+
+function M.readv(fd, iov, iovcnt, offset)
+   return request(ffi.C.zz_uring_prep_readv, fd, iov, iovcnt, offset or -1)
+end
+
+function M.writev(fd, iov, iovcnt, offset)
+   return request(ffi.C.zz_uring_prep_writev, fd, iov, iovcnt, offset or -1)
+end
+
+function M.open(path, flags, mode)
+   return request(ffi.C.zz_uring_prep_openat, ffi.C.ZZ_URING_AT_FDCWD, path, flags, mode)
+end
+
+function M.statx(path, flags, statxbuf)
+   return request(ffi.C.zz_uring_prep_statx, ffi.C.ZZ_URING_AT_FDCWD, path, flags,
+                  ffi.C.ZZ_URING_STATX_BASIC_STATS, statxbuf)
+end
+
+function M.close(fd)
+   return request(ffi.C.zz_uring_prep_close, fd)
+end
+
+local function UringModule(sched)
+   local self = {}
+   function self.init()
+      ring = nil
+      inflight = 0
+   end
+   function self.tick()
+      if ring then
+         -- one syscall for all operations prepared since the last tick
+         if ffi.C.zz_uring_pending(ring) > 0 then
+            submit()
+         end
+         -- operations served from the page cache complete during
+         -- submission, their waiters can run in this tick
+         reap()
+      end
+   end
+   function self.done()
+      if ring then
+         sched.poller_del(ffi.C.zz_uring_event_fd(ring))
+         if inflight > 0 then
+            -- the kernel may still write into buffers of these
+            -- operations, so we leak the ring
+            pf("WARNING: uring.inflight = %d at scheduler shutdown", inflight)
+         else
+            ffi.C.zz_uring_destroy(ring)
+         end
+      end
+      ring = nil
+   end
+   return self
+end
+
+sched.register_module(UringModule)
+
+return M
@@ -0,0 +1,91 @@
+local testing = require('testing')('uring')
+local ffi = require('ffi')
+local bit = require('bit')
+local uring = require('uring')
+local fs = require('fs')
+local sched = require('sched')
+local assert = require('assert')
+local util = require('util')
+
+-- on kernels without io_uring support these tests have nothing to do
+
+testing("open, read, close", function()
+   if not uring.available() then return end
+   local fd, _errno = uring.open("testdata/hello.txt", ffi.C.O_RDONLY, 0)
+   assert(fd >= 0)
+   local buf = ffi.new("uint8_t[64]")
+   -- offset -1: read from the current file position
+   assert.equals(uring.read(fd, buf, 5), 5)
+   assert.equals(ffi.string(buf, 5), "hello")
+   assert.equals(uring.read(fd, buf, 64), 9)
+   assert.equals(ffi.string(buf, 9), ", world!\n")
+   assert.equals(uring.read(fd, buf, 64), 0)
+   -- explicit offset
+   assert.equals(uring.read(fd, buf, 5, 7), 5)
+   assert.equals(ffi.string(buf, 5), "world")
+   assert.equals(uring.close(fd), 0)
+end)
+
+testing("errors", function()
+   if not uring.available() then return end
+   local fd, _errno = uring.open("nonexistentfile", ffi.C.O_RDONLY, 0)
+   assert.equals(fd, -1)
+   assert.equals(_errno, ffi.C.ENOENT)
+   local rv, _errno = uring.close(-1)
+   assert.equals(rv, -1)
+   assert.equals(_errno, ffi.C.EBADF)
+end)
+
+testing("statx", function()
+   if not uring.available() then return end
+   local stx = ffi.new("struct statx")
+   assert.equals(uring.statx("testdata/hello.txt", 0, stx), 0)
+   assert.equals(tonumber(stx.stx_size), 14)
+   -- fs.stat() converts statx to struct stat
+   local s = fs.stat("testdata/hello.txt")
+   assert.equals(s.size, 14)
+   assert.equals(fs.type("testdata/hello.txt"), "reg")
+   -- fs.lstat() does not follow symlinks
+   assert.equals(fs.type("testdata/hello.txt.symlink"), "lnk")
+end)
+
+testing:with_tmpdir("write", function(ctx)
+   if not uring.available() then return end
+   local path = fs.join(ctx.tmpdir, "data.txt")
+   local flags = bit.bor(ffi.C.O_CREAT, ffi.C.O_WRONLY, ffi.C.O_TRUNC)
+   local fd = uring.open(path, flags, util.oct("644"))
+   assert(fd >= 0)
+   assert.equals(uring.write(fd, "hello, ", 7), 7)
+   assert.equals(uring.write(fd, "world!", 6), 6)
+   assert.equals(uring.close(fd), 0)
+   assert.equals(fs.readfile(path), "hello, world!")
+end)
+
+testing("concurrent reads", function()
+   if not uring.available() then return end
+   local contents = fs.readfile('testdata/arborescence.jpg')
+   local f = fs.open('testdata/arborescence.jpg')
+   local threads = {}
+   local n = 64
+   for i=1,n do
+      threads[i] = sched(function()
+         local offset = math.random(0, #contents-4096)
+         local buf = ffi.new("uint8_t[4096]")
+         assert.equals(uring.read(f.fd, buf, 4096, offset), 4096)
+         assert(ffi.string(buf, 4096) == contents:str(offset, 4096))
+      end)
+   end
+   sched.join(threads)
+   f:close()
+end)
+
+testing("fallback to the thread pool", function()
+   uring.enabled = false
+   local ok, err = pcall(function()
+      assert(not uring.available())
+      assert.equals(fs.readfile('testdata/hello.txt'), "hello, world!\n")
+      assert.equals(fs.stat('testdata/hello.txt').size, 14)
+   end)
+   uring.enabled = true
+   assert(ok, err)
+end)
@@ -5,36 +5,125 @@ local buffer = require('buffer')
 local M = {}
 
 -- List
+--
+-- a double-ended queue backed by a growable ring buffer
+--
+-- push(), pop(), shift() and unshift() are O(1): items never move
+-- when the list is modified at either end. the ring is stored in
+-- `_items` at 0-based slots [0, _cap), _cap is always a power of 2.
 
 local List_mt = {}
 
+local LIST_INITIAL_CAPACITY = 8
+
+function List_mt:_grow()
+   local items = self._items
+   local cap = self._cap
+   local mask = cap - 1
+   local head = self._head
+   local new_items = {}
+   for i=0,self._size-1 do
+      new_items[i] = items[bit.band(head + i, mask)]
+   end
+   self._items = new_items
+   self._cap = cap * 2
+   self._head = 0
+end
+
 function List_mt:push(item)
-   table.insert(self._items, item)
+   local size = self._size
+   if size == self._cap then
+      self:_grow()
+   end
+   self._items[bit.band(self._head + size, self._cap - 1)] = item
+   self._size = size + 1
 end
 
 function List_mt:pop()
-   return table.remove(self._items)
+   local size = self._size
+   if size == 0 then
+      return nil
+   end
+   size = size - 1
+   local items = self._items
+   local pos = bit.band(self._head + size, self._cap - 1)
+   local item = items[pos]
+   items[pos] = nil
+   self._size = size
+   return item
 end
 
 function List_mt:shift()
-   return table.remove(self._items, 1)
+   local size = self._size
+   if size == 0 then
+      return nil
+   end
+   local items = self._items
+   local head = self._head
+   local item = items[head]
+   items[head] = nil
+   self._head = bit.band(head + 1, self._cap - 1)
+   self._size = size - 1
+   return item
 end
 
 function List_mt:unshift(item)
-   table.insert(self._items, 1, item)
+   if self._size == self._cap then
+      self:_grow()
+   end
+   local head = bit.band(self._head - 1, self._cap - 1)
+   self._items[head] = item
+   self._head = head
+   self._size = self._size + 1
 end
 
 function List_mt:index(item)
-   for i=1, #self._items do
-      if self._items[i]==item then
-         return i-1
+   local items = self._items
+   local head = self._head
+   local mask = self._cap - 1
+   for i=0,self._size-1 do
+      if items[bit.band(head + i, mask)]==item then
+         return i
       end
    end
    return nil
 end
 
+function List_mt:insert_at(index, item)
+   -- O(n): moves the items at and after `index` one slot up
+   local size = self._size
+   if index < 0 or index > size then
+      ef("List:insert_at(): index out of range: %d", index)
+   end
+   if size == self._cap then
+      self:_grow()
+   end
+   local items = self._items
+   local head = self._head
+   local mask = self._cap - 1
+   for i=size-1,index,-1 do
+      items[bit.band(head + i + 1, mask)] = items[bit.band(head + i, mask)]
+   end
+   items[bit.band(head + index, mask)] = item
+   self._size = size + 1
+end
+
 function List_mt:remove_at(index)
-   return table.remove(self._items, index+1)
+   -- O(n): moves the items after `index` one slot down
+   local size = self._size
+   if index < 0 or index >= size then
+      return nil
+   end
+   local items = self._items
+   local head = self._head
+   local mask = self._cap - 1
+   local item = items[bit.band(head + index, mask)]
+   for i=index,size-2 do
+      items[bit.band(head + i, mask)] = items[bit.band(head + i + 1, mask)]
+   end
+   items[bit.band(head + size - 1, mask)] = nil
+   self._size = size - 1
+   return item
 end
 
 function List_mt:remove(item)
@@ -45,20 +134,28 @@ function List_mt:remove(item)
 end
 
 function List_mt:size()
-   return #self._items
+   return self._size
 end
 
 function List_mt:empty()
-   return #self._items == 0
+   return self._size == 0
 end
 
 function List_mt:clear()
    self._items = {}
+   self._head = 0
+   self._size = 0
+end
+
+local function list_get(self, pos)
+   if pos >= 0 and pos < self._size then
+      return self._items[bit.band(self._head + pos, self._cap - 1)]
+   end
 end
 
 function List_mt:__index(pos)
    if type(pos) == "number" then
-      return self._items[pos+1]
+      return list_get(self, pos)
    else
       return rawget(List_mt, pos)
    end
@@ -90,15 +187,18 @@ end
 function List_mt:__ipairs()
    local function iter(t,i)
       i = (i or 0) + 1
-      local v = self._items[i]
+      local v = list_get(self, i-1)
       if v then return i,v end
    end
-   return iter, self._items, nil
+   return iter, self, nil
 end
 
 function M.List()
    local self = {
-      _items = {}
+      _items = {},
+      _cap = LIST_INITIAL_CAPACITY,
+      _head = 0,
+      _size = 0,
    }
    return setmetatable(self, List_mt)
 end
@@ -108,29 +208,175 @@ end
 local OrderedList_mt = {}
 
 function OrderedList_mt:push(item)
-   local i = 1
-   while i <= #self._items and self.key_fn(item) > self.key_fn(self._items[i]) do
+   local key_fn = self.key_fn
+   local key = key_fn(item)
+   local size = self._size
+   local i = 0
+   while i < size and key > key_fn(list_get(self, i)) do
       i = i + 1
    end
-   table.insert(self._items, i, item)
+   self:insert_at(i, item)
 end
 
 function OrderedList_mt:__index(pos)
    if type(pos) == "number" then
-      return self._items[pos+1]
+      return list_get(self, pos)
    else
       return rawget(OrderedList_mt, pos) or rawget(List_mt, pos)
    end
 end
 
+OrderedList_mt.__ipairs = List_mt.__ipairs
+
 function M.OrderedList(key_fn)
    local self = {
       _items = {},
+      _cap = LIST_INITIAL_CAPACITY,
+      _head = 0,
+      _size = 0,
       key_fn = key_fn or function(x) return x end,
    }
    return setmetatable(self, OrderedList_mt)
 end
 
+-- Heap
+
+-- a binary min-heap ordered by numeric keys
+--
+-- push() is O(log n) and returns a handle (the heap node) which can
+-- be passed to remove() to take the item out of the heap before it
+-- reaches the top. items with equal keys come out in push order.
+
+local Heap_mt = {}
+Heap_mt.__index = Heap_mt
+
+local function heap_less(a, b)
+   return a.key < b.key or (a.key == b.key and a.seq < b.seq)
+end
+
+local function heap_set(nodes, i, node)
+   nodes[i] = node
+   node.index = i
+end
+
+function Heap_mt:_sift_up(i)
+   local nodes = self._nodes
+   local node = nodes[i]
+   while i > 1 do
+      local parent_index = bit.rshift(i, 1)
+      local parent = nodes[parent_index]
+      if not heap_less(node, parent) then
+         break
+      end
+      heap_set(nodes, i, parent)
+      i = parent_index
+   end
+   heap_set(nodes, i, node)
+end
+
+function Heap_mt:_sift_down(i)
+   local nodes = self._nodes
+   local size = self._size
+   local node = nodes[i]
+   while true do
+      local child_index = i * 2
+      if child_index > size then
+         break
+      end
+      local child = nodes[child_index]
+      local right = nodes[child_index+1]
+      if right and heap_less(right, child) then
+         child_index = child_index + 1
+         child = right
+      end
+      if not heap_less(child, node) then
+         break
+      end
+      heap_set(nodes, i, child)
+      i = child_index
+   end
+   heap_set(nodes, i, node)
+end
+
+function Heap_mt:push(item, key)
+   local seq = self._next_seq
+   self._next_seq = seq + 1
+   local size = self._size + 1
+   self._size = size
+   local node = { item = item, key = key, seq = seq, index = size }
+   self._nodes[size] = node
+   self:_sift_up(size)
+   return node
+end
+
+function Heap_mt:peek()
+   local top = self._nodes[1]
+   if top then
+      return top.item, top.key
+   end
+end
+
+function Heap_mt:_remove_at(i)
+   local nodes = self._nodes
+   local size = self._size
+   local node = nodes[i]
+   local last = nodes[size]
+   nodes[size] = nil
+   self._size = size - 1
+   if i < size then
+      heap_set(nodes, i, last)
+      if i > 1 and heap_less(last, nodes[bit.rshift(i, 1)]) then
+         self:_sift_up(i)
+      else
+         self:_sift_down(i)
+      end
+   end
+   node.index = nil
+   return node
+end
+
+function Heap_mt:pop()
+   if self._size > 0 then
+      local node = self:_remove_at(1)
+      return node.item, node.key
+   end
+end
+
+function Heap_mt:remove(node)
+   -- returns true if the node was still in the heap
+   local i = node.index
+   if i and self._nodes[i] == node then
+      self:_remove_at(i)
+      return true
+   end
+   return false
+end
+
+function Heap_mt:size()
+   return self._size
+end
+
+function Heap_mt:empty()
+   return self._size == 0
+end
+
+function Heap_mt:clear()
+   for i=1,self._size do
+      self._nodes[i].index = nil
+   end
+   self._nodes = {}
+   self._size = 0
+end
+
+function M.Heap()
+   local self = {
+      _nodes = {},
+      _size = 0,
+      _next_seq = 0,
+   }
+   return setmetatable(self, Heap_mt)
+end
+
 -- Set
 
 local Set_mt = {}
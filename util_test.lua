@@ -385,6 +385,54 @@ testing("List", function()
    assert.equals(items, {5,8,13})
 end)
 
+testing("List wraps around", function()
+   -- List is a ring buffer: exercise it across wrap-around and growth
+   local l = util.List()
+   local next_in, next_out = 1, 1
+   for round=1,5 do
+      for i=1,round*7 do
+         l:push(next_in)
+         next_in = next_in + 1
+      end
+      for i=1,round*5 do
+         assert.equals(l:shift(), next_out)
+         next_out = next_out + 1
+      end
+      assert.equals(l:size(), next_in - next_out)
+      for i=0,l:size()-1 do
+         assert.equals(l[i], next_out + i)
+      end
+   end
+   assert.equals(l[-1], nil)
+   assert.equals(l[l:size()], nil)
+
+   -- index/remove_at/insert_at work on wrapped lists
+   local l = util.List()
+   for i=1,6 do l:push(i) end
+   for i=1,5 do l:shift() end
+   for i=7,12 do l:push(i) end
+   -- l = 6..12, stored across the end of the ring
+   assert.equals(l:index(9), 3)
+   assert.equals(l:remove_at(3), 9)
+   l:insert_at(0, 5)
+   l:insert_at(3, 8.5)
+   l:insert_at(l:size(), 13)
+   local items = {}
+   for _,v in ipairs(l) do
+      table.insert(items, v)
+   end
+   assert.equals(items, {5, 6, 7, 8.5, 8, 10, 11, 12, 13})
+
+   -- unshift into an empty list wraps to the end of the ring
+   local l = util.List()
+   for i=1,20 do l:unshift(i) end
+   for i=20,1,-1 do
+      assert.equals(l:shift(), i)
+   end
+   assert(l:empty())
+   assert.equals(l:shift(), nil)
+end)
+
 testing("OrderedList", function()
    local l = util.OrderedList()
    assert(l:empty())
@@ -449,6 +497,60 @@ testing("OrderedList", function()
    assert.equals(items, {[0]=10, [1]=20, [2]=30})
 end)
 
+testing("Heap", function()
+   local h = util.Heap()
+   assert(h:empty())
+   assert(h:peek() == nil)
+   assert(h:pop() == nil)
+   for _,k in ipairs { 50, 10, 40, 30, 20, 60 } do
+      h:push("item"..k, k)
+   end
+   assert.equals(h:size(), 6)
+   assert.equals({h:peek()}, {"item10", 10})
+   local keys = {}
+   while not h:empty() do
+      local item, key = h:pop()
+      assert.equals(item, "item"..key)
+      table.insert(keys, key)
+   end
+   assert.equals(keys, {10, 20, 30, 40, 50, 60})
+
+   -- items with equal keys come out in insertion order
+   h:push("a", 1)
+   h:push("b", 1)
+   h:push("c", 0)
+   h:push("d", 1)
+   assert.equals(h:pop(), "c")
+   assert.equals(h:pop(), "a")
+   assert.equals(h:pop(), "b")
+   assert.equals(h:pop(), "d")
+
+   -- push() returns a handle which can be used to remove the item
+   local handles = {}
+   for k=1,10 do
+      handles[k] = h:push(k, k)
+   end
+   assert(h:remove(handles[1]))
+   assert(h:remove(handles[5]))
+   assert(h:remove(handles[10]))
+   -- removing twice is a no-op
+   assert(not h:remove(handles[5]))
+   assert.equals(h:size(), 7)
+   local items = {}
+   while not h:empty() do
+      table.insert(items, h:pop())
+   end
+   assert.equals(items, {2, 3, 4, 6, 7, 8, 9})
+   -- popped items cannot be removed
+   assert(not h:remove(handles[2]))
+
+   h:push("x", 1)
+   h:push("y", 2)
+   h:clear()
+   assert(h:empty())
+   assert.equals(h:size(), 0)
+end)
+
 testing("Set", function()
    local s = util.Set()
 
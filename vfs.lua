@@ -28,11 +28,41 @@ function Target:resolve(path)
    return path
 end
 
+-- returns the list of paths (relative to the mount point) the target
+-- provides, or nil if the target cannot be indexed
+function Target:paths()
+   return nil
+end
+
 function Target:close()
 end
 
-local function FSTarget(tpath, mp)
+-- lists the regular files under dir (recursively)
+local function list_files(dir, prefix, paths)
+   for name in fs.readdir(dir) do
+      if name ~= '.' and name ~= '..' then
+         local path = fs.join(dir, name)
+         if fs.is_dir(path) then
+            list_files(path, prefix..name.."/", paths)
+         elseif fs.is_reg(path) then
+            table.insert(paths, prefix..name)
+         end
+      end
+   end
+   return paths
+end
+
+-- options.index: list the directory tree at mount time
+--
+-- lookups in an indexed directory do not touch the file system, but
+-- files created after the mount are not found
+local function FSTarget(tpath, mp, options)
    local self = Target(tpath, mp)
+   if options.index then
+      function self:paths()
+         return list_files(tpath, "", {})
+      end
+   end
    function self:exists(path)
       path = self:resolve(path)
       return path and fs.exists(fs.join(self.tpath, path))
@@ -47,8 +77,16 @@ local function FSTarget(tpath, mp)
 end
 
 local function ZipTarget(tpath, mp)
-   local zf = zip.open(tpath)
+   -- mounted archives are only read
+   local zf = zip.open(tpath, { mmap = true })
    local self = Target(tpath, mp)
+   function self:paths()
+      local paths = {}
+      for i,entry in ipairs(zf.entries) do
+         paths[i] = entry.file_name
+      end
+      return paths
+   end
    function self:exists(path)
       path = self:resolve(path)
       return zf:exists(path)
@@ -66,20 +104,90 @@ end
 
 local Root = util.Class()
 
+-- lookups
+--
+-- the paths of indexable targets (zip archives and directories
+-- mounted with options.index) are collected into a hash map at mount
+-- time. the map is keyed by vfs path and points to the first target
+-- (in mount order) providing that path. other targets are probed
+-- one by one, but only those mounted before the indexed hit
+--
+-- the result of resolving a path for a given package is cached until
+-- the next mount or unmount. results which needed a probe of an
+-- unindexed directory are deliberately not cached: such mounts are
+-- meant for trees which change while we run (zz run mounts the
+-- source tree this way), their lookups always go to the file system
+
 function Root:new()
    return {
-      targets = {}
+      targets = {},
+      -- vfs path -> target
+      index = {},
+      -- targets which are not in the index (in mount order)
+      unindexed = {},
+      -- package descriptor -> path -> { target, vfs path } or false
+      cache = {},
    }
 end
 
-function Root:mount(tpath, mp)
+function Root:_add_to_index(t)
+   local paths = t:paths()
+   if paths then
+      local index = self.index
+      local mp = t.mp or ""
+      for _,path in ipairs(paths) do
+         local vpath = mp..path
+         if not index[vpath] then
+            index[vpath] = t
+         end
+      end
+   else
+      table.insert(self.unindexed, t)
+   end
+end
+
+function Root:_rebuild_index()
+   self.index = {}
+   self.unindexed = {}
+   for i,t in ipairs(self.targets) do
+      t.position = i
+      self:_add_to_index(t)
+   end
+   self.cache = {}
+end
+
+-- options.index: index the contents of a mounted directory
+function Root:mount(tpath, mp, options)
+   options = options or {}
+   local t
    if fs.is_dir(tpath) then
-      table.insert(self.targets, FSTarget(tpath, mp))
+      t = FSTarget(tpath, mp, options)
    elseif fs.is_reg(tpath) then
-      table.insert(self.targets, ZipTarget(tpath, mp))
+      t = ZipTarget(tpath, mp)
    else
       ef("unable to mount target: %s", tpath)
    end
+   table.insert(self.targets, t)
+   t.position = #self.targets
+   -- the new target comes last, so the index only grows
+   self:_add_to_index(t)
+   -- but it may provide a path which precedes a cached one in the
+   -- lookup order (or one which was not found)
+   self.cache = {}
+end
+
+-- unmounts all targets mounted from tpath
+function Root:unmount(tpath)
+   local targets = {}
+   for _,t in ipairs(self.targets) do
+      if t.tpath == tpath then
+         t:close()
+      else
+         table.insert(targets, t)
+      end
+   end
+   self.targets = targets
+   self:_rebuild_index()
 end
 
 function Root:_get_calling_package_descriptor()
@@ -108,12 +216,12 @@ function Root:_get_calling_package_descriptor()
    return pd
 end
 
-function Root:_possible_vfs_paths_for(path)
+function Root:_possible_vfs_paths_for(path, pd)
    -- path may be fully qualified
    local paths = { path }
 
    -- path may be located in the calling package
-   local pd = self:_get_calling_package_descriptor()
+   pd = pd or self:_get_calling_package_descriptor()
    table.insert(paths, sf('%s/%s', pd.package, path))
 
    -- path may be located in an import of the calling package
@@ -132,28 +240,69 @@ function Root:find_target(filter)
    end
 end
 
-function Root:exists(path)
-   for _,possible_path in ipairs(self:_possible_vfs_paths_for(path)) do
-      local t = self:find_target(function(t)
-         return t:exists(possible_path)
-      end)
-      if t then
-         return t
+-- returns the first target which provides vpath
+--
+-- the second return value is true if unindexed targets had to be
+-- probed: such results reflect the current state of the file system
+-- and must not be cached
+function Root:_lookup(vpath)
+   local t = self.index[vpath]
+   local position = t and t.position or #self.targets + 1
+   local probed = false
+   for _,u in ipairs(self.unindexed) do
+      if u.position > position then
+         break
+      end
+      probed = true
+      if u:exists(vpath) then
+         return u, probed
       end
    end
-   return false
+   return t, probed
 end
 
-function Root:stream(path)
-   for _,possible_path in ipairs(self:_possible_vfs_paths_for(path)) do
-      local t = self:find_target(function(t)
-         return t:exists(possible_path)
-      end)
-      if t then
-         return t:stream(possible_path)
+-- returns { target, vfs path } or false
+--
+-- results which come from indexed targets only are cached
+function Root:_resolve(path)
+   local pd = self:_get_calling_package_descriptor()
+   local cache = self.cache[pd]
+   if not cache then
+      cache = {}
+      self.cache[pd] = cache
+   end
+   local hit = cache[path]
+   if hit == nil then
+      hit = false
+      local cacheable = true
+      for _,vpath in ipairs(self:_possible_vfs_paths_for(path, pd)) do
+         local t, probed = self:_lookup(vpath)
+         if probed then
+            cacheable = false
+         end
+         if t then
+            hit = { t, vpath }
+            break
+         end
+      end
+      if cacheable then
+         cache[path] = hit
       end
    end
-   ef("vfs file not found: %s", path)
+   return hit
+end
+
+function Root:exists(path)
+   local hit = self:_resolve(path)
+   return hit and hit[1]
+end
+
+function Root:stream(path)
+   local hit = self:_resolve(path)
+   if not hit then
+      ef("vfs file not found: %s", path)
+   end
+   return hit[1]:stream(hit[2])
 end
 
 function Root:readfile(path)
@@ -167,6 +316,8 @@ function Root:close()
    for _,t in ipairs(self.targets) do
       t:close()
    end
+   self.targets = {}
+   self:_rebuild_index()
 end
 
 M.Root = Root
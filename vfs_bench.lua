@@ -0,0 +1,67 @@
+-- vfs: startup cost of asset lookups
+--
+-- mounts a tree of N assets (as a directory and as a zip archive),
+-- then looks up each asset twice: the first pass resolves the paths,
+-- the second one is served from the lookup cache
+--
+-- usage: zz run vfs_bench.lua
+
+local vfs = require('vfs')
+local fs = require('fs')
+local zip = require('zip')
+local time = require('time')
+
+local M = {}
+
+local N = 10000
+local FILES_PER_DIR = 100
+
+local function asset_path(i)
+   return sf("assets/%03d/%05d.txt", math.floor(i / FILES_PER_DIR), i)
+end
+
+local function create_assets(dir, zip_path)
+   local zf = zip.open(zip_path)
+   for i=0,N-1 do
+      local path = asset_path(i)
+      fs.mkpath(fs.dirname(fs.join(dir, path)))
+      fs.writefile(fs.join(dir, path), path)
+      zf:add(path, path)
+   end
+   zf:close()
+end
+
+local function bench(name, tpath, options)
+   local t0 = time.time()
+   local root = vfs.Root()
+   -- a few other mounts which are searched before the assets
+   root:mount('testdata')
+   root:mount('testdata/sub', 'sub')
+   root:mount(tpath, nil, options)
+   local t1 = time.time()
+   for i=0,N-1 do
+      assert(root:exists(asset_path(i)))
+   end
+   local t2 = time.time()
+   for i=0,N-1 do
+      assert(root:exists(asset_path(i)))
+   end
+   local t3 = time.time()
+   root:close()
+   pf("%-24s mount %8.3f ms  lookups %8.3f ms  cached %8.3f ms",
+      name, (t1-t0) * 1000, (t2-t1) * 1000, (t3-t2) * 1000)
+end
+
+function M.main()
+   local tmpdir = fs.mktemp("vfs_bench")
+   fs.mkdir(tmpdir)
+   local dir = fs.join(tmpdir, "dir")
+   local zip_path = fs.join(tmpdir, "assets.zip")
+   create_assets(dir, zip_path)
+   bench("directory", dir)
+   bench("directory (indexed)", dir, { index = true })
+   bench("zip", zip_path)
+   fs.rmpath(tmpdir)
+end
+
+return M
@@ -76,3 +76,61 @@ testing:with_tmpdir("mounting a zip file", function(ctx)
    assert.equals(root:readfile('other/path/wisdom.txt'), fs.readfile('testdata/sub/HighHopes.txt'))
    root:close()
 end)
+
+testing:with_tmpdir("index", function(ctx)
+   local zip_path = fs.join(ctx.tmpdir, 'data.zip')
+   local zf = zip.open(zip_path)
+   zf:add('hopes.txt', fs.open('testdata/sub/HighHopes.txt'))
+   zf:add('hello.txt', 'hello from the zip')
+   zf:close()
+
+   local dir = fs.join(ctx.tmpdir, 'dir')
+   fs.mkdir(dir)
+   fs.mkdir(fs.join(dir, 'sub'))
+   fs.writefile(fs.join(dir, 'sub/data.txt'), 'data')
+
+   -- zip archives are always indexed, directories only with
+   -- options.index
+   local root = vfs.Root()
+   root:mount(dir, 'indexed', { index = true })
+   root:mount(dir, 'probed')
+   root:mount(zip_path)
+   assert(root:exists('indexed/sub/data.txt'))
+   assert(root:exists('probed/sub/data.txt'))
+   assert.equals(root:readfile('hello.txt'), 'hello from the zip')
+
+   -- an indexed directory does not see files created after the
+   -- mount, a probed one does
+   fs.writefile(fs.join(dir, 'new.txt'), 'new')
+   assert(not root:exists('indexed/new.txt'))
+   assert(root:exists('probed/new.txt'))
+   -- lookups involving probed directories are not cached
+   assert(not root:exists('probed/later.txt'))
+   fs.writefile(fs.join(dir, 'later.txt'), 'later')
+   assert(root:exists('probed/later.txt'))
+
+   -- the first target in mount order wins, indexed or not
+   root:mount(dir)
+   fs.writefile(fs.join(dir, 'hello.txt'), 'hello from the dir')
+   assert.equals(root:readfile('hello.txt'), 'hello from the zip')
+   root:close()
+   local root = vfs.Root()
+   root:mount(dir)
+   root:mount(zip_path)
+   assert.equals(root:readfile('hello.txt'), 'hello from the dir')
+   assert.equals(root:readfile('hopes.txt'), fs.readfile('testdata/sub/HighHopes.txt'))
+   -- a deleted file falls through to the next target
+   fs.unlink(fs.join(dir, 'hello.txt'))
+   assert.equals(root:readfile('hello.txt'), 'hello from the zip')
+   fs.writefile(fs.join(dir, 'hello.txt'), 'hello from the dir')
+
+   -- unmount() removes all targets mounted from a path
+   root:unmount(dir)
+   assert.equals(root:readfile('hello.txt'), 'hello from the zip')
+   root:unmount(zip_path)
+   assert(not root:exists('hello.txt'))
+   -- mount() invalidates cached lookups (including misses)
+   root:mount(zip_path)
+   assert(root:exists('hello.txt'))
+   root:close()
+end)
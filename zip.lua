@@ -6,6 +6,7 @@ local util = require('util')
 local fs = require('fs')
 local stream = require('stream')
 local buffer = require('buffer')
+local thread = require('thread')
 
 ffi.cdef [[
 
@@ -164,6 +165,38 @@ struct zz_zip_local_file_header {
   /* extra field (variable length) */
 };
 
+struct zz_zip64_extra { /* zip64 extended information extra field */
+  uint16_t header_id; /* 0x0001 */
+  uint16_t data_size;
+  uint64_t uncompressed_size;
+  uint64_t compressed_size;
+  uint64_t local_header_offset;
+  uint32_t disk_number_start;
+
+  /* only the fields whose 32-bit counterpart is 0xffffffff are
+     present, in this order */
+};
+
+struct zz_zip64_eocd { /* zip64 end-of-central-directory record */
+  uint32_t signature; /* 0x06064b50 */
+  uint64_t eocd_size; /* size of the rest of the record */
+  uint16_t made_by_version;
+  uint16_t extract_version;
+  uint32_t disk_number;
+  uint32_t disk_number_of_eocd;
+  uint64_t num_entries_disk;
+  uint64_t num_entries_total;
+  uint64_t central_directory_size;
+  uint64_t central_directory_offset;
+};
+
+struct zz_zip64_eocd_locator {
+  uint32_t signature; /* 0x07064b50 */
+  uint32_t disk_number_of_zip64_eocd;
+  uint64_t zip64_eocd_offset;
+  uint32_t num_disks;
+};
+
 struct zz_zip_eocd { /* end-of-central-directory */
   uint32_t signature; /* 0x06054b50 */
   uint16_t disk_number;
@@ -188,16 +221,70 @@ local BUF_SIZE = 16384
 local CENTRAL_FILE_HEADER_SIGNATURE = 0x02014b50
 local LOCAL_FILE_HEADER_SIGNATURE   = 0x04034b50
 local EOCD_SIGNATURE                = 0x06054b50
+local ZIP64_EOCD_SIGNATURE          = 0x06064b50
+local ZIP64_EOCD_LOCATOR_SIGNATURE  = 0x07064b50
 
 local CENTRAL_FILE_HEADER_SIZE = 46
 local LOCAL_FILE_HEADER_SIZE   = 30
 local EOCD_SIZE                = 22
+local ZIP64_EOCD_SIZE          = 56
+local ZIP64_EOCD_LOCATOR_SIZE  = 20
+
+local ZIP64_EXTRA_ID      = 0x0001
+local ZIP64_VERSION       = 45
+local ZIP64_MAGIC_32      = 0xffffffff
+local ZIP64_MAGIC_16      = 0xffff
+
+-- compression methods
+M.STORED   = 0
+M.DEFLATED = 8
+
+-- sizes and offsets at or above this limit are stored in ZIP64
+-- extra fields and records (tests lower it to exercise ZIP64 with
+-- small archives)
+M.ZIP64_LIMIT = ZIP64_MAGIC_32
+
+-- compression level of new entries unless overridden by the
+-- `level` option of zip.open() or ZipFile:add()
+--
+-- level 0 means: store the data uncompressed (method 0)
+M.DEFAULT_LEVEL = -1 -- Z_DEFAULT_COMPRESSION
+
+-- the 32-bit fields are read as signed integers
+local function u32(x)
+   return x % 0x100000000
+end
+
+local function read_u32(s)
+   return u32(s:read_le(4))
+end
+
+local function read_u64(s)
+   local lo = read_u32(s)
+   local hi = read_u32(s)
+   return hi * 0x100000000 + lo
+end
+
+local function write_u64(s, x)
+   s:write_le(4, x % 0x100000000)
+   s:write_le(4, math.floor(x / 0x100000000))
+end
+
+-- value of a 32-bit field: the value itself or the ZIP64 marker
+local function field32(x)
+   if x >= M.ZIP64_LIMIT then
+      return ZIP64_MAGIC_32
+   else
+      return x
+   end
+end
 
 local function zlibVersion()
    return ffi.string(z.zlibVersion())
 end
 
-function M.deflate(input)
+-- level: 0 (no compression) .. 9 (best compression), default: 6
+function M.deflate(input, level)
    input = stream(input)
 
    local z_stream = ffi.new("z_stream")
@@ -205,7 +292,7 @@ function M.deflate(input)
    z_stream.zfree = nil
    z_stream.opaque = nil
 
-   local level = z.Z_DEFAULT_COMPRESSION
+   level = level or z.Z_DEFAULT_COMPRESSION
    local method = z.Z_DEFLATED
    local windowBits = -15 -- raw deflate with 32k window
    local memLevel = 8
@@ -343,24 +430,81 @@ function EOCD:new(opts)
    return self
 end
 
+function EOCD:is_zip64()
+   return self.num_entries_total >= ZIP64_MAGIC_16
+      or self.central_directory_size >= M.ZIP64_LIMIT
+      or self.central_directory_offset >= M.ZIP64_LIMIT
+end
+
 function EOCD:write(f)
    local s = stream(f)
+   local num_entries_disk = self.num_entries_disk
+   local num_entries_total = self.num_entries_total
+   if self:is_zip64() then
+      -- the zip64 record follows the central directory
+      local zip64_eocd_offset = self.central_directory_offset
+         + self.central_directory_size
+      s:write_le(4, ZIP64_EOCD_SIGNATURE)
+      write_u64(s, ZIP64_EOCD_SIZE - 12)
+      s:write_le(2, ZIP64_VERSION)
+      s:write_le(2, ZIP64_VERSION)
+      s:write_le(4, self.disk_number)
+      s:write_le(4, self.disk_number_of_eocd)
+      write_u64(s, num_entries_disk)
+      write_u64(s, num_entries_total)
+      write_u64(s, self.central_directory_size)
+      write_u64(s, self.central_directory_offset)
+      s:write_le(4, ZIP64_EOCD_LOCATOR_SIGNATURE)
+      s:write_le(4, 0)
+      write_u64(s, zip64_eocd_offset)
+      s:write_le(4, 1)
+      num_entries_disk = math.min(num_entries_disk, ZIP64_MAGIC_16)
+      num_entries_total = math.min(num_entries_total, ZIP64_MAGIC_16)
+   end
    s:write_le(4, EOCD_SIGNATURE)
    s:write_le(2, self.disk_number)
    s:write_le(2, self.disk_number_of_eocd)
-   s:write_le(2, self.num_entries_disk)
-   s:write_le(2, self.num_entries_total)
-   s:write_le(4, self.central_directory_size)
-   s:write_le(4, self.central_directory_offset)
+   s:write_le(2, num_entries_disk)
+   s:write_le(2, num_entries_total)
+   s:write_le(4, field32(self.central_directory_size))
+   s:write_le(4, field32(self.central_directory_offset))
    s:write_le(2, self.zip_comment_length) -- should be zero
 end
 
+-- reads the zip64 record referenced by the locator which precedes
+-- the EOCD (if there is one)
+local function read_zip64_eocd(f, opts)
+   local locator_offset = tonumber(f:size()) - EOCD_SIZE - ZIP64_EOCD_LOCATOR_SIZE
+   if locator_offset < ZIP64_EOCD_SIZE then
+      return
+   end
+   local s = stream(f:as_stream_at(locator_offset))
+   if read_u32(s) ~= ZIP64_EOCD_LOCATOR_SIGNATURE then
+      return
+   end
+   s:read_le(4) -- disk number of zip64 eocd
+   local zip64_eocd_offset = read_u64(s)
+   s = stream(f:as_stream_at(zip64_eocd_offset))
+   if read_u32(s) ~= ZIP64_EOCD_SIGNATURE then
+      ef("invalid zip64 end-of-central-directory record")
+   end
+   read_u64(s) -- size of record
+   s:read_le(2) -- made by version
+   s:read_le(2) -- extract version
+   opts.disk_number = read_u32(s)
+   opts.disk_number_of_eocd = read_u32(s)
+   opts.num_entries_disk = read_u64(s)
+   opts.num_entries_total = read_u64(s)
+   opts.central_directory_size = read_u64(s)
+   opts.central_directory_offset = read_u64(s)
+end
+
 local function read_eocd(f)
-   if f:size() < EOCD_SIZE then
+   local size = f:size()
+   if size < EOCD_SIZE then
       return nil
    end
-   f:seek(-EOCD_SIZE)
-   local s = stream(f)
+   local s = stream(f:as_stream_at(size - EOCD_SIZE))
    local signature = s:read_le(4)
    if signature ~= EOCD_SIGNATURE then
       return nil
@@ -370,10 +514,15 @@ local function read_eocd(f)
    opts.disk_number_of_eocd = s:read_le(2)
    opts.num_entries_disk = s:read_le(2)
    opts.num_entries_total = s:read_le(2)
-   opts.central_directory_size = s:read_le(4)
-   opts.central_directory_offset = s:read_le(4)
+   opts.central_directory_size = read_u32(s)
+   opts.central_directory_offset = read_u32(s)
    opts.zip_comment_length = s:read_le(2)
    assert(opts.zip_comment_length == 0)
+   if opts.num_entries_total == ZIP64_MAGIC_16
+      or opts.central_directory_size == ZIP64_MAGIC_32
+      or opts.central_directory_offset == ZIP64_MAGIC_32 then
+      read_zip64_eocd(f, opts)
+   end
    return EOCD(opts)
 end
 
@@ -423,32 +572,121 @@ function ZipEntry:new(opts)
       disk_number_start = 0,
       internal_attributes = 0,
       external_attributes = 0,
-      local_header_offset = opts.local_header_offset or 0
+      local_header_offset = opts.local_header_offset or 0,
+      -- size of the local header incl. file name and extra field
+      local_header_size = opts.local_header_size,
+      -- true if the local header has room for a zip64 extra field
+      local_zip64 = opts.local_zip64 or false,
    }
    return self
 end
 
+-- returns a zip64 extra field holding `values` (or nil if empty)
+local function zip64_extra(values)
+   if #values == 0 then
+      return nil
+   end
+   local buf = buffer.new()
+   local s = stream(buf)
+   s:write_le(2, ZIP64_EXTRA_ID)
+   s:write_le(2, 8 * #values)
+   for _,value in ipairs(values) do
+      write_u64(s, value)
+   end
+   return buf
+end
+
+-- picks the zip64 extended information from an extra field
+--
+-- the 64-bit values replace the fields of entry which are set to
+-- 0xffffffff, the rest of the extra field is returned
+local function parse_extra_field(extra_field, entry)
+   local ptr = ffi.cast("const uint8_t*", extra_field.ptr)
+   local len = #extra_field
+   local rest = buffer.new()
+   local i = 0
+   while i + 4 <= len do
+      local id = ptr[i] + ptr[i+1] * 0x100
+      local size = ptr[i+2] + ptr[i+3] * 0x100
+      if id == ZIP64_EXTRA_ID then
+         local j = i + 4
+         local function next_u64()
+            if j + 8 > i + 4 + size then
+               ef("invalid zip64 extra field")
+            end
+            local value = 0
+            for k=7,0,-1 do
+               value = value * 0x100 + ptr[j+k]
+            end
+            j = j + 8
+            return value
+         end
+         if entry.uncompressed_size == ZIP64_MAGIC_32 then
+            entry.uncompressed_size = next_u64()
+         end
+         if entry.compressed_size == ZIP64_MAGIC_32 then
+            entry.compressed_size = next_u64()
+         end
+         if entry.local_header_offset == ZIP64_MAGIC_32 then
+            entry.local_header_offset = next_u64()
+         end
+      else
+         rest:append(ptr + i, util.min(4 + size, len - i))
+      end
+      i = i + 4 + size
+   end
+   if #rest > 0 then
+      return rest
+   end
+end
+
+function ZipEntry:extract_version_needed(zip64)
+   if zip64 then
+      return math.max(self.extract_version, ZIP64_VERSION)
+   else
+      return self.extract_version
+   end
+end
+
 function ZipEntry:write_central_header(f)
    local s = stream(f)
+   local zip64_values = {}
+   local function field(value)
+      if value >= M.ZIP64_LIMIT then
+         table.insert(zip64_values, value)
+      end
+      return field32(value)
+   end
+   -- the order of the zip64 values is fixed by the spec
+   local uncompressed_size = field(self.uncompressed_size)
+   local compressed_size = field(self.compressed_size)
+   local local_header_offset = field(self.local_header_offset)
+   local zip64 = zip64_extra(zip64_values)
+   local extra_field_length = (zip64 and #zip64 or 0)
+      + (self.extra_field and #self.extra_field or 0)
    s:write_le(4, CENTRAL_FILE_HEADER_SIGNATURE)
-   s:write_le(2, self.made_by_version)
-   s:write_le(2, self.extract_version)
+   s:write_le(2, zip64 and math.max(self.made_by_version, ZIP64_VERSION)
+                 or self.made_by_version)
+   s:write_le(2, self:extract_version_needed(zip64))
    s:write_le(2, self.bit_flags)
    s:write_le(2, self.compression_method)
    local tm = time.gmtime(self.mtime)
    s:write_le(2, to_msdos_time(tm))
    s:write_le(2, to_msdos_date(tm))
    s:write_le(4, self.crc32)
-   s:write_le(4, self.compressed_size)
-   s:write_le(4, self.uncompressed_size)
+   s:write_le(4, compressed_size)
+   s:write_le(4, uncompressed_size)
    s:write_le(2, #self.file_name)
-   s:write_le(2, self.extra_field and #self.extra_field or 0)
+   s:write_le(2, extra_field_length)
    s:write_le(2, self.file_comment and #self.file_comment or 0)
    s:write_le(2, self.disk_number_start)
    s:write_le(2, self.internal_attributes)
    s:write_le(4, self.external_attributes)
-   s:write_le(4, self.local_header_offset)
+   s:write_le(4, local_header_offset)
    s:write(self.file_name)
+   if zip64 then
+      s:write(zip64)
+   end
    if self.extra_field then
       s:write(self.extra_field)
    end
@@ -457,21 +695,36 @@ function ZipEntry:write_central_header(f)
    end
 end
 
+-- the local header is written before the data and rewritten in
+-- place afterwards, so whether it has a zip64 extra field (which
+-- always holds both sizes) must be decided in advance
 function ZipEntry:write_local_header(f)
    local s = stream(f)
+   local zip64
+   if self.local_zip64 then
+      zip64 = zip64_extra { self.uncompressed_size, self.compressed_size }
+   elseif self.uncompressed_size >= M.ZIP64_LIMIT
+      or self.compressed_size >= M.ZIP64_LIMIT then
+      ef("%s: entry needs zip64 but its local header has no room for it", self.file_name)
+   end
+   local extra_field_length = (zip64 and #zip64 or 0)
+      + (self.extra_field and #self.extra_field or 0)
    s:write_le(4, LOCAL_FILE_HEADER_SIGNATURE)
-   s:write_le(2, self.extract_version)
+   s:write_le(2, self:extract_version_needed(zip64))
    s:write_le(2, self.bit_flags)
    s:write_le(2, self.compression_method)
    local tm = time.gmtime(self.mtime)
    s:write_le(2, to_msdos_time(tm))
    s:write_le(2, to_msdos_date(tm))
    s:write_le(4, self.crc32)
-   s:write_le(4, self.compressed_size)
-   s:write_le(4, self.uncompressed_size)
+   s:write_le(4, zip64 and ZIP64_MAGIC_32 or self.compressed_size)
+   s:write_le(4, zip64 and ZIP64_MAGIC_32 or self.uncompressed_size)
    s:write_le(2, #self.file_name)
-   s:write_le(2, self.extra_field and #self.extra_field or 0)
+   s:write_le(2, extra_field_length)
    s:write(self.file_name)
+   if zip64 then
+      s:write(zip64)
+   end
    if self.extra_field then
       s:write(self.extra_field)
    end
@@ -490,21 +743,21 @@ local function read_central_header(f)
    local mdate = s:read_le(2)
    local tm = from_msdos_date_and_time(mdate, mtime)
    opts.mtime = tm:timegm()
-   opts.crc32 = s:read_le(4)
-   opts.compressed_size = s:read_le(4)
-   opts.uncompressed_size = s:read_le(4)
+   opts.crc32 = read_u32(s)
+   opts.compressed_size = read_u32(s)
+   opts.uncompressed_size = read_u32(s)
    local file_name_length = s:read_le(2)
    local extra_field_length = s:read_le(2)
    local file_comment_length = s:read_le(2)
    opts.disk_number_start = s:read_le(2)
    opts.internal_attributes = s:read_le(2)
    opts.external_attributes = s:read_le(4)
-   opts.local_header_offset = s:read_le(4)
+   opts.local_header_offset = read_u32(s)
 
    s = stream.with_size(file_name_length + extra_field_length + file_comment_length, f)
    opts.file_name = tostring(s:read(file_name_length))
    if extra_field_length > 0 then
-      opts.extra_field = s:read(extra_field_length)
+      opts.extra_field = parse_extra_field(s:read(extra_field_length), opts)
    end
    if file_comment_length > 0 then
       opts.file_comment = tostring(s:read(file_comment_length))
@@ -525,16 +778,19 @@ local function read_local_header(f)
    local mdate = s:read_le(2)
    local tm = from_msdos_date_and_time(mdate, mtime)
    opts.mtime = tm:timegm()
-   opts.crc32 = s:read_le(4)
-   opts.compressed_size = s:read_le(4)
-   opts.uncompressed_size = s:read_le(4)
+   opts.crc32 = read_u32(s)
+   opts.compressed_size = read_u32(s)
+   opts.uncompressed_size = read_u32(s)
    local file_name_length = s:read_le(2)
    local extra_field_length = s:read_le(2)
+   opts.local_header_size = LOCAL_FILE_HEADER_SIZE
+      + file_name_length + extra_field_length
 
    s = stream.with_size(file_name_length + extra_field_length, f)
    opts.file_name = tostring(s:read(file_name_length))
    if extra_field_length > 0 then
-      opts.extra_field = s:read(extra_field_length)
+      opts.local_zip64 = opts.compressed_size == ZIP64_MAGIC_32
+      opts.extra_field = parse_extra_field(s:read(extra_field_length), opts)
    end
 
    return ZipEntry(opts)
@@ -544,24 +800,61 @@ local function read_entries(f, eocd)
    assert(eocd.disk_number == 0)
    assert(eocd.disk_number_of_eocd == 0)
    assert(eocd.num_entries_disk == eocd.num_entries_total)
-   f:seek(eocd.central_directory_offset)
+   local s = stream(f:as_stream_at(eocd.central_directory_offset))
    local entries = {}
    for i=1,eocd.num_entries_total do
-      local entry = read_central_header(f)
+      local entry = read_central_header(s)
       table.insert(entries, entry)
    end
    return entries
 end
 
+-- read-only backing store of an archive, on top of fs.mmap()
+local MappedFile = util.Class()
+
+function MappedFile:new(path)
+   return {
+      buf = fs.mmap(path, "random"),
+   }
+end
+
+function MappedFile:size()
+   return #self.buf
+end
+
+function MappedFile:pread(ptr, size, offset)
+   local nbytes = util.max(0, util.min(size, #self.buf - offset))
+   ffi.copy(ptr, self.buf.ptr + offset, nbytes)
+   return nbytes
+end
+
+function MappedFile:as_stream_at(offset)
+   local buf = self.buf
+   -- the view keeps the mapping alive as long as the stream needs it
+   return buffer.view(buf, offset):as_stream()
+end
+
+function MappedFile:close()
+   -- the mapping is removed when the last stream lets it go
+   self.buf = nil
+end
+
 local ZipFile = util.Class()
 
-function ZipFile:new(path)
+-- options.mmap: open the archive read-only via a memory mapping
+-- options.level: compression level of added entries (0: store)
+function ZipFile:new(path, options)
+   options = options or {}
    local self = {
       path = path,
       entries = {},
       updated = false,
+      readonly = options.mmap and true or false,
+      level = options.level or M.DEFAULT_LEVEL,
    }
-   if fs.exists(path) then
+   if self.readonly then
+      self.file = MappedFile(path)
+   elseif fs.exists(path) then
       self.file = fs.open(path, bit.bor(ffi.C.O_RDWR))
    else
       self.file = fs.open(path, bit.bor(ffi.C.O_CREAT, ffi.C.O_RDWR))
@@ -573,6 +866,11 @@ function ZipFile:new(path)
          entries[entry.file_name] = entry
       end
       self.entries = entries
+   end
+   if self.readonly then
+      return self
+   end
+   if self.eocd then
       -- move file pointer to the start of the central directory
       --
       -- before new files are added to the ZIP, the file will be
@@ -585,60 +883,193 @@ function ZipFile:new(path)
    return self
 end
 
-function ZipFile:add(file_name, streamable, options)
-   options = options or {}
+-- upper bound of the compressed size of `size` bytes of input
+--
+-- incompressible data is emitted as stored deflate blocks (max 16K
+-- with 5 bytes of overhead each when zlib runs with default settings)
+local function deflate_bound(size)
+   return size + math.ceil(size / 16384) * 5 + 64
+end
 
-   local crc32 = M.crc32
-   local input = stream(streamable)
+-- size of a streamable if it can be determined without reading it
+local function size_of(streamable)
+   if type(streamable) == "string" or buffer.is_buffer(streamable) then
+      return #streamable
+   elseif ffi.istype("struct zz_fs_File_ct", streamable) then
+      return tonumber(streamable:size() - streamable:pos())
+   end
+end
+
+-- writes entry and the (already compressed) data from input at the
+-- current file position, then adds entry to the central directory
+local function append_entry(self, entry, input)
+   -- the file pointer is either at the end of file or at the start of
+   -- the central directory (when calling add() for the first time on
+   -- an existing archive)
+   local header_offset = tonumber(self.file:pos())
+   entry.local_header_offset = header_offset
+   self.file:truncate()
+   local output = stream(self.file)
+   entry:write_local_header(output)
+   stream.copy(input, output)
 
-   local entry = ZipEntry {
+   -- now that we know the sizes and the crc, rewrite the local
+   -- header in place (the file position stays at the end)
+   local header = buffer.new()
+   entry:write_local_header(header)
+   self.file:pwrite(header.ptr, #header, header_offset)
+   entry.local_header_size = #header
+
+   if self.entries[entry.file_name] then
+      -- replace the existing entry
+      for i,existing_entry in ipairs(self.entries) do
+         if existing_entry.file_name == entry.file_name then
+            table.remove(self.entries, i)
+            break
+         end
+      end
+   end
+   table.insert(self.entries, entry)
+   self.entries[entry.file_name] = entry
+
+   self.updated = true
+end
+
+local function make_entry(file_name, method, options)
+   return ZipEntry {
       file_name = file_name,
       extra_field = options.extra_field,
       file_comment = options.file_comment,
       mtime = options.mtime,
+      compression_method = method,
+      extract_version = method == M.STORED and 10 or 20,
    }
+end
+
+-- options.level: compression level (0: store uncompressed)
+-- options.size: size of the input (if it cannot be determined)
+function ZipFile:add(file_name, streamable, options)
+   if self.readonly then
+      ef("cannot add to a read-only zip archive: %s", self.path)
+   end
+   options = options or {}
+
+   local level = options.level or self.level
+   local method = level == 0 and M.STORED or M.DEFLATED
+   local size = options.size or size_of(streamable)
+   local crc32 = M.crc32
+   local input = stream(streamable)
+
+   local entry = make_entry(file_name, method, options)
+   -- if the size is not known in advance, we reserve room for the
+   -- zip64 sizes in the local header
+   entry.local_zip64 = not size or deflate_bound(size) >= M.ZIP64_LIMIT
 
    input = stream.tap(input, function(ptr, len)
       entry.uncompressed_size = entry.uncompressed_size + len
       entry.crc32 = crc32(entry.crc32, ptr, len)
    end)
-   input = M.deflate(input)
+   if method == M.DEFLATED then
+      input = M.deflate(input, level)
+   end
    input = stream.tap(input, function(ptr, len)
       entry.compressed_size = entry.compressed_size + len
    end)
 
-   -- the file pointer is either at the end of file or at the start of
-   -- the central directory (when calling add() for the first time on
-   -- an existing archive)
-   local header_offset = self.file:pos()
-   entry.local_header_offset = header_offset
-   self.file:truncate()
-   local output = stream(self.file)
-   entry:write_local_header(output)
-   stream.copy(input, output)
+   append_entry(self, entry, input)
    input:close()
+end
 
-   local next_offset = self.file:pos()
-   self.file:seek(header_offset)
-   -- stream writes are unbuffered so we don't have to worry about
-   -- data left in output buffers
-   entry:write_local_header(output)
-   self.file:seek(next_offset)
+-- worker of ZipFile:add_files(), runs in a thread
+--
+-- deflates the file at job.path into job.tmp_path
+function M.deflate_file(job)
+   local crc32 = M.crc32
+   local rv = {
+      crc32 = 0,
+      uncompressed_size = 0,
+   }
+   local input = stream.tap(fs.open(job.path), function(ptr, len)
+      rv.uncompressed_size = rv.uncompressed_size + len
+      rv.crc32 = crc32(rv.crc32, ptr, len)
+   end)
+   local output = fs.open(job.tmp_path, "w")
+   local deflated = M.deflate(input, job.level)
+   stream.copy(deflated, output)
+   deflated:close()
+   rv.compressed_size = tonumber(output:pos())
+   output:close()
+   rv.crc32 = tonumber(rv.crc32)
+   return rv
+end
 
-   local old_entry_index
-   for i,existing_entry in ipairs(self.entries) do
-      if existing_entry.file_name == file_name then
-         old_entry_index = i
-         break
-      end
+-- adds several files to the archive
+--
+-- files: a list of {file_name, path} pairs
+--
+-- the files are compressed in parallel by options.nthreads worker
+-- threads (default: number of online CPUs) into temporary files,
+-- which are then appended to the archive in the order of `files`
+--
+-- the temporary files are created next to the archive: all of them
+-- exist before the first one is appended, so the file system of the
+-- archive needs free space for the compressed data twice. being on
+-- the same file system, they are appended by copy_file_range(),
+-- which shares the data blocks where the file system supports it
+-- (reflinks) and copies within the kernel elsewhere
+--
+-- accepts the same options as add()
+function ZipFile:add_files(files, options)
+   if self.readonly then
+      ef("cannot add to a read-only zip archive: %s", self.path)
    end
-   if old_entry_index then
-      table.remove(self.entries, old_entry_index)
+   options = options or {}
+
+   local level = options.level or self.level
+   if level == 0 or #files < 2 or options.nthreads == 1 then
+      -- nothing to gain from the threads
+      for _,file in ipairs(files) do
+         self:add(file[1], fs.open(file[2]), options)
+      end
+      return
    end
-   table.insert(self.entries, entry)
-   self.entries[file_name] = entry
 
-   self.updated = true
+   local jobs = {}
+   local tmp_prefix = fs.basename(self.path)
+   local tmp_dir = fs.dirname(self.path)
+   for i,file in ipairs(files) do
+      local f, tmp_path = fs.mkstemp(tmp_prefix, tmp_dir)
+      f:close()
+      jobs[i] = { path = file[2], tmp_path = tmp_path, level = level }
+   end
+   local ok, err = util.pcall(function()
+      -- the thread resolves zip to the core module
+      local results = thread.map(ZZ_PACKAGE.."/zip", "deflate_file",
+                                 jobs, options.nthreads)
+      for i,file in ipairs(files) do
+         local entry = make_entry(file[1], M.DEFLATED, options)
+         local r = results[i]
+         entry.crc32 = r.crc32
+         entry.uncompressed_size = r.uncompressed_size
+         entry.compressed_size = r.compressed_size
+         entry.local_zip64 = r.uncompressed_size >= M.ZIP64_LIMIT
+            or r.compressed_size >= M.ZIP64_LIMIT
+         local input = fs.open(jobs[i].tmp_path)
+         -- file to file: the kernel copies the data
+         append_entry(self, entry, input)
+         input:close()
+         fs.unlink(jobs[i].tmp_path)
+         jobs[i].tmp_path = nil
+      end
+   end)
+   for _,job in ipairs(jobs) do
+      if job.tmp_path then
+         fs.unlink(job.tmp_path)
+      end
+   end
+   if not ok then
+      util.throw(err)
+   end
 end
 
 function ZipFile:exists(file_name)
@@ -653,17 +1084,57 @@ function ZipFile:get_entry(file_name)
    return entry
 end
 
+-- offset of the entry's data in the archive
+function ZipFile:data_offset(entry)
+   if not entry.local_header_size then
+      -- the extra field of the local header may differ from the
+      -- one in the central directory
+      local s = stream(self.file:as_stream_at(entry.local_header_offset))
+      local header = read_local_header(s)
+      entry.local_header_size = header.local_header_size
+   end
+   return entry.local_header_offset + entry.local_header_size
+end
+
 function ZipFile:stream(file_name)
    local entry = self:get_entry(file_name)
-   self.file:seek(entry.local_header_offset)
-   local header = read_local_header(self.file)
-   return M.inflate(
-      stream.with_size(header.compressed_size,
-         -- prevent inflate from closing the zip file
-         stream.no_close(self.file)))
+   -- positional reads: several entries may be streamed at the same
+   -- time and the file position (used by add) is not disturbed
+   --
+   -- closing this stream does not close the zip file
+   --
+   -- the sizes come from the central directory: local headers may
+   -- lack them
+   local s = self.file:as_stream_at(self:data_offset(entry))
+   s = stream.with_size(entry.compressed_size, s)
+   if entry.compression_method == M.STORED then
+      -- reads go straight into the caller's buffer
+      return s
+   elseif entry.compression_method == M.DEFLATED then
+      return M.inflate(s)
+   else
+      ef("%s: unsupported compression method: %d",
+         file_name, entry.compression_method)
+   end
 end
 
 function ZipFile:readfile(file_name)
+   local entry = self:get_entry(file_name)
+   if entry.compression_method == M.STORED then
+      -- the data is read into the result with pread() calls
+      local size = entry.uncompressed_size
+      local data = buffer.new(util.max(size, 1))
+      local offset = self:data_offset(entry)
+      while #data < size do
+         local nbytes = tonumber(self.file:pread(data.ptr + #data, size - #data,
+                                                 offset + #data))
+         if nbytes == 0 then
+            ef("%s: unexpected end of file", self.path)
+         end
+         data.len = data.len + nbytes
+      end
+      return data
+   end
    local s = self:stream(file_name)
    local data = s:read(0)
    s:close()
@@ -673,11 +1144,11 @@ end
 function ZipFile:close()
    if self.updated then
       -- file pointer is after last appended file
-      local cd_start = self.file:pos()
+      local cd_start = tonumber(self.file:pos())
       for _,entry in ipairs(self.entries) do
          entry:write_central_header(self.file)
       end
-      local cd_end = self.file:pos()
+      local cd_end = tonumber(self.file:pos())
       local cd_size = cd_end - cd_start
       local eocd = EOCD {
          num_entries_total = #self.entries,
@@ -692,8 +1163,8 @@ function ZipFile:close()
    end
 end
 
-function M.open(path)
-   return ZipFile(path)
+function M.open(path, options)
+   return ZipFile(path, options)
 end
 
 function M.crc32(crc, ptr, len)
@@ -54,6 +54,129 @@ testing:with_tmpdir("open", function(ctx)
    zf:close()
 end)
 
+testing:with_tmpdir("open with mmap", function(ctx)
+   local zip_path = fs.join(ctx.tmpdir, "data.zip")
+   local zf = zip.open(zip_path)
+   zf:add("arborescence.jpg", fs.readfile("testdata/arborescence.jpg"))
+   zf:add("hello.txt", fs.readfile("testdata/hello.txt"))
+   zf:close()
+
+   -- a memory mapped archive is read-only
+   local zf = zip.open(zip_path, { mmap = true })
+   assert(zf:exists("hello.txt"))
+   -- several entries can be streamed at the same time
+   local s1 = zf:stream("arborescence.jpg")
+   local s2 = zf:stream("hello.txt")
+   assert.equals(s2:read(0), "hello, world!\n")
+   assert.equals(s1:read(0), fs.readfile("testdata/arborescence.jpg"))
+   s1:close()
+   s2:close()
+   assert.throws("read-only", function()
+      zf:add("new.txt", "data")
+   end)
+   zf:close()
+end)
+
+testing:with_tmpdir("compression levels", function(ctx)
+   local zip_path = fs.join(ctx.tmpdir, "data.zip")
+   local hopes = fs.readfile("testdata/sub/HighHopes.txt")
+   -- options.level of zip.open() applies to all added entries
+   local zf = zip.open(zip_path, { level = 9 })
+   zf:add("best.txt", hopes)
+   -- options.level of zf:add() overrides it for one entry
+   zf:add("fast.txt", hopes, { level = 1 })
+   -- level 0 stores the data uncompressed (method 0)
+   zf:add("stored.txt", hopes, { level = 0 })
+   zf:add("stored.jpg", fs.open("testdata/arborescence.jpg"), { level = 0 })
+   zf:close()
+
+   local zf = zip.open(zip_path)
+   assert.equals(zf:get_entry("best.txt").compression_method, zip.DEFLATED)
+   assert.equals(zf:get_entry("stored.txt").compression_method, zip.STORED)
+   assert.equals(zf:get_entry("stored.txt").compressed_size, #hopes)
+   assert(zf:get_entry("best.txt").compressed_size < #hopes)
+   for _,name in ipairs { "best.txt", "fast.txt", "stored.txt" } do
+      assert.equals(zf:readfile(name), hopes)
+   end
+   -- stored entries are streamed straight from the archive
+   local s = zf:stream("stored.jpg")
+   assert.equals(s:read(0), fs.readfile("testdata/arborescence.jpg"))
+   s:close()
+   zf:close()
+
+   local zf = zip.open(zip_path, { mmap = true })
+   assert.equals(zf:readfile("stored.txt"), hopes)
+   assert.equals(zf:readfile("stored.jpg"), fs.readfile("testdata/arborescence.jpg"))
+   zf:close()
+end)
+
+testing:with_tmpdir("add_files", function(ctx)
+   local zip_path = fs.join(ctx.tmpdir, "data.zip")
+   local files = {
+      { "a/arborescence.jpg", "testdata/arborescence.jpg" },
+      { "b/hello.txt", "testdata/hello.txt" },
+      { "c/HighHopes.txt", "testdata/sub/HighHopes.txt" },
+   }
+   local zf = zip.open(zip_path)
+   -- zf:add_files() compresses the files in worker threads
+   zf:add_files(files, { nthreads = 2 })
+   zf:close()
+
+   local zf = zip.open(zip_path)
+   -- the entries are added in the given order
+   for i,file in ipairs(files) do
+      assert.equals(zf.entries[i].file_name, file[1])
+      assert.equals(zf:readfile(file[1]), fs.readfile(file[2]))
+   end
+   zf:close()
+end)
+
+testing:with_tmpdir("zip64", function(ctx)
+   local zip_path = fs.join(ctx.tmpdir, "data.zip")
+   local hello = fs.readfile("testdata/hello.txt")
+   local hopes = fs.readfile("testdata/sub/HighHopes.txt")
+   -- lower the limit so that the ZIP64 fields and records are used
+   -- with small files too
+   local limit = zip.ZIP64_LIMIT
+   zip.ZIP64_LIMIT = 256
+   local ok, err = pcall(function()
+      local zf = zip.open(zip_path)
+      zf:add("hello.txt", hello)
+      zf:add("hopes.txt", hopes)
+      zf:add("stored.txt", hopes, { level = 0 })
+      -- an input of unknown size gets zip64 sizes in its local header
+      zf:add("stream.txt", stream(fs.open("testdata/sub/HighHopes.txt")))
+      zf:close()
+   end)
+   zip.ZIP64_LIMIT = limit
+   assert(ok, err)
+
+   -- reading does not depend on the limit
+   for _,options in ipairs { {}, { mmap = true } } do
+      local zf = zip.open(zip_path, options)
+      assert.equals(#zf.entries, 4)
+      assert.equals(zf:get_entry("stored.txt").uncompressed_size, #hopes)
+      assert.equals(zf:get_entry("stored.txt").compressed_size, #hopes)
+      assert(zf:get_entry("stored.txt").local_header_offset > 256)
+      assert.equals(zf:readfile("hello.txt"), hello)
+      assert.equals(zf:readfile("hopes.txt"), hopes)
+      assert.equals(zf:readfile("stored.txt"), hopes)
+      assert.equals(zf:readfile("stream.txt"), hopes)
+      zf:close()
+   end
+
+   -- the central directory of an existing zip64 archive can be
+   -- extended
+   local zf = zip.open(zip_path)
+   zf:add("hello2.txt", hello)
+   zf:close()
+   local zf = zip.open(zip_path)
+   assert.equals(#zf.entries, 5)
+   assert.equals(zf:readfile("hopes.txt"), hopes)
+   assert.equals(zf:readfile("hello2.txt"), hello)
+   zf:close()
+end)
+
 testing("crc32", function()
    local crc = zip.crc32()
    local s = stream(fs.open("testdata/arborescence.jpg"))
@@ -11,9 +11,28 @@ local bcsave = require('jit.bcsave')
 local ffi = require('ffi')
 local stream = require('stream')
 local zip = require('zip')
+local sched = require('sched')
+local digest = require('digest')
+local time = require('time')
 
 local quiet = false
 
+-- fingerprint dbs of all build contexts (see FingerprintDB)
+local fingerprint_dbs = {}
+
+-- writes the fingerprint dbs which have unsaved changes
+--
+-- called once at the end of a build (or when it fails), not after
+-- each target: the dbs hold the content hash cache too
+local function save_fingerprints()
+   for _,db in ipairs(fingerprint_dbs) do
+      db:save()
+   end
+end
+
+-- max number of build jobs running at the same time (-j)
+local max_jobs = 1
+
 local function log(msg, ...)
    if not quiet then
       pf(msg, ...)
@@ -22,6 +41,8 @@ end
 
 local function die(msg, ...)
    pf("ERROR: %s", sf(tostring(msg), ...))
+   -- keep the fingerprints of the targets built so far
+   save_fingerprints()
    process.exit(1)
 end
 
@@ -46,6 +67,8 @@ Available commands:
 Global options:
 
   -q|--quiet: keep quiet
+  -j|--jobs <n>: run up to n build jobs in parallel
+                 (default: 1, 0 means: number of CPUs)
 ]]
    process.exit(0)
 end
@@ -193,14 +216,6 @@ function Target:new(opts)
    return opts
 end
 
-function Target:mtime()
-   if self.path and fs.exists(self.path) then
-      return fs.stat(self.path).mtime
-   else
-      return -1
-   end
-end
-
 function Target:collect(key)
    local rv = {}
    local function collect(t)
@@ -212,24 +227,112 @@ function Target:collect(key)
    return rv
 end
 
-function Target:make()
-   local my_mtime = self:mtime()
-   local changed = {} -- list of updated dependencies
-   local max_mtime = 0
+-- build jobs
+--
+-- targets which do not depend on each other are made in separate
+-- threads. at most `max_jobs` of them may run their build function
+-- at the same time, the rest wait for a free job slot
+
+local running_jobs = 0
+local job_slot_freed = {} -- event type
+
+local function acquire_job_slot()
+   while running_jobs >= max_jobs do
+      sched.wait(job_slot_freed)
+   end
+   running_jobs = running_jobs + 1
+end
+
+local function release_job_slot()
+   running_jobs = running_jobs - 1
+   sched.emit(job_slot_freed, 0)
+end
+
+local function make_all(targets)
+   if max_jobs == 1 then
+      for _,t in ipairs(targets) do
+         t:make()
+      end
+   else
+      local threads = {}
+      for _,t in ipairs(targets) do
+         table.insert(threads, sched(function() t:make() end))
+      end
+      sched.join(threads)
+   end
+end
+
+-- build timings: collected by Target:make(), reported (and reset)
+-- by report_build_times()
+
+local build_times = {}
+local build_started = nil
+
+local function report_build_times()
+   if #build_times > 0 then
+      local elapsed = time.time() - build_started
+      table.sort(build_times, function(a, b) return a.time > b.time end)
+      log("[TIME] %d target(s) built in %.3f s (jobs: %d), slowest:",
+          #build_times, elapsed, max_jobs)
+      for i=1,math.min(#build_times, 5) do
+         log("%10.3f s  %s", build_times[i].time, build_times[i].path)
+      end
+   end
+   build_times = {}
+   build_started = nil
+end
+
+-- a target is (re)built if its output is missing or its fingerprint
+-- has changed since the last build
+--
+-- the fingerprint is a hash over the identities of the dependencies
+-- (path + content hash + fingerprint) and the flags of the target
+-- (compiler flags, etc.). touching a source without changing its
+-- contents does not trigger a rebuild
+--
+-- targets are made at most once per process: threads which need a
+-- target being made by another thread wait until it is ready
+
+local function make_target(self)
    self.depends = flatten(self.ctx:resolve_targets(self.depends))
    for _,t in ipairs(self.depends) do
       assert(is_target(t))
-      t:make()
-      local mtime = t:mtime()
-      if mtime > my_mtime then
+   end
+   make_all(self.depends)
+   if not self.build then
+      return
+   end
+   local ctx = self.ctx
+   local fingerprints = ctx:fingerprints()
+   local changed = {} -- list of updated dependencies
+   local exists = self.path and fs.exists(self.path)
+   local dep_ids = {}
+   local md = digest.sha1()
+   for i,t in ipairs(self.depends) do
+      local id = ctx:target_identity(t)
+      local key = sf("dep\t%s\t%s", tostring(self.path), t.path or i)
+      if not exists or fingerprints:get(key) ~= id then
          table.insert(changed, t)
       end
-      if mtime > max_mtime then
-         max_mtime = mtime
-      end
+      dep_ids[key] = id
+      md:update(id.."\n")
+   end
+   local flags = self.flags
+   if type(flags) == "function" then
+      flags = flags(self)
+   end
+   for _,flag in ipairs(flatten(flags or {})) do
+      md:update(flag.."\n")
+   end
+   self.fingerprint = util.hexstr(md:final())
+   local fp_key = sf("fp\t%s", tostring(self.path))
+   if exists and not self.force and fingerprints:get(fp_key) == self.fingerprint then
+      return
    end
-   if (my_mtime < max_mtime or self.force) and self.build then
-      log("[BUILD] %s", self.basename)
+   acquire_job_slot()
+   log("[BUILD] %s", self.basename)
+   local t0 = time.time()
+   local ok, err = util.pcall(function()
       if self.dirname then
          fs.mkpath(self.dirname)
       end
@@ -237,6 +340,42 @@ function Target:make()
       if self.path then
          fs.touch(self.path)
       end
+   end)
+   release_job_slot()
+   if not ok then
+      util.throw(err)
+   end
+   table.insert(build_times, {
+      path = self.path or tostring(self.basename),
+      time = time.time() - t0,
+   })
+   if self.path then
+      for key,id in pairs(dep_ids) do
+         fingerprints:set(key, id)
+      end
+      fingerprints:set(fp_key, self.fingerprint)
+   end
+end
+
+function Target:make()
+   if self.make_state == "done" then
+      return
+   elseif self.make_state == "making" then
+      repeat
+         sched.wait(self)
+      until self.make_state ~= "making"
+      if self.make_state ~= "done" then
+         ef("cannot make %s: it failed in another job", self.path or self.basename)
+      end
+      return
+   end
+   self.make_state = "making"
+   build_started = build_started or time.time()
+   local ok, err = util.pcall(make_target, self)
+   self.make_state = ok and "done" or nil
+   sched.emit(self, true)
+   if not ok then
+      util.throw(err)
    end
 end
 
@@ -264,13 +403,77 @@ local function with_cwd(cwd, fn)
    end
 end
 
-function system(args)
+-- runs a command in cwd (default: the current directory)
+--
+-- the directory is changed in the child process, so commands of
+-- parallel build jobs do not step on each other
+function system(args, cwd)
    local msg = args
    if type(msg) == "table" then
       msg = table.concat(args, " ")
    end
    log(msg)
-   return process.system(args)
+   local p = process.create {
+      command = args,
+      cwd = cwd,
+   }
+   return p:wait().exit_status
+end
+
+-- FingerprintDB: persistent key-value store of a build context
+--
+-- keys:
+--
+--   hash\t<path>: "<mtime> <size> <sha1 of contents>"
+--   fp\t<target path>: fingerprint of the target at its last build
+--   dep\t<target path>\t<dep path>: identity of the dependency at
+--                                    the last build of the target
+--
+-- stored as tab-separated lines in $ZZPATH/obj/<package>/.fingerprints
+
+local FingerprintDB = util.Class()
+
+function FingerprintDB:new(path)
+   local self = {
+      path = path,
+      entries = {},
+      dirty = false,
+   }
+   if fs.exists(path) then
+      for line in tostring(fs.readfile(path)):gmatch("[^\n]+") do
+         local key, value = line:match("^(.*)\t([^\t]*)$")
+         if key then
+            self.entries[key] = value
+         end
+      end
+   end
+   return self
+end
+
+function FingerprintDB:get(key)
+   return self.entries[key]
+end
+
+function FingerprintDB:set(key, value)
+   if self.entries[key] ~= value then
+      self.entries[key] = value
+      self.dirty = true
+   end
+end
+
+function FingerprintDB:save()
+   if not self.dirty then
+      return
+   end
+   local lines = {}
+   for key, value in pairs(self.entries) do
+      table.insert(lines, sf("%s\t%s\n", key, value))
+   end
+   fs.mkpath(fs.dirname(self.path))
+   local tmp_path = self.path..".tmp"
+   fs.writefile(tmp_path, table.concat(lines))
+   assert(os.rename(tmp_path, self.path))
+   self.dirty = false
 end
 
 -- BuildContext holds the stuff necessary
@@ -309,6 +512,58 @@ function BuildContext:new(pd)
    return ctx
 end
 
+function BuildContext:fingerprints()
+   if not self.fingerprint_db then
+      self.fingerprint_db = FingerprintDB(fs.join(self.objdir, ".fingerprints"))
+      table.insert(fingerprint_dbs, self.fingerprint_db)
+   end
+   return self.fingerprint_db
+end
+
+local HASH_BLOCK_SIZE = 65536
+
+-- returns the SHA-1 of the contents of the file at path (hex)
+--
+-- or nil if the file does not exist. hashes are cached in the
+-- fingerprint db and recalculated only if the mtime or size of the
+-- file changes
+function BuildContext:content_hash(path)
+   if not fs.exists(path) then
+      return nil
+   end
+   if not fs.is_reg(path) then
+      return "-"
+   end
+   local st = fs.stat(path)
+   local stamp = sf("%.6f %d", st.mtime, st.size)
+   local key = sf("hash\t%s", path)
+   local fingerprints = self:fingerprints()
+   local cached = fingerprints:get(key)
+   if cached and cached:sub(1,#stamp+1) == stamp.." " then
+      return cached:sub(#stamp+2)
+   end
+   local md = digest.sha1()
+   local block = ffi.new("uint8_t[?]", HASH_BLOCK_SIZE)
+   local f = fs.open(path)
+   while true do
+      local nbytes = tonumber(f:read1(block, HASH_BLOCK_SIZE))
+      if nbytes == 0 then
+         break
+      end
+      md:update(block, nbytes)
+   end
+   f:close()
+   local hash = util.hexstr(md:final())
+   fingerprints:set(key, sf("%s %s", stamp, hash))
+   return hash
+end
+
+-- identity of a dependency: changes whenever the dependency changes
+function BuildContext:target_identity(t)
+   local hash = t.path and self:content_hash(t.path)
+   return sf("%s %s %s", t.path or "-", hash or "-", t.fingerprint or "-")
+end
+
 function BuildContext:mangle(module_name)
    -- generate globally unique name for a zz module
    local sha1 = require('sha1')
@@ -353,51 +608,43 @@ function BuildContext:resolve_targets(targets)
 end
 
 function BuildContext:download(opts)
-   with_cwd(opts.cwd, function()
-      local status = system {
-         "curl",
-         "-L",
-         "-o", target_path(opts.dst),
-         opts.src
-      }
-      if status ~= 0 then
-         die("download failed")
-      end
-   end)
+   local status = system({
+      "curl",
+      "-L",
+      "-o", target_path(opts.dst),
+      opts.src
+   }, opts.cwd)
+   if status ~= 0 then
+      die("download failed")
+   end
 end
 
 function BuildContext:extract(opts)
-   with_cwd(opts.cwd, function()
-      local status = system {
-         "tar", "xzf", target_path(opts.src)
-      }
-      if status ~= 0 then
-         die("extract failed")
-      end
-   end)
+   local status = system({
+      "tar", "xzf", target_path(opts.src)
+   }, opts.cwd)
+   if status ~= 0 then
+      die("extract failed")
+   end
 end
 
 function BuildContext:system(opts)
-   with_cwd(opts.cwd, function()
-      local status = system(opts.command)
-      if status ~= 0 then
-         die("command failed")
-      end
-   end)
+   local status = system(opts.command, opts.cwd)
+   if status ~= 0 then
+      die("command failed")
+   end
 end
 
 function BuildContext:compile_c(opts)
-   with_cwd(opts.cwd, function()
-      local args = { "gcc", "-c", "-Wall" }
-      util.extend(args, opts.cflags)
-      table.insert(args, "-o")
-      table.insert(args, target_path(opts.dst))
-      table.insert(args, target_path(opts.src))
-      local status = system(args)
-      if status ~= 0 then
-         die("compile_c failed")
-      end
-   end)
+   local args = { "gcc", "-c", "-Wall" }
+   util.extend(args, opts.cflags)
+   table.insert(args, "-o")
+   table.insert(args, target_path(opts.dst))
+   table.insert(args, target_path(opts.src))
+   local status = system(args, opts.cwd)
+   if status ~= 0 then
+      die("compile_c failed")
+   end
 end
 
 function BuildContext:compile_lua(opts)
@@ -409,29 +656,25 @@ function BuildContext:compile_lua(opts)
 end
 
 function BuildContext:ar(opts)
-   with_cwd(opts.cwd, function()
-      local status = system {
-         "ar", "rsc",
-         target_path(opts.dst),
-         unpack(flatmap(target_path, opts.src))
-      }
-      if status ~= 0 then
-         die("ar failed")
-      end
-   end)
+   local status = system({
+      "ar", "rsc",
+      target_path(opts.dst),
+      unpack(flatmap(target_path, opts.src))
+   }, opts.cwd)
+   if status ~= 0 then
+      die("ar failed")
+   end
 end
 
 function BuildContext:cp(opts)
-   with_cwd(opts.cwd, function()
-      local status = system {
-         "cp",
-         target_path(opts.src),
-         target_path(opts.dst)
-      }
-      if status ~= 0 then
-         die("copy failed")
-      end
-   end)
+   local status = system({
+      "cp",
+      target_path(opts.src),
+      target_path(opts.dst)
+   }, opts.cwd)
+   if status ~= 0 then
+      die("copy failed")
+   end
 end
 
 function BuildContext:symlink(opts)
@@ -464,12 +707,12 @@ end
 
 function BuildContext:attach_zipped_mounts(opts)
    local zf = zip.open(target_path(opts.dst))
+   local files = {}
    for _,mount in ipairs(opts.mounts) do
       local function process(path)
          local abspath = fs.join(mount.path, path)
          if fs.is_reg(abspath) then
-            zf:add(fs.join(mount.pkg, path), fs.open(abspath))
-            pf("[ZIP] %s", fs.join(mount.pkg, path))
+            table.insert(files, { fs.join(mount.pkg, path), abspath })
          end
       end
       local function get_children(path)
@@ -486,6 +729,11 @@ function BuildContext:attach_zipped_mounts(opts)
       end
       walk('', process, get_children)
    end
+   -- the files are compressed in parallel
+   zf:add_files(files)
+   for _,file in ipairs(files) do
+      pf("[ZIP] %s", file[1])
+   end
    zf:close()
 end
 
@@ -521,6 +769,9 @@ function BuildContext.LuaModuleTarget(ctx, opts)
       dirname = m_objdir,
       basename = sf("%s.lo", m_basename),
       depends = m_src,
+      flags = function(self)
+         return { ctx:mangle(modname) }
+      end,
       build = function(self)
          ctx:compile_lua {
             src = m_src,
@@ -558,25 +809,29 @@ function BuildContext.CModuleTarget(ctx, opts)
       dirname = m_srcdir,
       basename = sf("%s.h", m_basename)
    }
+   local function collect_cflags(self)
+      local cflags = {}
+      local seen = {}
+      local function collect(t)
+         if not seen[t.ctx] then
+            util.extend(cflags, { "-iquote", t.ctx.srcdir })
+            seen[t.ctx] = true
+         end
+         util.extend(cflags, t.cflags)
+      end
+      walk(self, collect, "depends")
+      return cflags
+   end
    return ctx:Target {
       dirname = m_objdir,
       basename = sf("%s.o", m_basename),
       depends = util.extend({ c_src, c_h }, ctx.pd.depends[modname]),
+      flags = collect_cflags,
       build = function(self)
-         local cflags = {}
-         local seen = {}
-         local function collect(t)
-            if not seen[t.ctx] then
-               util.extend(cflags, { "-iquote", t.ctx.srcdir })
-               seen[t.ctx] = true
-            end
-            util.extend(cflags, t.cflags)
-         end
-         walk(self, collect, "depends")
          ctx:compile_c {
             src = c_src,
             dst = self,
-            cflags = cflags
+            cflags = collect_cflags(self)
          }
       end
    }
@@ -730,6 +985,9 @@ function BuildContext:main_targets(name, bootstrap_code)
       dirname = ctx.objdir,
       basename = sf("%s.o", name),
       depends = main_c,
+      flags = function(self)
+         return zzctx:get("libluajit.a").cflags
+      end,
       build = function(self)
          ctx:compile_c {
             src = main_c,
@@ -750,6 +1008,9 @@ function BuildContext:main_targets(name, bootstrap_code)
       dirname = ctx.tmpdir,
       basename = sf("%s.lua", name),
       depends = { main_tpl_lua, package_lua },
+      flags = function(self)
+         return { ctx:gen_preamble(), bootstrap_code }
+      end,
       build = function(self)
          local f = stream(fs.open(self.path, bit.bor(ffi.C.O_CREAT,
                                               ffi.C.O_WRONLY,
@@ -791,11 +1052,14 @@ function BuildContext:collect_mounts()
    return mounts
 end
 
-function BuildContext:gen_vfs_mounts()
+-- index: list the mounted directories at startup (see vfs.mount).
+-- lookups are cached then, but files created later are not found
+function BuildContext:gen_vfs_mounts(index)
    local mount_statements = {}
+   local options = index and ",{ index = true }" or ""
    for _,mount in ipairs(self:collect_mounts()) do
       table.insert(mount_statements,
-         sf("vfs.mount('%s','%s')\n", mount.path, mount.pkg))
+         sf("vfs.mount('%s','%s'%s)\n", mount.path, mount.pkg, options))
    end
    local code = ''
    if #mount_statements > 0 then
@@ -820,12 +1084,14 @@ function BuildContext:gen_app_bootstrap(appname, has_attached_zip)
    return code
 end
 
+-- scripts run against the live source tree: their mounts are not
+-- indexed (nor cached), edits show up immediately
 function BuildContext:gen_run_bootstrap()
-   return self:gen_vfs_mounts()..sf("run_script(table.remove(_G.arg,1))\n")
+   return self:gen_vfs_mounts(false)..sf("run_script(table.remove(_G.arg,1))\n")
 end
 
 function BuildContext:gen_test_bootstrap()
-   return self:gen_vfs_mounts().."run_tests(_G.arg)\n"
+   return self:gen_vfs_mounts(true).."run_tests(_G.arg)\n"
 end
 
 function BuildContext:prep_app_targets()
@@ -852,6 +1118,9 @@ function BuildContext:prep_app_targets()
                app_module_targets,
                main_targets,
             },
+            flags = function(self)
+               return ctx:ldflags()
+            end,
             build = function(self)
                ctx:link {
                   dst = self,
@@ -885,18 +1154,15 @@ function BuildContext:build(opts)
    end
    with_cwd(self.srcdir, function()
       self:prep_native_targets()
-      for _,native_target in ipairs(self.native_targets) do
-         native_target:make()
-      end
       self:prep_library_target()
-      self.library_target:make()
+      local targets = { self.native_targets, self.library_target }
       if opts.apps then
          self:prep_app_targets()
-         for _,app_target in ipairs(self.app_targets) do
-            app_target:make()
-         end
+         table.insert(targets, self.app_targets)
       end
+      make_all(flatten(targets))
    end)
+   save_fingerprints()
 end
 
 function BuildContext:install()
@@ -904,6 +1170,7 @@ function BuildContext:install()
       recursive = true,
       apps = true
    }
+   report_build_times()
    self:prep_app_targets()
    for _,app_target in ipairs(self.app_targets) do
       self:symlink {
@@ -929,6 +1196,9 @@ function BuildContext:run(path)
       dirname = ctx.tmpdir,
       basename = '_run',
       depends = { ctx.link_targets, main_targets },
+      flags = function(self)
+         return ctx:ldflags()
+      end,
       build = function(self)
          ctx:link {
             dst = self,
@@ -938,6 +1208,8 @@ function BuildContext:run(path)
       end
    }
    runner:make()
+   save_fingerprints()
+   report_build_times()
    process.system { runner.path, unpack(_G.arg, 2) }
 end
 
@@ -979,6 +1251,9 @@ function BuildContext:test(test_names)
       dirname = ctx.tmpdir,
       basename = '_test',
       depends = { ctx.link_targets, main_targets },
+      flags = function(self)
+         return ctx:ldflags()
+      end,
       build = function(self)
          ctx:link {
             dst = self,
@@ -988,6 +1263,8 @@ function BuildContext:test(test_names)
       end
    }
    testrunner:make()
+   save_fingerprints()
+   report_build_times()
    process.system { testrunner.path, unpack(test_paths) }
 end
 
@@ -1186,6 +1463,7 @@ function handlers.build(args)
       recursive = args.recursive,
       apps = true
    }
+   report_build_times()
 end
 
 function handlers.install(args)
@@ -1245,11 +1523,18 @@ function M.main()
    local ap = argparser("zz", "zz build system")
    ap:add { name = "command", type = "string" }
    ap:add { name = "quiet", option = "-q|--quiet" }
+   ap:add { name = "jobs", option = "-j|--jobs", type = "number" }
    local args, rest_of_args = ap:parse()
    if not args.command then
       usage()
    end
    quiet = args.quiet
+   if args.jobs then
+      max_jobs = args.jobs
+      if max_jobs < 1 then
+         max_jobs = process.nprocs()
+      end
+   end
    local handler = handlers[args.command]
    if not handler then
       die("Invalid command: %s", args.command)
@@ -29,9 +29,11 @@ PACKAGE_MODULES=(
   signal
   stream
   testing
+  thread
   time
   trigger
   uri
+  uring
   util
   vfs
   zip